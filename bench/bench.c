@@ -0,0 +1,63 @@
+#include "harness.h"
+#include "../src/net.h"
+
+/* NOTE: every benchmark in one binary, `bench [flags] name...` runs the named
+ * ones and no names runs all of them. Flags go to the harness: --cpu N pins
+ * the process, --samples N, --warmup-ms N, --sample-us N and --json path */
+
+int bench_reliable(void);
+int bench_ratelimit(void);
+int bench_proto(void);
+
+typedef struct Bench {
+  char *name;
+  int (*run)(void);
+} Bench;
+
+static Bench benches[] = {
+    {"reliable", bench_reliable},
+    {"ratelimit", bench_ratelimit},
+    {"proto", bench_proto},
+};
+
+int main(int argc, char **argv) {
+  BenchOptions options;
+  u32 i;
+  s32 arg;
+  int res;
+
+  conn_init();
+
+  bench_options_default(&options);
+  argc = bench_options_parse(&options, argc, argv);
+  if (argc < 0 || !bench_harness_init(&options)) {
+    return 1;
+  }
+
+  res = 0;
+  if (argc < 2) {
+    for (i = 0; i < array_len(benches); ++i) {
+      printf("== %s\n", benches[i].name);
+      res |= benches[i].run();
+    }
+    return res | !bench_harness_finish();
+  }
+  for (arg = 1; arg < argc; ++arg) {
+    for (i = 0; i < array_len(benches); ++i) {
+      if (strcmp(argv[arg], benches[i].name) == 0) {
+        break;
+      }
+    }
+    if (i == array_len(benches)) {
+      fprintf(stderr, "unknown bench %s, available:", argv[arg]);
+      for (i = 0; i < array_len(benches); ++i) {
+        fprintf(stderr, " %s", benches[i].name);
+      }
+      fprintf(stderr, "\n");
+      return 1;
+    }
+    printf("== %s\n", benches[i].name);
+    res |= benches[i].run();
+  }
+  return res | !bench_harness_finish();
+}
@@ -0,0 +1,296 @@
+#include "harness.h"
+#include "../src/proto.h"
+
+/* NOTE: the hot paths under the protocol, one case per operation. Serialize
+ * and deserialize run on the message shapes the server and peers really send,
+ * the stream cases push frames through a socketpair in chunks from one byte
+ * to many frames so both the partial frame path and the batched path show
+ * up */
+
+#define PROTO_BENCH_PEERS 16
+#define PROTO_BENCH_PAYLOAD 1200
+#define STREAM_BENCH_FRAMES 64
+#define ALLOC_BENCH_BATCH 64
+#define DLLIST_BENCH_NODES 1024
+
+typedef struct MessageBench {
+  Arena arena;
+  Message *msg;
+  u8 *buffer;
+  u64 size;
+} MessageBench;
+
+typedef struct StreamBench {
+  Arena arena;
+  /* NOTE: the case rewinds arena, the pool keeps its buffers */
+  Arena buffers_arena;
+  StreamBufferPool buffers;
+  Conn writer;
+  Stream reader;
+  u8 *frames;
+  u64 frames_size;
+  u64 frame_size;
+  u64 offset;
+  u32 chunk;
+  u64 written;
+  u64 received;
+} StreamBench;
+
+typedef struct AllocBench {
+  MessageAllocator allocator;
+  Message *batch[ALLOC_BENCH_BATCH];
+} AllocBench;
+
+typedef struct DllistNode {
+  struct DllistNode *next;
+  struct DllistNode *prev;
+} DllistNode;
+
+static void bench_serialize(void *state, u64 iterations) {
+  MessageBench *bench;
+  u64 mark, size, i;
+  bench = state;
+  mark = bench->arena.used;
+  for (i = 0; i < iterations; ++i) {
+    bench_sink += (u64)message_serialize(&bench->arena, bench->msg, &size);
+    bench->arena.used = mark;
+  }
+}
+
+static void bench_deserialize(void *state, u64 iterations) {
+  MessageBench *bench;
+  u64 mark, i;
+  bench = state;
+  mark = bench->arena.used;
+  for (i = 0; i < iterations; ++i) {
+    bench_sink +=
+        (u64)message_deserialize(&bench->arena, bench->buffer, bench->size);
+    bench->arena.used = mark;
+  }
+}
+
+static void message_bench_init(MessageBench *bench, Message *msg, u8 *memory,
+                               u64 memory_size) {
+  arena_init(&bench->arena, memory, memory_size);
+  bench->msg = msg;
+  bench->buffer = message_serialize(&bench->arena, msg, &bench->size);
+}
+
+static void message_bench_run(char *name, Message *msg) {
+  MessageBench bench;
+  char case_name[BENCH_NAME_SIZE];
+  static u8 memory[kb(64)];
+  message_bench_init(&bench, msg, memory, sizeof(memory));
+  assert(message_deserialize(&bench.arena, bench.buffer, bench.size));
+  snprintf(case_name, sizeof(case_name), "message_serialize/%s", name);
+  bench_case(case_name, bench_serialize, &bench, bench.size);
+  snprintf(case_name, sizeof(case_name), "message_deserialize/%s", name);
+  bench_case(case_name, bench_deserialize, &bench, bench.size);
+}
+
+static void fill_candidates(Candidate *candidates, u32 *count, u32 seed) {
+  u32 i;
+  *count = 3;
+  for (i = 0; i < *count; ++i) {
+    candidates[i].type =
+        i ? CandidateType_HOST : CandidateType_SERVER_REFLEXIVE;
+    endpoint_ipv4(&candidates[i].endpoint, 0x0a000001 + seed * 16 + i,
+                  (u16)(40000 + i));
+  }
+}
+
+static void bench_messages(void) {
+  Message connect, peers, data;
+  PeerConnected peer_nodes[PROTO_BENCH_PEERS];
+  static u8 payload[PROTO_BENCH_PAYLOAD];
+  u32 i;
+
+  memset(&connect, 0, sizeof(connect));
+  connect.header.type = MessageType_CONNECT;
+  connect.connect.room = 7;
+  endpoint_ipv4(&connect.connect.endpoint, 0xc0a80001, 40000);
+  fill_candidates(connect.connect.candidates,
+                  &connect.connect.candidates_count, 0);
+  message_bench_run("connect", &connect);
+
+  memset(&peers, 0, sizeof(peers));
+  peers.header.type = MessageType_PEERS_TO_CONNECT;
+  for (i = 0; i < PROTO_BENCH_PEERS; ++i) {
+    PeerConnected *peer;
+    peer = &peer_nodes[i];
+    memset(peer, 0, sizeof(*peer));
+    endpoint_ipv4(&peer->endpoint, 0xc0a80001 + i, (u16)(40000 + i));
+    fill_candidates(peer->candidates, &peer->candidates_count, i);
+    dllist_push_back(peers.peers_to_connect.first,
+                     peers.peers_to_connect.last, peer);
+    peers.peers_to_connect.count++;
+  }
+  message_bench_run("peers_to_connect_16", &peers);
+
+  memset(&data, 0, sizeof(data));
+  data.header.type = MessageType_RELIABLE_DATA;
+  data.reliable_data.seq = 1234;
+  data.reliable_data.timestamp = 5678;
+  data.reliable_data.size = PROTO_BENCH_PAYLOAD;
+  data.reliable_data.data = payload;
+  message_bench_run("reliable_data_1200", &data);
+}
+
+static void stream_bench_callback(Stream *stream, Message *msg, void *param) {
+  StreamBench *bench;
+  unused(stream);
+  bench = param;
+  bench->received++;
+  bench_sink += msg->header.type;
+}
+
+/* NOTE: an operation is one frame through the stream. The writer only ever
+ * gets a chunk ahead of the reader so the socket never fills up and blocks */
+static void bench_stream(void *state, u64 iterations) {
+  StreamBench *bench;
+  u64 target, mark;
+  u32 res;
+  bench = state;
+  target = bench->received + iterations;
+  mark = bench->arena.used;
+  while (bench->received < target) {
+    u32 size;
+    size = (u32)min((u64)bench->chunk, bench->frames_size - bench->offset);
+    res = conn_write(bench->writer, bench->frames + bench->offset, size);
+    assert(res == size);
+    bench->offset = (bench->offset + size) % bench->frames_size;
+    bench->written += size;
+    while (bench->received * bench->frame_size +
+               bench->reader.recv_buffer_used <
+           bench->written) {
+      res = stream_proccess_messages(&bench->arena, &bench->reader,
+                                     stream_bench_callback, bench);
+      assert(res == CONN_OK);
+      bench->arena.used = mark;
+    }
+  }
+}
+
+static void bench_streams(void) {
+  static u32 chunks[] = {1, 64, 1500, kb(8)};
+  static StreamBench bench;
+  static u8 memory[kb(64)];
+  static u8 buffers_memory[STREAM_BUFFER_SIZE * 2];
+  char case_name[BENCH_NAME_SIZE];
+  Message msg;
+  u8 *frame;
+  u32 i;
+
+  memset(&bench, 0, sizeof(bench));
+  arena_init(&bench.arena, memory, sizeof(memory));
+  memset(&msg, 0, sizeof(msg));
+  msg.header.type = MessageType_CONNECT;
+  endpoint_ipv4(&msg.connect.endpoint, 0xc0a80001, 40000);
+  fill_candidates(msg.connect.candidates, &msg.connect.candidates_count, 0);
+  frame = message_serialize(&bench.arena, &msg, &bench.frame_size);
+  bench.frames_size = bench.frame_size * STREAM_BENCH_FRAMES;
+  bench.frames = arena_push(&bench.arena, bench.frames_size, 8);
+  for (i = 0; i < STREAM_BENCH_FRAMES; ++i) {
+    memcpy(bench.frames + i * bench.frame_size, frame, bench.frame_size);
+  }
+  arena_init(&bench.buffers_arena, buffers_memory, sizeof(buffers_memory));
+  stream_buffer_pool_init(&bench.buffers, &bench.buffers_arena, 1);
+  if (conn_stream_pair(&bench.writer, &bench.reader.conn) != CONN_OK) {
+    fprintf(stderr, "can not create a stream pair\n");
+    return;
+  }
+  bench.reader.pool = &bench.buffers;
+  for (i = 0; i < array_len(chunks); ++i) {
+    bench.chunk = chunks[i];
+    snprintf(case_name, sizeof(case_name), "stream_proccess_messages/chunk_%u",
+             bench.chunk);
+    bench_case(case_name, bench_stream, &bench, bench.frame_size);
+  }
+  conn_close(bench.writer);
+  conn_close(bench.reader.conn);
+}
+
+static void bench_arena_push(void *state, u64 iterations) {
+  Arena *arena;
+  u64 i;
+  arena = state;
+  for (i = 0; i < iterations; ++i) {
+    if (arena->used + 64 > arena->size) {
+      arena->used = 0;
+    }
+    bench_sink += (u64)arena_push(arena, 64, 8);
+  }
+}
+
+static void bench_message_alloc(void *state, u64 iterations) {
+  AllocBench *bench;
+  Message *msg;
+  u64 i;
+  bench = state;
+  for (i = 0; i < iterations; ++i) {
+    msg = message_alloc(&bench->allocator);
+    bench_sink += (u64)msg;
+    message_free(&bench->allocator, msg);
+  }
+}
+
+/* NOTE: a full batch out then back in, the free list order changes under it
+ * like it does when queues drain out of order */
+static void bench_message_alloc_batch(void *state, u64 iterations) {
+  AllocBench *bench;
+  u64 done;
+  u32 i;
+  bench = state;
+  for (done = 0; done < iterations; done += ALLOC_BENCH_BATCH) {
+    for (i = 0; i < ALLOC_BENCH_BATCH; ++i) {
+      bench->batch[i] = message_alloc(&bench->allocator);
+    }
+    for (i = 0; i < ALLOC_BENCH_BATCH; ++i) {
+      message_free(&bench->allocator, bench->batch[i]);
+    }
+  }
+}
+
+static void bench_dllist(void *state, u64 iterations) {
+  DllistNode *nodes, *first, *last;
+  u64 done;
+  u32 i;
+  nodes = state;
+  first = last = 0;
+  for (done = 0; done < iterations; done += DLLIST_BENCH_NODES) {
+    for (i = 0; i < DLLIST_BENCH_NODES; ++i) {
+      dllist_push_back(first, last, &nodes[i]);
+    }
+    /* NOTE: every other node from the middle out first, then the rest */
+    for (i = 1; i < DLLIST_BENCH_NODES; i += 2) {
+      dllist_remove(first, last, &nodes[i]);
+    }
+    for (i = 0; i < DLLIST_BENCH_NODES; i += 2) {
+      dllist_remove(first, last, &nodes[i]);
+    }
+  }
+  bench_sink += (u64)first;
+}
+
+int bench_proto(void) {
+  static u8 arena_memory[kb(256)];
+  static u8 alloc_memory[mb(1)];
+  static DllistNode nodes[DLLIST_BENCH_NODES];
+  static AllocBench alloc;
+  Arena arena, alloc_arena;
+
+  bench_messages();
+  bench_streams();
+
+  arena_init(&arena, arena_memory, sizeof(arena_memory));
+  bench_case("arena_push/64", bench_arena_push, &arena, 0);
+
+  arena_init(&alloc_arena, alloc_memory, sizeof(alloc_memory));
+  message_allocator_init(&alloc.allocator, &alloc_arena);
+  bench_case("message_alloc_free/single", bench_message_alloc, &alloc, 0);
+  bench_case("message_alloc_free/batch_64", bench_message_alloc_batch, &alloc,
+             0);
+
+  bench_case("dllist/push_back_remove", bench_dllist, nodes, 0);
+  return 0;
+}
@@ -0,0 +1,62 @@
+#include "../src/net.h"
+#include "../src/ratelimit.h"
+
+/* NOTE: cost of one rate_limiter_allow call with the same table the server
+ * uses, for one hot source, a working set that fits in the table and a flood
+ * of random (spoofed) sources that keeps evicting. The time passed in moves
+ * 1us per call like a busy loop would */
+
+#define ITERATIONS 20000000
+#define SOURCES_COUNT 8192
+
+static u64 rng_state = 0x2545f4914f6cdd1dull;
+
+static u32 random_u32(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (u32)rng_state;
+}
+
+static void bench_run(const char *name, u32 *addrs, u32 addrs_mask) {
+  static u8 memory[mb(1)];
+  Arena arena;
+  RateLimiter limiter;
+  u64 start, end, now;
+  u32 i, allowed;
+  arena_init(&arena, memory, sizeof(memory));
+  rate_limiter_init(&limiter, &arena, 4096, 10, 20);
+  allowed = 0;
+  now = 1;
+  start = conn_current_time_us();
+  for (i = 0; i < ITERATIONS; ++i) {
+    allowed += rate_limiter_allow(&limiter, addrs[i & addrs_mask], now++);
+  }
+  end = conn_current_time_us();
+  printf("%-16s %6.2f ns/op  allowed %9llu  dropped %9llu  evictions %9llu\n",
+         name, (f64)(end - start) * 1000.0 / ITERATIONS,
+         limiter.stats.allowed, limiter.stats.dropped,
+         limiter.stats.evictions);
+  unused(allowed);
+}
+
+int bench_ratelimit(void) {
+  static u32 addrs[1 << 20];
+  u32 i;
+
+
+  addrs[0] = 0x0a000001;
+  bench_run("one source", addrs, 0);
+
+  for (i = 0; i < SOURCES_COUNT; ++i) {
+    addrs[i] = random_u32();
+  }
+  bench_run("8k sources", addrs, SOURCES_COUNT - 1);
+
+  for (i = 0; i < array_len(addrs); ++i) {
+    addrs[i] = random_u32();
+  }
+  bench_run("1m sources", addrs, array_len(addrs) - 1);
+
+  return 0;
+}
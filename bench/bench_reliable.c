@@ -0,0 +1,259 @@
+#include "../src/reliable.h"
+
+/* NOTE: two reliable channels on loopback talking through an emulated link
+ * that delays and drops datagrams, the sender writes fixed size records
+ * stamped with the time they were handed to the channel */
+
+#define RECORD_SIZE 1024
+#define LINK_QUEUE_SIZE 4096
+#define LINK_PACKET_SIZE 1500
+#define MAX_LATENCIES (1 << 20)
+
+typedef struct LinkPacket {
+  u64 deliver_at;
+  u32 size;
+  b32 to_b;
+  u8 data[LINK_PACKET_SIZE];
+} LinkPacket;
+
+typedef struct Link {
+  Dgram a_side;
+  Dgram b_side;
+  ConnAddr *a_addr;
+  ConnAddr *b_addr;
+  LinkPacket *queue;
+  u32 queue_first;
+  u32 queue_count;
+  u32 loss_per_mille;
+  u64 delay;
+  u64 rng;
+  u64 dropped;
+} Link;
+
+static u32 link_random(Link *link) {
+  link->rng ^= link->rng << 13;
+  link->rng ^= link->rng >> 7;
+  link->rng ^= link->rng << 17;
+  return (u32)link->rng;
+}
+
+static void link_receive(Link *link, Arena *arena, Dgram *side, b32 to_b,
+                         u64 now) {
+  LinkPacket *packet;
+  ConnAddr *from;
+  u32 size, slot;
+  u8 discard[LINK_PACKET_SIZE];
+  from = conn_address_create(arena);
+  if (link->queue_count == LINK_QUEUE_SIZE) {
+    conn_read_from(side->conn, discard, sizeof(discard), from);
+    link->dropped++;
+    return;
+  }
+  slot = (link->queue_first + link->queue_count) % LINK_QUEUE_SIZE;
+  packet = &link->queue[slot];
+  size = conn_read_from(side->conn, packet->data, LINK_PACKET_SIZE, from);
+  if (size == CONN_ERROR) {
+    return;
+  }
+  if (link_random(link) % 1000 < link->loss_per_mille) {
+    link->dropped++;
+    return;
+  }
+  packet->size = size;
+  packet->to_b = to_b;
+  packet->deliver_at = now + link->delay;
+  link->queue_count++;
+}
+
+static void link_deliver(Link *link, u64 now) {
+  while (link->queue_count) {
+    LinkPacket *packet = &link->queue[link->queue_first];
+    if (packet->deliver_at > now) {
+      break;
+    }
+    if (packet->to_b) {
+      conn_write_to(link->b_side.conn, packet->data, packet->size,
+                    link->b_addr);
+    } else {
+      conn_write_to(link->a_side.conn, packet->data, packet->size,
+                    link->a_addr);
+    }
+    link->queue_first = (link->queue_first + 1) % LINK_QUEUE_SIZE;
+    link->queue_count--;
+  }
+}
+
+static Dgram bench_socket(Arena *arena, ConnAddr **addr) {
+  Dgram dgram;
+  ConnErr udp;
+  udp = conn_udp();
+  assert(udp.err == CONN_OK);
+  dgram.conn = udp.conn;
+  *addr = conn_address(arena, "127.0.0.1", 0);
+  assert(conn_bind(dgram.conn, *addr) == CONN_OK);
+  *addr = conn_get_addr(arena, dgram.conn);
+  return dgram;
+}
+
+static void channel_read(Arena *arena, ReliableChannel *channel, u64 now) {
+  DgramBatch batch;
+  ConnAddr *from;
+  u32 i, count;
+  from = conn_address_create(arena);
+  dgram_batch_init(&batch, arena_push(arena, DGRAM_BATCH_SIZE, 8),
+                   DGRAM_BATCH_SIZE);
+  if (dgram_batch_read_from(channel->dgram, &batch, from) == CONN_ERROR) {
+    return;
+  }
+  count = dgram_batch_count(&batch);
+  for (i = 0; i < count; ++i) {
+    Message *msg = dgram_batch_message(arena, &batch, i);
+    if (msg) {
+      reliable_process(channel, msg, now);
+    }
+  }
+}
+
+static int compare_u32(const void *a, const void *b) {
+  u32 x = *(u32 *)a, y = *(u32 *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void bench_run(char *name, u32 loss_per_mille, u64 delay, u32 rate,
+                      u64 duration) {
+  static u8 memory[mb(32)];
+  Arena arena, event_arena;
+  ConnAddr *a_addr, *b_addr, *link_a_addr, *link_b_addr;
+  Dgram a, b;
+  ReliableChannel sender, receiver;
+  Link link;
+  ConnSet *read;
+  u32 *latencies, latencies_count;
+  u8 pending[RECORD_SIZE];
+  u32 pending_used;
+  u64 start, now, delivered, next_record;
+
+  arena_init(&arena, memory, mb(24));
+  arena_init(&event_arena, memory + mb(24), mb(8));
+
+  a = bench_socket(&arena, &a_addr);
+  b = bench_socket(&arena, &b_addr);
+  dgram_enable_segmentation(&a);
+  dgram_enable_segmentation(&b);
+
+  memset(&link, 0, sizeof(link));
+  link.a_side = bench_socket(&arena, &link_a_addr);
+  link.b_side = bench_socket(&arena, &link_b_addr);
+  link.a_addr = a_addr;
+  link.b_addr = b_addr;
+  link.queue = arena_push(&arena, sizeof(LinkPacket) * LINK_QUEUE_SIZE, 8);
+  link.loss_per_mille = loss_per_mille;
+  link.delay = delay;
+  link.rng = 0x9e3779b97f4a7c15ull;
+
+  reliable_init(&sender, &arena, &a, link_a_addr);
+  reliable_init(&receiver, &arena, &b, link_b_addr);
+  read = conn_set_create(&arena);
+  latencies = arena_push(&arena, sizeof(u32) * MAX_LATENCIES, 4);
+  latencies_count = 0;
+  pending_used = 0;
+  delivered = 0;
+
+  start = next_record = conn_current_time_us();
+  for (now = start; now - start < duration; now = conn_current_time_us()) {
+    u64 timeout;
+
+    while (reliable_send_space(&sender) >= RECORD_SIZE &&
+           (!rate || next_record <= now)) {
+      u8 record[RECORD_SIZE];
+      memset(record, 0, sizeof(record));
+      memcpy(record, &now, sizeof(now));
+      reliable_send(&sender, record, RECORD_SIZE);
+      next_record += rate ? 1000000 / rate : 0;
+    }
+
+    reliable_update(&sender, now);
+    reliable_update(&receiver, now);
+    link_deliver(&link, now);
+
+    timeout = min(reliable_next_timeout(&sender, now),
+                  reliable_next_timeout(&receiver, now));
+    if (rate) {
+      timeout = min(timeout, next_record > now ? next_record - now : 0);
+    }
+    if (link.queue_count) {
+      LinkPacket *packet = &link.queue[link.queue_first];
+      timeout = min(timeout,
+                    packet->deliver_at > now ? packet->deliver_at - now : 0);
+    }
+    timeout = min(timeout, 10000);
+
+    conn_set_clear(read);
+    conn_set_add(read, a.conn);
+    conn_set_add(read, b.conn);
+    conn_set_add(read, link.a_side.conn);
+    conn_set_add(read, link.b_side.conn);
+    if (conn_select(read, 0, (u32)((timeout + 999) / 1000)) == CONN_ERROR) {
+      break;
+    }
+    now = conn_current_time_us();
+    if (conn_set_has(read, link.a_side.conn)) {
+      link_receive(&link, &event_arena, &link.a_side, true, now);
+    }
+    if (conn_set_has(read, link.b_side.conn)) {
+      link_receive(&link, &event_arena, &link.b_side, false, now);
+    }
+    if (conn_set_has(read, a.conn)) {
+      channel_read(&event_arena, &sender, now);
+    }
+    if (conn_set_has(read, b.conn)) {
+      channel_read(&event_arena, &receiver, now);
+    }
+
+    for (;;) {
+      u32 got;
+      got = reliable_recv(&receiver, pending + pending_used,
+                          RECORD_SIZE - pending_used);
+      if (!got) {
+        break;
+      }
+      pending_used += got;
+      delivered += got;
+      if (pending_used == RECORD_SIZE) {
+        u64 sent_at;
+        memcpy(&sent_at, pending, sizeof(sent_at));
+        if (latencies_count < MAX_LATENCIES) {
+          latencies[latencies_count++] = (u32)(now - sent_at);
+        }
+        pending_used = 0;
+      }
+    }
+    event_arena.used = 0;
+  }
+
+  qsort(latencies, latencies_count, sizeof(u32), compare_u32);
+  printf("%-24s goodput %8.2f Mbit/s  records %7u  p50 %7u us  p99 %7u us  "
+         "p999 %7u us  retx %6llu  fast %6llu  rto %4llu  dropped %6llu\n",
+         name, (f64)delivered * 8.0 / (f64)(now - start), latencies_count,
+         latencies_count ? latencies[latencies_count / 2] : 0,
+         latencies_count ? latencies[(latencies_count * 99) / 100] : 0,
+         latencies_count ? latencies[(latencies_count * 999) / 1000] : 0,
+         sender.stats.retransmits, sender.stats.fast_retransmits,
+         sender.stats.timeouts, link.dropped);
+
+  conn_close(a.conn);
+  conn_close(b.conn);
+  conn_close(link.a_side.conn);
+  conn_close(link.b_side.conn);
+}
+
+int bench_reliable(void) {
+  u64 duration;
+  duration = 3000000;
+  bench_run("bulk clean", 0, 1000, 0, duration);
+  bench_run("bulk 10ms 1% loss", 10, 5000, 0, duration);
+  bench_run("bulk 10ms 5% loss", 50, 5000, 0, duration);
+  bench_run("2k rec/s clean", 0, 1000, 2000, duration);
+  bench_run("2k rec/s 10ms 1% loss", 10, 5000, 2000, duration);
+  return 0;
+}
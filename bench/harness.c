@@ -0,0 +1,207 @@
+#if !defined(_WIN32)
+#define _GNU_SOURCE
+#include <sched.h>
+#else
+#include <windows.h>
+#endif
+
+#include "harness.h"
+#include "../src/net.h"
+
+volatile u64 bench_sink;
+
+static BenchOptions bench_options;
+static BenchResult bench_results[BENCH_MAX_RESULTS];
+static u32 bench_results_count;
+static f64 bench_samples[BENCH_MAX_SAMPLES];
+
+void bench_options_default(BenchOptions *options) {
+  options->cpu = -1;
+  options->samples = 200;
+  options->warmup_ms = 200;
+  options->sample_us = 2000;
+  options->json_path = 0;
+}
+
+static b32 bench_parse_u32(char *text, u32 *value) {
+  char *end;
+  unsigned long result;
+  result = strtoul(text, &end, 10);
+  if (end == text || *end || result > 0xffffffffu) {
+    return false;
+  }
+  *value = (u32)result;
+  return true;
+}
+
+s32 bench_options_parse(BenchOptions *options, s32 argc, char **argv) {
+  s32 i, names;
+  names = 1;
+  for (i = 1; i < argc; ++i) {
+    u32 value;
+    char *flag;
+    flag = argv[i];
+    if (strncmp(flag, "--", 2) != 0) {
+      argv[names++] = flag;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      fprintf(stderr, "missing value for %s\n", flag);
+      return -1;
+    }
+    if (strcmp(flag, "--json") == 0) {
+      options->json_path = argv[++i];
+      continue;
+    }
+    if (!bench_parse_u32(argv[++i], &value)) {
+      fprintf(stderr, "%s takes a number\n", flag);
+      return -1;
+    }
+    if (strcmp(flag, "--cpu") == 0) {
+      options->cpu = (s32)value;
+    } else if (strcmp(flag, "--samples") == 0 && value > 0 &&
+               value <= BENCH_MAX_SAMPLES) {
+      options->samples = value;
+    } else if (strcmp(flag, "--warmup-ms") == 0) {
+      options->warmup_ms = value;
+    } else if (strcmp(flag, "--sample-us") == 0 && value > 0) {
+      options->sample_us = value;
+    } else {
+      fprintf(stderr, "unknown or out of range flag %s\n", flag);
+      return -1;
+    }
+  }
+  return names;
+}
+
+static b32 bench_pin(s32 cpu) {
+#if defined(_WIN32)
+  return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#else
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#endif
+}
+
+b32 bench_harness_init(BenchOptions *options) {
+  bench_options = *options;
+  bench_results_count = 0;
+  if (options->cpu >= 0 && !bench_pin(options->cpu)) {
+    fprintf(stderr, "can not pin to cpu %d\n", options->cpu);
+    return false;
+  }
+  return true;
+}
+
+static int bench_compare_f64(const void *a, const void *b) {
+  f64 x, y;
+  x = *(const f64 *)a;
+  y = *(const f64 *)b;
+  return (x > y) - (x < y);
+}
+
+static f64 bench_percentile(f64 *sorted, u32 count, u32 percentile) {
+  return sorted[((count - 1) * percentile + 50) / 100];
+}
+
+BenchResult *bench_case(char *name, BenchCaseFn fn, void *state,
+                        u64 bytes_per_op) {
+  BenchResult *result;
+  u64 iterations, start, elapsed, target;
+  f64 sum;
+  u32 i;
+
+  assert(bench_results_count < BENCH_MAX_RESULTS);
+  if (bench_results_count == 0) {
+    printf("%-40s %10s %10s %10s %10s %12s\n", "case (ns/op)", "min", "p50",
+           "p99", "mean", "MB/s");
+  }
+  result = &bench_results[bench_results_count++];
+  memset(result, 0, sizeof(*result));
+  strncpy(result->name, name, BENCH_NAME_SIZE - 1);
+
+  /* NOTE: calibrate, double until a run is long enough to scale from */
+  target = (u64)bench_options.sample_us * 1000;
+  iterations = 1;
+  for (;;) {
+    start = conn_current_time_ns();
+    fn(state, iterations);
+    elapsed = conn_current_time_ns() - start;
+    if (elapsed >= target / 8 || iterations >= (1ull << 32)) {
+      break;
+    }
+    iterations *= 2;
+  }
+  iterations = max(1, (u64)((f64)iterations * target / max(elapsed, 1)));
+
+  start = conn_current_time_ns();
+  while (conn_current_time_ns() - start <
+         (u64)bench_options.warmup_ms * 1000000) {
+    fn(state, iterations);
+  }
+
+  sum = 0;
+  for (i = 0; i < bench_options.samples; ++i) {
+    start = conn_current_time_ns();
+    fn(state, iterations);
+    elapsed = conn_current_time_ns() - start;
+    bench_samples[i] = (f64)elapsed / iterations;
+    sum += bench_samples[i];
+  }
+  qsort(bench_samples, bench_options.samples, sizeof(f64), bench_compare_f64);
+
+  result->iterations = iterations;
+  result->samples = bench_options.samples;
+  result->bytes_per_op = bytes_per_op;
+  result->min = bench_samples[0];
+  result->p50 = bench_percentile(bench_samples, result->samples, 50);
+  result->p90 = bench_percentile(bench_samples, result->samples, 90);
+  result->p99 = bench_percentile(bench_samples, result->samples, 99);
+  result->max = bench_samples[result->samples - 1];
+  result->mean = sum / result->samples;
+
+  printf("%-40s %10.2f %10.2f %10.2f %10.2f", result->name, result->min,
+         result->p50, result->p99, result->mean);
+  if (bytes_per_op) {
+    printf(" %12.1f", (f64)bytes_per_op * 1000.0 / result->p50);
+  }
+  printf("\n");
+  return result;
+}
+
+b32 bench_harness_finish(void) {
+  FILE *file;
+  u32 i;
+  if (!bench_options.json_path) {
+    return true;
+  }
+  file = fopen(bench_options.json_path, "w");
+  if (!file) {
+    fprintf(stderr, "can not write %s\n", bench_options.json_path);
+    return false;
+  }
+  fprintf(file,
+          "{\n  \"cpu\": %d,\n  \"samples\": %u,\n  \"warmup_ms\": %u,\n"
+          "  \"sample_us\": %u,\n  \"results\": [",
+          bench_options.cpu, bench_options.samples, bench_options.warmup_ms,
+          bench_options.sample_us);
+  for (i = 0; i < bench_results_count; ++i) {
+    BenchResult *result;
+    result = &bench_results[i];
+    fprintf(file,
+            "%s\n    {\"name\": \"%s\", \"iterations\": %llu, "
+            "\"bytes_per_op\": %llu, \"ns_per_op\": {\"min\": %.3f, "
+            "\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f, "
+            "\"mean\": %.3f}, \"bytes_per_sec\": %.0f}",
+            i ? "," : "", result->name, result->iterations,
+            result->bytes_per_op, result->min, result->p50, result->p90,
+            result->p99, result->max, result->mean,
+            result->bytes_per_op ? result->bytes_per_op * 1e9 / result->p50
+                                 : 0.0);
+  }
+  fprintf(file, "\n  ]\n}\n");
+  fclose(file);
+  return true;
+}
@@ -0,0 +1,56 @@
+#ifndef _HARNESS_H_
+#define _HARNESS_H_
+
+#include "../src/core.h"
+
+/* NOTE: microbenchmark harness. A case is a function that runs the measured
+ * operation `iterations` times. The harness grows the iteration count until
+ * one sample takes about sample_us, runs it for warmup_ms without measuring,
+ * then takes `samples` samples and reports ns/op percentiles over them (and
+ * bytes/s when the case moves bytes). The process can be pinned to one cpu so
+ * runs are comparable, and every result can go to a json file to diff between
+ * commits */
+
+#define BENCH_MAX_SAMPLES 10000
+#define BENCH_MAX_RESULTS 256
+#define BENCH_NAME_SIZE 64
+
+typedef void (*BenchCaseFn)(void *state, u64 iterations);
+
+typedef struct BenchOptions {
+  /* NOTE: -1 does not pin */
+  s32 cpu;
+  u32 samples;
+  u32 warmup_ms;
+  u32 sample_us;
+  char *json_path;
+} BenchOptions;
+
+typedef struct BenchResult {
+  char name[BENCH_NAME_SIZE];
+  u64 iterations;
+  u32 samples;
+  u64 bytes_per_op;
+  /* NOTE: ns per operation */
+  f64 min;
+  f64 p50;
+  f64 p90;
+  f64 p99;
+  f64 max;
+  f64 mean;
+} BenchResult;
+
+/* NOTE: cases write results they would otherwise throw away here so the
+ * compiler can not drop the work */
+extern volatile u64 bench_sink;
+
+void bench_options_default(BenchOptions *options);
+/* NOTE: takes the harness flags out of argv and returns the new argc, the
+ * ones left are bench names. Returns -1 on a bad flag */
+s32 bench_options_parse(BenchOptions *options, s32 argc, char **argv);
+b32 bench_harness_init(BenchOptions *options);
+BenchResult *bench_case(char *name, BenchCaseFn fn, void *state,
+                        u64 bytes_per_op);
+b32 bench_harness_finish(void);
+
+#endif
@@ -0,0 +1,767 @@
+#if !defined(_WIN32)
+#define _GNU_SOURCE
+#include <unistd.h>
+#endif
+
+#include "../src/config.h"
+#include "../src/proto.h"
+
+/* NOTE: synthetic load for the rendezvous server. One process plays many
+ * peers over loopback and every one of them goes through the real join: stun
+ * request, CONNECT once both the stun response and the ctrl handshake are
+ * done, then the PEERS_TO_CONNECT list. Joined peers send keep alives, can
+ * refresh stun and get replaced at the churn rate.
+ *
+ * Peer i binds its sockets to source-base + i (the whole 127/8 is loopback)
+ * so the server rate limiter sees different clients, the ctrl connections do
+ * not share one ephemeral port range and the address the server puts in a
+ * PEERS_TO_CONNECT entry tells which simulated peer it is.
+ *
+ * Join latency goes from arrival to the list, broadcast completion from the
+ * CONNECT to the moment every room member that had joined before it got the
+ * new peer. Server cpu comes from /proc when --server-pid is given */
+
+#define LOAD_MAX_PEERS (1 << 16)
+#define LOAD_MAX_SAMPLES (1 << 20)
+#define LOAD_TICK_MS 1
+#define LOAD_CHURN_ATTEMPTS 16
+
+typedef enum LoadPeerState {
+  /* NOTE: not arrived yet, or left and waiting to come back */
+  LoadPeerState_IDLE,
+  LoadPeerState_JOINING,
+  LoadPeerState_JOINED,
+} LoadPeerState;
+
+typedef struct LoadPeer {
+  LoadPeerState state;
+  Stream ctrl;
+  Dgram udp;
+  b32 ctrl_connecting;
+  b32 ctrl_connected;
+  b32 connect_sent;
+  b32 stun_pending;
+  b32 list_partial;
+  u32 room;
+  /* NOTE: what the server saw, family none until the stun response */
+  ConnEndpoint endpoint;
+  u64 arrive_time;
+  u64 rejoin_time;
+  u64 stun_sent_time;
+  u64 connect_time;
+  u64 next_keepalive;
+  u64 next_stun;
+  /* NOTE: room members that had joined when the CONNECT went out */
+  u32 notices_expected;
+  u32 notices_received;
+} LoadPeer;
+
+typedef struct LoadSamples {
+  u32 *values;
+  u32 count;
+  u64 dropped;
+} LoadSamples;
+
+typedef struct LoadConfig {
+  char server_address[CONFIG_STRING_SIZE];
+  u16 server_ctrl_port;
+  u16 server_stun_port;
+  char source_base[CONFIG_STRING_SIZE];
+  u32 peers;
+  u32 rooms;
+  u32 arrival_rate;
+  u32 duration_ms;
+  u32 keepalive_ms;
+  u32 stun_interval_ms;
+  u32 stun_timeout_ms;
+  u32 churn_rate;
+  u32 rejoin_delay_ms;
+  u32 server_pid;
+  char json_path[CONFIG_STRING_SIZE];
+} LoadConfig;
+
+typedef struct LoadStats {
+  u64 arrivals;
+  u64 joins;
+  u64 leaves;
+  u64 ctrl_errors;
+  u64 stun_requests;
+  u64 stun_responses;
+  u64 stun_retries;
+  u64 keepalives;
+  u64 lists;
+  u64 notices;
+  u64 broadcasts_complete;
+} LoadStats;
+
+typedef struct LoadGen {
+  LoadConfig config;
+
+  Arena arena;
+  Arena event_arena;
+  Arena buffers_arena;
+  StreamBufferPool stream_buffers;
+
+  ConnAddr *ctrl_addr;
+  ConnAddr *stun_addr;
+  u32 source_base;
+
+  ConnSet *read;
+  ConnSet *write;
+
+  LoadPeer *peers;
+  u32 *rooms_joined;
+  u32 arrived;
+
+  u64 start_time;
+  u64 ramp_end_time;
+  u64 next_churn;
+  u64 next_progress;
+  u32 rng;
+
+  LoadStats stats;
+  LoadSamples join_latency;
+  LoadSamples connect_latency;
+  LoadSamples stun_rtt;
+  LoadSamples broadcast_completion;
+
+  u64 server_cpu_start;
+} LoadGen;
+
+#define DEFAULT_SERVER_ADDRESS "127.0.0.1"
+#define DEFAULT_SERVER_CTRL_PORT 8080
+#define DEFAULT_SERVER_STUN_PORT 8081
+#define DEFAULT_SOURCE_BASE "127.1.0.1"
+#define DEFAULT_PEERS 1000
+#define DEFAULT_ROOMS 16
+#define DEFAULT_ARRIVAL_RATE 500
+#define DEFAULT_DURATION_MS 10000
+#define DEFAULT_KEEPALIVE_MS 5000
+#define DEFAULT_STUN_TIMEOUT_MS 500
+#define DEFAULT_REJOIN_DELAY_MS 100
+
+void load_config_default(LoadConfig *config) {
+  memset(config, 0, sizeof(*config));
+  strcpy(config->server_address, DEFAULT_SERVER_ADDRESS);
+  config->server_ctrl_port = DEFAULT_SERVER_CTRL_PORT;
+  config->server_stun_port = DEFAULT_SERVER_STUN_PORT;
+  strcpy(config->source_base, DEFAULT_SOURCE_BASE);
+  config->peers = DEFAULT_PEERS;
+  config->rooms = DEFAULT_ROOMS;
+  config->arrival_rate = DEFAULT_ARRIVAL_RATE;
+  config->duration_ms = DEFAULT_DURATION_MS;
+  config->keepalive_ms = DEFAULT_KEEPALIVE_MS;
+  config->stun_timeout_ms = DEFAULT_STUN_TIMEOUT_MS;
+  config->rejoin_delay_ms = DEFAULT_REJOIN_DELAY_MS;
+}
+
+u32 load_config_parse(LoadConfig *config, int argc, char **argv) {
+  ConfigOption options[] = {
+      {"server", ConfigType_STRING, config->server_address, 0, 0,
+       "address of the server"},
+      {"server-ctrl-port", ConfigType_U16, &config->server_ctrl_port, 1,
+       0xffff, "tcp port of the server ctrl socket"},
+      {"server-stun-port", ConfigType_U16, &config->server_stun_port, 1,
+       0xffff, "udp port of the server stun socket"},
+      {"source-base", ConfigType_STRING, config->source_base, 0, 0,
+       "ipv4 address of peer 0, peer i binds to it plus i"},
+      {"peers", ConfigType_U32, &config->peers, 1, LOAD_MAX_PEERS,
+       "simulated peers"},
+      {"rooms", ConfigType_U32, &config->rooms, 1, LOAD_MAX_PEERS,
+       "rooms the peers are spread over"},
+      {"arrival-rate", ConfigType_U32, &config->arrival_rate, 0, 1000000,
+       "peers arriving per second, 0 is all at once"},
+      {"duration-ms", ConfigType_U32, &config->duration_ms, 0, 86400000,
+       "milliseconds to keep running once every peer arrived"},
+      {"keepalive-ms", ConfigType_U32, &config->keepalive_ms, 0, 3600000,
+       "keep alive interval of a joined peer, 0 is none"},
+      {"stun-interval-ms", ConfigType_U32, &config->stun_interval_ms, 0,
+       3600000, "stun refresh interval of a joined peer, 0 is none"},
+      {"stun-timeout-ms", ConfigType_U32, &config->stun_timeout_ms, 1,
+       60000, "milliseconds before a stun request is sent again"},
+      {"churn-rate", ConfigType_U32, &config->churn_rate, 0, 1000000,
+       "joined peers leaving per second, each comes back as a new peer"},
+      {"rejoin-delay-ms", ConfigType_U32, &config->rejoin_delay_ms, 0,
+       3600000, "milliseconds between a peer leaving and coming back"},
+      {"server-pid", ConfigType_U32, &config->server_pid, 0, 0xffffffff,
+       "pid of the server to report its cpu time, 0 is none"},
+      {"json", ConfigType_STRING, config->json_path, 0, 0,
+       "file to write the results to, empty is none"},
+  };
+  return config_parse_args(options, array_len(options), argc, argv);
+}
+
+/* NOTE: user plus system time of a process in microseconds, 0 when it can
+ * not be read */
+static u64 process_cpu_us(u32 pid) {
+#if defined(__linux__)
+  char path[64], line[1024], *cursor;
+  unsigned long long user, system;
+  FILE *file;
+  snprintf(path, sizeof(path), "/proc/%u/stat", pid);
+  file = fopen(path, "r");
+  if (!file) {
+    return 0;
+  }
+  cursor = fgets(line, sizeof(line), file);
+  fclose(file);
+  /* NOTE: the command name can have spaces, fields restart after it */
+  cursor = cursor ? strrchr(line, ')') : 0;
+  if (!cursor || sscanf(cursor + 2,
+                        "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                        &user, &system) != 2) {
+    return 0;
+  }
+  return (u64)(user + system) * 1000000 / (u64)sysconf(_SC_CLK_TCK);
+#else
+  unused(pid);
+  return 0;
+#endif
+}
+
+static void samples_init(LoadSamples *samples) {
+  samples->values = malloc(sizeof(u32) * LOAD_MAX_SAMPLES);
+  assert(samples->values);
+  samples->count = 0;
+  samples->dropped = 0;
+}
+
+static void samples_add(LoadSamples *samples, u64 value) {
+  if (samples->count == LOAD_MAX_SAMPLES) {
+    samples->dropped++;
+    return;
+  }
+  samples->values[samples->count++] = (u32)min(value, 0xffffffffull);
+}
+
+static int compare_u32(const void *a, const void *b) {
+  u32 x, y;
+  x = *(const u32 *)a;
+  y = *(const u32 *)b;
+  return (x > y) - (x < y);
+}
+
+static u32 samples_percentile(LoadSamples *samples, u32 percentile) {
+  if (!samples->count) {
+    return 0;
+  }
+  return samples->values[((samples->count - 1) * percentile + 50) / 100];
+}
+
+static u32 load_random(LoadGen *load) {
+  load->rng ^= load->rng << 13;
+  load->rng ^= load->rng >> 17;
+  load->rng ^= load->rng << 5;
+  return load->rng;
+}
+
+static void load_stun_send(LoadGen *load, LoadPeer *peer, u64 now) {
+  Message msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.header.type = MessageType_STUN;
+  dgram_message_write_to(&load->event_arena, &peer->udp, &msg,
+                         load->stun_addr);
+  peer->stun_pending = true;
+  peer->stun_sent_time = now;
+  load->stats.stun_requests++;
+}
+
+static void load_peer_close(LoadGen *load, LoadPeer *peer, u64 now) {
+  if (peer->state == LoadPeerState_JOINED) {
+    load->rooms_joined[peer->room]--;
+  }
+  conn_close(peer->ctrl.conn);
+  stream_reset(&peer->ctrl);
+  conn_close(peer->udp.conn);
+  peer->state = LoadPeerState_IDLE;
+  peer->rejoin_time = now + (u64)load->config.rejoin_delay_ms * 1000;
+}
+
+static void load_peer_arrive(LoadGen *load, LoadPeer *peer, u64 now) {
+  ConnEndpoint source;
+  ConnAddr *source_addr;
+  ConnErr tcp, udp;
+  u32 index, res;
+  u64 mark;
+
+  index = (u32)(peer - load->peers);
+  memset(peer, 0, sizeof(*peer));
+  peer->room = index % load->config.rooms;
+  peer->arrive_time = now;
+  load->stats.arrivals++;
+
+  mark = load->event_arena.used;
+  endpoint_ipv4(&source, load->source_base + index, 0);
+  source_addr = conn_address_endpoint(&load->event_arena, &source);
+  udp = conn_udp();
+  tcp = conn_tcp();
+  if (udp.err == CONN_ERROR || tcp.err == CONN_ERROR) {
+    fprintf(stderr, "out of sockets at %u peers\n", load->arrived);
+    exit(1);
+  }
+  peer->udp.conn = udp.conn;
+  stream_init(&peer->ctrl, tcp.conn, &load->stream_buffers);
+  peer->state = LoadPeerState_JOINING;
+  if (conn_bind(peer->udp.conn, source_addr) == CONN_ERROR ||
+      conn_bind(peer->ctrl.conn, source_addr) == CONN_ERROR) {
+    fprintf(stderr, "can not bind to the source address of peer %u\n", index);
+    exit(1);
+  }
+  load->event_arena.used = mark;
+
+  res = conn_connect_start(peer->ctrl.conn, load->ctrl_addr);
+  if (res == CONN_ERROR) {
+    load->stats.ctrl_errors++;
+    load_peer_close(load, peer, now);
+    return;
+  }
+  peer->ctrl_connecting = res == CONN_WOULD_BLOCK;
+  peer->ctrl_connected = res == CONN_OK;
+  load_stun_send(load, peer, now);
+}
+
+/* NOTE: the CONNECT goes out when the last of stun and ctrl is done, like in
+ * the peer */
+static void load_peer_try_connect(LoadGen *load, LoadPeer *peer, u64 now) {
+  Message msg;
+  if (!peer->ctrl_connected || peer->endpoint.family == CONN_FAMILY_NONE ||
+      peer->connect_sent) {
+    return;
+  }
+  memset(&msg, 0, sizeof(msg));
+  msg.header.type = MessageType_CONNECT;
+  msg.connect.room = peer->room;
+  msg.connect.endpoint = peer->endpoint;
+  msg.connect.candidates_count = 1;
+  msg.connect.candidates[0].type = CandidateType_SERVER_REFLEXIVE;
+  msg.connect.candidates[0].endpoint = peer->endpoint;
+  if (stream_message_write(&load->event_arena, &peer->ctrl, &msg) ==
+      CONN_ERROR) {
+    load->stats.ctrl_errors++;
+    load_peer_close(load, peer, now);
+    return;
+  }
+  peer->connect_sent = true;
+  peer->connect_time = now;
+  peer->notices_expected = load->rooms_joined[peer->room];
+}
+
+static LoadPeer *load_peer_find(LoadGen *load, ConnEndpoint *endpoint) {
+  LoadPeer *peer;
+  u32 index;
+  if (endpoint->family != CONN_FAMILY_IPV4) {
+    return 0;
+  }
+  index = endpoint_ipv4_addr(endpoint) - load->source_base;
+  if (index >= load->config.peers) {
+    return 0;
+  }
+  peer = &load->peers[index];
+  if (peer->state == LoadPeerState_IDLE ||
+      !endpoint_equals(&peer->endpoint, endpoint)) {
+    return 0;
+  }
+  return peer;
+}
+
+typedef struct LoadCallbackParams {
+  LoadGen *load;
+  LoadPeer *peer;
+  u64 now;
+} LoadCallbackParams;
+
+static void load_message_callback(Stream *stream, Message *msg, void *param) {
+  LoadCallbackParams *params;
+  LoadGen *load;
+  LoadPeer *peer;
+  PeerConnected *entry;
+  params = param;
+  load = params->load;
+  peer = params->peer;
+  if (msg->header.type != MessageType_PEERS_TO_CONNECT) {
+    return;
+  }
+  /* NOTE: the list of the room comes first, everything after it announces
+   * a peer that joined later. A list too large for the stream buffer comes
+   * in parts */
+  if (peer->list_partial) {
+    peer->list_partial = stream->decode_entries != 0;
+    return;
+  }
+  if (peer->state == LoadPeerState_JOINING) {
+    peer->list_partial = stream->decoding && stream->decode_entries != 0;
+    peer->state = LoadPeerState_JOINED;
+    load->rooms_joined[peer->room]++;
+    load->stats.joins++;
+    load->stats.lists++;
+    samples_add(&load->join_latency, params->now - peer->arrive_time);
+    samples_add(&load->connect_latency, params->now - peer->connect_time);
+    peer->next_keepalive = params->now + (u64)load->config.keepalive_ms * 1000;
+    peer->next_stun = params->now + (u64)load->config.stun_interval_ms * 1000;
+    return;
+  }
+  for (entry = msg->peers_to_connect.first; entry != 0; entry = entry->next) {
+    LoadPeer *joiner;
+    load->stats.notices++;
+    joiner = load_peer_find(load, &entry->endpoint);
+    if (!joiner || !joiner->connect_sent) {
+      continue;
+    }
+    joiner->notices_received++;
+    if (joiner->notices_received == joiner->notices_expected) {
+      load->stats.broadcasts_complete++;
+      samples_add(&load->broadcast_completion,
+                  params->now - joiner->connect_time);
+    }
+  }
+}
+
+static void load_udp_read(LoadGen *load, LoadPeer *peer, u64 now) {
+  ConnAddr *from;
+  Message *msg;
+  from = conn_address_create(&load->event_arena);
+  msg = dgram_message_read_from(&load->event_arena, &peer->udp, from);
+  if (!msg || msg->header.type != MessageType_STUN_RESPONSE ||
+      !peer->stun_pending) {
+    return;
+  }
+  peer->stun_pending = false;
+  load->stats.stun_responses++;
+  samples_add(&load->stun_rtt, now - peer->stun_sent_time);
+  if (peer->endpoint.family == CONN_FAMILY_NONE) {
+    peer->endpoint = msg->stun_response.endpoint;
+    load_peer_try_connect(load, peer, now);
+  }
+}
+
+static void load_keepalive_send(LoadGen *load, LoadPeer *peer) {
+  Message msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.header.type = MessageType_KEEP_ALIVE;
+  dgram_message_write_to(&load->event_arena, &peer->udp, &msg,
+                         load->stun_addr);
+  load->stats.keepalives++;
+}
+
+/* NOTE: timers of one peer, stun retries and refreshes, keep alives and
+ * coming back after a leave */
+static void load_peer_update(LoadGen *load, LoadPeer *peer, u64 now) {
+  LoadConfig *config;
+  config = &load->config;
+  if (peer->state == LoadPeerState_IDLE) {
+    if (peer->rejoin_time && now >= peer->rejoin_time) {
+      load_peer_arrive(load, peer, now);
+    }
+    return;
+  }
+  if (peer->stun_pending &&
+      now - peer->stun_sent_time >= (u64)config->stun_timeout_ms * 1000) {
+    load->stats.stun_retries++;
+    load_stun_send(load, peer, now);
+  }
+  if (peer->state != LoadPeerState_JOINED) {
+    return;
+  }
+  if (config->keepalive_ms && now >= peer->next_keepalive) {
+    load_keepalive_send(load, peer);
+    peer->next_keepalive = now + (u64)config->keepalive_ms * 1000;
+  }
+  if (config->stun_interval_ms && !peer->stun_pending &&
+      now >= peer->next_stun) {
+    load_stun_send(load, peer, now);
+    peer->next_stun = now + (u64)config->stun_interval_ms * 1000;
+  }
+}
+
+static void load_churn(LoadGen *load, u64 now) {
+  u64 interval;
+  u32 attempt;
+  if (!load->config.churn_rate) {
+    return;
+  }
+  interval = 1000000 / load->config.churn_rate;
+  while (now >= load->next_churn) {
+    load->next_churn += interval;
+    for (attempt = 0; attempt < LOAD_CHURN_ATTEMPTS; ++attempt) {
+      LoadPeer *peer;
+      peer = &load->peers[load_random(load) % load->arrived];
+      if (peer->state == LoadPeerState_JOINED) {
+        load->stats.leaves++;
+        load_peer_close(load, peer, now);
+        break;
+      }
+    }
+  }
+}
+
+static void load_arrivals(LoadGen *load, u64 now) {
+  while (load->arrived < load->config.peers) {
+    u64 at;
+    at = load->config.arrival_rate
+             ? load->start_time +
+                   (u64)load->arrived * 1000000 / load->config.arrival_rate
+             : load->start_time;
+    if (now < at) {
+      break;
+    }
+    load_peer_arrive(load, &load->peers[load->arrived++], now);
+  }
+  if (load->arrived == load->config.peers && !load->ramp_end_time) {
+    load->ramp_end_time = now;
+    load->next_churn = now;
+  }
+}
+
+static void load_prepare(LoadGen *load) {
+  u32 i;
+  conn_set_clear(load->read);
+  conn_set_clear(load->write);
+  for (i = 0; i < load->arrived; ++i) {
+    LoadPeer *peer;
+    peer = &load->peers[i];
+    if (peer->state == LoadPeerState_IDLE) {
+      continue;
+    }
+    conn_set_add(load->read, peer->udp.conn);
+    if (peer->ctrl_connecting) {
+      conn_set_add(load->write, peer->ctrl.conn);
+    } else if (peer->ctrl_connected) {
+      conn_set_add(load->read, peer->ctrl.conn);
+    }
+  }
+}
+
+static void load_process(LoadGen *load) {
+  u64 now;
+  u32 i;
+  assert(conn_select(load->read, load->write, LOAD_TICK_MS) != CONN_ERROR);
+  now = conn_current_time_us();
+  for (i = 0; i < load->arrived; ++i) {
+    LoadPeer *peer;
+    peer = &load->peers[i];
+    if (peer->state != LoadPeerState_IDLE &&
+        conn_set_has(load->read, peer->udp.conn)) {
+      load_udp_read(load, peer, now);
+    }
+    if (peer->state != LoadPeerState_IDLE && peer->ctrl_connecting &&
+        conn_set_has(load->write, peer->ctrl.conn)) {
+      peer->ctrl_connecting = false;
+      if (conn_connect_finish(peer->ctrl.conn) != CONN_OK) {
+        load->stats.ctrl_errors++;
+        load_peer_close(load, peer, now);
+        continue;
+      }
+      peer->ctrl_connected = true;
+      load_peer_try_connect(load, peer, now);
+    }
+    if (peer->state != LoadPeerState_IDLE && peer->ctrl_connected &&
+        conn_set_has(load->read, peer->ctrl.conn)) {
+      LoadCallbackParams params;
+      u64 mark;
+      u32 res;
+      params.load = load;
+      params.peer = peer;
+      params.now = now;
+      /* NOTE: nothing decoded outlives the callback, a large list would
+       * fill the arena when every peer reads one */
+      mark = load->event_arena.used;
+      res = stream_proccess_messages(&load->event_arena, &peer->ctrl,
+                                     load_message_callback, &params);
+      load->event_arena.used = mark;
+      if (res == CONN_ERROR) {
+        load->stats.ctrl_errors++;
+        load_peer_close(load, peer, now);
+        continue;
+      }
+    }
+    load_peer_update(load, peer, now);
+  }
+  load_arrivals(load, now);
+  if (load->ramp_end_time) {
+    load_churn(load, now);
+  }
+  if (now >= load->next_progress) {
+    load->next_progress = now + 1000000;
+    printf("%6.1fs arrived %u joins %llu leaves %llu stun %llu/%llu "
+           "notices %llu ctrl errors %llu\n",
+           (f64)(now - load->start_time) / 1e6, load->arrived,
+           load->stats.joins, load->stats.leaves, load->stats.stun_responses,
+           load->stats.stun_requests, load->stats.notices,
+           load->stats.ctrl_errors);
+  }
+  load->event_arena.used = 0;
+}
+
+static b32 load_init(LoadGen *load, LoadConfig *config) {
+  ConnAddr *base;
+  ConnEndpoint endpoint;
+  memset(load, 0, sizeof(*load));
+  load->config = *config;
+  arena_init(&load->arena, (u8 *)malloc(mb(1)), mb(1));
+  arena_init(&load->event_arena, (u8 *)malloc(mb(4)), mb(4));
+  /* NOTE: room for a half read frame on every peer, pages are only touched
+   * when they are used */
+  arena_init(&load->buffers_arena,
+             (u8 *)malloc((u64)(config->peers + 1) * STREAM_BUFFER_SIZE),
+             (u64)(config->peers + 1) * STREAM_BUFFER_SIZE);
+  stream_buffer_pool_init(&load->stream_buffers, &load->buffers_arena,
+                          config->peers);
+  load->ctrl_addr = conn_address(&load->arena, config->server_address,
+                                 config->server_ctrl_port);
+  load->stun_addr = conn_address(&load->arena, config->server_address,
+                                 config->server_stun_port);
+  base = conn_address(&load->arena, config->source_base, 0);
+  conn_address_get_endpoint(base, &endpoint);
+  if (endpoint.family != CONN_FAMILY_IPV4) {
+    fprintf(stderr, "source-base must be an ipv4 address\n");
+    return false;
+  }
+  load->source_base = endpoint_ipv4_addr(&endpoint);
+  load->read = conn_set_create(&load->arena);
+  load->write = conn_set_create(&load->arena);
+  load->peers = calloc(config->peers, sizeof(LoadPeer));
+  load->rooms_joined = calloc(config->rooms, sizeof(u32));
+  assert(load->peers && load->rooms_joined);
+  samples_init(&load->join_latency);
+  samples_init(&load->connect_latency);
+  samples_init(&load->stun_rtt);
+  samples_init(&load->broadcast_completion);
+  load->rng = 0x9e3779b9;
+  load->start_time = conn_current_time_us();
+  load->next_progress = load->start_time + 1000000;
+  if (config->server_pid) {
+    load->server_cpu_start = process_cpu_us(config->server_pid);
+  }
+  return true;
+}
+
+typedef struct LoadReport {
+  char *name;
+  LoadSamples *samples;
+} LoadReport;
+
+static void load_report(LoadGen *load, u64 elapsed, u64 server_cpu) {
+  LoadReport reports[4];
+  LoadStats *stats;
+  FILE *json;
+  f64 seconds;
+  u64 operations;
+  u32 i;
+
+  reports[0].name = "join_latency_us";
+  reports[0].samples = &load->join_latency;
+  reports[1].name = "connect_to_list_us";
+  reports[1].samples = &load->connect_latency;
+  reports[2].name = "stun_rtt_us";
+  reports[2].samples = &load->stun_rtt;
+  reports[3].name = "broadcast_completion_us";
+  reports[3].samples = &load->broadcast_completion;
+
+  stats = &load->stats;
+  seconds = (f64)elapsed / 1e6;
+  /* NOTE: what the server had to handle, every request and every message it
+   * wrote */
+  operations = stats->joins + stats->stun_requests + stats->keepalives +
+               stats->lists + stats->notices;
+  printf("\npeers %u rooms %u elapsed %.1fs\n", load->config.peers,
+         load->config.rooms, seconds);
+  printf("joins %llu (%.1f/s) leaves %llu ctrl errors %llu broadcasts "
+         "complete %llu\n",
+         stats->joins, stats->joins / seconds, stats->leaves,
+         stats->ctrl_errors, stats->broadcasts_complete);
+  printf("stun requests %llu (%.1f/s) responses %llu retries %llu keep "
+         "alives %llu notices %llu\n",
+         stats->stun_requests, stats->stun_requests / seconds,
+         stats->stun_responses, stats->stun_retries, stats->keepalives,
+         stats->notices);
+  printf("%-26s %10s %10s %10s %10s %10s\n", "", "samples", "p50", "p90",
+         "p99", "max");
+  for (i = 0; i < array_len(reports); ++i) {
+    LoadSamples *samples;
+    samples = reports[i].samples;
+    qsort(samples->values, samples->count, sizeof(u32), compare_u32);
+    printf("%-26s %10u %10u %10u %10u %10u\n", reports[i].name,
+           samples->count, samples_percentile(samples, 50),
+           samples_percentile(samples, 90), samples_percentile(samples, 99),
+           samples_percentile(samples, 100));
+  }
+  if (load->config.server_pid) {
+    printf("server cpu %.3fs, %.2f us per join, %.3f us per operation\n",
+           (f64)server_cpu / 1e6,
+           stats->joins ? (f64)server_cpu / stats->joins : 0.0,
+           operations ? (f64)server_cpu / operations : 0.0);
+  }
+
+  if (!load->config.json_path[0]) {
+    return;
+  }
+  json = fopen(load->config.json_path, "w");
+  if (!json) {
+    fprintf(stderr, "can not write %s\n", load->config.json_path);
+    return;
+  }
+  fprintf(json,
+          "{\n  \"peers\": %u,\n  \"rooms\": %u,\n  \"elapsed_us\": %llu,\n"
+          "  \"joins\": %llu,\n  \"leaves\": %llu,\n  \"ctrl_errors\": %llu,\n"
+          "  \"stun_requests\": %llu,\n  \"stun_responses\": %llu,\n"
+          "  \"keepalives\": %llu,\n  \"notices\": %llu,\n"
+          "  \"server_cpu_us\": %llu,\n",
+          load->config.peers, load->config.rooms, elapsed, stats->joins,
+          stats->leaves, stats->ctrl_errors, stats->stun_requests,
+          stats->stun_responses, stats->keepalives, stats->notices,
+          server_cpu);
+  for (i = 0; i < array_len(reports); ++i) {
+    LoadSamples *samples;
+    samples = reports[i].samples;
+    fprintf(json,
+            "  \"%s\": {\"samples\": %u, \"p50\": %u, \"p90\": %u, "
+            "\"p99\": %u, \"max\": %u}%s\n",
+            reports[i].name, samples->count, samples_percentile(samples, 50),
+            samples_percentile(samples, 90), samples_percentile(samples, 99),
+            samples_percentile(samples, 100),
+            i + 1 < array_len(reports) ? "," : "");
+  }
+  fprintf(json, "}\n");
+  fclose(json);
+}
+
+int main(int argc, char **argv) {
+  static LoadGen _load;
+  LoadGen *load = &_load;
+  LoadConfig config;
+  u64 now, server_cpu;
+  u32 res, i;
+
+  load_config_default(&config);
+  res = load_config_parse(&config, argc, argv);
+  if (res != CONFIG_OK) {
+    return res == CONFIG_EXIT ? 0 : 1;
+  }
+
+  conn_init();
+  if (!load_init(load, &config)) {
+    return 1;
+  }
+
+  for (;;) {
+    load_prepare(load);
+    load_process(load);
+    now = conn_current_time_us();
+    if (load->ramp_end_time &&
+        now - load->ramp_end_time >= (u64)config.duration_ms * 1000) {
+      break;
+    }
+  }
+
+  server_cpu = 0;
+  if (config.server_pid) {
+    server_cpu = process_cpu_us(config.server_pid) - load->server_cpu_start;
+  }
+  load_report(load, now - load->start_time, server_cpu);
+  for (i = 0; i < load->arrived; ++i) {
+    if (load->peers[i].state != LoadPeerState_IDLE) {
+      load_peer_close(load, &load->peers[i], now);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,410 @@
+#include "../src/capture.h"
+#include "../src/config.h"
+#include "../src/metrics.h"
+#include "../src/proto.h"
+
+/* NOTE: drives a server with a capture written by tenet-server --capture.
+ * Datagrams go to the stun port from one socket per source endpoint of the
+ * capture, ctrl connections are opened, fed their frames byte for byte and
+ * closed when the capture says so. Every socket gets source-base plus its
+ * index as local address (the whole 127/8 is loopback) so the rate limiter
+ * and the rooms see as many clients as the capture had.
+ *
+ * Records go out at their captured times divided by the speed, 0 sends them
+ * back to back. What the server answers is read and thrown away, the report
+ * has the pace that was kept (lag of each record behind its schedule) and
+ * how much the server answered */
+
+#define REPLAY_MAX_SOCKETS (1 << 16)
+#define REPLAY_DRAIN_EVERY 64
+
+typedef struct ReplayConfig {
+  char server_address[CONFIG_STRING_SIZE];
+  u16 server_ctrl_port;
+  u16 server_stun_port;
+  char source_base[CONFIG_STRING_SIZE];
+  char capture_path[CONFIG_STRING_SIZE];
+  u32 speed;
+  u32 drain_ms;
+} ReplayConfig;
+
+typedef struct ReplaySource {
+  ConnEndpoint endpoint;
+  Conn conn;
+} ReplaySource;
+
+typedef struct ReplayConn {
+  u32 id;
+  Conn conn;
+  b32 open;
+} ReplayConn;
+
+typedef struct ReplayStats {
+  u64 records[CaptureKind_CLOSE + 1];
+  u64 bytes_sent;
+  u64 datagrams_received;
+  u64 ctrl_bytes_received;
+  u64 server_closed;
+  u64 errors;
+} ReplayStats;
+
+typedef struct Replay {
+  ReplayConfig config;
+  Arena arena;
+  ConnAddr *ctrl_addr;
+  ConnAddr *stun_addr;
+  u32 source_base;
+  ConnSet *read;
+
+  ReplaySource *sources;
+  u32 sources_count;
+  ReplayConn *conns;
+  u32 conns_count;
+  /* NOTE: open addressing, slot is index + 1 and 0 is empty */
+  u32 *source_slots;
+  u32 *conn_slots;
+
+  ReplayStats stats;
+  MetricsHistogram *lag;
+} Replay;
+
+#define DEFAULT_SERVER_ADDRESS "127.0.0.1"
+#define DEFAULT_SERVER_CTRL_PORT 8080
+#define DEFAULT_SERVER_STUN_PORT 8081
+#define DEFAULT_SOURCE_BASE "127.2.0.1"
+#define DEFAULT_CAPTURE_PATH "tenet-server.pcapng"
+#define DEFAULT_SPEED 1
+#define DEFAULT_DRAIN_MS 500
+
+static u32 replay_config_parse(ReplayConfig *config, int argc, char **argv) {
+  ConfigOption options[] = {
+      {"server", ConfigType_STRING, config->server_address, 0, 0,
+       "address of the server"},
+      {"server-ctrl-port", ConfigType_U16, &config->server_ctrl_port, 1,
+       0xffff, "tcp port of the server ctrl socket"},
+      {"server-stun-port", ConfigType_U16, &config->server_stun_port, 1,
+       0xffff, "udp port of the server stun socket"},
+      {"source-base", ConfigType_STRING, config->source_base, 0, 0,
+       "ipv4 address of socket 0, socket i binds to it plus i, empty is no "
+       "bind"},
+      {"capture", ConfigType_STRING, config->capture_path, 0, 0,
+       "capture written by tenet-server --capture"},
+      {"speed", ConfigType_U32, &config->speed, 0, 1000000,
+       "times faster than captured, 0 is as fast as possible"},
+      {"drain-ms", ConfigType_U32, &config->drain_ms, 0, 600000,
+       "milliseconds to keep reading answers after the last record"},
+  };
+  memset(config, 0, sizeof(*config));
+  strcpy(config->server_address, DEFAULT_SERVER_ADDRESS);
+  config->server_ctrl_port = DEFAULT_SERVER_CTRL_PORT;
+  config->server_stun_port = DEFAULT_SERVER_STUN_PORT;
+  strcpy(config->source_base, DEFAULT_SOURCE_BASE);
+  strcpy(config->capture_path, DEFAULT_CAPTURE_PATH);
+  config->speed = DEFAULT_SPEED;
+  config->drain_ms = DEFAULT_DRAIN_MS;
+  return config_parse_args(options, array_len(options), argc, argv);
+}
+
+/* NOTE: binds to source-base + index when there is a base */
+static b32 replay_bind(Replay *replay, Conn conn, u32 index) {
+  ConnEndpoint source;
+  ConnAddr *addr;
+  u64 mark;
+  u32 res;
+  if (!replay->source_base) {
+    return true;
+  }
+  mark = replay->arena.used;
+  endpoint_ipv4(&source, replay->source_base + index, 0);
+  addr = conn_address_endpoint(&replay->arena, &source);
+  res = conn_bind(conn, addr);
+  replay->arena.used = mark;
+  return res != CONN_ERROR;
+}
+
+static ReplaySource *replay_source(Replay *replay, ConnEndpoint *endpoint) {
+  ReplaySource *source;
+  ConnErr udp;
+  u32 slot;
+  slot = endpoint_hash(endpoint) & (REPLAY_MAX_SOCKETS * 2 - 1);
+  while (replay->source_slots[slot]) {
+    source = &replay->sources[replay->source_slots[slot] - 1];
+    if (endpoint_equals(&source->endpoint, endpoint)) {
+      return source;
+    }
+    slot = (slot + 1) & (REPLAY_MAX_SOCKETS * 2 - 1);
+  }
+  if (replay->sources_count == REPLAY_MAX_SOCKETS) {
+    return 0;
+  }
+  udp = conn_udp();
+  if (udp.err == CONN_ERROR) {
+    return 0;
+  }
+  if (!replay_bind(replay, udp.conn, replay->sources_count)) {
+    conn_close(udp.conn);
+    return 0;
+  }
+  source = &replay->sources[replay->sources_count++];
+  source->endpoint = *endpoint;
+  source->conn = udp.conn;
+  replay->source_slots[slot] = replay->sources_count;
+  return source;
+}
+
+static ReplayConn *replay_conn_find(Replay *replay, u32 id, b32 insert) {
+  ReplayConn *conn;
+  u32 slot;
+  slot = (id * 0x9e3779b1u) & (REPLAY_MAX_SOCKETS * 2 - 1);
+  while (replay->conn_slots[slot]) {
+    conn = &replay->conns[replay->conn_slots[slot] - 1];
+    if (conn->id == id) {
+      return conn;
+    }
+    slot = (slot + 1) & (REPLAY_MAX_SOCKETS * 2 - 1);
+  }
+  if (!insert || replay->conns_count == REPLAY_MAX_SOCKETS) {
+    return 0;
+  }
+  conn = &replay->conns[replay->conns_count++];
+  memset(conn, 0, sizeof(*conn));
+  conn->id = id;
+  replay->conn_slots[slot] = replay->conns_count;
+  return conn;
+}
+
+/* NOTE: connections of a capture that started late are opened on their
+ * first frame */
+static ReplayConn *replay_conn_open(Replay *replay, u32 id) {
+  ReplayConn *conn;
+  ConnErr tcp;
+  u32 index;
+  conn = replay_conn_find(replay, id, true);
+  if (!conn || conn->open) {
+    return conn;
+  }
+  index = (u32)(conn - replay->conns);
+  tcp = conn_tcp();
+  if (tcp.err == CONN_ERROR) {
+    return 0;
+  }
+  /* NOTE: the udp sockets take the low addresses */
+  if (!replay_bind(replay, tcp.conn, REPLAY_MAX_SOCKETS + index) ||
+      conn_connect(tcp.conn, replay->ctrl_addr) == CONN_ERROR) {
+    conn_close(tcp.conn);
+    return 0;
+  }
+  conn->conn = tcp.conn;
+  conn->open = true;
+  return conn;
+}
+
+static void replay_conn_close(ReplayConn *conn) {
+  if (conn->open) {
+    conn_close(conn->conn);
+    conn->open = false;
+  }
+}
+
+static b32 replay_write(Conn conn, u8 *data, u32 size) {
+  u32 sent, res;
+  sent = 0;
+  while (sent < size) {
+    res = conn_write(conn, data + sent, size - sent);
+    if (res == CONN_ERROR) {
+      return false;
+    }
+    sent += res;
+  }
+  return true;
+}
+
+static void replay_send(Replay *replay, CaptureRecord *record) {
+  ReplaySource *source;
+  ReplayConn *conn;
+  b32 ok;
+  ok = false;
+  switch (record->kind) {
+  case CaptureKind_DGRAM: {
+    source = replay_source(replay, &record->endpoint);
+    ok = source && conn_write_to(source->conn, record->data, record->size,
+                                 replay->stun_addr) != CONN_ERROR;
+  } break;
+  case CaptureKind_OPEN: {
+    ok = replay_conn_open(replay, record->conn) != 0;
+  } break;
+  case CaptureKind_FRAME: {
+    conn = replay_conn_open(replay, record->conn);
+    ok = conn && replay_write(conn->conn, record->data, record->size);
+    if (conn && !ok) {
+      replay_conn_close(conn);
+    }
+  } break;
+  case CaptureKind_CLOSE: {
+    conn = replay_conn_find(replay, record->conn, false);
+    if (conn) {
+      replay_conn_close(conn);
+    }
+    ok = true;
+  } break;
+  default: {
+    return;
+  }
+  }
+  replay->stats.records[record->kind]++;
+  if (ok) {
+    replay->stats.bytes_sent += record->size;
+  } else {
+    replay->stats.errors++;
+  }
+}
+
+/* NOTE: reads whatever the server answered, waits up to ms for it */
+static void replay_drain(Replay *replay, u32 ms) {
+  static u8 buffer[kb(64)];
+  u32 i, res;
+  conn_set_clear(replay->read);
+  for (i = 0; i < replay->sources_count; ++i) {
+    conn_set_add(replay->read, replay->sources[i].conn);
+  }
+  for (i = 0; i < replay->conns_count; ++i) {
+    if (replay->conns[i].open) {
+      conn_set_add(replay->read, replay->conns[i].conn);
+    }
+  }
+  res = conn_select(replay->read, 0, ms);
+  if (res == CONN_ERROR || res == 0) {
+    return;
+  }
+  for (i = 0; i < replay->sources_count; ++i) {
+    if (conn_set_has(replay->read, replay->sources[i].conn)) {
+      if (conn_read(replay->sources[i].conn, buffer, sizeof(buffer)) !=
+          CONN_ERROR) {
+        replay->stats.datagrams_received++;
+      }
+    }
+  }
+  for (i = 0; i < replay->conns_count; ++i) {
+    ReplayConn *conn;
+    conn = &replay->conns[i];
+    if (conn->open && conn_set_has(replay->read, conn->conn)) {
+      res = conn_read(conn->conn, buffer, sizeof(buffer));
+      if (res == CONN_ERROR || res == 0) {
+        replay->stats.server_closed++;
+        replay_conn_close(conn);
+      } else {
+        replay->stats.ctrl_bytes_received += res;
+      }
+    }
+  }
+}
+
+static void replay_report(Replay *replay, u64 span, u64 elapsed, u64 count) {
+  ReplayStats *stats;
+  f64 seconds;
+  stats = &replay->stats;
+  seconds = max(elapsed, 1) / 1e6;
+  printf("records %llu (dgram %llu open %llu frame %llu close %llu) "
+         "errors %llu\n",
+         count, stats->records[CaptureKind_DGRAM],
+         stats->records[CaptureKind_OPEN], stats->records[CaptureKind_FRAME],
+         stats->records[CaptureKind_CLOSE], stats->errors);
+  printf("captured %.3fs replayed in %.3fs, %.0f records/s %.0f bytes/s\n",
+         span / 1e6, seconds, count / seconds, stats->bytes_sent / seconds);
+  printf("lag_us p50 %llu p99 %llu max %llu\n",
+         metrics_percentile(replay->lag->buckets, replay->lag->count, 50),
+         metrics_percentile(replay->lag->buckets, replay->lag->count, 99),
+         metrics_percentile(replay->lag->buckets, replay->lag->count, 100));
+  printf("answers: datagrams %llu ctrl bytes %llu closed by server %llu\n",
+         stats->datagrams_received, stats->ctrl_bytes_received,
+         stats->server_closed);
+  printf("sockets: udp %u tcp %u\n", replay->sources_count,
+         replay->conns_count);
+}
+
+int main(int argc, char **argv) {
+  static Replay _replay;
+  Replay *replay = &_replay;
+  ReplayConfig *config;
+  CaptureReader reader;
+  CaptureRecord record;
+  ConnEndpoint base;
+  u64 first_time, start, now, due, count, elapsed, span;
+  u32 res, i;
+
+  config = &replay->config;
+  res = replay_config_parse(config, argc, argv);
+  if (res != CONFIG_OK) {
+    return res == CONFIG_EXIT ? 0 : 1;
+  }
+  conn_init();
+  if (!capture_reader_open(&reader, config->capture_path)) {
+    fprintf(stderr, "%s: not a capture of tenet-server\n",
+            config->capture_path);
+    return 1;
+  }
+
+  arena_init(&replay->arena, malloc(mb(1)), mb(1));
+  replay->ctrl_addr = conn_address(&replay->arena, config->server_address,
+                                   config->server_ctrl_port);
+  replay->stun_addr = conn_address(&replay->arena, config->server_address,
+                                   config->server_stun_port);
+  if (config->source_base[0]) {
+    conn_address_get_endpoint(
+        conn_address(&replay->arena, config->source_base, 0), &base);
+    replay->source_base = endpoint_ipv4_addr(&base);
+  }
+  replay->read = conn_set_create(&replay->arena);
+  replay->sources = calloc(REPLAY_MAX_SOCKETS, sizeof(ReplaySource));
+  replay->conns = calloc(REPLAY_MAX_SOCKETS, sizeof(ReplayConn));
+  replay->source_slots = calloc(REPLAY_MAX_SOCKETS * 2, sizeof(u32));
+  replay->conn_slots = calloc(REPLAY_MAX_SOCKETS * 2, sizeof(u32));
+  replay->lag = calloc(1, sizeof(MetricsHistogram));
+  assert(replay->sources && replay->conns && replay->source_slots &&
+         replay->conn_slots && replay->lag);
+
+  first_time = 0;
+  count = 0;
+  start = conn_current_time_us();
+  now = start;
+  while (capture_reader_next(&reader, &record)) {
+    if (count == 0) {
+      first_time = record.time;
+    }
+    due = config->speed
+              ? start + (record.time - first_time) / config->speed
+              : now;
+    for (;;) {
+      now = conn_current_time_us();
+      if (now >= due) {
+        break;
+      }
+      replay_drain(replay, (u32)((due - now) / 1000));
+    }
+    metrics_record(replay->lag, now - due);
+    replay_send(replay, &record);
+    count++;
+    if (count % REPLAY_DRAIN_EVERY == 0) {
+      replay_drain(replay, 0);
+    }
+  }
+  now = conn_current_time_us();
+  elapsed = now - start;
+  span = count ? record.time - first_time : 0;
+
+  start = now;
+  while (now - start < (u64)config->drain_ms * 1000) {
+    replay_drain(replay, (u32)(config->drain_ms - (now - start) / 1000));
+    now = conn_current_time_us();
+  }
+  replay_report(replay, span, elapsed, count);
+
+  for (i = 0; i < replay->sources_count; ++i) {
+    conn_close(replay->sources[i].conn);
+  }
+  for (i = 0; i < replay->conns_count; ++i) {
+    replay_conn_close(&replay->conns[i]);
+  }
+  capture_reader_close(&reader);
+  return 0;
+}
@@ -5,7 +5,7 @@ if not exist .\build mkdir .\build
 set TARGET=server.exe
 set CFLAGS=-std=c99 -Wall -Werror -pedantic -g
 set LIBS=-lws2_32 -lIphlpapi
-set SOURCES= src/core.c src/net.c src/proto.c src/server.c
+set SOURCES= src/core.c src/net.c src/proto.c src/config.c src/log.c src/mapfile.c src/metrics.c src/capture.c src/ratelimit.c src/stun.c src/rank.c src/server.c
 set OUT_DIR=build/
 
 clang %CFLAGS% %SOURCES% -o %OUT_DIR%%TARGET% %LIBS% -Wno-long-long 
@@ -13,7 +13,47 @@ clang %CFLAGS% %SOURCES% -o %OUT_DIR%%TARGET% %LIBS% -Wno-long-long
 set TARGET=peer.exe
 set CFLAGS=-std=c99 -Wall -Werror -pedantic -g
 set LIBS=-lws2_32 -lIphlpapi
-set SOURCES= src/core.c src/net.c src/proto.c src/peer.c
+set SOURCES= src/core.c src/net.c src/proto.c src/config.c src/mapfile.c src/metrics.c src/reliable.c src/sequenced.c src/punch.c src/gossip.c src/peer.c
+set OUT_DIR=build/
+
+clang %CFLAGS% %SOURCES% -o %OUT_DIR%%TARGET% %LIBS% -Wno-long-long
+
+set TARGET=bench.exe
+set CFLAGS=-std=c99 -Wall -Werror -pedantic -g -O2
+set LIBS=-lws2_32 -lIphlpapi
+set SOURCES= src/core.c src/net.c src/proto.c src/reliable.c src/ratelimit.c bench/bench.c bench/harness.c bench/bench_reliable.c bench/bench_ratelimit.c bench/bench_proto.c
+set OUT_DIR=build/
+
+clang %CFLAGS% %SOURCES% -o %OUT_DIR%%TARGET% %LIBS% -Wno-long-long
+
+set TARGET=loadgen.exe
+set CFLAGS=-std=c99 -Wall -Werror -pedantic -g -O2
+set LIBS=-lws2_32 -lIphlpapi
+set SOURCES= src/core.c src/net.c src/proto.c src/config.c bench/loadgen.c
+set OUT_DIR=build/
+
+clang %CFLAGS% %SOURCES% -o %OUT_DIR%%TARGET% %LIBS% -Wno-long-long
+
+set TARGET=replay.exe
+set CFLAGS=-std=c99 -Wall -Werror -pedantic -g -O2
+set LIBS=-lws2_32 -lIphlpapi
+set SOURCES= src/core.c src/net.c src/proto.c src/config.c src/mapfile.c src/metrics.c src/capture.c bench/replay.c
+set OUT_DIR=build/
+
+clang %CFLAGS% %SOURCES% -o %OUT_DIR%%TARGET% %LIBS% -Wno-long-long
+
+set TARGET=top.exe
+set CFLAGS=-std=c99 -Wall -Werror -pedantic -g
+set LIBS=-lws2_32 -lIphlpapi
+set SOURCES= src/core.c src/net.c src/config.c src/mapfile.c src/metrics.c src/top.c
+set OUT_DIR=build/
+
+clang %CFLAGS% %SOURCES% -o %OUT_DIR%%TARGET% %LIBS% -Wno-long-long
+
+set TARGET=tests.exe
+set CFLAGS=-std=c99 -Wall -Werror -pedantic -g
+set LIBS=-lws2_32 -lIphlpapi
+set SOURCES= src/core.c src/net.c src/proto.c src/config.c src/log.c src/mapfile.c src/metrics.c src/capture.c src/ratelimit.c src/stun.c src/punch.c src/gossip.c src/rank.c src/reliable.c src/sequenced.c tests/test_main.c tests/test_proto.c tests/test_ratelimit.c tests/test_stun.c tests/test_config.c tests/test_punch.c tests/test_metrics.c tests/test_log.c tests/test_capture.c tests/test_rank.c tests/test_gossip.c tests/test_reliable.c tests/test_sequenced.c
 set OUT_DIR=build/
 
 clang %CFLAGS% %SOURCES% -o %OUT_DIR%%TARGET% %LIBS% -Wno-long-long
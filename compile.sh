@@ -0,0 +1,35 @@
+#!/bin/sh
+
+mkdir -p ./build
+
+CFLAGS="-std=c99 -Wall -Werror -pedantic -g"
+LIBS="-lpthread"
+OUT_DIR=build/
+
+TARGET=server
+SOURCES="src/core.c src/net_linux.c src/proto.c src/config.c src/log.c src/mapfile.c src/metrics.c src/capture.c src/ratelimit.c src/stun.c src/rank.c src/server.c"
+cc $CFLAGS $SOURCES -o $OUT_DIR$TARGET $LIBS -Wno-long-long || exit 1
+
+TARGET=peer
+SOURCES="src/core.c src/net_linux.c src/proto.c src/config.c src/mapfile.c src/metrics.c src/reliable.c src/sequenced.c src/punch.c src/gossip.c src/peer.c"
+cc $CFLAGS $SOURCES -o $OUT_DIR$TARGET $LIBS -Wno-long-long || exit 1
+
+TARGET=bench
+SOURCES="src/core.c src/net_linux.c src/proto.c src/reliable.c src/ratelimit.c bench/bench.c bench/harness.c bench/bench_reliable.c bench/bench_ratelimit.c bench/bench_proto.c"
+cc $CFLAGS -O2 $SOURCES -o $OUT_DIR$TARGET $LIBS -Wno-long-long || exit 1
+
+TARGET=loadgen
+SOURCES="src/core.c src/net_linux.c src/proto.c src/config.c bench/loadgen.c"
+cc $CFLAGS -O2 $SOURCES -o $OUT_DIR$TARGET $LIBS -Wno-long-long || exit 1
+
+TARGET=top
+SOURCES="src/core.c src/net_linux.c src/config.c src/mapfile.c src/metrics.c src/top.c"
+cc $CFLAGS $SOURCES -o $OUT_DIR$TARGET $LIBS -Wno-long-long || exit 1
+
+TARGET=replay
+SOURCES="src/core.c src/net_linux.c src/proto.c src/config.c src/mapfile.c src/metrics.c src/capture.c bench/replay.c"
+cc $CFLAGS -O2 $SOURCES -o $OUT_DIR$TARGET $LIBS -Wno-long-long || exit 1
+
+TARGET=tests
+SOURCES="src/core.c src/net_linux.c src/proto.c src/config.c src/log.c src/mapfile.c src/metrics.c src/capture.c src/ratelimit.c src/stun.c src/punch.c src/gossip.c src/rank.c src/reliable.c src/sequenced.c tests/test_main.c tests/test_proto.c tests/test_ratelimit.c tests/test_stun.c tests/test_config.c tests/test_punch.c tests/test_metrics.c tests/test_log.c tests/test_capture.c tests/test_rank.c tests/test_gossip.c tests/test_reliable.c tests/test_sequenced.c"
+cc $CFLAGS $SOURCES -o $OUT_DIR$TARGET $LIBS -Wno-long-long || exit 1
@@ -0,0 +1,182 @@
+#include <time.h>
+
+#include "capture.h"
+
+#define CAPTURE_BLOCK_SECTION 0x0a0d0d0a
+#define CAPTURE_BLOCK_INTERFACE 0x00000001
+#define CAPTURE_BLOCK_PACKET 0x00000006
+#define CAPTURE_BYTE_ORDER 0x1a2b3c4d
+#define CAPTURE_SECTION_SIZE 28
+#define CAPTURE_INTERFACE_SIZE 20
+/* NOTE: enhanced packet block without the data */
+#define CAPTURE_PACKET_SIZE 32
+
+#define capture_align(size) (((size) + 3) & ~(u64)3)
+
+static u8 *capture_put_u32(u8 *cursor, u32 value) {
+  memcpy(cursor, &value, sizeof(value));
+  return cursor + sizeof(value);
+}
+
+static u8 *capture_put_u16(u8 *cursor, u16 value) {
+  memcpy(cursor, &value, sizeof(value));
+  return cursor + sizeof(value);
+}
+
+static u32 capture_get_u32(u8 *cursor) {
+  u32 value;
+  memcpy(&value, cursor, sizeof(value));
+  return value;
+}
+
+static u16 capture_get_u16(u8 *cursor) {
+  u16 value;
+  memcpy(&value, cursor, sizeof(value));
+  return value;
+}
+
+b32 capture_open(Capture *capture, char *path, u64 size) {
+  s64 section_size;
+  u8 *cursor;
+  memset(capture, 0, sizeof(*capture));
+  if (size < CAPTURE_SECTION_SIZE + CAPTURE_INTERFACE_SIZE ||
+      !mapped_file_create(&capture->file, path, size)) {
+    return false;
+  }
+  capture->epoch_offset = (u64)time(0) * 1000000 - conn_current_time_us();
+
+  cursor = capture->file.data;
+  cursor = capture_put_u32(cursor, CAPTURE_BLOCK_SECTION);
+  cursor = capture_put_u32(cursor, CAPTURE_SECTION_SIZE);
+  cursor = capture_put_u32(cursor, CAPTURE_BYTE_ORDER);
+  cursor = capture_put_u16(cursor, 1);
+  cursor = capture_put_u16(cursor, 0);
+  /* NOTE: -1 is section size not known */
+  section_size = -1;
+  memcpy(cursor, &section_size, sizeof(section_size));
+  cursor += sizeof(section_size);
+  cursor = capture_put_u32(cursor, CAPTURE_SECTION_SIZE);
+
+  /* NOTE: no options, microsecond timestamps are the default */
+  cursor = capture_put_u32(cursor, CAPTURE_BLOCK_INTERFACE);
+  cursor = capture_put_u32(cursor, CAPTURE_INTERFACE_SIZE);
+  cursor = capture_put_u16(cursor, CAPTURE_LINKTYPE_USER0);
+  cursor = capture_put_u16(cursor, 0);
+  cursor = capture_put_u32(cursor, 0);
+  cursor = capture_put_u32(cursor, CAPTURE_INTERFACE_SIZE);
+  capture->used = (u64)(cursor - capture->file.data);
+  return true;
+}
+
+void capture_close(Capture *capture) {
+  mapped_file_close(&capture->file, capture->used);
+  memset(capture, 0, sizeof(*capture));
+}
+
+void capture_record(Capture *capture, u64 now, CaptureKind kind, u32 conn,
+                    ConnEndpoint *from, u8 *data, u32 size) {
+  CaptureHeader header;
+  u64 block_size, time;
+  u32 packet_size;
+  u8 *cursor;
+  if (!capture->file.data) {
+    return;
+  }
+  packet_size = (u32)sizeof(header) + size;
+  block_size = CAPTURE_PACKET_SIZE + capture_align(packet_size);
+  if (capture->used + block_size > capture->file.size) {
+    capture->dropped++;
+    return;
+  }
+  memset(&header, 0, sizeof(header));
+  header.kind = (u8)kind;
+  header.conn = conn;
+  if (from) {
+    header.family = from->family;
+    header.port = from->port;
+    memcpy(header.addr, from->addr, sizeof(header.addr));
+  }
+  time = now + capture->epoch_offset;
+
+  /* NOTE: the file is zeros, the padding is already there */
+  cursor = capture->file.data + capture->used;
+  cursor = capture_put_u32(cursor, CAPTURE_BLOCK_PACKET);
+  cursor = capture_put_u32(cursor, (u32)block_size);
+  cursor = capture_put_u32(cursor, 0);
+  cursor = capture_put_u32(cursor, (u32)(time >> 32));
+  cursor = capture_put_u32(cursor, (u32)time);
+  cursor = capture_put_u32(cursor, packet_size);
+  cursor = capture_put_u32(cursor, packet_size);
+  memcpy(cursor, &header, sizeof(header));
+  memcpy(cursor + sizeof(header), data, size);
+  cursor += capture_align(packet_size);
+  capture_put_u32(cursor, (u32)block_size);
+  capture->used += block_size;
+  capture->records++;
+}
+
+b32 capture_reader_open(CaptureReader *reader, char *path) {
+  u8 *data;
+  memset(reader, 0, sizeof(*reader));
+  if (!mapped_file_open(&reader->file, path)) {
+    return false;
+  }
+  data = reader->file.data;
+  /* NOTE: only files written on a machine with the same byte order */
+  if (reader->file.size < CAPTURE_SECTION_SIZE ||
+      capture_get_u32(data) != CAPTURE_BLOCK_SECTION ||
+      capture_get_u32(data + 8) != CAPTURE_BYTE_ORDER) {
+    capture_reader_close(reader);
+    return false;
+  }
+  reader->offset = capture_get_u32(data + 4);
+  return true;
+}
+
+void capture_reader_close(CaptureReader *reader) {
+  mapped_file_close(&reader->file, reader->file.size);
+  memset(reader, 0, sizeof(*reader));
+}
+
+b32 capture_reader_next(CaptureReader *reader, CaptureRecord *record) {
+  while (reader->offset + 12 <= reader->file.size) {
+    CaptureHeader header;
+    u8 *block;
+    u32 type, block_size, packet_size;
+    block = reader->file.data + reader->offset;
+    type = capture_get_u32(block);
+    block_size = capture_get_u32(block + 4);
+    /* NOTE: a zero block is the unused tail of a capture that was not
+     * closed */
+    if (block_size < 12 || block_size % 4 != 0 ||
+        reader->offset + block_size > reader->file.size) {
+      return false;
+    }
+    reader->offset += block_size;
+    if (type == CAPTURE_BLOCK_INTERFACE &&
+        capture_get_u16(block + 8) != CAPTURE_LINKTYPE_USER0) {
+      return false;
+    }
+    if (type != CAPTURE_BLOCK_PACKET || block_size < CAPTURE_PACKET_SIZE) {
+      continue;
+    }
+    packet_size = capture_get_u32(block + 20);
+    if (packet_size < sizeof(header) ||
+        packet_size > block_size - CAPTURE_PACKET_SIZE) {
+      continue;
+    }
+    memcpy(&header, block + 28, sizeof(header));
+    record->kind = (CaptureKind)header.kind;
+    record->time = ((u64)capture_get_u32(block + 12) << 32) |
+                   capture_get_u32(block + 16);
+    record->conn = header.conn;
+    memset(&record->endpoint, 0, sizeof(record->endpoint));
+    record->endpoint.family = header.family;
+    record->endpoint.port = header.port;
+    memcpy(record->endpoint.addr, header.addr, sizeof(header.addr));
+    record->data = block + 28 + sizeof(header);
+    record->size = packet_size - (u32)sizeof(header);
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,77 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include "core.h"
+#include "mapfile.h"
+#include "net.h"
+
+/* NOTE: traffic capture in pcapng, written straight into a memory mapped
+ * file of fixed size. The file is one section with one interface of link type
+ * USER0 and an enhanced packet block per record, so wireshark and tcpdump
+ * open it and tenet-replay drives a server with it. Every packet starts with
+ * a CaptureHeader that says what it is:
+ *
+ *   DGRAM  a datagram received on the stun socket, endpoint is the source
+ *   OPEN   the server accepted ctrl connection conn
+ *   FRAME  a whole frame decoded from ctrl connection conn
+ *   CLOSE  ctrl connection conn is gone
+ *
+ * Timestamps are microseconds since the epoch. Everything is in host byte
+ * order, the section header tells readers which one. A full capture stops
+ * recording and counts what it missed */
+
+#define CAPTURE_LINKTYPE_USER0 147
+#define CAPTURE_DEFAULT_SIZE mb(256)
+
+typedef enum CaptureKind {
+  CaptureKind_DGRAM = 1,
+  CaptureKind_OPEN,
+  CaptureKind_FRAME,
+  CaptureKind_CLOSE,
+} CaptureKind;
+
+typedef struct CaptureHeader {
+  u8 kind;
+  u8 family;
+  u16 port;
+  u32 conn;
+  u8 addr[16];
+} CaptureHeader;
+
+typedef struct Capture {
+  MappedFile file;
+  u64 used;
+  /* NOTE: added to conn_current_time_us to get the epoch */
+  u64 epoch_offset;
+  u64 records;
+  u64 dropped;
+} Capture;
+
+typedef struct CaptureRecord {
+  CaptureKind kind;
+  u64 time;
+  u32 conn;
+  ConnEndpoint endpoint;
+  u8 *data;
+  u32 size;
+} CaptureRecord;
+
+typedef struct CaptureReader {
+  MappedFile file;
+  u64 offset;
+} CaptureReader;
+
+b32 capture_open(Capture *capture, char *path, u64 size);
+/* NOTE: cuts the file to what was written */
+void capture_close(Capture *capture);
+/* NOTE: now is conn_current_time_us, from is 0 for ctrl records */
+void capture_record(Capture *capture, u64 now, CaptureKind kind, u32 conn,
+                    ConnEndpoint *from, u8 *data, u32 size);
+
+b32 capture_reader_open(CaptureReader *reader, char *path);
+void capture_reader_close(CaptureReader *reader);
+/* NOTE: false at the end of the capture, blocks that are not packets are
+ * skipped */
+b32 capture_reader_next(CaptureReader *reader, CaptureRecord *record);
+
+#endif
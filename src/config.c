@@ -0,0 +1,250 @@
+#include "config.h"
+
+#include <ctype.h>
+
+static ConfigOption *config_find(ConfigOption *options, u32 count, char *name,
+                                 u32 name_size) {
+  u32 i;
+  for (i = 0; i < count; ++i) {
+    if (strlen(options[i].name) == name_size &&
+        memcmp(options[i].name, name, name_size) == 0) {
+      return &options[i];
+    }
+  }
+  return 0;
+}
+
+static b32 config_parse_number(char *text, b32 allow_suffix, u64 *value) {
+  u64 result, digit;
+  if (!isdigit((u8)*text)) {
+    return false;
+  }
+  result = 0;
+  while (isdigit((u8)*text)) {
+    digit = (u64)(*text++ - '0');
+    if (result > (0xffffffffffffffffull - digit) / 10) {
+      return false;
+    }
+    result = result * 10 + digit;
+  }
+  if (allow_suffix && *text) {
+    u64 scale;
+    switch (tolower((u8)*text++)) {
+    case 'k': {
+      scale = kb(1);
+    } break;
+    case 'm': {
+      scale = mb(1);
+    } break;
+    case 'g': {
+      scale = gb(1);
+    } break;
+    default: {
+      return false;
+    } break;
+    }
+    if (result > 0xffffffffffffffffull / scale) {
+      return false;
+    }
+    result *= scale;
+  }
+  if (*text) {
+    return false;
+  }
+  *value = result;
+  return true;
+}
+
+static void config_error_prefix(char *source, u32 line) {
+  if (line) {
+    fprintf(stderr, "%s:%u: ", source, line);
+  } else {
+    fprintf(stderr, "%s: ", source);
+  }
+}
+
+/* NOTE: source and line are only for the error message, line 0 is the
+ * command line */
+static u32 config_set(ConfigOption *option, char *value, char *source,
+                      u32 line) {
+  u64 number;
+  if (option->type == ConfigType_STRING) {
+    if (strlen(value) >= CONFIG_STRING_SIZE) {
+      config_error_prefix(source, line);
+      fprintf(stderr, "value of %s is too long\n", option->name);
+      return CONFIG_ERROR;
+    }
+    strcpy((char *)option->value, value);
+    return CONFIG_OK;
+  }
+  if (!config_parse_number(value, option->type == ConfigType_SIZE,
+                           &number) ||
+      number < option->min_value || number > option->max_value) {
+    config_error_prefix(source, line);
+    fprintf(stderr, "%s must be a number in [%llu, %llu], got '%s'\n",
+            option->name, option->min_value, option->max_value, value);
+    return CONFIG_ERROR;
+  }
+  switch (option->type) {
+  case ConfigType_U16: {
+    *(u16 *)option->value = (u16)number;
+  } break;
+  case ConfigType_U32: {
+    *(u32 *)option->value = (u32)number;
+  } break;
+  case ConfigType_SIZE: {
+    *(u64 *)option->value = number;
+  } break;
+  case ConfigType_STRING: {
+  } break;
+  }
+  return CONFIG_OK;
+}
+
+static char *config_trim(char *text) {
+  char *end;
+  while (isspace((u8)*text)) {
+    text++;
+  }
+  end = text + strlen(text);
+  while (end > text && isspace((u8)end[-1])) {
+    *--end = 0;
+  }
+  return text;
+}
+
+u32 config_parse_file(ConfigOption *options, u32 count, char *path) {
+  FILE *file;
+  char line[CONFIG_STRING_SIZE * 2];
+  u32 line_number, res;
+  file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "%s: cannot open config file\n", path);
+    return CONFIG_ERROR;
+  }
+  res = CONFIG_OK;
+  line_number = 0;
+  while (res == CONFIG_OK && fgets(line, sizeof(line), file)) {
+    ConfigOption *option;
+    char *name, *value, *separator;
+    line_number++;
+    separator = strchr(line, '#');
+    if (separator) {
+      *separator = 0;
+    }
+    name = config_trim(line);
+    if (!*name) {
+      continue;
+    }
+    separator = strchr(name, '=');
+    if (!separator) {
+      fprintf(stderr, "%s:%u: expected name = value\n", path, line_number);
+      res = CONFIG_ERROR;
+      break;
+    }
+    *separator = 0;
+    name = config_trim(name);
+    value = config_trim(separator + 1);
+    option = config_find(options, count, name, (u32)strlen(name));
+    if (!option) {
+      fprintf(stderr, "%s:%u: unknown option %s\n", path, line_number, name);
+      res = CONFIG_ERROR;
+      break;
+    }
+    res = config_set(option, value, path, line_number);
+  }
+  fclose(file);
+  return res;
+}
+
+u32 config_parse_args(ConfigOption *options, u32 count, int argc,
+                      char **argv) {
+  s32 i;
+  /* NOTE: the file goes first so flags override it wherever they are */
+  for (i = 1; i < argc; ++i) {
+    char *path;
+    path = 0;
+    if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+      path = argv[i + 1];
+    } else if (strncmp(argv[i], "--config=", 9) == 0) {
+      path = argv[i] + 9;
+    }
+    if (path && config_parse_file(options, count, path) == CONFIG_ERROR) {
+      return CONFIG_ERROR;
+    }
+  }
+  for (i = 1; i < argc; ++i) {
+    ConfigOption *option;
+    char *arg, *value, *equals;
+    u32 name_size;
+    arg = argv[i];
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+      config_print_usage(argv[0], options, count);
+      return CONFIG_EXIT;
+    }
+    if (strncmp(arg, "--", 2) != 0) {
+      fprintf(stderr, "unexpected argument '%s', try --help\n", arg);
+      return CONFIG_ERROR;
+    }
+    arg += 2;
+    equals = strchr(arg, '=');
+    name_size = equals ? (u32)(equals - arg) : (u32)strlen(arg);
+    if (equals) {
+      value = equals + 1;
+    } else if (i + 1 < argc) {
+      value = argv[++i];
+    } else {
+      fprintf(stderr, "missing value for --%s\n", arg);
+      return CONFIG_ERROR;
+    }
+    if (name_size == 6 && memcmp(arg, "config", 6) == 0) {
+      continue;
+    }
+    option = config_find(options, count, arg, name_size);
+    if (!option) {
+      fprintf(stderr, "unknown option --%.*s, try --help\n", (s32)name_size,
+              arg);
+      return CONFIG_ERROR;
+    }
+    if (config_set(option, value, "command line", 0) == CONFIG_ERROR) {
+      return CONFIG_ERROR;
+    }
+  }
+  return CONFIG_OK;
+}
+
+static void config_print_value(ConfigOption *option) {
+  switch (option->type) {
+  case ConfigType_STRING: {
+    printf("%s", (char *)option->value);
+  } break;
+  case ConfigType_U16: {
+    printf("%u", *(u16 *)option->value);
+  } break;
+  case ConfigType_U32: {
+    printf("%u", *(u32 *)option->value);
+  } break;
+  case ConfigType_SIZE: {
+    printf("%llu", *(u64 *)option->value);
+  } break;
+  }
+}
+
+void config_print_usage(char *program, ConfigOption *options, u32 count) {
+  u32 i;
+  printf("usage: %s [--config file] [--name value]...\n\n", program);
+  for (i = 0; i < count; ++i) {
+    printf("  --%-26s %s (", options[i].name, options[i].help);
+    config_print_value(&options[i]);
+    printf(")\n");
+  }
+}
+
+void config_print(ConfigOption *options, u32 count) {
+  u32 i;
+  for (i = 0; i < count; ++i) {
+    printf("%s = ", options[i].name);
+    config_print_value(&options[i]);
+    printf("\n");
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include "core.h"
+
+/* NOTE: startup configuration. Every binary describes its settings with a
+ * table of ConfigOption that points into its own config struct (already
+ * filled with the defaults), then a config file and the command line write
+ * over it. Flags are `--name value` or `--name=value`, the file has one
+ * `name = value` per line and `#` comments, `--config path` loads a file and
+ * flags always win over the file. Sizes take a k, m or g suffix. Nothing in
+ * here runs after startup */
+
+#define CONFIG_STRING_SIZE 256
+#define CONFIG_OK ((u32)0)
+#define CONFIG_ERROR ((u32) - 1)
+/* NOTE: --help, usage was printed and the program should exit */
+#define CONFIG_EXIT ((u32)1)
+
+typedef enum ConfigType {
+  ConfigType_STRING,
+  ConfigType_U16,
+  ConfigType_U32,
+  ConfigType_SIZE
+} ConfigType;
+
+typedef struct ConfigOption {
+  char *name;
+  ConfigType type;
+  /* NOTE: char[CONFIG_STRING_SIZE], u16, u32 or u64 for sizes */
+  void *value;
+  /* NOTE: inclusive range, ignored for strings */
+  u64 min_value;
+  u64 max_value;
+  char *help;
+} ConfigOption;
+
+u32 config_parse_file(ConfigOption *options, u32 count, char *path);
+u32 config_parse_args(ConfigOption *options, u32 count, int argc, char **argv);
+void config_print_usage(char *program, ConfigOption *options, u32 count);
+void config_print(ConfigOption *options, u32 count);
+
+#endif
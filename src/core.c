@@ -6,7 +6,7 @@ void arena_init(Arena *arena, u8 *data, u64 size) {
   arena->used = 0;
 }
 
-void *arena_push(Arena *arena, u64 size, u32 align) {
+void *arena_try_push(Arena *arena, u64 size, u32 align) {
   u64 address, align_address;
   u64 a, total_size;
 
@@ -16,7 +16,16 @@ void *arena_push(Arena *arena, u64 size, u32 align) {
   align_address = (address + a) & ~a;
   total_size = (align_address - address) + size;
 
-  assert(arena->used + total_size <= arena->size);
+  if (arena->used + total_size > arena->size) {
+    return 0;
+  }
   arena->used += total_size;
   return (void *)align_address;
 }
+
+void *arena_push(Arena *arena, u64 size, u32 align) {
+  void *res;
+  res = arena_try_push(arena, size, align);
+  assert(res);
+  return res;
+}
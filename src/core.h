@@ -54,16 +54,19 @@ typedef unsigned int b32;
 
 #define dllist_empty(f, l) (checknull(f) && checknull(l))
 
-#define dllist_push_back(f, l, n)                                              \
+#define dllist_push_back_np(f, l, n, next, prev)                               \
   (checknull(l)                                                                \
        ? ((f) = (l) = (n), setnull((n)->prev), setnull((n)->next))             \
        : ((l)->next = (n), (n)->prev = (l), setnull((n)->next), (l) = (n)))
 
-#define dllist_remove(f, l, n)                                                 \
+#define dllist_remove_np(f, l, n, next, prev)                                  \
   (((n) == (f) ? (f) = (n)->next : (0)), ((n) == (l) ? (l) = (n)->prev : (0)), \
    (checknull((n)->prev) ? (0) : ((n)->prev->next = (n)->next)),               \
    (checknull((n)->next) ? (0) : ((n)->next->prev = (n)->prev)))
 
+#define dllist_push_back(f, l, n) dllist_push_back_np(f, l, n, next, prev)
+#define dllist_remove(f, l, n) dllist_remove_np(f, l, n, next, prev)
+
 typedef struct Arena {
   u8 *data;
   u64 used;
@@ -72,5 +75,7 @@ typedef struct Arena {
 
 void arena_init(Arena *arena, u8 *data, u64 size);
 void *arena_push(Arena *arena, u64 size, u32 align);
+/* NOTE: 0 when it does not fit, arena_push asserts instead */
+void *arena_try_push(Arena *arena, u64 size, u32 align);
 
 #endif
@@ -0,0 +1,270 @@
+#include "gossip.h"
+
+void gossip_init(Gossip *gossip, Arena *arena, Dgram *dgram, u32 capacity,
+                 u32 seed) {
+  u32 table_capacity;
+  memset(gossip, 0, sizeof(*gossip));
+  gossip->dgram = dgram;
+  gossip->members_capacity = capacity;
+  gossip->members = arena_push(arena, sizeof(GossipMember) * capacity, 8);
+  gossip->hot = arena_push(arena, sizeof(u32) * capacity, 4);
+  table_capacity = 1;
+  while (table_capacity < capacity * 2) {
+    table_capacity <<= 1;
+  }
+  gossip->table_capacity = table_capacity;
+  gossip->table = arena_push(arena, sizeof(u32) * table_capacity, 4);
+  memset(gossip->table, 0, sizeof(u32) * table_capacity);
+  gossip->digest.header.type = MessageType_GOSSIP_DIGEST;
+  gossip->random = seed | 1;
+}
+
+static u32 gossip_random(Gossip *gossip) {
+  gossip->random ^= gossip->random << 13;
+  gossip->random ^= gossip->random >> 17;
+  gossip->random ^= gossip->random << 5;
+  return gossip->random;
+}
+
+static u32 gossip_bucket(u32 hash) {
+  return (hash >> 16) % GOSSIP_DIGEST_BUCKETS;
+}
+
+static u32 *gossip_slot(Gossip *gossip, ConnEndpoint *endpoint) {
+  u32 mask, index;
+  mask = gossip->table_capacity - 1;
+  index = endpoint_hash(endpoint) & mask;
+  for (;;) {
+    u32 *slot = &gossip->table[index];
+    if (*slot == 0) {
+      return slot;
+    }
+    if (endpoint_equals(&gossip->members[*slot - 1].peer.endpoint,
+                        endpoint)) {
+      return slot;
+    }
+    index = (index + 1) & mask;
+  }
+}
+
+GossipMember *gossip_find(Gossip *gossip, ConnEndpoint *endpoint) {
+  u32 *slot;
+  slot = gossip_slot(gossip, endpoint);
+  return *slot ? &gossip->members[*slot - 1] : 0;
+}
+
+GossipMember *gossip_add(Gossip *gossip, PeerConnected *peer) {
+  GossipMember *member;
+  u32 *slot;
+  if (peer->endpoint.family == CONN_FAMILY_NONE || peer->endpoint.port == 0) {
+    return 0;
+  }
+  slot = gossip_slot(gossip, &peer->endpoint);
+  if (*slot) {
+    return 0;
+  }
+  if (gossip->members_count == gossip->members_capacity) {
+    gossip->stats.rejected++;
+    return 0;
+  }
+  member = &gossip->members[gossip->members_count++];
+  *slot = gossip->members_count;
+  member->peer = *peer;
+  member->peer.next = 0;
+  member->peer.prev = 0;
+  member->hash = endpoint_hash(&peer->endpoint);
+  member->rounds = GOSSIP_ROUNDS;
+  gossip->hot[gossip->hot_count++] = gossip->members_count - 1;
+  gossip->digest.count++;
+  gossip->digest.buckets[gossip_bucket(member->hash)] ^= member->hash;
+  return member;
+}
+
+u32 gossip_digest_diff(Gossip *gossip, MessageGossipDigest *digest) {
+  u32 mask, i;
+  mask = 0;
+  for (i = 0; i < GOSSIP_DIGEST_BUCKETS; ++i) {
+    if (digest->buckets[i] != gossip->digest.buckets[i]) {
+      mask |= 1u << i;
+    }
+  }
+  /* NOTE: the xors can cancel out, the count still tells */
+  if (!mask && digest->count != gossip->digest.count) {
+    mask = (1u << GOSSIP_DIGEST_BUCKETS) - 1;
+  }
+  return mask;
+}
+
+static void gossip_delta_init(Message *msg, u32 *size) {
+  memset(msg, 0, sizeof(*msg));
+  msg->header.type = MessageType_GOSSIP_DELTA;
+  /* NOTE: magic, size, type and the entry count */
+  *size = 13;
+}
+
+static b32 gossip_delta_push(Arena *arena, Message *msg, u32 *size,
+                             GossipMember *member) {
+  PeerConnected *node;
+  u32 entry_size;
+  entry_size = peer_connected_wire_size(&member->peer);
+  if (*size + entry_size > GOSSIP_DATAGRAM_SIZE) {
+    return false;
+  }
+  node = arena_push(arena, sizeof(*node), 8);
+  *node = member->peer;
+  node->next = 0;
+  node->prev = 0;
+  dllist_push_back(msg->peers_to_connect.first, msg->peers_to_connect.last,
+                   node);
+  msg->peers_to_connect.count++;
+  *size += entry_size;
+  return true;
+}
+
+u32 gossip_delta(Gossip *gossip, Arena *arena, Message *msg, u32 mask,
+                 u32 *cursor, u32 end) {
+  u32 size;
+  gossip_delta_init(msg, &size);
+  if (!gossip->members_count) {
+    *cursor = end;
+    return 0;
+  }
+  while (*cursor < end) {
+    GossipMember *member;
+    member = &gossip->members[*cursor % gossip->members_count];
+    if (mask & (1u << gossip_bucket(member->hash))) {
+      if (!gossip_delta_push(arena, msg, &size, member)) {
+        break;
+      }
+    }
+    ++*cursor;
+  }
+  return msg->peers_to_connect.count;
+}
+
+static void gossip_send(Gossip *gossip, Arena *arena, Message *msg,
+                        ConnAddr *to) {
+  dgram_message_write_to(arena, gossip->dgram, msg, to);
+  if (msg->header.type == MessageType_GOSSIP_DIGEST) {
+    gossip->stats.digests_sent++;
+  } else {
+    gossip->stats.deltas_sent++;
+  }
+}
+
+/* NOTE: the entries of the buckets that differ, from a random member on so
+ * a capped answer does not keep sending the same ones */
+static void gossip_repair(Gossip *gossip, Arena *arena, u32 mask,
+                          ConnAddr *to) {
+  u32 cursor, end, datagrams;
+  if (!gossip->members_count) {
+    return;
+  }
+  cursor = gossip_random(gossip) % gossip->members_count;
+  end = cursor + gossip->members_count;
+  for (datagrams = 0; datagrams < GOSSIP_REPAIR_DATAGRAMS && cursor < end;
+       ++datagrams) {
+    Message msg;
+    u64 mark;
+    mark = arena->used;
+    if (gossip_delta(gossip, arena, &msg, mask, &cursor, end)) {
+      gossip_send(gossip, arena, &msg, to);
+    }
+    arena->used = mark;
+  }
+}
+
+PeerConnected *gossip_process(Gossip *gossip, Arena *arena, Message *msg,
+                              ConnAddr *from) {
+  PeerConnected *first, *last, *entry;
+  first = 0;
+  last = 0;
+  switch (msg->header.type) {
+  case MessageType_GOSSIP_DELTA: {
+    for (entry = msg->peers_to_connect.first; entry != 0;
+         entry = entry->next) {
+      GossipMember *member;
+      PeerConnected *node;
+      member = gossip_add(gossip, entry);
+      if (!member) {
+        continue;
+      }
+      node = arena_push(arena, sizeof(*node), 8);
+      *node = member->peer;
+      dllist_push_back(first, last, node);
+      gossip->stats.learned++;
+    }
+  } break;
+  case MessageType_GOSSIP_DIGEST: {
+    u32 mask;
+    mask = gossip_digest_diff(gossip, &msg->gossip_digest);
+    if (!mask) {
+      break;
+    }
+    gossip_repair(gossip, arena, mask, from);
+    if (!msg->gossip_digest.reply) {
+      u64 mark;
+      mark = arena->used;
+      gossip->digest.reply = true;
+      gossip_send(gossip, arena, (Message *)&gossip->digest, from);
+      gossip->digest.reply = false;
+      arena->used = mark;
+    }
+  } break;
+  default: {
+  } break;
+  }
+  return first;
+}
+
+void gossip_update(Gossip *gossip, Arena *arena, ConnAddr **targets,
+                   u32 count) {
+  Message msg;
+  u32 size, fanout, i, kept;
+  u64 mark;
+  if (!count) {
+    return;
+  }
+  /* NOTE: the first fanout targets become a random sample */
+  fanout = min(count, GOSSIP_FANOUT);
+  for (i = 0; i < fanout; ++i) {
+    ConnAddr *tmp;
+    u32 j;
+    j = i + gossip_random(gossip) % (count - i);
+    tmp = targets[i];
+    targets[i] = targets[j];
+    targets[j] = tmp;
+  }
+
+  mark = arena->used;
+  gossip_send(gossip, arena, (Message *)&gossip->digest, targets[0]);
+  arena->used = mark;
+
+  if (!gossip->hot_count) {
+    return;
+  }
+  /* NOTE: the oldest rumors that fit in one datagram */
+  gossip_delta_init(&msg, &size);
+  for (i = 0; i < gossip->hot_count; ++i) {
+    if (!gossip_delta_push(arena, &msg, &size,
+                           &gossip->members[gossip->hot[i]])) {
+      break;
+    }
+  }
+  for (i = 0; i < fanout; ++i) {
+    gossip_send(gossip, arena, &msg, targets[i]);
+  }
+  arena->used = mark;
+  kept = 0;
+  for (i = 0; i < gossip->hot_count; ++i) {
+    GossipMember *member;
+    member = &gossip->members[gossip->hot[i]];
+    if (i < msg.peers_to_connect.count) {
+      member->rounds--;
+    }
+    if (member->rounds) {
+      gossip->hot[kept++] = gossip->hot[i];
+    }
+  }
+  gossip->hot_count = kept;
+}
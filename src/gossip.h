@@ -0,0 +1,83 @@
+#ifndef _GOSSIP_H_
+#define _GOSSIP_H_
+
+#include "proto.h"
+
+/* NOTE: room membership spread peer to peer, so the server only has to seed
+ * a joiner with a few peers. The membership is a grow only set of
+ * PeerConnected entries keyed by public endpoint, two sets agree once they
+ * hold the same endpoints. A new entry is a rumor, it is pushed to
+ * GOSSIP_FANOUT connected peers for GOSSIP_ROUNDS ticks. Every tick a digest
+ * also goes to one peer, which answers with its entries of the buckets that
+ * differ and, unless the digest was a reply, with its own digest so the
+ * other side does the same. Rumors are fast and digests repair what they
+ * missed. Nothing expires, an entry has no version on the wire and a copy
+ * dropped here would come back with the next repair. Once the set is full
+ * new entries are rejected and counted */
+
+#define GOSSIP_FANOUT 3
+#define GOSSIP_ROUNDS 3
+/* NOTE: below the datagram read buffer of dgram_message_read_from */
+#define GOSSIP_DATAGRAM_SIZE 1000
+/* NOTE: delta datagrams a single digest can get back */
+#define GOSSIP_REPAIR_DATAGRAMS 4
+
+typedef struct GossipMember {
+  PeerConnected peer;
+  u32 hash;
+  u32 rounds;
+} GossipMember;
+
+typedef struct GossipStats {
+  u64 digests_sent;
+  u64 deltas_sent;
+  u64 learned;
+  /* NOTE: new entries that found the set full */
+  u64 rejected;
+} GossipStats;
+
+typedef struct Gossip {
+  Dgram *dgram;
+
+  GossipMember *members;
+  u32 members_count;
+  u32 members_capacity;
+
+  /* NOTE: member index + 1 by endpoint, 0 is empty */
+  u32 *table;
+  u32 table_capacity;
+
+  /* NOTE: members with push rounds left, oldest first */
+  u32 *hot;
+  u32 hot_count;
+
+  /* NOTE: kept up to date by gossip_add */
+  MessageGossipDigest digest;
+
+  u32 random;
+
+  GossipStats stats;
+} Gossip;
+
+void gossip_init(Gossip *gossip, Arena *arena, Dgram *dgram, u32 capacity,
+                 u32 seed);
+/* NOTE: returns the member when the entry was not known */
+GossipMember *gossip_add(Gossip *gossip, PeerConnected *peer);
+GossipMember *gossip_find(Gossip *gossip, ConnEndpoint *endpoint);
+/* NOTE: mask of the buckets where the digest and the set differ */
+u32 gossip_digest_diff(Gossip *gossip, MessageGossipDigest *digest);
+/* NOTE: fills a GOSSIP_DELTA with the members of the buckets in mask that
+ * fit in a datagram. Positions go from *cursor to end and wrap around the
+ * members, *cursor is left after the last one taken */
+u32 gossip_delta(Gossip *gossip, Arena *arena, Message *msg, u32 mask,
+                 u32 *cursor, u32 end);
+/* NOTE: a GOSSIP_DELTA or GOSSIP_DIGEST from a connected peer, returns the
+ * entries that were new for the caller to punch */
+PeerConnected *gossip_process(Gossip *gossip, Arena *arena, Message *msg,
+                              struct ConnAddr *from);
+/* NOTE: one tick, the rumors go to GOSSIP_FANOUT of the targets and a digest
+ * to one of them. The targets array is shuffled */
+void gossip_update(Gossip *gossip, Arena *arena, struct ConnAddr **targets,
+                   u32 count);
+
+#endif
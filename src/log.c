@@ -0,0 +1,252 @@
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#define _GNU_SOURCE
+#include <pthread.h>
+#endif
+
+#include "log.h"
+
+#if defined(_MSC_VER)
+#define log_load_acquire(p) (*(volatile u64 *)(p))
+#define log_store_release(p, v) (*(volatile u64 *)(p) = (v))
+#define log_flag_load(p) (*(volatile u32 *)(p))
+#define log_flag_store(p, v) (*(volatile u32 *)(p) = (v))
+#else
+#define log_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define log_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define log_flag_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define log_flag_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+/* NOTE: how long the writer thread sleeps when the ring is empty */
+#define LOG_IDLE_MS 10
+
+static void log_format_endpoint(u64 *words, char *buffer, u32 buffer_size) {
+  u8 memory[256];
+  ConnEndpoint endpoint;
+  Arena arena;
+  arena_init(&arena, memory, sizeof(memory));
+  endpoint.family = (u8)(words[0] & 0xff);
+  endpoint.port = (u16)(words[0] >> 8);
+  memcpy(endpoint.addr, &words[1], 8);
+  memcpy(endpoint.addr + 8, &words[2], 8);
+  conn_address_string(conn_address_endpoint(&arena, &endpoint),
+                      (u8 *)buffer, buffer_size);
+}
+
+u32 log_format(LogRecord *record, char *buffer, u32 buffer_size) {
+  char *format;
+  u32 used, arg;
+  s32 res;
+  assert(buffer_size > 0);
+  format = record->site->format;
+  used = 0;
+  arg = 0;
+  res = snprintf(buffer, buffer_size, "[%llu.%06llu] ",
+                 record->time / 1000000, record->time % 1000000);
+  used = min((u32)max(res, 0), buffer_size - 1);
+  while (*format && used < buffer_size - 1) {
+    char c;
+    c = *format++;
+    res = 0;
+    if (c != '%' || *format == 0) {
+      buffer[used++] = c;
+      continue;
+    }
+    c = *format++;
+    if (c == '%') {
+      buffer[used++] = c;
+    } else if (c == 'E' && arg + 3 <= record->args_count) {
+      log_format_endpoint(record->args + arg, buffer + used,
+                          buffer_size - used);
+      res = (s32)strlen(buffer + used);
+      arg += 3;
+    } else if ((c == 'u' || c == 'x') && arg < record->args_count) {
+      res = snprintf(buffer + used, buffer_size - used,
+                     c == 'u' ? "%llu" : "%llx", record->args[arg++]);
+    } else {
+      /* NOTE: a missing argument or an unknown conversion shows up as ? */
+      buffer[used++] = '?';
+    }
+    used = min(used + (u32)max(res, 0), buffer_size - 1);
+  }
+  if (record->suppressed && used < buffer_size - 1) {
+    res = snprintf(buffer + used, buffer_size - used, " (%u suppressed)",
+                   record->suppressed);
+    used = min(used + (u32)max(res, 0), buffer_size - 1);
+  }
+  buffer[used] = 0;
+  return used;
+}
+
+/* NOTE: returns false when there was nothing to write */
+static b32 log_drain(Log *log) {
+  static char buffer[1024];
+  u64 head, tail;
+  tail = log->tail;
+  head = log_load_acquire(&log->head);
+  if (head == tail) {
+    return false;
+  }
+  while (tail != head) {
+    LogRecord *record;
+    u32 size;
+    record = &log->records[tail & (log->capacity - 1)];
+    size = log_format(record, buffer, sizeof(buffer));
+    buffer[size] = '\n';
+    fwrite(buffer, 1, size + 1, log->out);
+    tail++;
+    log_store_release(&log->tail, tail);
+  }
+  fflush(log->out);
+  return true;
+}
+
+static void log_writer(Log *log) {
+  while (!log_flag_load(&log->stop)) {
+    if (!log_drain(log)) {
+      conn_sleep_ms(LOG_IDLE_MS);
+    }
+  }
+  log_drain(log);
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI log_thread_main(LPVOID param) {
+  log_writer((Log *)param);
+  return 0;
+}
+
+static b32 log_thread_start(Log *log) {
+  log->thread = CreateThread(0, 0, log_thread_main, log, 0, 0);
+  return log->thread != 0;
+}
+
+static void log_thread_join(Log *log) {
+  WaitForSingleObject((HANDLE)log->thread, INFINITE);
+  CloseHandle((HANDLE)log->thread);
+}
+#else
+static void *log_thread_main(void *param) {
+  log_writer((Log *)param);
+  return 0;
+}
+
+static b32 log_thread_start(Log *log) {
+  pthread_t *thread;
+  thread = malloc(sizeof(*thread));
+  if (!thread) {
+    return false;
+  }
+  if (pthread_create(thread, 0, log_thread_main, log) != 0) {
+    free(thread);
+    return false;
+  }
+  log->thread = thread;
+  return true;
+}
+
+static void log_thread_join(Log *log) {
+  pthread_join(*(pthread_t *)log->thread, 0);
+  free(log->thread);
+}
+#endif
+
+b32 log_open(Log *log, char *path, u32 capacity) {
+  assert(is_power_of_two(capacity));
+  memset(log, 0, sizeof(*log));
+  log->out = stdout;
+  if (path && path[0]) {
+    log->out = fopen(path, "ab");
+    log->close_out = true;
+    if (!log->out) {
+      return false;
+    }
+  }
+  log->records = calloc(capacity, sizeof(LogRecord));
+  log->capacity = capacity;
+  if (!log->records || !log_thread_start(log)) {
+    if (log->close_out) {
+      fclose(log->out);
+    }
+    free(log->records);
+    memset(log, 0, sizeof(*log));
+    return false;
+  }
+  return true;
+}
+
+void log_close(Log *log) {
+  if (!log->records) {
+    return;
+  }
+  log_flag_store(&log->stop, 1);
+  log_thread_join(log);
+  if (log->close_out) {
+    fclose(log->out);
+  }
+  free(log->records);
+  memset(log, 0, sizeof(*log));
+}
+
+b32 log_site_allow(LogSite *site, u64 now) {
+  u64 refill;
+  if (site->rate == 0) {
+    return true;
+  }
+  if (site->tokens < site->burst) {
+    refill = (now - site->refill_time) * site->rate / 1000000;
+    if (refill > 0) {
+      site->tokens = (u32)min(site->burst, site->tokens + refill);
+      site->refill_time = now;
+    }
+  }
+  if (site->tokens == 0) {
+    site->suppressed++;
+    return false;
+  }
+  /* NOTE: a full bucket does not refill, the clock starts on the first
+   * token taken */
+  if (site->tokens == site->burst) {
+    site->refill_time = now;
+  }
+  site->tokens--;
+  return true;
+}
+
+void log_push(Log *log, LogSite *site, u64 now, u64 *args, u32 args_count) {
+  LogRecord *record;
+  u64 head;
+  head = log->head;
+  if (head - log_load_acquire(&log->tail) >= log->capacity) {
+    log->stats.dropped++;
+    return;
+  }
+  record = &log->records[head & (log->capacity - 1)];
+  record->time = now;
+  record->site = site;
+  record->args_count = min(args_count, LOG_MAX_ARGS);
+  record->suppressed = site->suppressed;
+  memcpy(record->args, args, sizeof(u64) * record->args_count);
+  log->stats.pushed++;
+  log->stats.suppressed += site->suppressed;
+  site->suppressed = 0;
+  log_store_release(&log->head, head + 1);
+}
+
+u64 log_endpoint_word(ConnEndpoint *endpoint, u32 word) {
+  u64 value;
+  if (word == 0) {
+    return (u64)endpoint->family | ((u64)endpoint->port << 8);
+  }
+  memcpy(&value, endpoint->addr + (word == 1 ? 0 : 8), 8);
+  return value;
+}
+
+u64 log_address_word(ConnAddr *addr, u32 word) {
+  ConnEndpoint endpoint;
+  conn_address_get_endpoint(addr, &endpoint);
+  return log_endpoint_word(&endpoint, word);
+}
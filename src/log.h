@@ -0,0 +1,94 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include "core.h"
+#include "net.h"
+
+/* NOTE: logging off the event loop. A call site copies its arguments as raw
+ * u64 words into a fixed size record and pushes it to a single producer ring,
+ * a background thread formats the records and writes them out. Nothing is
+ * formatted and no syscall happens on the caller thread.
+ *
+ * Every call site has its own token bucket, past the burst records are
+ * counted instead of written and the next record that goes through says how
+ * many were suppressed. A full ring drops the record and counts it.
+ *
+ * Formats are printf like but every argument is a u64: %u decimal, %x hex,
+ * %E an endpoint (log_endpoint and log_address expand to its three words)
+ * and %% */
+
+#define LOG_MAX_ARGS 6
+#define LOG_DEFAULT_CAPACITY 4096
+
+typedef struct LogSite {
+  char *format;
+  /* NOTE: records per second and bucket size, 0 is no limit */
+  u32 rate;
+  u32 burst;
+  u32 tokens;
+  u64 refill_time;
+  u32 suppressed;
+} LogSite;
+
+typedef struct LogRecord {
+  u64 time;
+  LogSite *site;
+  u32 args_count;
+  /* NOTE: records of this site suppressed right before this one */
+  u32 suppressed;
+  u64 args[LOG_MAX_ARGS];
+} LogRecord;
+
+/* NOTE: kept by the producer */
+typedef struct LogStats {
+  u64 pushed;
+  u64 suppressed;
+  u64 dropped;
+} LogStats;
+
+typedef struct Log {
+  LogRecord *records;
+  u32 capacity;
+  /* NOTE: head is only written by the producer and tail by the writer thread,
+   * both only grow */
+  u64 head;
+  u64 tail;
+  FILE *out;
+  b32 close_out;
+  u32 stop;
+  void *thread;
+  LogStats stats;
+} Log;
+
+/* NOTE: path 0 or empty writes to stdout, capacity is a power of two */
+b32 log_open(Log *log, char *path, u32 capacity);
+/* NOTE: writes what is left in the ring and stops the writer thread */
+void log_close(Log *log);
+
+b32 log_site_allow(LogSite *site, u64 now);
+void log_push(Log *log, LogSite *site, u64 now, u64 *args, u32 args_count);
+/* NOTE: text of a record without the newline, returns its length */
+u32 log_format(LogRecord *record, char *buffer, u32 buffer_size);
+
+u64 log_endpoint_word(ConnEndpoint *endpoint, u32 word);
+u64 log_address_word(struct ConnAddr *addr, u32 word);
+#define log_endpoint(endpoint)                                                 \
+  log_endpoint_word((endpoint), 0), log_endpoint_word((endpoint), 1),          \
+      log_endpoint_word((endpoint), 2)
+#define log_address(addr)                                                      \
+  log_address_word((addr), 0), log_address_word((addr), 1),                    \
+      log_address_word((addr), 2)
+
+/* NOTE: now is in microseconds, the caller usually has it cached. The
+ * arguments are only evaluated when the site lets the record through, at
+ * least one has to be given */
+#define log_event(log, now, per_second, burst_size, fmt, ...)                  \
+  do {                                                                         \
+    static LogSite log_site_ = {fmt, per_second, burst_size, burst_size};      \
+    if (log_site_allow(&log_site_, (now))) {                                   \
+      u64 log_args_[] = {__VA_ARGS__};                                         \
+      log_push((log), &log_site_, (now), log_args_, array_len(log_args_));     \
+    }                                                                          \
+  } while (0)
+
+#endif
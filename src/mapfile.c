@@ -0,0 +1,155 @@
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mapfile.h"
+
+#if defined(_WIN32)
+static b32 mapped_file_map(MappedFile *file, HANDLE handle, u64 size,
+                           b32 writable) {
+  HANDLE mapping;
+  void *view;
+  mapping =
+      CreateFileMappingA(handle, 0, writable ? PAGE_READWRITE : PAGE_READONLY,
+                         (DWORD)(size >> 32), (DWORD)size, 0);
+  if (!mapping) {
+    return false;
+  }
+  view = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0,
+                       0, (SIZE_T)size);
+  if (!view) {
+    CloseHandle(mapping);
+    return false;
+  }
+  file->data = view;
+  file->size = size;
+  file->writable = writable;
+  file->file = handle;
+  file->mapping = mapping;
+  return true;
+}
+
+b32 mapped_file_create(MappedFile *file, char *path, u64 size) {
+  HANDLE handle;
+  memset(file, 0, sizeof(*file));
+  handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE, 0, CREATE_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL, 0);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  if (!mapped_file_map(file, handle, size, true)) {
+    CloseHandle(handle);
+    return false;
+  }
+  return true;
+}
+
+b32 mapped_file_open(MappedFile *file, char *path) {
+  HANDLE handle;
+  LARGE_INTEGER size;
+  memset(file, 0, sizeof(*file));
+  handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                       0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0 ||
+      !mapped_file_map(file, handle, (u64)size.QuadPart, false)) {
+    CloseHandle(handle);
+    return false;
+  }
+  return true;
+}
+
+void mapped_file_close(MappedFile *file, u64 keep_size) {
+  if (!file->data) {
+    return;
+  }
+  UnmapViewOfFile(file->data);
+  CloseHandle(file->mapping);
+  if (file->writable && keep_size < file->size) {
+    LARGE_INTEGER offset;
+    offset.QuadPart = (LONGLONG)keep_size;
+    SetFilePointerEx(file->file, offset, 0, FILE_BEGIN);
+    SetEndOfFile(file->file);
+  }
+  CloseHandle(file->file);
+  memset(file, 0, sizeof(*file));
+}
+#else
+b32 mapped_file_create(MappedFile *file, char *path, u64 size) {
+  char temp_path[1024];
+  void *view;
+  s32 fd;
+  memset(file, 0, sizeof(*file));
+  if ((u32)snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >=
+      sizeof(temp_path)) {
+    return false;
+  }
+  fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  if (ftruncate(fd, (off_t)size) < 0 || rename(temp_path, path) < 0) {
+    close(fd);
+    unlink(temp_path);
+    return false;
+  }
+  view = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (view == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  file->data = view;
+  file->size = size;
+  file->writable = true;
+  file->fd = fd;
+  return true;
+}
+
+b32 mapped_file_open(MappedFile *file, char *path) {
+  struct stat info;
+  void *view;
+  s32 fd;
+  memset(file, 0, sizeof(*file));
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  if (fstat(fd, &info) < 0 || info.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  view = mmap(0, (u64)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (view == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  file->data = view;
+  file->size = (u64)info.st_size;
+  file->fd = fd;
+  return true;
+}
+
+void mapped_file_close(MappedFile *file, u64 keep_size) {
+  if (!file->data) {
+    return;
+  }
+  munmap(file->data, file->size);
+  if (file->writable && keep_size < file->size) {
+    if (ftruncate(file->fd, (off_t)keep_size) < 0) {
+      /* NOTE: the file keeps its zero filled tail, readers stop there */
+    }
+  }
+  close(file->fd);
+  memset(file, 0, sizeof(*file));
+}
+#endif
@@ -0,0 +1,31 @@
+#ifndef _MAPFILE_H_
+#define _MAPFILE_H_
+
+#include "core.h"
+
+/* NOTE: a whole file mapped in memory, shared with other processes. A
+ * created file is built under path.tmp and renamed over path, so a reader
+ * that still maps the old file keeps a valid (stale) view instead of faulting
+ * on a truncated one */
+
+typedef struct MappedFile {
+  u8 *data;
+  u64 size;
+  b32 writable;
+#if defined(_WIN32)
+  void *file;
+  void *mapping;
+#else
+  s32 fd;
+#endif
+} MappedFile;
+
+/* NOTE: read write, size bytes of zeros */
+b32 mapped_file_create(MappedFile *file, char *path, u64 size);
+/* NOTE: read only, the size of the file */
+b32 mapped_file_open(MappedFile *file, char *path);
+/* NOTE: a writable file is cut to keep_size bytes, pass file->size to keep
+ * all of it */
+void mapped_file_close(MappedFile *file, u64 keep_size);
+
+#endif
@@ -0,0 +1,199 @@
+#include "metrics.h"
+#include "net.h"
+
+/* NOTE: the header counts publish a slot to readers in other processes */
+#if defined(_MSC_VER)
+#define metrics_load_acquire(p) (*(volatile u32 *)(p))
+#define metrics_store_release(p, v) (*(volatile u32 *)(p) = (v))
+#else
+#define metrics_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define metrics_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+static u64 metrics_size(u32 values_capacity, u32 histograms_capacity) {
+  return sizeof(MetricsHeader) + sizeof(MetricsValue) * values_capacity +
+         sizeof(MetricsHistogram) * histograms_capacity;
+}
+
+static void metrics_layout(Metrics *metrics) {
+  u8 *base;
+  base = (u8 *)metrics->header;
+  metrics->values = (MetricsValue *)(base + sizeof(MetricsHeader));
+  metrics->histograms =
+      (MetricsHistogram *)(metrics->values + metrics->header->values_capacity);
+}
+
+b32 metrics_open(Metrics *metrics, char *path, u32 values_capacity,
+                 u32 histograms_capacity) {
+  u64 size;
+  memset(metrics, 0, sizeof(*metrics));
+  size = metrics_size(values_capacity, histograms_capacity);
+  if (path && path[0]) {
+    if (!mapped_file_create(&metrics->file, path, size)) {
+      return false;
+    }
+    metrics->header = (MetricsHeader *)metrics->file.data;
+    metrics->mapped = true;
+  } else {
+    metrics->header = calloc(1, size);
+    if (!metrics->header) {
+      return false;
+    }
+  }
+  metrics->size = size;
+  /* NOTE: a new file reads as zeros, the magic goes last so a reader never
+   * takes a half written header */
+  metrics->header->version = METRICS_VERSION;
+  metrics->header->values_capacity = values_capacity;
+  metrics->header->histograms_capacity = histograms_capacity;
+  metrics->header->created_time = conn_current_time_us();
+  metrics_layout(metrics);
+  metrics_store_release(&metrics->header->magic, METRICS_MAGIC);
+  return true;
+}
+
+b32 metrics_attach(Metrics *metrics, char *path) {
+  MetricsHeader *header;
+  memset(metrics, 0, sizeof(*metrics));
+  if (!mapped_file_open(&metrics->file, path)) {
+    return false;
+  }
+  header = (MetricsHeader *)metrics->file.data;
+  metrics->header = header;
+  metrics->size = metrics->file.size;
+  metrics->mapped = true;
+  if (metrics->size < sizeof(MetricsHeader) ||
+      metrics_load_acquire(&header->magic) != METRICS_MAGIC ||
+      header->version != METRICS_VERSION ||
+      metrics->size < metrics_size(header->values_capacity,
+                                   header->histograms_capacity)) {
+    metrics_close(metrics);
+    return false;
+  }
+  metrics_layout(metrics);
+  return true;
+}
+
+void metrics_close(Metrics *metrics) {
+  if (!metrics->header) {
+    return;
+  }
+  if (metrics->mapped) {
+    mapped_file_close(&metrics->file, metrics->file.size);
+  } else {
+    free(metrics->header);
+  }
+  memset(metrics, 0, sizeof(*metrics));
+}
+
+u32 metrics_values_count(Metrics *metrics) {
+  return metrics_load_acquire(&metrics->header->values_count);
+}
+
+u32 metrics_histograms_count(Metrics *metrics) {
+  return metrics_load_acquire(&metrics->header->histograms_count);
+}
+
+MetricsValue *metrics_value(Metrics *metrics, char *name, MetricType type) {
+  MetricsHeader *header;
+  MetricsValue *value;
+  u32 i;
+  header = metrics->header;
+  for (i = 0; i < header->values_count; ++i) {
+    if (strcmp(metrics->values[i].name, name) == 0) {
+      return &metrics->values[i];
+    }
+  }
+  assert(header->values_count < header->values_capacity);
+  assert(strlen(name) < METRICS_NAME_SIZE);
+  value = &metrics->values[header->values_count];
+  strcpy(value->name, name);
+  value->type = type;
+  metrics_store_release(&header->values_count, header->values_count + 1);
+  return value;
+}
+
+MetricsHistogram *metrics_histogram(Metrics *metrics, char *name) {
+  MetricsHeader *header;
+  MetricsHistogram *histogram;
+  u32 i;
+  header = metrics->header;
+  for (i = 0; i < header->histograms_count; ++i) {
+    if (strcmp(metrics->histograms[i].name, name) == 0) {
+      return &metrics->histograms[i];
+    }
+  }
+  assert(header->histograms_count < header->histograms_capacity);
+  assert(strlen(name) < METRICS_NAME_SIZE);
+  histogram = &metrics->histograms[header->histograms_count];
+  strcpy(histogram->name, name);
+  metrics_store_release(&header->histograms_count,
+                        header->histograms_count + 1);
+  return histogram;
+}
+
+static u32 metrics_msb(u64 value) {
+#if defined(__GNUC__) || defined(__clang__)
+  return 63 - (u32)__builtin_clzll(value);
+#else
+  u32 msb;
+  msb = 0;
+  while (value >>= 1) {
+    msb++;
+  }
+  return msb;
+#endif
+}
+
+u32 metrics_bucket(u64 value) {
+  u32 shift;
+  if (value < (1u << METRICS_SUB_BITS)) {
+    return (u32)value;
+  }
+  if (value >> METRICS_MAX_BITS) {
+    return METRICS_BUCKETS - 1;
+  }
+  /* NOTE: keep the top METRICS_SUB_BITS bits, the leading one picks the power
+   * of two and the rest the bucket inside it */
+  shift = metrics_msb(value) - (METRICS_SUB_BITS - 1);
+  return (1u << METRICS_SUB_BITS) +
+         (shift - 1) * (1u << (METRICS_SUB_BITS - 1)) +
+         (u32)(value >> shift) - (1u << (METRICS_SUB_BITS - 1));
+}
+
+u64 metrics_bucket_value(u32 bucket) {
+  u32 shift, sub;
+  if (bucket < (1u << METRICS_SUB_BITS)) {
+    return bucket;
+  }
+  bucket -= 1u << METRICS_SUB_BITS;
+  shift = bucket / (1u << (METRICS_SUB_BITS - 1)) + 1;
+  sub = bucket % (1u << (METRICS_SUB_BITS - 1)) +
+        (1u << (METRICS_SUB_BITS - 1));
+  return ((u64)(sub + 1) << shift) - 1;
+}
+
+void metrics_record(MetricsHistogram *histogram, u64 value) {
+  u64 *bucket;
+  bucket = &histogram->buckets[metrics_bucket(value)];
+  metrics_store(bucket, metrics_load(bucket) + 1);
+  metrics_store(&histogram->sum, metrics_load(&histogram->sum) + value);
+  metrics_store(&histogram->count, metrics_load(&histogram->count) + 1);
+}
+
+u64 metrics_percentile(u64 *buckets, u64 count, u32 percentile) {
+  u64 rank, seen;
+  u32 i;
+  if (!count) {
+    return 0;
+  }
+  rank = max(1, (count * percentile + 99) / 100);
+  seen = 0;
+  for (i = 0; i < METRICS_BUCKETS; ++i) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      return metrics_bucket_value(i);
+    }
+  }
+  return metrics_bucket_value(METRICS_BUCKETS - 1);
+}
@@ -0,0 +1,105 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "core.h"
+#include "mapfile.h"
+
+/* NOTE: metrics shared with other processes through a memory mapped file.
+ * The file is a header, a table of named values (counters and gauges, one
+ * cache line each) and a table of histograms. Names are registered at startup
+ * and a slot never moves, the hot path keeps the pointer and only does relaxed
+ * loads and stores on it, no locks and no syscalls. There is one writer per
+ * file, readers (tenet-top) map it read only and can see a histogram halfway
+ * through an update, which only skews one sample.
+ *
+ * Histograms are hdr style log linear: values below 2^METRICS_SUB_BITS get a
+ * bucket each, above that every power of two is split in
+ * 2^(METRICS_SUB_BITS - 1) buckets so the error stays under 1/16 of the
+ * value. Values at or above 2^METRICS_MAX_BITS go to the last bucket */
+
+#define METRICS_MAGIC 0x4d54454e
+#define METRICS_VERSION 1
+#define METRICS_NAME_SIZE 48
+#define METRICS_SUB_BITS 5
+#define METRICS_MAX_BITS 40
+#define METRICS_BUCKETS                                                        \
+  ((1 << METRICS_SUB_BITS) +                                                   \
+   (METRICS_MAX_BITS - METRICS_SUB_BITS) * (1 << (METRICS_SUB_BITS - 1)))
+
+typedef enum MetricType {
+  /* NOTE: only goes up, readers show it as a rate */
+  MetricType_COUNTER,
+  MetricType_GAUGE,
+} MetricType;
+
+typedef struct MetricsHeader {
+  u32 magic;
+  u32 version;
+  u32 values_capacity;
+  u32 histograms_capacity;
+  /* NOTE: published after the slot is filled */
+  u32 values_count;
+  u32 histograms_count;
+  /* NOTE: conn_current_time_us of the writer when the file was created */
+  u64 created_time;
+  u8 reserved[32];
+} MetricsHeader;
+
+typedef struct MetricsValue {
+  char name[METRICS_NAME_SIZE];
+  u32 type;
+  u32 reserved;
+  u64 value;
+} MetricsValue;
+
+typedef struct MetricsHistogram {
+  char name[METRICS_NAME_SIZE];
+  u64 count;
+  u64 sum;
+  u64 buckets[METRICS_BUCKETS];
+} MetricsHistogram;
+
+typedef struct Metrics {
+  MetricsHeader *header;
+  MetricsValue *values;
+  MetricsHistogram *histograms;
+  u64 size;
+  b32 mapped;
+  MappedFile file;
+} Metrics;
+
+#if defined(_MSC_VER)
+#define metrics_load(p) (*(volatile u64 *)(p))
+#define metrics_store(p, v) (*(volatile u64 *)(p) = (v))
+#else
+#define metrics_load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define metrics_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#endif
+
+/* NOTE: a single writer does not need a locked add, a load and a store keep
+ * readers from seeing torn values */
+#define metrics_add(metric, n)                                                 \
+  metrics_store(&(metric)->value, metrics_load(&(metric)->value) + (u64)(n))
+#define metrics_set(metric, n) metrics_store(&(metric)->value, (u64)(n))
+
+/* NOTE: path 0 or empty keeps the metrics in private memory, the code that
+ * updates them does not change */
+b32 metrics_open(Metrics *metrics, char *path, u32 values_capacity,
+                 u32 histograms_capacity);
+/* NOTE: read only view of a file another process writes */
+b32 metrics_attach(Metrics *metrics, char *path);
+void metrics_close(Metrics *metrics);
+
+MetricsValue *metrics_value(Metrics *metrics, char *name, MetricType type);
+MetricsHistogram *metrics_histogram(Metrics *metrics, char *name);
+u32 metrics_values_count(Metrics *metrics);
+u32 metrics_histograms_count(Metrics *metrics);
+
+u32 metrics_bucket(u64 value);
+/* NOTE: highest value that lands in the bucket */
+u64 metrics_bucket_value(u32 bucket);
+void metrics_record(MetricsHistogram *histogram, u64 value);
+/* NOTE: percentile of a bucket array, a snapshot or the difference of two */
+u64 metrics_percentile(u64 *buckets, u64 count, u32 percentile);
+
+#endif
@@ -1,6 +1,9 @@
 #include "core.h"
 #include "net.h"
 
+/* NOTE: winsock fd_sets are arrays of sockets, 64 by default. The size has
+ * to be set before the first winsock include */
+#define FD_SETSIZE 8192
 #include <winsock2.h>
 #include <ws2tcpip.h>
 
@@ -25,17 +28,104 @@ u32 conn_current_time_ms(void) {
   return ms;
 }
 
+u64 conn_current_time_ns(void) {
+  LARGE_INTEGER performance_counter;
+  u64 seconds, remainder;
+  if (!performance_frequency_init) {
+    QueryPerformanceFrequency(&performance_frequency);
+    performance_frequency_init = true;
+  }
+  QueryPerformanceCounter(&performance_counter);
+  seconds = performance_counter.QuadPart / performance_frequency.QuadPart;
+  remainder = performance_counter.QuadPart % performance_frequency.QuadPart;
+  return seconds * 1000000000 +
+         (remainder * 1000000000) / performance_frequency.QuadPart;
+}
+
+void conn_sleep_ms(u32 ms) { Sleep(ms); }
+
+u64 conn_current_time_us(void) {
+  LARGE_INTEGER performance_counter;
+  u64 seconds, remainder;
+  if (!performance_frequency_init) {
+    QueryPerformanceFrequency(&performance_frequency);
+    performance_frequency_init = true;
+  }
+  QueryPerformanceCounter(&performance_counter);
+  seconds = performance_counter.QuadPart / performance_frequency.QuadPart;
+  remainder = performance_counter.QuadPart % performance_frequency.QuadPart;
+  return seconds * 1000000 +
+         (remainder * 1000000) / performance_frequency.QuadPart;
+}
+
+/* NOTE: sockets are ipv6 with IPV6_V6ONLY off when the system has ipv6, ipv4
+ * destinations are mapped right before the syscall and mapped sources are
+ * unmapped right after it */
 typedef struct ConnAddr {
-  struct sockaddr_in addr_in;
+  union {
+    struct sockaddr sa;
+    struct sockaddr_in in4;
+    struct sockaddr_in6 in6;
+    struct sockaddr_storage storage;
+  } u;
 } ConnAddr;
 
 typedef struct ConnSet {
   fd_set fds;
 } ConnSet;
 
+static s32 conn_family = AF_INET;
+
 void conn_init(void) {
   WSADATA wsa_data;
+  SOCKET sock;
+  DWORD off;
   WSAStartup(MAKEWORD(2, 2), &wsa_data);
+  sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock != INVALID_SOCKET) {
+    off = 0;
+    if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&off,
+                   sizeof(off)) != SOCKET_ERROR) {
+      conn_family = AF_INET6;
+    }
+    closesocket(sock);
+  }
+}
+
+static s32 conn_address_size(ConnAddr *addr) {
+  return addr->u.sa.sa_family == AF_INET6 ? (s32)sizeof(addr->u.in6)
+                                          : (s32)sizeof(addr->u.in4);
+}
+
+/* NOTE: returns the sockaddr to hand to winsock, scratch is only used when an
+ * ipv4 address has to be mapped for an ipv6 socket */
+static struct sockaddr *conn_address_native(ConnAddr *addr, ConnAddr *scratch,
+                                            s32 *size) {
+  if (conn_family == AF_INET6 && addr->u.sa.sa_family == AF_INET) {
+    memset(&scratch->u.in6, 0, sizeof(scratch->u.in6));
+    scratch->u.in6.sin6_family = AF_INET6;
+    scratch->u.in6.sin6_port = addr->u.in4.sin_port;
+    scratch->u.in6.sin6_addr.s6_addr[10] = 0xff;
+    scratch->u.in6.sin6_addr.s6_addr[11] = 0xff;
+    memcpy(&scratch->u.in6.sin6_addr.s6_addr[12], &addr->u.in4.sin_addr, 4);
+    *size = (s32)sizeof(scratch->u.in6);
+    return &scratch->u.sa;
+  }
+  *size = conn_address_size(addr);
+  return &addr->u.sa;
+}
+
+static void conn_address_unmap(ConnAddr *addr) {
+  if (addr->u.sa.sa_family == AF_INET6 &&
+      IN6_IS_ADDR_V4MAPPED(&addr->u.in6.sin6_addr)) {
+    struct sockaddr_in in4;
+    memset(&in4, 0, sizeof(in4));
+    in4.sin_family = AF_INET;
+    in4.sin_port = addr->u.in6.sin6_port;
+    memcpy(&in4.sin_addr, &addr->u.in6.sin6_addr.s6_addr[12], 4);
+    memset(addr, 0, sizeof(*addr));
+    addr->u.in4 = in4;
+  }
 }
 
 ConnAddr *conn_address_create(Arena *arena) {
@@ -45,40 +135,86 @@ ConnAddr *conn_address_create(Arena *arena) {
   return addr;
 }
 
-ConnAddr *conn_address_raw(struct Arena *arena, u32 address, u16 port) {
+ConnAddr *conn_address_endpoint(struct Arena *arena, ConnEndpoint *endpoint) {
+  ConnAddr *addr = conn_address_create(arena);
+  if (endpoint->family == CONN_FAMILY_IPV6) {
+    addr->u.in6.sin6_family = AF_INET6;
+    addr->u.in6.sin6_port = htons(endpoint->port);
+    memcpy(&addr->u.in6.sin6_addr, endpoint->addr, 16);
+  } else {
+    addr->u.in4.sin_family = AF_INET;
+    addr->u.in4.sin_port = htons(endpoint->port);
+    memcpy(&addr->u.in4.sin_addr, endpoint->addr, 4);
+  }
+  return addr;
+}
+
+ConnAddr *conn_address_any(struct Arena *arena, u16 port) {
   ConnAddr *addr = conn_address_create(arena);
-  addr->addr_in.sin_family = AF_INET;
-  addr->addr_in.sin_port = htons(port);
-  addr->addr_in.sin_addr.S_un.S_addr = htonl(address);
+  if (conn_family == AF_INET6) {
+    addr->u.in6.sin6_family = AF_INET6;
+    addr->u.in6.sin6_port = htons(port);
+    addr->u.in6.sin6_addr = in6addr_any;
+  } else {
+    addr->u.in4.sin_family = AF_INET;
+    addr->u.in4.sin_port = htons(port);
+    addr->u.in4.sin_addr.S_un.S_addr = htonl(INADDR_ANY);
+  }
   return addr;
 }
 
 ConnAddr *conn_address(Arena *arena, char *address, u16 port) {
   ConnAddr *addr;
-  addr = conn_address_raw(arena, 0, port);
-  inet_pton(addr->addr_in.sin_family, address, &addr->addr_in.sin_addr);
+  addr = conn_address_create(arena);
+  if (inet_pton(AF_INET, address, &addr->u.in4.sin_addr) == 1) {
+    addr->u.in4.sin_family = AF_INET;
+    addr->u.in4.sin_port = htons(port);
+  } else if (inet_pton(AF_INET6, address, &addr->u.in6.sin6_addr) == 1) {
+    addr->u.in6.sin6_family = AF_INET6;
+    addr->u.in6.sin6_port = htons(port);
+    conn_address_unmap(addr);
+  }
   return addr;
 }
 
-void conn_address_get_address_and_port(ConnAddr *addr, u32 *address,
-                                       u16 *port) {
-  *address = ntohl(addr->addr_in.sin_addr.S_un.S_addr);
-  *port = ntohs(addr->addr_in.sin_port);
+void conn_address_get_endpoint(ConnAddr *addr, ConnEndpoint *endpoint) {
+  memset(endpoint, 0, sizeof(*endpoint));
+  if (addr->u.sa.sa_family == AF_INET6) {
+    endpoint->family = CONN_FAMILY_IPV6;
+    endpoint->port = ntohs(addr->u.in6.sin6_port);
+    memcpy(endpoint->addr, &addr->u.in6.sin6_addr, 16);
+  } else if (addr->u.sa.sa_family == AF_INET) {
+    endpoint->family = CONN_FAMILY_IPV4;
+    endpoint->port = ntohs(addr->u.in4.sin_port);
+    memcpy(endpoint->addr, &addr->u.in4.sin_addr, 4);
+  }
+}
+
+static void *conn_address_ip(ConnAddr *addr) {
+  if (addr->u.sa.sa_family == AF_INET6) {
+    return &addr->u.in6.sin6_addr;
+  }
+  return &addr->u.in4.sin_addr;
 }
 
 void conn_address_print(ConnAddr *addr) {
   static char buffer[1024];
-  inet_ntop(addr->addr_in.sin_family, &addr->addr_in.sin_addr, buffer,
+  inet_ntop(addr->u.sa.sa_family, conn_address_ip(addr), buffer,
             sizeof(buffer));
   printf("%s\n", buffer);
 }
 
 void conn_address_string(ConnAddr *addr, u8 *buffer, u32 buffer_size) {
-  char ip[64];
+  char ip[INET6_ADDRSTRLEN];
   u16 port;
-  port = addr->addr_in.sin_port;
-  inet_ntop(addr->addr_in.sin_family, &addr->addr_in.sin_addr, ip, sizeof(ip));
-  sprintf_s((char *)buffer, buffer_size, "%s:%d", ip, port);
+  inet_ntop(addr->u.sa.sa_family, conn_address_ip(addr), ip, sizeof(ip));
+  if (addr->u.sa.sa_family == AF_INET6) {
+    port = ntohs(addr->u.in6.sin6_port);
+    sprintf_s((char *)buffer, buffer_size, "[%s]:%d", ip, port);
+  } else {
+    port = ntohs(addr->u.in4.sin_port);
+    sprintf_s((char *)buffer, buffer_size, "%s:%d", ip, port);
+  }
 }
 
 void conn_address_set(ConnAddr *dst, ConnAddr *src) {
@@ -86,10 +222,30 @@ void conn_address_set(ConnAddr *dst, ConnAddr *src) {
 }
 
 b32 conn_address_equals(struct ConnAddr *addr0, struct ConnAddr *addr1) {
-  return addr0->addr_in.sin_family == addr1->addr_in.sin_family &&
-         addr0->addr_in.sin_port == addr1->addr_in.sin_port &&
-         addr0->addr_in.sin_addr.S_un.S_addr ==
-             addr1->addr_in.sin_addr.S_un.S_addr;
+  if (addr0->u.sa.sa_family != addr1->u.sa.sa_family) {
+    return false;
+  }
+  if (addr0->u.sa.sa_family == AF_INET6) {
+    return addr0->u.in6.sin6_port == addr1->u.in6.sin6_port &&
+           addr0->u.in6.sin6_scope_id == addr1->u.in6.sin6_scope_id &&
+           memcmp(&addr0->u.in6.sin6_addr, &addr1->u.in6.sin6_addr, 16) == 0;
+  }
+  return addr0->u.in4.sin_port == addr1->u.in4.sin_port &&
+         addr0->u.in4.sin_addr.S_un.S_addr == addr1->u.in4.sin_addr.S_un.S_addr;
+}
+
+u32 conn_address_hash(struct ConnAddr *addr) {
+  u64 hash;
+  if (addr->u.sa.sa_family == AF_INET6) {
+    u64 hi, lo;
+    memcpy(&hi, &addr->u.in6.sin6_addr.s6_addr[0], 8);
+    memcpy(&lo, &addr->u.in6.sin6_addr.s6_addr[8], 8);
+    hash = (hi ^ (lo * 0xff51afd7ed558ccdull)) + addr->u.in6.sin6_port;
+  } else {
+    hash = ((u64)addr->u.in4.sin_addr.S_un.S_addr << 16) |
+           addr->u.in4.sin_port;
+  }
+  return (u32)((hash * 0x9e3779b97f4a7c15ull) >> 32);
 }
 
 ConnSet *conn_set_create(Arena *arena) {
@@ -138,39 +294,37 @@ u32 conn_select(ConnSet *read, ConnSet *write, u32 ms) {
   return res;
 }
 
-ConnErr conn_tcp(void) {
+static ConnErr conn_socket(s32 type, s32 protocol) {
   ConnErr res;
   SOCKET sock;
-  sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  DWORD off;
+  sock = socket(conn_family, type, protocol);
   if (sock == INVALID_SOCKET) {
     res.err = CONN_ERROR;
     res.conn = CONN_INVALID;
   } else {
+    if (conn_family == AF_INET6) {
+      off = 0;
+      setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&off, sizeof(off));
+    }
     res.err = CONN_OK;
     res.conn = (Conn)sock;
   }
   return res;
 }
 
-ConnErr conn_udp(void) {
-  ConnErr res;
-  SOCKET sock;
-  sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  if (sock == INVALID_SOCKET) {
-    res.err = CONN_ERROR;
-    res.conn = CONN_INVALID;
-  } else {
-    res.err = CONN_OK;
-    res.conn = (Conn)sock;
-  }
-  return res;
-}
+ConnErr conn_tcp(void) { return conn_socket(SOCK_STREAM, IPPROTO_TCP); }
+
+ConnErr conn_udp(void) { return conn_socket(SOCK_DGRAM, IPPROTO_UDP); }
 
 u32 conn_bind(Conn conn, ConnAddr *addr) {
+  ConnAddr scratch;
+  struct sockaddr *native;
+  s32 native_size;
   SOCKET sock;
   sock = (SOCKET)conn;
-  if (bind(sock, (struct sockaddr *)&addr->addr_in,
-           (int)sizeof(addr->addr_in)) == SOCKET_ERROR) {
+  native = conn_address_native(addr, &scratch, &native_size);
+  if (bind(sock, native, native_size) == SOCKET_ERROR) {
     return CONN_ERROR;
   }
   return CONN_OK;
@@ -186,30 +340,127 @@ u32 conn_listen(Conn conn) {
 }
 
 u32 conn_connect(Conn conn, ConnAddr *addr) {
+  ConnAddr scratch;
+  struct sockaddr *native;
+  s32 native_size;
+  SOCKET sock;
+  sock = (SOCKET)conn;
+  assert(sock != INVALID_SOCKET);
+  native = conn_address_native(addr, &scratch, &native_size);
+  if (connect(sock, native, native_size) == SOCKET_ERROR) {
+    return CONN_ERROR;
+  }
+  return CONN_OK;
+}
+
+void conn_set_non_blocking(Conn conn) {
+  u_long non_blocking;
+  non_blocking = 1;
+  ioctlsocket((SOCKET)conn, FIONBIO, &non_blocking);
+}
+
+u32 conn_connect_start(Conn conn, ConnAddr *addr) {
+  ConnAddr scratch;
+  struct sockaddr *native;
+  s32 native_size;
+  u_long non_blocking;
   SOCKET sock;
   sock = (SOCKET)conn;
   assert(sock != INVALID_SOCKET);
-  if (connect(sock, (struct sockaddr *)&addr->addr_in,
-              (int)sizeof(addr->addr_in)) == SOCKET_ERROR) {
+  non_blocking = 1;
+  ioctlsocket(sock, FIONBIO, &non_blocking);
+  native = conn_address_native(addr, &scratch, &native_size);
+  if (connect(sock, native, native_size) == SOCKET_ERROR) {
+    if (WSAGetLastError() == WSAEWOULDBLOCK) {
+      return CONN_WOULD_BLOCK;
+    }
+    non_blocking = 0;
+    ioctlsocket(sock, FIONBIO, &non_blocking);
+    return CONN_ERROR;
+  }
+  non_blocking = 0;
+  ioctlsocket(sock, FIONBIO, &non_blocking);
+  return CONN_OK;
+}
+
+/* NOTE: winsock reports a failed connect in the except set of select, not
+ * the write set, so callers also need a connect timeout */
+u32 conn_connect_finish(Conn conn) {
+  u_long non_blocking;
+  s32 err, size;
+  SOCKET sock;
+  sock = (SOCKET)conn;
+  err = 0;
+  size = sizeof(err);
+  non_blocking = 0;
+  ioctlsocket(sock, FIONBIO, &non_blocking);
+  if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&err, &size) ==
+          SOCKET_ERROR ||
+      err != 0) {
     return CONN_ERROR;
   }
   return CONN_OK;
 }
 
+/* NOTE: no socketpair in winsock, connect to a throwaway loopback listener */
+u32 conn_stream_pair(Conn *a, Conn *b) {
+  struct sockaddr_in addr;
+  s32 addr_size;
+  SOCKET listener, client, server;
+  listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listener == INVALID_SOCKET) {
+    return CONN_ERROR;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr_size = sizeof(addr);
+  client = INVALID_SOCKET;
+  server = INVALID_SOCKET;
+  if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+      getsockname(listener, (struct sockaddr *)&addr, &addr_size) ==
+          SOCKET_ERROR ||
+      listen(listener, 1) == SOCKET_ERROR) {
+    closesocket(listener);
+    return CONN_ERROR;
+  }
+  client = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (client == INVALID_SOCKET ||
+      connect(client, (struct sockaddr *)&addr, sizeof(addr)) ==
+          SOCKET_ERROR) {
+    closesocket(listener);
+    if (client != INVALID_SOCKET) {
+      closesocket(client);
+    }
+    return CONN_ERROR;
+  }
+  server = accept(listener, 0, 0);
+  closesocket(listener);
+  if (server == INVALID_SOCKET) {
+    closesocket(client);
+    return CONN_ERROR;
+  }
+  *a = (Conn)client;
+  *b = (Conn)server;
+  return CONN_OK;
+}
+
 ConnErr conn_accept(Conn conn, ConnAddr *addr) {
   ConnErr res;
   SOCKET sock, other;
   s32 other_addr_len;
-  struct sockaddr_in other_addr;
-  other_addr_len = sizeof(other_addr);
+  ConnAddr other_addr;
+  memset(&other_addr, 0, sizeof(other_addr));
+  other_addr_len = sizeof(other_addr.u);
   sock = (SOCKET)conn;
-  other = accept(sock, (struct sockaddr *)&other_addr, &other_addr_len);
+  other = accept(sock, &other_addr.u.sa, &other_addr_len);
   if (other == INVALID_SOCKET) {
     res.err = CONN_ERROR;
     res.conn = CONN_INVALID;
   } else {
     if (addr) {
-      addr->addr_in = other_addr;
+      conn_address_unmap(&other_addr);
+      *addr = other_addr;
     }
     res.err = CONN_OK;
     res.conn = (Conn)other;
@@ -221,34 +472,91 @@ u32 conn_read_from(Conn conn, u8 *buffer, u32 size, ConnAddr *from) {
   s32 res, addr_size;
   SOCKET sock;
   sock = (SOCKET)conn;
-  addr_size = (u32)sizeof(from->addr_in);
-  res = recvfrom(sock, (char *)buffer, size, 0,
-                 (struct sockaddr *)&from->addr_in, &addr_size);
+  memset(from, 0, sizeof(*from));
+  addr_size = (s32)sizeof(from->u);
+  res = recvfrom(sock, (char *)buffer, size, 0, &from->u.sa, &addr_size);
   if (res == SOCKET_ERROR) {
     return CONN_ERROR;
   }
+  conn_address_unmap(from);
   return res;
 }
 
 u32 conn_write_to(Conn conn, u8 *buffer, u32 size, ConnAddr *to) {
-  s32 res, addr_size;
+  ConnAddr scratch;
+  struct sockaddr *native;
+  s32 res, native_size;
+  SOCKET sock;
+  sock = (SOCKET)conn;
+  native = conn_address_native(to, &scratch, &native_size);
+  res = sendto(sock, (char *)buffer, size, 0, native, native_size);
+  if (res == SOCKET_ERROR) {
+    return CONN_ERROR;
+  }
+  return (u32)res;
+}
+
+u32 conn_try_write_to(Conn conn, u8 *buffer, u32 size, ConnAddr *to) {
+  ConnAddr scratch;
+  struct sockaddr *native;
+  s32 res, native_size;
   SOCKET sock;
+  /* TODO: winsock has no per call non blocking flag, the socket would have to
+   * be switched with ioctlsocket(FIONBIO). A udp send on a blocking socket
+   * only waits for buffer space, so this is good enough for now */
   sock = (SOCKET)conn;
-  addr_size = (u32)sizeof(to->addr_in);
-  res = sendto(sock, (char *)buffer, size, 0, (struct sockaddr *)&to->addr_in,
-               addr_size);
+  native = conn_address_native(to, &scratch, &native_size);
+  res = sendto(sock, (char *)buffer, size, 0, native, native_size);
   if (res == SOCKET_ERROR) {
+    if (WSAGetLastError() == WSAEWOULDBLOCK) {
+      return CONN_WOULD_BLOCK;
+    }
     return CONN_ERROR;
   }
   return (u32)res;
 }
 
+u32 conn_enable_segmentation(Conn conn) {
+  /* TODO: use UDP_SEND_MSG_SIZE and UDP_RECV_MAX_COALESCED_SIZE, receiving the
+   * coalesced size needs WSARecvMsg */
+  unused(conn);
+  return CONN_ERROR;
+}
+
+u32 conn_write_segments_to(Conn conn, u8 *buffer, u32 size, u32 segment_size,
+                           ConnAddr *to) {
+  u32 sent;
+  assert(segment_size > 0);
+  sent = 0;
+  while (sent < size) {
+    u32 chunk = min(segment_size, size - sent);
+    if (conn_write_to(conn, buffer + sent, chunk, to) == CONN_ERROR) {
+      return sent ? sent : CONN_ERROR;
+    }
+    sent += chunk;
+  }
+  return sent;
+}
+
+u32 conn_read_segments_from(Conn conn, u8 *buffer, u32 size, u32 *segment_size,
+                            ConnAddr *from) {
+  u32 res;
+  res = conn_read_from(conn, buffer, size, from);
+  if (res != CONN_ERROR) {
+    *segment_size = res;
+  }
+  return res;
+}
+
 u32 conn_read(Conn conn, u8 *buffer, u32 size) {
   s32 res;
   SOCKET sock;
   sock = (SOCKET)conn;
   res = recv(sock, (char *)buffer, size, 0);
   if (res == SOCKET_ERROR) {
+    if (WSAGetLastError() == WSAEWOULDBLOCK) {
+      return CONN_WOULD_BLOCK;
+    }
     return CONN_ERROR;
   }
   return (u32)res;
@@ -260,6 +568,9 @@ u32 conn_write(Conn conn, u8 *buffer, u32 size) {
   sock = (SOCKET)conn;
   res = send(sock, (char *)buffer, size, 0);
   if (res == SOCKET_ERROR) {
+    if (WSAGetLastError() == WSAEWOULDBLOCK) {
+      return CONN_WOULD_BLOCK;
+    }
     return CONN_ERROR;
   }
   return (u32)res;
@@ -271,15 +582,17 @@ void conn_close(Conn conn) {
   closesocket(sock);
 }
 
-void conn_get_local_addr_and_port(Conn conn, u32 *address, u16 *port) {
+void conn_get_local_endpoint(Conn conn, ConnEndpoint *endpoint) {
   s32 res, addr_len;
   ConnAddr addr;
   SOCKET sock;
   sock = (SOCKET)conn;
-  addr_len = sizeof(addr.addr_in);
-  res = getsockname(sock, (struct sockaddr *)&addr.addr_in, &addr_len);
+  memset(&addr, 0, sizeof(addr));
+  addr_len = sizeof(addr.u);
+  res = getsockname(sock, &addr.u.sa, &addr_len);
   assert(res != SOCKET_ERROR);
-  conn_address_get_address_and_port(&addr, address, port);
+  conn_address_unmap(&addr);
+  conn_address_get_endpoint(&addr, endpoint);
 }
 
 static struct sockaddr_in *get_default_network_adapter_addr(Arena *arena) {
@@ -332,7 +645,7 @@ ConnAddr *conn_get_default_network_addapter_addr(struct Arena *arena) {
   mark1 = arena->used;
   addr_in = get_default_network_adapter_addr(arena);
   if (addr_in) {
-    memcpy(&addr->addr_in, addr_in, sizeof(addr->addr_in));
+    memcpy(&addr->u.in4, addr_in, sizeof(addr->u.in4));
     arena->used = mark1;
     return addr;
   }
@@ -340,14 +653,67 @@ ConnAddr *conn_get_default_network_addapter_addr(struct Arena *arena) {
   return 0;
 }
 
+u32 conn_get_host_endpoints(ConnEndpoint *endpoints, u32 max_count) {
+  u32 res, count;
+  unsigned long adapters_buffer_size;
+  IP_ADAPTER_ADDRESSES *adapters, *current;
+  static u8 adapters_buffer[kb(32)];
+  adapters_buffer_size = (unsigned long)sizeof(adapters_buffer);
+  adapters = (IP_ADAPTER_ADDRESSES *)adapters_buffer;
+  res = GetAdaptersAddresses(
+      conn_family == AF_INET6 ? AF_UNSPEC : AF_INET,
+      GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST |
+          GAA_FLAG_SKIP_DNS_SERVER | GAA_FLAG_SKIP_FRIENDLY_NAME,
+      0, adapters, &adapters_buffer_size);
+  if (res != ERROR_SUCCESS) {
+    return 0;
+  }
+  count = 0;
+  for (current = adapters; current != 0; current = current->Next) {
+    IP_ADAPTER_UNICAST_ADDRESS *unicast_addr;
+    if (current->OperStatus != IfOperStatusUp ||
+        current->IfType == IF_TYPE_SOFTWARE_LOOPBACK) {
+      continue;
+    }
+    for (unicast_addr = current->FirstUnicastAddress;
+         unicast_addr != 0 && count < max_count;
+         unicast_addr = unicast_addr->Next) {
+      struct sockaddr *sa = unicast_addr->Address.lpSockaddr;
+      ConnAddr addr;
+      memset(&addr, 0, sizeof(addr));
+      if (sa->sa_family == AF_INET) {
+        memcpy(&addr.u.in4, sa, sizeof(addr.u.in4));
+        /* NOTE: 169.254/16, only there when dhcp failed */
+        if ((ntohl(addr.u.in4.sin_addr.S_un.S_addr) >> 16) == 0xa9fe) {
+          continue;
+        }
+      } else if (sa->sa_family == AF_INET6) {
+        memcpy(&addr.u.in6, sa, sizeof(addr.u.in6));
+        /* NOTE: link local needs the scope id, it does not survive the wire */
+        if (IN6_IS_ADDR_LINKLOCAL(&addr.u.in6.sin6_addr) ||
+            IN6_IS_ADDR_V4MAPPED(&addr.u.in6.sin6_addr)) {
+          continue;
+        }
+      } else {
+        continue;
+      }
+      conn_address_get_endpoint(&addr, &endpoints[count]);
+      endpoints[count].port = 0;
+      count++;
+    }
+  }
+  return count;
+}
+
 ConnAddr *conn_get_addr(Arena *arena, Conn conn) {
   SOCKET sock;
   ConnAddr *addr;
   s32 res, addr_len;
   addr = conn_address_create(arena);
-  addr_len = sizeof(addr->addr_in);
+  addr_len = sizeof(addr->u);
   sock = (SOCKET)conn;
-  res = getsockname(sock, (struct sockaddr *)&addr->addr_in, &addr_len);
+  res = getsockname(sock, &addr->u.sa, &addr_len);
   assert(res != SOCKET_ERROR);
+  conn_address_unmap(addr);
   return addr;
 }
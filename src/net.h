@@ -11,19 +11,37 @@ typedef struct ConnSet ConnSet;
 #define CONN_INVALID ((u32) - 1)
 #define CONN_ERROR ((u32) - 1)
 #define CONN_OK ((u32)0)
+#define CONN_WOULD_BLOCK ((u32) - 2)
 
 typedef struct ConnErr {
   Conn conn;
   u32 err;
 } ConnErr;
 
+/* NOTE: value form of an address, the one that goes on the wire and in hash
+ * tables. addr is in network order and ipv4 only uses the first 4 bytes. A
+ * ConnAddr never holds an ipv4 mapped ipv6 address, the backends convert them
+ * to plain ipv4 so both forms compare equal */
+#define CONN_FAMILY_NONE 0
+#define CONN_FAMILY_IPV4 4
+#define CONN_FAMILY_IPV6 6
+
+typedef struct ConnEndpoint {
+  u8 family;
+  u16 port;
+  u8 addr[16];
+} ConnEndpoint;
+
 void conn_init(void);
 
 struct ConnAddr *conn_address_create(struct Arena *arena);
 struct ConnAddr *conn_address(struct Arena *arena, char *address, u16 port);
-struct ConnAddr *conn_address_raw(struct Arena *arena, u32 address, u16 port);
-void conn_address_get_address_and_port(struct ConnAddr *addr, u32 *address,
-                                       u16 *port);
+struct ConnAddr *conn_address_endpoint(struct Arena *arena,
+                                       ConnEndpoint *endpoint);
+/* NOTE: wildcard address, dual stack when the system supports ipv6 */
+struct ConnAddr *conn_address_any(struct Arena *arena, u16 port);
+void conn_address_get_endpoint(struct ConnAddr *addr, ConnEndpoint *endpoint);
+u32 conn_address_hash(struct ConnAddr *addr);
 void conn_address_string(ConnAddr *addr, u8 *buffer, u32 buffer_size);
 
 b32 conn_address_equals(struct ConnAddr *addr0, struct ConnAddr *addr1);
@@ -43,20 +61,52 @@ ConnErr conn_udp(void);
 u32 conn_bind(Conn conn, struct ConnAddr *addr);
 u32 conn_listen(Conn conn);
 u32 conn_connect(Conn conn, struct ConnAddr *addr);
+/* NOTE: non blocking connect. conn_connect_start returns CONN_OK when it
+ * connected right away, CONN_WOULD_BLOCK while the handshake is in flight
+ * (the socket becomes writable when it ends) and CONN_ERROR on failure.
+ * conn_connect_finish reports the result and puts the socket back in
+ * blocking mode */
+u32 conn_connect_start(Conn conn, struct ConnAddr *addr);
+u32 conn_connect_finish(Conn conn);
 ConnErr conn_accept(Conn conn, struct ConnAddr *addr);
+/* NOTE: two connected stream sockets in this process, for tests and
+ * benchmarks. A unix socketpair where there is one, loopback tcp otherwise */
+u32 conn_stream_pair(Conn *a, Conn *b);
+/* NOTE: conn_read and conn_write return CONN_WOULD_BLOCK instead of waiting
+ * once the socket is non blocking */
+void conn_set_non_blocking(Conn conn);
 
 u32 conn_read(Conn conn, u8 *buffer, u32 size);
 u32 conn_write(Conn conn, u8 *buffer, u32 size);
 u32 conn_read_from(Conn conn, u8 *buffer, u32 size, struct ConnAddr *from);
 u32 conn_write_to(Conn conn, u8 *buffer, u32 size, struct ConnAddr *to);
+/* NOTE: never blocks, returns CONN_WOULD_BLOCK when the send buffer is full */
+u32 conn_try_write_to(Conn conn, u8 *buffer, u32 size, struct ConnAddr *to);
+
+/* NOTE: bulk udp path, a burst of datagrams of segment_size bytes (the last one
+ * can be shorter) goes out or comes in with a single syscall when the platform
+ * supports udp segmentation offload, otherwise it falls back to one datagram
+ * per call. conn_read_segments_from returns the total bytes read and writes the
+ * stride of the datagrams in segment_size */
+u32 conn_enable_segmentation(Conn conn);
+u32 conn_write_segments_to(Conn conn, u8 *buffer, u32 size, u32 segment_size,
+                           struct ConnAddr *to);
+u32 conn_read_segments_from(Conn conn, u8 *buffer, u32 size, u32 *segment_size,
+                            struct ConnAddr *from);
 
 u32 conn_current_time_ms(void);
+u64 conn_current_time_us(void);
+u64 conn_current_time_ns(void);
+void conn_sleep_ms(u32 ms);
 
 void conn_close(Conn conn);
 
-void conn_get_local_addr_and_port(Conn conn, u32 *address, u16 *port);
+void conn_get_local_endpoint(Conn conn, ConnEndpoint *endpoint);
 
 struct ConnAddr *conn_get_default_network_addapter_addr(struct Arena *arena);
+/* NOTE: addresses of every interface that is up, without loopback and link
+ * local ones, port is 0. Returns how many were written */
+u32 conn_get_host_endpoints(ConnEndpoint *endpoints, u32 max_count);
 ConnAddr *conn_get_addr(Arena *arena, Conn conn);
 
 #endif
@@ -0,0 +1,840 @@
+#define _GNU_SOURCE
+
+#include "core.h"
+#include "net.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* NOTE: older libc headers do not expose the UDP segmentation offload options
+ * even when the running kernel supports them */
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* NOTE: the kernel rejects GSO sends with more than 64 segments or bigger
+ * than a single ip packet */
+#define CONN_MAX_SEGMENTS 64
+#define CONN_MAX_SEGMENTS_SIZE 65000
+
+static b32 segmentation_unsupported = false;
+
+u32 conn_current_time_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u32)((u64)ts.tv_sec * 1000 + (u64)ts.tv_nsec / 1000000);
+}
+
+u64 conn_current_time_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000 + (u64)ts.tv_nsec / 1000;
+}
+
+u64 conn_current_time_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+}
+
+/* NOTE: sockets are ipv6 with IPV6_V6ONLY off when the system has ipv6, ipv4
+ * destinations are mapped right before the syscall and mapped sources are
+ * unmapped right after it */
+struct ConnAddr {
+  union {
+    struct sockaddr sa;
+    struct sockaddr_in in4;
+    struct sockaddr_in6 in6;
+    struct sockaddr_storage storage;
+  } u;
+};
+
+/* NOTE: poll based, select can not watch descriptors past FD_SETSIZE (1024)
+ * and a server holds far more connections than that. A set is the list of
+ * descriptors added to it plus a bitmap by descriptor, conn_select leaves only
+ * the ready ones in the bitmap. The arrays grow on demand, the read set also
+ * owns the pollfd scratch of conn_select */
+struct ConnSet {
+  u64 *bits;
+  u32 bits_count;
+  s32 *fds;
+  u32 fds_count;
+  u32 fds_capacity;
+  struct pollfd *polls;
+  u32 polls_capacity;
+};
+
+static s32 conn_family = AF_INET;
+
+void conn_sleep_ms(u32 ms) {
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (long)(ms % 1000) * 1000000;
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+  }
+}
+
+void conn_init(void) {
+  struct rlimit limit;
+  s32 fd, off;
+  signal(SIGPIPE, SIG_IGN);
+  /* NOTE: the soft descriptor limit is usually 1024, a server or the load
+   * generator needs one per connection */
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < min(limit.rlim_max, (rlim_t)1 << 20)) {
+    limit.rlim_cur = min(limit.rlim_max, (rlim_t)1 << 20);
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  fd = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd >= 0) {
+    off = 0;
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) == 0) {
+      conn_family = AF_INET6;
+    }
+    close(fd);
+  }
+}
+
+static socklen_t conn_address_size(ConnAddr *addr) {
+  return addr->u.sa.sa_family == AF_INET6 ? sizeof(addr->u.in6)
+                                          : sizeof(addr->u.in4);
+}
+
+/* NOTE: returns the sockaddr to hand to the kernel, scratch is only used when
+ * an ipv4 address has to be mapped for an ipv6 socket */
+static struct sockaddr *conn_address_native(ConnAddr *addr, ConnAddr *scratch,
+                                            socklen_t *size) {
+  if (conn_family == AF_INET6 && addr->u.sa.sa_family == AF_INET) {
+    memset(&scratch->u.in6, 0, sizeof(scratch->u.in6));
+    scratch->u.in6.sin6_family = AF_INET6;
+    scratch->u.in6.sin6_port = addr->u.in4.sin_port;
+    scratch->u.in6.sin6_addr.s6_addr[10] = 0xff;
+    scratch->u.in6.sin6_addr.s6_addr[11] = 0xff;
+    memcpy(&scratch->u.in6.sin6_addr.s6_addr[12], &addr->u.in4.sin_addr, 4);
+    *size = sizeof(scratch->u.in6);
+    return &scratch->u.sa;
+  }
+  *size = conn_address_size(addr);
+  return &addr->u.sa;
+}
+
+static void conn_address_unmap(ConnAddr *addr) {
+  if (addr->u.sa.sa_family == AF_INET6 &&
+      IN6_IS_ADDR_V4MAPPED(&addr->u.in6.sin6_addr)) {
+    struct sockaddr_in in4;
+    memset(&in4, 0, sizeof(in4));
+    in4.sin_family = AF_INET;
+    in4.sin_port = addr->u.in6.sin6_port;
+    memcpy(&in4.sin_addr, &addr->u.in6.sin6_addr.s6_addr[12], 4);
+    memset(addr, 0, sizeof(*addr));
+    addr->u.in4 = in4;
+  }
+}
+
+ConnAddr *conn_address_create(Arena *arena) {
+  ConnAddr *addr;
+  addr = arena_push(arena, sizeof(*addr), 8);
+  memset(addr, 0, sizeof(*addr));
+  return addr;
+}
+
+ConnAddr *conn_address_endpoint(struct Arena *arena, ConnEndpoint *endpoint) {
+  ConnAddr *addr = conn_address_create(arena);
+  if (endpoint->family == CONN_FAMILY_IPV6) {
+    addr->u.in6.sin6_family = AF_INET6;
+    addr->u.in6.sin6_port = htons(endpoint->port);
+    memcpy(&addr->u.in6.sin6_addr, endpoint->addr, 16);
+  } else {
+    addr->u.in4.sin_family = AF_INET;
+    addr->u.in4.sin_port = htons(endpoint->port);
+    memcpy(&addr->u.in4.sin_addr, endpoint->addr, 4);
+  }
+  return addr;
+}
+
+ConnAddr *conn_address_any(struct Arena *arena, u16 port) {
+  ConnAddr *addr = conn_address_create(arena);
+  if (conn_family == AF_INET6) {
+    addr->u.in6.sin6_family = AF_INET6;
+    addr->u.in6.sin6_port = htons(port);
+    addr->u.in6.sin6_addr = in6addr_any;
+  } else {
+    addr->u.in4.sin_family = AF_INET;
+    addr->u.in4.sin_port = htons(port);
+    addr->u.in4.sin_addr.s_addr = htonl(INADDR_ANY);
+  }
+  return addr;
+}
+
+ConnAddr *conn_address(Arena *arena, char *address, u16 port) {
+  ConnAddr *addr;
+  addr = conn_address_create(arena);
+  if (inet_pton(AF_INET, address, &addr->u.in4.sin_addr) == 1) {
+    addr->u.in4.sin_family = AF_INET;
+    addr->u.in4.sin_port = htons(port);
+  } else if (inet_pton(AF_INET6, address, &addr->u.in6.sin6_addr) == 1) {
+    addr->u.in6.sin6_family = AF_INET6;
+    addr->u.in6.sin6_port = htons(port);
+    conn_address_unmap(addr);
+  }
+  return addr;
+}
+
+void conn_address_get_endpoint(ConnAddr *addr, ConnEndpoint *endpoint) {
+  memset(endpoint, 0, sizeof(*endpoint));
+  if (addr->u.sa.sa_family == AF_INET6) {
+    endpoint->family = CONN_FAMILY_IPV6;
+    endpoint->port = ntohs(addr->u.in6.sin6_port);
+    memcpy(endpoint->addr, &addr->u.in6.sin6_addr, 16);
+  } else if (addr->u.sa.sa_family == AF_INET) {
+    endpoint->family = CONN_FAMILY_IPV4;
+    endpoint->port = ntohs(addr->u.in4.sin_port);
+    memcpy(endpoint->addr, &addr->u.in4.sin_addr, 4);
+  }
+}
+
+static void *conn_address_ip(ConnAddr *addr) {
+  if (addr->u.sa.sa_family == AF_INET6) {
+    return &addr->u.in6.sin6_addr;
+  }
+  return &addr->u.in4.sin_addr;
+}
+
+void conn_address_print(ConnAddr *addr) {
+  static char buffer[1024];
+  inet_ntop(addr->u.sa.sa_family, conn_address_ip(addr), buffer,
+            sizeof(buffer));
+  printf("%s\n", buffer);
+}
+
+void conn_address_string(ConnAddr *addr, u8 *buffer, u32 buffer_size) {
+  char ip[INET6_ADDRSTRLEN];
+  u16 port;
+  inet_ntop(addr->u.sa.sa_family, conn_address_ip(addr), ip, sizeof(ip));
+  if (addr->u.sa.sa_family == AF_INET6) {
+    port = ntohs(addr->u.in6.sin6_port);
+    snprintf((char *)buffer, buffer_size, "[%s]:%d", ip, port);
+  } else {
+    port = ntohs(addr->u.in4.sin_port);
+    snprintf((char *)buffer, buffer_size, "%s:%d", ip, port);
+  }
+}
+
+void conn_address_set(ConnAddr *dst, ConnAddr *src) {
+  memcpy(dst, src, sizeof(ConnAddr));
+}
+
+b32 conn_address_equals(struct ConnAddr *addr0, struct ConnAddr *addr1) {
+  if (addr0->u.sa.sa_family != addr1->u.sa.sa_family) {
+    return false;
+  }
+  if (addr0->u.sa.sa_family == AF_INET6) {
+    return addr0->u.in6.sin6_port == addr1->u.in6.sin6_port &&
+           addr0->u.in6.sin6_scope_id == addr1->u.in6.sin6_scope_id &&
+           memcmp(&addr0->u.in6.sin6_addr, &addr1->u.in6.sin6_addr, 16) == 0;
+  }
+  return addr0->u.in4.sin_port == addr1->u.in4.sin_port &&
+         addr0->u.in4.sin_addr.s_addr == addr1->u.in4.sin_addr.s_addr;
+}
+
+u32 conn_address_hash(struct ConnAddr *addr) {
+  u64 hash;
+  if (addr->u.sa.sa_family == AF_INET6) {
+    u64 hi, lo;
+    memcpy(&hi, &addr->u.in6.sin6_addr.s6_addr[0], 8);
+    memcpy(&lo, &addr->u.in6.sin6_addr.s6_addr[8], 8);
+    hash = (hi ^ (lo * 0xff51afd7ed558ccdull)) + addr->u.in6.sin6_port;
+  } else {
+    hash = ((u64)addr->u.in4.sin_addr.s_addr << 16) | addr->u.in4.sin_port;
+  }
+  return (u32)((hash * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+ConnSet *conn_set_create(Arena *arena) {
+  ConnSet *set;
+  set = arena_push(arena, sizeof(*set), 8);
+  assert(set);
+  memset(set, 0, sizeof(*set));
+  return set;
+}
+
+void conn_set_clear(ConnSet *set) {
+  u32 i;
+  for (i = 0; i < set->fds_count; ++i) {
+    set->bits[set->fds[i] / 64] = 0;
+  }
+  set->fds_count = 0;
+}
+
+void conn_set_add(ConnSet *set, Conn conn) {
+  s32 fd;
+  u64 bit;
+  fd = (s32)conn;
+  assert(fd >= 0);
+  if ((u32)fd / 64 >= set->bits_count) {
+    u32 count;
+    count = max(set->bits_count * 2, (u32)fd / 64 + 1);
+    set->bits = realloc(set->bits, sizeof(u64) * count);
+    assert(set->bits);
+    memset(set->bits + set->bits_count, 0,
+           sizeof(u64) * (count - set->bits_count));
+    set->bits_count = count;
+  }
+  bit = 1ull << (fd % 64);
+  if (set->bits[fd / 64] & bit) {
+    return;
+  }
+  set->bits[fd / 64] |= bit;
+  if (set->fds_count == set->fds_capacity) {
+    set->fds_capacity = max(set->fds_capacity * 2, 64);
+    set->fds = realloc(set->fds, sizeof(s32) * set->fds_capacity);
+    assert(set->fds);
+  }
+  set->fds[set->fds_count++] = fd;
+}
+
+b32 conn_set_has(ConnSet *set, Conn conn) {
+  s32 fd;
+  fd = (s32)conn;
+  if (fd < 0 || (u32)fd / 64 >= set->bits_count) {
+    return false;
+  }
+  return (set->bits[fd / 64] >> (fd % 64)) & 1;
+}
+
+static u32 conn_set_poll_add(struct pollfd *polls, u32 count, ConnSet *set,
+                             s16 events) {
+  u32 i;
+  for (i = 0; i < set->fds_count; ++i) {
+    polls[count].fd = set->fds[i];
+    polls[count].events = events;
+    polls[count].revents = 0;
+    count++;
+  }
+  return count;
+}
+
+/* NOTE: like select errors and hang ups count as ready, the read or write
+ * that follows reports them */
+static void conn_set_poll_result(struct pollfd *polls, u32 first, ConnSet *set,
+                                 s16 events) {
+  u32 i;
+  for (i = 0; i < set->fds_count; ++i) {
+    set->bits[set->fds[i] / 64] = 0;
+  }
+  for (i = 0; i < set->fds_count; ++i) {
+    struct pollfd *poll_fd;
+    poll_fd = &polls[first + i];
+    if (poll_fd->revents & (events | POLLERR | POLLHUP | POLLNVAL)) {
+      set->bits[poll_fd->fd / 64] |= 1ull << (poll_fd->fd % 64);
+    }
+  }
+}
+
+u32 conn_select(ConnSet *read, ConnSet *write, u32 ms) {
+  ConnSet *owner;
+  u32 count, needed, read_count;
+  s32 res, timeout;
+  owner = read ? read : write;
+  if (!owner) {
+    return CONN_ERROR;
+  }
+  read_count = read ? read->fds_count : 0;
+  needed = read_count + (write ? write->fds_count : 0);
+  if (needed > owner->polls_capacity) {
+    owner->polls_capacity = max(needed, owner->polls_capacity * 2);
+    owner->polls =
+        realloc(owner->polls, sizeof(struct pollfd) * owner->polls_capacity);
+    assert(owner->polls);
+  }
+  count = 0;
+  if (read) {
+    count = conn_set_poll_add(owner->polls, count, read, POLLIN);
+  }
+  if (write) {
+    count = conn_set_poll_add(owner->polls, count, write, POLLOUT);
+  }
+  timeout = ms == CONN_TIMEOUT_INFINITY ? -1 : (s32)min(ms, 0x7fffffffu);
+  res = poll(owner->polls, count, timeout);
+  if (res < 0 && errno == EINTR) {
+    u32 i;
+    /* NOTE: a signal, nothing is ready and the caller gets to look at
+     * whatever flag the handler set */
+    for (i = 0; i < count; ++i) {
+      owner->polls[i].revents = 0;
+    }
+    res = 0;
+  }
+  if (res < 0) {
+    return CONN_ERROR;
+  }
+  if (read) {
+    conn_set_poll_result(owner->polls, 0, read, POLLIN);
+  }
+  if (write) {
+    conn_set_poll_result(owner->polls, read_count, write, POLLOUT);
+  }
+  return res;
+}
+
+static ConnErr conn_socket(s32 type, s32 protocol) {
+  ConnErr res;
+  s32 fd, off;
+  fd = socket(conn_family, type, protocol);
+  if (fd < 0) {
+    res.err = CONN_ERROR;
+    res.conn = CONN_INVALID;
+  } else {
+    if (conn_family == AF_INET6) {
+      off = 0;
+      setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    }
+    res.err = CONN_OK;
+    res.conn = (Conn)fd;
+  }
+  return res;
+}
+
+ConnErr conn_tcp(void) { return conn_socket(SOCK_STREAM, IPPROTO_TCP); }
+
+ConnErr conn_udp(void) { return conn_socket(SOCK_DGRAM, IPPROTO_UDP); }
+
+u32 conn_bind(Conn conn, ConnAddr *addr) {
+  ConnAddr scratch;
+  struct sockaddr *native;
+  socklen_t native_size;
+  s32 fd, reuse;
+  fd = (s32)conn;
+  reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  native = conn_address_native(addr, &scratch, &native_size);
+  if (bind(fd, native, native_size) < 0) {
+    return CONN_ERROR;
+  }
+  return CONN_OK;
+}
+
+u32 conn_listen(Conn conn) {
+  s32 fd;
+  fd = (s32)conn;
+  if (listen(fd, SOMAXCONN) < 0) {
+    return CONN_ERROR;
+  }
+  return CONN_OK;
+}
+
+u32 conn_connect(Conn conn, ConnAddr *addr) {
+  ConnAddr scratch;
+  struct sockaddr *native;
+  socklen_t native_size;
+  s32 fd;
+  fd = (s32)conn;
+  assert(conn != CONN_INVALID);
+  native = conn_address_native(addr, &scratch, &native_size);
+  if (connect(fd, native, native_size) < 0) {
+    return CONN_ERROR;
+  }
+  return CONN_OK;
+}
+
+static void conn_set_blocking(s32 fd, b32 blocking) {
+  s32 flags;
+  flags = fcntl(fd, F_GETFL, 0);
+  flags = blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK;
+  fcntl(fd, F_SETFL, flags);
+}
+
+void conn_set_non_blocking(Conn conn) {
+  conn_set_blocking((s32)conn, false);
+}
+
+u32 conn_connect_start(Conn conn, ConnAddr *addr) {
+  ConnAddr scratch;
+  struct sockaddr *native;
+  socklen_t native_size;
+  s32 fd;
+  fd = (s32)conn;
+  assert(conn != CONN_INVALID);
+  conn_set_blocking(fd, false);
+  native = conn_address_native(addr, &scratch, &native_size);
+  if (connect(fd, native, native_size) < 0) {
+    if (errno == EINPROGRESS) {
+      return CONN_WOULD_BLOCK;
+    }
+    conn_set_blocking(fd, true);
+    return CONN_ERROR;
+  }
+  conn_set_blocking(fd, true);
+  return CONN_OK;
+}
+
+u32 conn_connect_finish(Conn conn) {
+  socklen_t size;
+  s32 fd, err;
+  fd = (s32)conn;
+  err = 0;
+  size = sizeof(err);
+  conn_set_blocking(fd, true);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &size) < 0 || err != 0) {
+    return CONN_ERROR;
+  }
+  return CONN_OK;
+}
+
+u32 conn_stream_pair(Conn *a, Conn *b) {
+  s32 fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    return CONN_ERROR;
+  }
+  *a = (Conn)fds[0];
+  *b = (Conn)fds[1];
+  return CONN_OK;
+}
+
+ConnErr conn_accept(Conn conn, ConnAddr *addr) {
+  ConnErr res;
+  s32 fd, other;
+  socklen_t other_addr_len;
+  ConnAddr other_addr;
+  memset(&other_addr, 0, sizeof(other_addr));
+  other_addr_len = sizeof(other_addr.u);
+  fd = (s32)conn;
+  other = accept(fd, &other_addr.u.sa, &other_addr_len);
+  if (other < 0) {
+    res.err = CONN_ERROR;
+    res.conn = CONN_INVALID;
+  } else {
+    if (addr) {
+      conn_address_unmap(&other_addr);
+      *addr = other_addr;
+    }
+    res.err = CONN_OK;
+    res.conn = (Conn)other;
+  }
+  return res;
+}
+
+u32 conn_read_from(Conn conn, u8 *buffer, u32 size, ConnAddr *from) {
+  ssize_t res;
+  socklen_t addr_size;
+  s32 fd;
+  fd = (s32)conn;
+  memset(from, 0, sizeof(*from));
+  addr_size = sizeof(from->u);
+  res = recvfrom(fd, buffer, size, 0, &from->u.sa, &addr_size);
+  if (res < 0) {
+    return CONN_ERROR;
+  }
+  conn_address_unmap(from);
+  return (u32)res;
+}
+
+u32 conn_write_to(Conn conn, u8 *buffer, u32 size, ConnAddr *to) {
+  ConnAddr scratch;
+  struct sockaddr *native;
+  socklen_t native_size;
+  ssize_t res;
+  s32 fd;
+  fd = (s32)conn;
+  native = conn_address_native(to, &scratch, &native_size);
+  res = sendto(fd, buffer, size, 0, native, native_size);
+  if (res < 0) {
+    return CONN_ERROR;
+  }
+  return (u32)res;
+}
+
+u32 conn_try_write_to(Conn conn, u8 *buffer, u32 size, ConnAddr *to) {
+  ConnAddr scratch;
+  struct sockaddr *native;
+  socklen_t native_size;
+  ssize_t res;
+  s32 fd;
+  fd = (s32)conn;
+  native = conn_address_native(to, &scratch, &native_size);
+  res = sendto(fd, buffer, size, MSG_DONTWAIT, native, native_size);
+  if (res < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+      return CONN_WOULD_BLOCK;
+    }
+    return CONN_ERROR;
+  }
+  return (u32)res;
+}
+
+u32 conn_enable_segmentation(Conn conn) {
+  s32 fd, enable;
+  fd = (s32)conn;
+  enable = 1;
+  if (segmentation_unsupported ||
+      setsockopt(fd, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) < 0) {
+    return CONN_ERROR;
+  }
+  return CONN_OK;
+}
+
+static u32 conn_write_segments_fallback(Conn conn, u8 *buffer, u32 size,
+                                        u32 segment_size, ConnAddr *to) {
+  u32 sent;
+  sent = 0;
+  while (sent < size) {
+    u32 chunk = min(segment_size, size - sent);
+    if (conn_write_to(conn, buffer + sent, chunk, to) == CONN_ERROR) {
+      return sent ? sent : CONN_ERROR;
+    }
+    sent += chunk;
+  }
+  return sent;
+}
+
+u32 conn_write_segments_to(Conn conn, u8 *buffer, u32 size, u32 segment_size,
+                           ConnAddr *to) {
+  ConnAddr scratch;
+  struct sockaddr *native;
+  socklen_t native_size;
+  u32 sent, max_chunk;
+  s32 fd;
+  fd = (s32)conn;
+  assert(segment_size > 0);
+  if (segmentation_unsupported || size <= segment_size) {
+    return conn_write_segments_fallback(conn, buffer, size, segment_size, to);
+  }
+  native = conn_address_native(to, &scratch, &native_size);
+  max_chunk = min(CONN_MAX_SEGMENTS, CONN_MAX_SEGMENTS_SIZE / segment_size);
+  max_chunk *= segment_size;
+  sent = 0;
+  while (sent < size) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+      u8 buffer[CMSG_SPACE(sizeof(u16))];
+      struct cmsghdr align;
+    } control;
+    ssize_t res;
+    u32 chunk;
+
+    chunk = min(max_chunk, size - sent);
+    iov.iov_base = buffer + sent;
+    iov.iov_len = chunk;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = native;
+    msg.msg_namelen = native_size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(u16));
+    *(u16 *)CMSG_DATA(cmsg) = (u16)segment_size;
+
+    res = sendmsg(fd, &msg, 0);
+    if (res < 0) {
+      if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT) {
+        /* NOTE: no gso on this kernel or device, stop trying */
+        u32 rest;
+        segmentation_unsupported = true;
+        rest = conn_write_segments_fallback(conn, buffer + sent, size - sent,
+                                            segment_size, to);
+        if (rest == CONN_ERROR) {
+          return sent ? sent : CONN_ERROR;
+        }
+        return sent + rest;
+      }
+      return sent ? sent : CONN_ERROR;
+    }
+    sent += (u32)res;
+  }
+  return sent;
+}
+
+u32 conn_read_segments_from(Conn conn, u8 *buffer, u32 size, u32 *segment_size,
+                            ConnAddr *from) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    u8 buffer[CMSG_SPACE(sizeof(s32))];
+    struct cmsghdr align;
+  } control;
+  ssize_t res;
+  s32 fd;
+  fd = (s32)conn;
+  iov.iov_base = buffer;
+  iov.iov_len = size;
+  memset(&msg, 0, sizeof(msg));
+  memset(from, 0, sizeof(*from));
+  msg.msg_name = &from->u;
+  msg.msg_namelen = sizeof(from->u);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+  res = recvmsg(fd, &msg, 0);
+  if (res < 0) {
+    return CONN_ERROR;
+  }
+  conn_address_unmap(from);
+  *segment_size = (u32)res;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != 0; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      s32 gso_size;
+      memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+      if (gso_size > 0) {
+        *segment_size = (u32)gso_size;
+      }
+    }
+  }
+  return (u32)res;
+}
+
+u32 conn_read(Conn conn, u8 *buffer, u32 size) {
+  ssize_t res;
+  s32 fd;
+  fd = (s32)conn;
+  res = recv(fd, buffer, size, 0);
+  if (res < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return CONN_WOULD_BLOCK;
+    }
+    return CONN_ERROR;
+  }
+  return (u32)res;
+}
+
+u32 conn_write(Conn conn, u8 *buffer, u32 size) {
+  ssize_t res;
+  s32 fd;
+  fd = (s32)conn;
+  res = send(fd, buffer, size, MSG_NOSIGNAL);
+  if (res < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return CONN_WOULD_BLOCK;
+    }
+    return CONN_ERROR;
+  }
+  return (u32)res;
+}
+
+void conn_close(Conn conn) {
+  s32 fd;
+  fd = (s32)conn;
+  close(fd);
+}
+
+void conn_get_local_endpoint(Conn conn, ConnEndpoint *endpoint) {
+  s32 res, fd;
+  socklen_t addr_len;
+  ConnAddr addr;
+  fd = (s32)conn;
+  memset(&addr, 0, sizeof(addr));
+  addr_len = sizeof(addr.u);
+  res = getsockname(fd, &addr.u.sa, &addr_len);
+  assert(res >= 0);
+  unused(res);
+  conn_address_unmap(&addr);
+  conn_address_get_endpoint(&addr, endpoint);
+}
+
+ConnAddr *conn_get_default_network_addapter_addr(struct Arena *arena) {
+  /* NOTE: connecting a udp socket sends nothing, it only asks the kernel for
+   * the route, same idea as GetBestInterface on win32 */
+  ConnAddr *addr;
+  struct sockaddr_in probe;
+  socklen_t addr_len;
+  s32 fd;
+  fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd < 0) {
+    return 0;
+  }
+  memset(&probe, 0, sizeof(probe));
+  probe.sin_family = AF_INET;
+  probe.sin_port = htons(53);
+  inet_pton(probe.sin_family, "8.8.8.8", &probe.sin_addr);
+  if (connect(fd, (struct sockaddr *)&probe, sizeof(probe)) < 0) {
+    close(fd);
+    return 0;
+  }
+  addr = conn_address_create(arena);
+  addr_len = sizeof(addr->u);
+  if (getsockname(fd, &addr->u.sa, &addr_len) < 0) {
+    close(fd);
+    return 0;
+  }
+  close(fd);
+  addr->u.in4.sin_port = 0;
+  return addr;
+}
+
+u32 conn_get_host_endpoints(ConnEndpoint *endpoints, u32 max_count) {
+  struct ifaddrs *interfaces, *it;
+  u32 count;
+  if (getifaddrs(&interfaces) < 0) {
+    return 0;
+  }
+  count = 0;
+  for (it = interfaces; it != 0 && count < max_count; it = it->ifa_next) {
+    ConnAddr addr;
+    if (!it->ifa_addr || !(it->ifa_flags & IFF_UP) ||
+        (it->ifa_flags & IFF_LOOPBACK)) {
+      continue;
+    }
+    memset(&addr, 0, sizeof(addr));
+    if (it->ifa_addr->sa_family == AF_INET) {
+      memcpy(&addr.u.in4, it->ifa_addr, sizeof(addr.u.in4));
+      /* NOTE: 169.254/16, only there when dhcp failed */
+      if ((ntohl(addr.u.in4.sin_addr.s_addr) >> 16) == 0xa9fe) {
+        continue;
+      }
+    } else if (it->ifa_addr->sa_family == AF_INET6 &&
+               conn_family == AF_INET6) {
+      memcpy(&addr.u.in6, it->ifa_addr, sizeof(addr.u.in6));
+      /* NOTE: link local needs the scope id, it does not survive the wire */
+      if (IN6_IS_ADDR_LINKLOCAL(&addr.u.in6.sin6_addr) ||
+          IN6_IS_ADDR_V4MAPPED(&addr.u.in6.sin6_addr)) {
+        continue;
+      }
+    } else {
+      continue;
+    }
+    conn_address_get_endpoint(&addr, &endpoints[count]);
+    endpoints[count].port = 0;
+    count++;
+  }
+  freeifaddrs(interfaces);
+  return count;
+}
+
+ConnAddr *conn_get_addr(Arena *arena, Conn conn) {
+  ConnAddr *addr;
+  s32 res, fd;
+  socklen_t addr_len;
+  addr = conn_address_create(arena);
+  addr_len = sizeof(addr->u);
+  fd = (s32)conn;
+  res = getsockname(fd, &addr->u.sa, &addr_len);
+  assert(res >= 0);
+  unused(res);
+  conn_address_unmap(addr);
+  return addr;
+}
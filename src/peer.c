@@ -1,4 +1,9 @@
-#include "proto.h"
+#include "config.h"
+#include "gossip.h"
+#include "metrics.h"
+#include "punch.h"
+#include "reliable.h"
+#include "sequenced.h"
 
 typedef enum State {
   State_DONT_KNOW_IT_SELF,
@@ -6,37 +11,103 @@ typedef enum State {
   State_CONNECTED,
 } State;
 
+/* NOTE: the ctrl connection runs on its own, stun discovery does not wait
+ * for the tcp handshake and a lost server is retried with backoff */
+typedef enum CtrlState {
+  CtrlState_DISCONNECTED,
+  CtrlState_CONNECTING,
+  CtrlState_CONNECTED,
+} CtrlState;
+
 struct Context;
 typedef void (*EventCallback)(struct Context *ctx, Message *msg,
                               ConnAddr *addr);
 
 typedef struct Peer {
   ConnAddr *addr;
+  ReliableChannel *channel;
+  SequencedChannel *sequenced;
 
   u32 timeout;
   u32 last_activity;
 
-  u32 raw_addr;
-  u16 raw_port;
-  u32 raw_local_addr;
-  u16 raw_local_port;
+  ConnEndpoint endpoint;
+  /* NOTE: send-bytes still to go out on the reliable channel */
+  u64 send_left;
 
   struct Peer *next;
   struct Peer *prev;
 } Peer;
 
+typedef struct PeerConfig {
+  char server_address[CONFIG_STRING_SIZE];
+  u16 server_ctrl_port;
+  u16 server_stun_port;
+  u32 room;
+  u64 arena_size;
+  u64 event_arena_size;
+  u32 max_peers;
+  u32 ctrl_connect_timeout_ms;
+  u32 ctrl_backoff_base_ms;
+  u32 ctrl_backoff_max_ms;
+  char metrics_path[CONFIG_STRING_SIZE];
+  u32 pages;
+  u32 gossip_ms;
+  u32 channels_max;
+  u64 send_bytes;
+  u32 sequenced_hz;
+} PeerConfig;
+
+/* NOTE: slots in the metrics file, see metrics.h */
+typedef struct PeerMetrics {
+  MetricsValue *ctrl_connects;
+  MetricsValue *ctrl_disconnects;
+  MetricsValue *ctrl_messages_sent;
+  MetricsValue *peers_received;
+  MetricsValue *stun_requests;
+  MetricsValue *keepalives;
+  MetricsValue *punch_probes;
+  MetricsValue *punch_connected;
+  MetricsValue *punch_failed;
+  MetricsValue *punch_recycled;
+  MetricsValue *peers;
+  MetricsValue *gossip_members;
+  MetricsValue *gossip_learned;
+  MetricsValue *gossip_rejected;
+  MetricsValue *gossip_digests;
+  MetricsValue *gossip_deltas;
+  MetricsValue *channels;
+  MetricsValue *channel_bytes_sent;
+  MetricsValue *channel_bytes_received;
+  MetricsValue *channel_messages_sent;
+  MetricsValue *channel_messages_received;
+  /* NOTE: serialize and write of one ctrl message, in nanoseconds */
+  MetricsHistogram *send_ns;
+} PeerMetrics;
+
 typedef struct Context {
+  PeerConfig config;
+
+  Metrics metrics;
+  PeerMetrics m;
+
   Arena arena;
   Arena event_arena;
 
   MessageAllocator message_allocator;
   AddrMessageAllocator addr_message_allocator;
+  StreamBufferPool stream_buffers;
 
   Stream ctrl;
+  CtrlState ctrl_state;
+  /* NOTE: connect timeout while CONNECTING, next attempt while
+   * DISCONNECTED, in microseconds */
+  u64 ctrl_deadline;
+  u32 ctrl_attempts;
+  u32 ctrl_jitter_seed;
   Dgram transport;
   ConnAddr *ctrl_addr;
   ConnAddr *transport_addr;
-  ConnAddr *local_addr;
 
   ConnSet *read;
   ConnSet *write;
@@ -49,23 +120,119 @@ typedef struct Context {
   AddrMessage *addr_messages_first;
   AddrMessage *addr_messages_last;
 
+  Peer *peers_first;
+  Peer *peers_last;
+  u32 peers_count;
+  u32 channels_count;
+  /* NOTE: next round of sequenced-hz messages, in microseconds */
+  u64 sequenced_next;
+
+  Punch punch;
+  Gossip gossip;
+  u64 gossip_next;
+
   EventCallback transport_on_timeout;
   EventCallback transport_on_read;
 
   u32 timeout;
+  u64 timeout_start;
   b32 running;
 
-  u32 own_addr;
-  u16 own_port;
-  u32 own_local_addr;
-  u16 own_local_port;
+  ConnEndpoint own_endpoint;
+  /* NOTE: host candidates, the server reflexive one is own_endpoint */
+  Candidate own_candidates[CANDIDATES_MAX];
+  u32 own_candidates_count;
 } Context;
 
-#define SERVER_ADDRESS "192.168.100.197"
-#define SERVER_CTRL_PORT 8080
-#define SERVER_STUN_PORT 8081
+/* NOTE: defaults, see peer_config_parse for the flags */
+#define DEFAULT_SERVER_ADDRESS "192.168.100.197"
+#define DEFAULT_SERVER_CTRL_PORT 8080
+#define DEFAULT_SERVER_STUN_PORT 8081
+#define DEFAULT_ROOM 0
+#define DEFAULT_CTRL_CONNECT_TIMEOUT_MS 3000
+#define DEFAULT_CTRL_BACKOFF_BASE_MS 250
+#define DEFAULT_CTRL_BACKOFF_MAX_MS 30000
+#define DEFAULT_METRICS_PATH ""
+#define DEFAULT_PAGES 0
+#define DEFAULT_GOSSIP_MS 250
+#define DEFAULT_CHANNELS_MAX 4
+#define DEFAULT_SEND_BYTES 0
+#define DEFAULT_SEQUENCED_HZ 0
+#define CHANNEL_IO_SIZE kb(16)
+#define CHANNEL_SEQUENCED_FLUSH_US 10000
+#define CHANNEL_SEQUENCED_MESSAGE_SIZE 32
+#define METRICS_VALUES_CAPACITY 32
+#define METRICS_HISTOGRAMS_CAPACITY 8
 
 #define DEFAULT_ARENAS_SIZE mb(10)
+#define DEFAULT_MAX_PEERS 1024
+/* NOTE: the ctrl stream is the only one, a half read frame and a write */
+#define PEER_STREAM_BUFFERS 4
+
+void peer_config_default(PeerConfig *config) {
+  memset(config, 0, sizeof(*config));
+  strcpy(config->server_address, DEFAULT_SERVER_ADDRESS);
+  config->server_ctrl_port = DEFAULT_SERVER_CTRL_PORT;
+  config->server_stun_port = DEFAULT_SERVER_STUN_PORT;
+  config->room = DEFAULT_ROOM;
+  config->arena_size = DEFAULT_ARENAS_SIZE;
+  config->event_arena_size = DEFAULT_ARENAS_SIZE;
+  config->max_peers = DEFAULT_MAX_PEERS;
+  config->ctrl_connect_timeout_ms = DEFAULT_CTRL_CONNECT_TIMEOUT_MS;
+  config->ctrl_backoff_base_ms = DEFAULT_CTRL_BACKOFF_BASE_MS;
+  config->ctrl_backoff_max_ms = DEFAULT_CTRL_BACKOFF_MAX_MS;
+  strcpy(config->metrics_path, DEFAULT_METRICS_PATH);
+  config->pages = DEFAULT_PAGES;
+  config->gossip_ms = DEFAULT_GOSSIP_MS;
+  config->channels_max = DEFAULT_CHANNELS_MAX;
+  config->send_bytes = DEFAULT_SEND_BYTES;
+  config->sequenced_hz = DEFAULT_SEQUENCED_HZ;
+}
+
+u32 peer_config_parse(PeerConfig *config, int argc, char **argv) {
+  u32 res;
+  ConfigOption options[] = {
+      {"server", ConfigType_STRING, config->server_address, 0, 0,
+       "address of the server"},
+      {"server-ctrl-port", ConfigType_U16, &config->server_ctrl_port, 1,
+       0xffff, "tcp port of the server ctrl socket"},
+      {"server-stun-port", ConfigType_U16, &config->server_stun_port, 1,
+       0xffff, "udp port of the server stun socket"},
+      {"room", ConfigType_U32, &config->room, 0, 0xffffffff,
+       "room to join, only peers in it are introduced"},
+      {"arena-size", ConfigType_SIZE, &config->arena_size, mb(1), gb(64),
+       "bytes reserved for long lived state"},
+      {"event-arena-size", ConfigType_SIZE, &config->event_arena_size, mb(1),
+       gb(64), "bytes reserved for one event loop iteration"},
+      {"max-peers", ConfigType_U32, &config->max_peers, 1, 1u << 20,
+       "peers that can be punched at the same time"},
+      {"ctrl-connect-timeout-ms", ConfigType_U32,
+       &config->ctrl_connect_timeout_ms, 1, 600000,
+       "milliseconds before a ctrl connect attempt is given up"},
+      {"ctrl-backoff-base-ms", ConfigType_U32, &config->ctrl_backoff_base_ms,
+       1, 600000, "first ctrl reconnect backoff in milliseconds"},
+      {"ctrl-backoff-max-ms", ConfigType_U32, &config->ctrl_backoff_max_ms, 1,
+       3600000, "ctrl reconnect backoff cap in milliseconds"},
+      {"metrics", ConfigType_STRING, config->metrics_path, 0, 0,
+       "file shared with tenet-top, empty keeps the metrics private"},
+      {"pages", ConfigType_U32, &config->pages, 0, 1u << 16,
+       "pages of the room to ask for when the server sends only the best"},
+      {"gossip-ms", ConfigType_U32, &config->gossip_ms, 0, 60000,
+       "milliseconds between gossip rounds with punched peers, 0 is off"},
+      {"channels-max", ConfigType_U32, &config->channels_max, 0, 1024,
+       "channels open at the same time, each one takes its buffers"},
+      {"send-bytes", ConfigType_SIZE, &config->send_bytes, 0, gb(64),
+       "bytes sent over a reliable channel to every punched peer"},
+      {"sequenced-hz", ConfigType_U32, &config->sequenced_hz, 0, 1000,
+       "sequenced messages per second to every punched peer"},
+  };
+  res = config_parse_args(options, array_len(options), argc, argv);
+  if (res != CONFIG_OK) {
+    return res;
+  }
+  config_print(options, array_len(options));
+  return CONFIG_OK;
+}
 
 void print_le_address(u32 addr) {
   u8 b0, b1, b2, b3;
@@ -76,20 +243,77 @@ void print_le_address(u32 addr) {
   printf("%d.%d.%d.%d\n", b0, b1, b2, b3);
 }
 
-b32 ctrl_init(Stream *ctrl, ConnAddr *addr) {
+void push_connect_message(Context *ctx);
+
+/* NOTE: equal jitter, half of the backoff is fixed and half is random so a
+ * restarted server does not get every client back at the same time */
+void ctrl_schedule_reconnect(Context *ctx, u64 now) {
+  u64 backoff;
+  u32 shift;
+  shift = min(ctx->ctrl_attempts, 16);
+  backoff = min((u64)ctx->config.ctrl_backoff_base_ms << shift,
+                (u64)ctx->config.ctrl_backoff_max_ms);
+  backoff *= 1000;
+  ctx->ctrl_jitter_seed ^= ctx->ctrl_jitter_seed << 13;
+  ctx->ctrl_jitter_seed ^= ctx->ctrl_jitter_seed >> 17;
+  ctx->ctrl_jitter_seed ^= ctx->ctrl_jitter_seed << 5;
+  ctx->ctrl_deadline =
+      now + backoff / 2 + ctx->ctrl_jitter_seed % (backoff / 2 + 1);
+  ctx->ctrl_attempts++;
+  ctx->ctrl_state = CtrlState_DISCONNECTED;
+}
+
+void ctrl_on_connected(Context *ctx) {
+  ctx->ctrl_state = CtrlState_CONNECTED;
+  ctx->ctrl_attempts = 0;
+  metrics_add(ctx->m.ctrl_connects, 1);
+  /* NOTE: when stun won the race the CONNECT goes out now, otherwise the
+   * stun response sends it */
+  if (ctx->state != State_DONT_KNOW_IT_SELF) {
+    ctx->state = State_KNOW_IT_SELF;
+    push_connect_message(ctx);
+  }
+}
+
+void ctrl_connect(Context *ctx, u64 now) {
   ConnErr tcp;
+  u32 res;
   tcp = conn_tcp();
   if (tcp.err == CONN_ERROR) {
-    return false;
+    ctrl_schedule_reconnect(ctx, now);
+    return;
   }
-  ctrl->conn = tcp.conn;
-  ctrl->recv_buffer_used = 0;
-  ctrl->bytes_to_farm = 0;
-  ctrl->farming = false;
-  if (conn_connect(ctrl->conn, addr) == CONN_ERROR) {
-    return false;
+  stream_init(&ctx->ctrl, tcp.conn, &ctx->stream_buffers);
+  res = conn_connect_start(ctx->ctrl.conn, ctx->ctrl_addr);
+  if (res == CONN_OK) {
+    ctrl_on_connected(ctx);
+  } else if (res == CONN_WOULD_BLOCK) {
+    ctx->ctrl_state = CtrlState_CONNECTING;
+    ctx->ctrl_deadline =
+        now + (u64)ctx->config.ctrl_connect_timeout_ms * 1000;
+  } else {
+    conn_close(ctx->ctrl.conn);
+    ctrl_schedule_reconnect(ctx, now);
   }
-  return true;
+}
+
+void ctrl_disconnect(Context *ctx, u64 now) {
+  MessageHeader *msg;
+  conn_close(ctx->ctrl.conn);
+  stream_reset(&ctx->ctrl);
+  /* NOTE: whatever was queued belongs to the old session, a new CONNECT is
+   * sent once the connection is back */
+  msg = ctx->messages_first;
+  while (msg != 0) {
+    MessageHeader *to_free;
+    to_free = msg;
+    msg = msg->next;
+    dllist_remove(ctx->messages_first, ctx->messages_last, to_free);
+    message_free(&ctx->message_allocator, (Message *)to_free);
+  }
+  metrics_add(ctx->m.ctrl_disconnects, 1);
+  printf("ctrl connection lost, retry %u\n", ctx->ctrl_attempts + 1);
+  ctrl_schedule_reconnect(ctx, now);
 }
 
 b32 transport_init(Dgram *transport) {
@@ -99,44 +323,126 @@ b32 transport_init(Dgram *transport) {
     return false;
   }
   transport->conn = udp.conn;
+  /* NOTE: optional, without it every datagram is read by its own syscall */
+  dgram_enable_segmentation(transport);
 
   return true;
 }
 
-void ctx_init(Context *ctx, EventCallback transport_on_timeout,
+void peer_metrics_init(Context *ctx) {
+  Metrics *metrics;
+  PeerMetrics *m;
+  metrics = &ctx->metrics;
+  m = &ctx->m;
+  if (!metrics_open(metrics, ctx->config.metrics_path,
+                    METRICS_VALUES_CAPACITY, METRICS_HISTOGRAMS_CAPACITY)) {
+    b32 res;
+    fprintf(stderr, "%s: can not create the metrics file, they stay "
+                    "private\n",
+            ctx->config.metrics_path);
+    res = metrics_open(metrics, 0, METRICS_VALUES_CAPACITY,
+                       METRICS_HISTOGRAMS_CAPACITY);
+    assert(res);
+    (void)res;
+  }
+  m->ctrl_connects =
+      metrics_value(metrics, "ctrl.connects", MetricType_COUNTER);
+  m->ctrl_disconnects =
+      metrics_value(metrics, "ctrl.disconnects", MetricType_COUNTER);
+  m->ctrl_messages_sent =
+      metrics_value(metrics, "ctrl.messages_sent", MetricType_COUNTER);
+  m->peers_received =
+      metrics_value(metrics, "ctrl.peers_received", MetricType_COUNTER);
+  m->stun_requests =
+      metrics_value(metrics, "stun.requests", MetricType_COUNTER);
+  m->keepalives = metrics_value(metrics, "stun.keepalives", MetricType_COUNTER);
+  m->punch_probes = metrics_value(metrics, "punch.probes", MetricType_COUNTER);
+  m->punch_connected =
+      metrics_value(metrics, "punch.connected", MetricType_COUNTER);
+  m->punch_failed = metrics_value(metrics, "punch.failed", MetricType_COUNTER);
+  m->punch_recycled =
+      metrics_value(metrics, "punch.recycled", MetricType_COUNTER);
+  m->peers = metrics_value(metrics, "peers", MetricType_GAUGE);
+  m->gossip_members =
+      metrics_value(metrics, "gossip.members", MetricType_GAUGE);
+  m->gossip_learned =
+      metrics_value(metrics, "gossip.learned", MetricType_COUNTER);
+  m->gossip_rejected =
+      metrics_value(metrics, "gossip.rejected", MetricType_COUNTER);
+  m->gossip_digests =
+      metrics_value(metrics, "gossip.digests", MetricType_COUNTER);
+  m->gossip_deltas =
+      metrics_value(metrics, "gossip.deltas", MetricType_COUNTER);
+  m->channels = metrics_value(metrics, "channels", MetricType_GAUGE);
+  m->channel_bytes_sent =
+      metrics_value(metrics, "channel.bytes_sent", MetricType_COUNTER);
+  m->channel_bytes_received =
+      metrics_value(metrics, "channel.bytes_received", MetricType_COUNTER);
+  m->channel_messages_sent =
+      metrics_value(metrics, "channel.messages_sent", MetricType_COUNTER);
+  m->channel_messages_received = metrics_value(
+      metrics, "channel.messages_received", MetricType_COUNTER);
+  m->send_ns = metrics_histogram(metrics, "ctrl.send_ns");
+}
+
+void ctx_init(Context *ctx, PeerConfig *config,
+              EventCallback transport_on_timeout,
               EventCallback transport_on_read) {
+  ConnEndpoint bound, host[CANDIDATES_MAX - 1];
+  u32 host_count, i;
+  u64 mark;
 
   memset(ctx, 0, sizeof(*ctx));
+  ctx->config = *config;
+  peer_metrics_init(ctx);
 
   /* Tomi: arenas setup */
-  arena_init(&ctx->arena, (u8 *)malloc(DEFAULT_ARENAS_SIZE),
-             DEFAULT_ARENAS_SIZE);
-  arena_init(&ctx->event_arena, (u8 *)malloc(DEFAULT_ARENAS_SIZE),
-             DEFAULT_ARENAS_SIZE);
+  arena_init(&ctx->arena, (u8 *)malloc(config->arena_size),
+             config->arena_size);
+  arena_init(&ctx->event_arena, (u8 *)malloc(config->event_arena_size),
+             config->event_arena_size);
 
   /* Tomi: allocators setup */
   message_allocator_init(&ctx->message_allocator, &ctx->arena);
   addr_message_allocator_init(&ctx->addr_message_allocator, &ctx->arena);
+  stream_buffer_pool_init(&ctx->stream_buffers, &ctx->arena,
+                          PEER_STREAM_BUFFERS);
 
   /* Tomi: ctrl setup */
-  ctx->ctrl_addr = conn_address(&ctx->arena, SERVER_ADDRESS, SERVER_CTRL_PORT);
-  assert(ctrl_init(&ctx->ctrl, ctx->ctrl_addr));
+  ctx->ctrl_addr = conn_address(&ctx->arena, config->server_address,
+                                config->server_ctrl_port);
+  ctx->ctrl_jitter_seed = (u32)conn_current_time_us() | 1;
+  ctrl_connect(ctx, conn_current_time_us());
   /* Tomi: transport setup */
   ctx->transport_addr =
-      conn_address(&ctx->arena, SERVER_ADDRESS, SERVER_STUN_PORT);
+      conn_address(&ctx->arena, config->server_address,
+                   config->server_stun_port);
   assert(transport_init(&ctx->transport));
 
-  u64 mark = ctx->arena.used;
-  ConnAddr *default_addr = conn_get_default_network_addapter_addr(&ctx->arena);
-  assert(default_addr);
-  assert(conn_bind(ctx->transport.conn, default_addr) != CONN_ERROR);
+  /* NOTE: bound to the wildcard so the socket is dual stack, every usable
+   * interface address with the bound port is a host candidate. The server
+   * reflexive candidate is added once the stun response arrives */
+  mark = ctx->arena.used;
+  assert(conn_bind(ctx->transport.conn, conn_address_any(&ctx->arena, 0)) !=
+         CONN_ERROR);
   ctx->arena.used = mark;
 
-  ctx->local_addr = conn_get_addr(&ctx->arena, ctx->transport.conn);
-  conn_address_get_address_and_port(ctx->local_addr, &ctx->own_local_addr,
-                                    &ctx->own_local_port);
+  conn_get_local_endpoint(ctx->transport.conn, &bound);
+  host_count = conn_get_host_endpoints(host, CANDIDATES_MAX - 1);
+  for (i = 0; i < host_count; ++i) {
+    Candidate *candidate = &ctx->own_candidates[ctx->own_candidates_count++];
+    candidate->type = CandidateType_HOST;
+    candidate->endpoint = host[i];
+    candidate->endpoint.port = bound.port;
+    mark = ctx->arena.used;
+    conn_address_print(
+        conn_address_endpoint(&ctx->arena, &candidate->endpoint));
+    ctx->arena.used = mark;
+  }
 
-  conn_address_print(ctx->local_addr);
+  punch_init(&ctx->punch, &ctx->arena, &ctx->transport, config->max_peers);
+  gossip_init(&ctx->gossip, &ctx->arena, &ctx->transport, config->max_peers,
+              ctx->ctrl_jitter_seed);
 
   /* Tomi: select sets setup */
   ctx->read = conn_set_create(&ctx->arena);
@@ -154,9 +460,18 @@ void event_loop_prepare(Context *ctx) {
   conn_set_clear(ctx->read);
   conn_set_clear(ctx->write);
 
-  conn_set_add(ctx->read, ctx->ctrl.conn);
-  if (!dllist_empty(ctx->messages_first, ctx->messages_last)) {
+  switch (ctx->ctrl_state) {
+  case CtrlState_CONNECTING: {
     conn_set_add(ctx->write, ctx->ctrl.conn);
+  } break;
+  case CtrlState_CONNECTED: {
+    conn_set_add(ctx->read, ctx->ctrl.conn);
+    if (!dllist_empty(ctx->messages_first, ctx->messages_last)) {
+      conn_set_add(ctx->write, ctx->ctrl.conn);
+    }
+  } break;
+  case CtrlState_DISCONNECTED: {
+  } break;
   }
 
   conn_set_add(ctx->read, ctx->transport.conn);
@@ -167,35 +482,195 @@ void event_loop_prepare(Context *ctx) {
 
 void message_callback(Stream *stream, Message *msg, void *param);
 
+u32 event_loop_timeout(Context *ctx, u64 now) {
+  Peer *peer;
+  u64 timeout, elapsed;
+  timeout = (u64)ctx->timeout * 1000;
+  elapsed = now - ctx->timeout_start;
+  timeout = elapsed < timeout ? timeout - elapsed : 0;
+  timeout = min(timeout, punch_next_timeout(&ctx->punch, now));
+  if (ctx->config.gossip_ms) {
+    timeout = min(timeout,
+                  ctx->gossip_next > now ? ctx->gossip_next - now : 0);
+  }
+  if (ctx->config.sequenced_hz && ctx->peers_first) {
+    timeout = min(timeout, ctx->sequenced_next > now
+                               ? ctx->sequenced_next - now
+                               : 0);
+  }
+  if (ctx->ctrl_state != CtrlState_CONNECTED) {
+    timeout = min(timeout,
+                  ctx->ctrl_deadline > now ? ctx->ctrl_deadline - now : 0);
+  }
+  for (peer = ctx->peers_first; peer != 0; peer = peer->next) {
+    if (peer->channel) {
+      timeout = min(timeout, reliable_next_timeout(peer->channel, now));
+    }
+    if (peer->sequenced) {
+      timeout = min(timeout, sequenced_next_timeout(peer->sequenced, now));
+    }
+  }
+  /* NOTE: round up, select only takes milliseconds */
+  return (u32)((timeout + 999) / 1000);
+}
+
+/* NOTE: a channel takes its segment buffers from the arena, so they are
+ * opened on demand and at most channels-max of them */
+ReliableChannel *peer_reliable(Context *ctx, Peer *peer) {
+  if (!peer->channel && ctx->channels_count < ctx->config.channels_max) {
+    peer->channel = arena_push(&ctx->arena, sizeof(*peer->channel), 8);
+    reliable_init(peer->channel, &ctx->arena, &ctx->transport, peer->addr);
+    ctx->channels_count++;
+  }
+  return peer->channel;
+}
+
+SequencedChannel *peer_sequenced(Context *ctx, Peer *peer) {
+  if (!peer->sequenced && ctx->channels_count < ctx->config.channels_max) {
+    peer->sequenced = arena_push(&ctx->arena, sizeof(*peer->sequenced), 8);
+    sequenced_init(peer->sequenced, &ctx->arena, &ctx->transport, peer->addr,
+                   CHANNEL_SEQUENCED_FLUSH_US);
+    ctx->channels_count++;
+  }
+  return peer->sequenced;
+}
+
+/* NOTE: what tenet-peer does with its channels, send-bytes and sequenced-hz
+ * to every peer and everything received is read and counted */
+void peer_channels_io(Context *ctx, u64 now) {
+  SequencedMessage *messages;
+  Peer *peer;
+  b32 sequenced_round;
+  u8 *buffer;
+  buffer = arena_push(&ctx->event_arena, CHANNEL_IO_SIZE, 8);
+  memset(buffer, 0, CHANNEL_IO_SIZE);
+  messages = arena_push(&ctx->event_arena,
+                        sizeof(*messages) * SEQUENCED_MAX_RECV, 8);
+  sequenced_round = ctx->config.sequenced_hz && now >= ctx->sequenced_next;
+  if (sequenced_round) {
+    ctx->sequenced_next = now + 1000000 / ctx->config.sequenced_hz;
+  }
+  for (peer = ctx->peers_first; peer != 0; peer = peer->next) {
+    u32 size;
+    if (sequenced_round && peer_sequenced(ctx, peer)) {
+      if (sequenced_send(peer->sequenced, 0, buffer,
+                         CHANNEL_SEQUENCED_MESSAGE_SIZE)) {
+        metrics_add(ctx->m.channel_messages_sent, 1);
+      }
+    }
+    if (peer->sequenced) {
+      metrics_add(ctx->m.channel_messages_received,
+                  sequenced_recv_batch(peer->sequenced, messages,
+                                       SEQUENCED_MAX_RECV));
+    }
+    if (!peer->channel) {
+      continue;
+    }
+    if (peer->send_left) {
+      size = reliable_send(peer->channel, buffer,
+                           (u32)min(peer->send_left, (u64)CHANNEL_IO_SIZE));
+      peer->send_left -= size;
+      metrics_add(ctx->m.channel_bytes_sent, size);
+    }
+    while ((size = reliable_recv(peer->channel, buffer, CHANNEL_IO_SIZE))) {
+      metrics_add(ctx->m.channel_bytes_received, size);
+    }
+  }
+}
+
+/* NOTE: a gossip round with the peers punched so far */
+void peer_gossip(Context *ctx, u64 now) {
+  ConnAddr **targets;
+  Peer *peer;
+  u32 count;
+  ctx->gossip_next = now + (u64)ctx->config.gossip_ms * 1000;
+  targets = arena_push(&ctx->event_arena,
+                       sizeof(*targets) * max(ctx->peers_count, 1), 8);
+  count = 0;
+  for (peer = ctx->peers_first; peer != 0; peer = peer->next) {
+    targets[count++] = peer->addr;
+  }
+  gossip_update(&ctx->gossip, &ctx->event_arena, targets, count);
+}
+
 void event_loop_process(Context *ctx) {
+  Peer *peer;
   u32 res;
+  u64 now;
 
-  res = conn_select(ctx->read, ctx->write, ctx->timeout);
+  res = conn_select(ctx->read, ctx->write,
+                    event_loop_timeout(ctx, conn_current_time_us()));
   assert(res != CONN_ERROR);
 
-  if (res == 0) {
+  now = conn_current_time_us();
+  if (now - ctx->timeout_start >= (u64)ctx->timeout * 1000) {
+    ctx->timeout_start = now;
     if (ctx->transport_on_timeout) {
       ctx->transport_on_timeout(ctx, 0, 0);
     }
   }
-  if (conn_set_has(ctx->read, ctx->ctrl.conn)) {
-    stream_proccess_messages(&ctx->event_arena, &ctx->ctrl, message_callback,
-                             0);
-  }
-  if (conn_set_has(ctx->write, ctx->ctrl.conn)) {
-    MessageHeader *msg;
-    assert(ctx->messages_first);
-    msg = ctx->messages_first;
-    dllist_remove(ctx->messages_first, ctx->messages_last, msg);
-    stream_message_write(&ctx->event_arena, &ctx->ctrl, (Message *)msg);
+  switch (ctx->ctrl_state) {
+  case CtrlState_CONNECTING: {
+    if (conn_set_has(ctx->write, ctx->ctrl.conn)) {
+      if (conn_connect_finish(ctx->ctrl.conn) == CONN_OK) {
+        ctrl_on_connected(ctx);
+      } else {
+        conn_close(ctx->ctrl.conn);
+        ctrl_schedule_reconnect(ctx, now);
+      }
+    } else if (now >= ctx->ctrl_deadline) {
+      conn_close(ctx->ctrl.conn);
+      ctrl_schedule_reconnect(ctx, now);
+    }
+  } break;
+  case CtrlState_CONNECTED: {
+    if (conn_set_has(ctx->read, ctx->ctrl.conn)) {
+      res = stream_proccess_messages(&ctx->event_arena, &ctx->ctrl,
+                                     message_callback, ctx);
+      if (res == CONN_ERROR) {
+        ctrl_disconnect(ctx, now);
+        break;
+      }
+    }
+    if (conn_set_has(ctx->write, ctx->ctrl.conn)) {
+      MessageHeader *msg;
+      u64 start;
+      assert(ctx->messages_first);
+      msg = ctx->messages_first;
+      dllist_remove(ctx->messages_first, ctx->messages_last, msg);
+      start = conn_current_time_ns();
+      res = stream_message_write(&ctx->event_arena, &ctx->ctrl, (Message *)msg);
+      metrics_record(ctx->m.send_ns, conn_current_time_ns() - start);
+      metrics_add(ctx->m.ctrl_messages_sent, 1);
+      message_free(&ctx->message_allocator, (Message *)msg);
+      if (res == CONN_ERROR) {
+        ctrl_disconnect(ctx, now);
+      }
+    }
+  } break;
+  case CtrlState_DISCONNECTED: {
+    if (now >= ctx->ctrl_deadline) {
+      ctrl_connect(ctx, now);
+    }
+  } break;
   }
   if (conn_set_has(ctx->read, ctx->transport.conn)) {
-    Message *msg;
+    DgramBatch batch;
     ConnAddr *from;
+    u8 *buffer;
     from = conn_address_create(&ctx->event_arena);
-    msg = dgram_message_read_from(&ctx->event_arena, &ctx->transport, from);
-    if (ctx->transport_on_read) {
-      ctx->transport_on_read(ctx, msg, from);
+    buffer = arena_push(&ctx->event_arena, DGRAM_BATCH_SIZE, 8);
+    dgram_batch_init(&batch, buffer, DGRAM_BATCH_SIZE);
+    if (dgram_batch_read_from(&ctx->transport, &batch, from) != CONN_ERROR) {
+      u32 i, count;
+      count = dgram_batch_count(&batch);
+      for (i = 0; i < count; ++i) {
+        Message *msg;
+        msg = dgram_batch_message(&ctx->event_arena, &batch, i);
+        if (msg && ctx->transport_on_read) {
+          ctx->transport_on_read(ctx, msg, from);
+        }
+      }
     }
   }
   if (conn_set_has(ctx->write, ctx->transport.conn)) {
@@ -207,9 +682,43 @@ void event_loop_process(Context *ctx) {
                            addr_msg->addr);
     addr_message_free(&ctx->addr_message_allocator, addr_msg);
   }
+
+  now = conn_current_time_us();
+  peer_channels_io(ctx, now);
+  punch_update(&ctx->punch, &ctx->event_arena, now);
+  if (ctx->config.gossip_ms && now >= ctx->gossip_next) {
+    peer_gossip(ctx, now);
+  }
+  for (peer = ctx->peers_first; peer != 0; peer = peer->next) {
+    if (peer->channel) {
+      reliable_update(peer->channel, now);
+    }
+    if (peer->sequenced) {
+      sequenced_update(peer->sequenced, now);
+    }
+  }
 }
 
-void event_loop_cleanup(Context *ctx) { ctx->event_arena.used = 0; }
+void peer_metrics_update(Context *ctx) {
+  PeerMetrics *m;
+  m = &ctx->m;
+  metrics_set(m->punch_probes, ctx->punch.stats.probes_sent);
+  metrics_set(m->punch_connected, ctx->punch.stats.connected);
+  metrics_set(m->punch_failed, ctx->punch.stats.failed);
+  metrics_set(m->punch_recycled, ctx->punch.stats.recycled);
+  metrics_set(m->peers, ctx->peers_count);
+  metrics_set(m->gossip_members, ctx->gossip.members_count);
+  metrics_set(m->gossip_learned, ctx->gossip.stats.learned);
+  metrics_set(m->gossip_rejected, ctx->gossip.stats.rejected);
+  metrics_set(m->gossip_digests, ctx->gossip.stats.digests_sent);
+  metrics_set(m->gossip_deltas, ctx->gossip.stats.deltas_sent);
+  metrics_set(m->channels, ctx->channels_count);
+}
+
+void event_loop_cleanup(Context *ctx) {
+  peer_metrics_update(ctx);
+  ctx->event_arena.used = 0;
+}
 
 Message *push_ctrl_message(Context *ctx) {
   MessageHeader *msg = (MessageHeader *)message_alloc(&ctx->message_allocator);
@@ -225,12 +734,26 @@ AddrMessage *push_transport_message(Context *ctx) {
 }
 
 void push_connect_message(Context *ctx) {
-  Message *msg = push_ctrl_message(ctx);
+  Message *msg;
+  Candidate *reflexive;
+  PeerConnected own;
+  msg = push_ctrl_message(ctx);
   msg->header.type = MessageType_CONNECT;
-  msg->connect.addr = ctx->own_addr;
-  msg->connect.port = ctx->own_port;
-  msg->connect.local_addr = ctx->own_local_addr;
-  msg->connect.local_port = ctx->own_local_port;
+  msg->connect.room = ctx->config.room;
+  msg->connect.endpoint = ctx->own_endpoint;
+  memcpy(msg->connect.candidates, ctx->own_candidates,
+         sizeof(Candidate) * ctx->own_candidates_count);
+  msg->connect.candidates_count = ctx->own_candidates_count;
+  reflexive = &msg->connect.candidates[msg->connect.candidates_count++];
+  reflexive->type = CandidateType_SERVER_REFLEXIVE;
+  reflexive->endpoint = ctx->own_endpoint;
+
+  /* NOTE: the peer is a member of its own set, as it is in the others */
+  own.endpoint = msg->connect.endpoint;
+  own.candidates_count = msg->connect.candidates_count;
+  memcpy(own.candidates, msg->connect.candidates,
+         sizeof(Candidate) * own.candidates_count);
+  gossip_add(&ctx->gossip, &own);
 }
 
 void transport_on_timeout(Context *ctx, Message *msg, ConnAddr *addr) {
@@ -238,26 +761,101 @@ void transport_on_timeout(Context *ctx, Message *msg, ConnAddr *addr) {
   case State_DONT_KNOW_IT_SELF: {
     AddrMessage *addr_msg = push_transport_message(ctx);
     addr_msg->msg.header.type = MessageType_STUN;
+    metrics_add(ctx->m.stun_requests, 1);
     ctx->timeout = 200;
   } break;
+  case State_CONNECTED:
   case State_KNOW_IT_SELF: {
     AddrMessage *addr_msg = push_transport_message(ctx);
     addr_msg->msg.header.type = MessageType_KEEP_ALIVE;
+    metrics_add(ctx->m.keepalives, 1);
   } break;
-  case State_CONNECTED: {
-  } break;
   }
 }
 
+/* NOTE: every peer comes from a connected punch target, its datagrams
+ * arrive from the endpoint the target connected on */
+Peer *peer_find(Context *ctx, ConnAddr *addr) {
+  PunchTarget *target;
+  ConnEndpoint endpoint;
+  conn_address_get_endpoint(addr, &endpoint);
+  target = punch_find_connected(&ctx->punch, &endpoint);
+  return target ? (Peer *)target->peer : 0;
+}
+
+Peer *peer_open(Context *ctx, ConnEndpoint *endpoint) {
+  Peer *peer;
+  peer = arena_push(&ctx->arena, sizeof(*peer), 8);
+  memset(peer, 0, sizeof(*peer));
+  /* NOTE: channels are opened on demand, a reliable channel is big */
+  peer->addr = conn_address_endpoint(&ctx->arena, endpoint);
+  peer->endpoint = *endpoint;
+  dllist_push_back(ctx->peers_first, ctx->peers_last, peer);
+  ctx->peers_count++;
+  peer->send_left = ctx->config.send_bytes;
+  if (peer->send_left) {
+    peer_reliable(ctx, peer);
+  }
+  return peer;
+}
+
 void transport_on_read(Context *ctx, Message *msg, ConnAddr *addr) {
+  if (msg->header.type == MessageType_PUNCH ||
+      msg->header.type == MessageType_PUNCH_ACK) {
+    PunchTarget *target;
+    target = punch_process(&ctx->punch, &ctx->event_arena, msg, addr,
+                           conn_current_time_us());
+    if (target && !peer_find(ctx, addr)) {
+      target->peer = peer_open(ctx, &target->connected_endpoint);
+    }
+    return;
+  }
+  if (msg->header.type == MessageType_RELIABLE_DATA ||
+      msg->header.type == MessageType_RELIABLE_ACK) {
+    Peer *peer;
+    /* NOTE: the side that did not send first opens its channel here */
+    peer = peer_find(ctx, addr);
+    if (peer && peer_reliable(ctx, peer)) {
+      reliable_process(peer->channel, msg, conn_current_time_us());
+    }
+    return;
+  }
+  if (msg->header.type == MessageType_GOSSIP_DELTA ||
+      msg->header.type == MessageType_GOSSIP_DIGEST) {
+    PeerConnected *entry;
+    u64 now;
+    /* NOTE: only punched peers are listened to */
+    if (!ctx->config.gossip_ms || !peer_find(ctx, addr)) {
+      return;
+    }
+    now = conn_current_time_us();
+    for (entry = gossip_process(&ctx->gossip, &ctx->event_arena, msg, addr);
+         entry != 0; entry = entry->next) {
+      if (!endpoint_equals(&entry->endpoint, &ctx->own_endpoint)) {
+        punch_add(&ctx->punch, entry, now);
+      }
+    }
+    return;
+  }
+  if (msg->header.type == MessageType_SEQUENCED) {
+    Peer *peer;
+    peer = peer_find(ctx, addr);
+    if (peer && peer_sequenced(ctx, peer)) {
+      sequenced_process(peer->sequenced, msg);
+    }
+    return;
+  }
+
   switch (ctx->state) {
   case State_DONT_KNOW_IT_SELF: {
     if (conn_address_equals(ctx->transport_addr, addr)) {
       if (msg->header.type == MessageType_STUN_RESPONSE) {
-        ctx->own_addr = msg->stun_response.addr;
-        ctx->own_port = msg->stun_response.port;
+        ctx->own_endpoint = msg->stun_response.endpoint;
+        punch_set_identity(&ctx->punch, &ctx->own_endpoint);
         ctx->state = State_KNOW_IT_SELF;
-        push_connect_message(ctx);
+        if (ctx->ctrl_state == CtrlState_CONNECTED) {
+          push_connect_message(ctx);
+        }
         ctx->timeout = 5000;
       }
     }
@@ -286,18 +884,48 @@ void transport_on_write(Context *ctx) {
 }
 
 void message_callback(Stream *stream, Message *msg, void *param) {
+  Context *ctx;
+  ctx = (Context *)param;
   switch (msg->header.type) {
+  case MessageType_PEERS_TO_CONNECT: {
+    PeerConnected *other;
+    u64 now;
+    u32 i;
+    now = conn_current_time_us();
+    /* NOTE: the first list of a session, a server with join-peers-max set
+     * has more in pages */
+    if (ctx->state != State_CONNECTED) {
+      for (i = 0; i < ctx->config.pages; ++i) {
+        push_ctrl_message(ctx)->header.type = MessageType_PEERS_MORE;
+      }
+    }
+    for (other = msg->peers_to_connect.first; other != 0;
+         other = other->next) {
+      punch_add(&ctx->punch, other, now);
+      gossip_add(&ctx->gossip, other);
+      metrics_add(ctx->m.peers_received, 1);
+    }
+    ctx->state = State_CONNECTED;
+  } break;
   default: {
   } break;
   }
 }
 
-int main(void) {
+int main(int argc, char **argv) {
   static Context _context;
   Context *ctx = &_context;
+  PeerConfig config;
+  u32 res;
+
+  peer_config_default(&config);
+  res = peer_config_parse(&config, argc, argv);
+  if (res != CONFIG_OK) {
+    return res == CONFIG_EXIT ? 0 : 1;
+  }
 
   conn_init();
-  ctx_init(ctx, transport_on_timeout, transport_on_read);
+  ctx_init(ctx, &config, transport_on_timeout, transport_on_read);
 
   for (;;) {
     if (!ctx->running) {
@@ -1,49 +1,270 @@
 #include "proto.h"
 
+void endpoint_ipv4(ConnEndpoint *endpoint, u32 addr, u16 port) {
+  u8 *cursor;
+  memset(endpoint, 0, sizeof(*endpoint));
+  endpoint->family = CONN_FAMILY_IPV4;
+  endpoint->port = port;
+  cursor = endpoint->addr;
+  write_u32_be(cursor, addr);
+}
+
+u32 endpoint_ipv4_addr(ConnEndpoint *endpoint) {
+  assert(endpoint->family == CONN_FAMILY_IPV4);
+  return peek_u32_be(endpoint->addr);
+}
+
+static u32 endpoint_addr_size(u8 family) {
+  return family == CONN_FAMILY_IPV6 ? 16 : 4;
+}
+
+b32 endpoint_same_host(ConnEndpoint *a, ConnEndpoint *b) {
+  return a->family == b->family &&
+         memcmp(a->addr, b->addr, endpoint_addr_size(a->family)) == 0;
+}
+
+b32 endpoint_same_prefix(ConnEndpoint *a, ConnEndpoint *b) {
+  return a->family == b->family &&
+         memcmp(a->addr, b->addr, a->family == CONN_FAMILY_IPV6 ? 6 : 3) == 0;
+}
+
+b32 endpoint_equals(ConnEndpoint *a, ConnEndpoint *b) {
+  return a->port == b->port && endpoint_same_host(a, b);
+}
+
+/* NOTE: the address bytes are read in network order so the digests gossip
+ * compares are the same on every host */
+u32 endpoint_hash(ConnEndpoint *endpoint) {
+  u64 hi, lo, hash;
+  u32 i, size;
+  hi = 0;
+  lo = 0;
+  size = endpoint->family == CONN_FAMILY_IPV6 ? 16 : 4;
+  for (i = 0; i < size; ++i) {
+    if (i < 8) {
+      hi = (hi << 8) | endpoint->addr[i];
+    } else {
+      lo = (lo << 8) | endpoint->addr[i];
+    }
+  }
+  hash = (hi ^ (lo * 0xff51afd7ed558ccdull)) + ((u64)endpoint->port << 32) +
+         endpoint->family;
+  return (u32)((hash * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+u32 endpoint_wire_size(ConnEndpoint *endpoint) {
+  return endpoint->family == CONN_FAMILY_IPV6 ? ENDPOINT_IPV6_WIRE_SIZE
+                                              : ENDPOINT_IPV4_WIRE_SIZE;
+}
+
+#define write_endpoint_or_count(buffer, endpoint, size)                        \
+  do {                                                                         \
+    u8 family_ = (endpoint)->family == CONN_FAMILY_IPV6 ? CONN_FAMILY_IPV6     \
+                                                        : CONN_FAMILY_IPV4;    \
+    write_u8_be_or_count(buffer, family_, size);                               \
+    write_bytes_or_count(buffer, (endpoint)->addr,                             \
+                         endpoint_addr_size(family_), size);                   \
+    write_u16_be_or_count(buffer, (endpoint)->port, size);                     \
+  } while (0)
+
+/* NOTE: returns the position after the endpoint or 0 when it does not fit or
+ * the family is unknown */
+static u8 *read_endpoint(u8 *buffer, u8 *end, ConnEndpoint *endpoint) {
+  u32 addr_size;
+  memset(endpoint, 0, sizeof(*endpoint));
+  if (buffer == 0 || buffer + 1 > end) {
+    return 0;
+  }
+  endpoint->family = read_u8_be(buffer);
+  if (endpoint->family != CONN_FAMILY_IPV4 &&
+      endpoint->family != CONN_FAMILY_IPV6) {
+    return 0;
+  }
+  addr_size = endpoint_addr_size(endpoint->family);
+  if (buffer + addr_size + 2 > end) {
+    return 0;
+  }
+  memcpy(endpoint->addr, buffer, addr_size);
+  buffer += addr_size;
+  endpoint->port = read_u16_be(buffer);
+  return buffer;
+}
+
+#define write_candidates_or_count(buffer, candidates, count, size)             \
+  do {                                                                         \
+    u32 i_;                                                                    \
+    write_u8_be_or_count(buffer, (count), size);                               \
+    for (i_ = 0; i_ < (count); ++i_) {                                         \
+      write_u8_be_or_count(buffer, (candidates)[i_].type, size);               \
+      write_endpoint_or_count(buffer, &(candidates)[i_].endpoint, size);       \
+    }                                                                          \
+  } while (0)
+
+static u8 *read_candidates(u8 *buffer, u8 *end, Candidate *candidates,
+                           u32 *count) {
+  u32 i;
+  if (buffer == 0 || buffer + 1 > end) {
+    return 0;
+  }
+  *count = read_u8_be(buffer);
+  if (*count > CANDIDATES_MAX) {
+    return 0;
+  }
+  for (i = 0; i < *count; ++i) {
+    if (buffer + 1 > end) {
+      return 0;
+    }
+    candidates[i].type = read_u8_be(buffer);
+    if (candidates[i].type >= CandidateType_COUNT) {
+      return 0;
+    }
+    buffer = read_endpoint(buffer, end, &candidates[i].endpoint);
+    if (!buffer) {
+      return 0;
+    }
+  }
+  return buffer;
+}
+
+static u8 *read_peer_connected(u8 *buffer, u8 *end, PeerConnected *peer) {
+  buffer = read_endpoint(buffer, end, &peer->endpoint);
+  return read_candidates(buffer, end, peer->candidates,
+                         &peer->candidates_count);
+}
+
+/* NOTE: writes one PEERS_TO_CONNECT entry, or only counts it when buffer is
+ * 0 */
+static u32 write_peer_connected(u8 *buffer, PeerConnected *peer) {
+  u32 size;
+  size = 0;
+  write_endpoint_or_count(buffer, &peer->endpoint, size);
+  write_candidates_or_count(buffer, peer->candidates, peer->candidates_count,
+                            size);
+  return size;
+}
+
+u32 peer_connected_wire_size(PeerConnected *peer) {
+  return write_peer_connected(0, peer);
+}
+
 Message *message_deserialize(Arena *arena, u8 *buffer, u64 size) {
   Message *msg;
   u32 proto, message_size;
+  u8 *end, type;
+  /* NOTE: everything here comes from the network, a bad message is dropped
+   * and never asserted on */
+  if (size < MESSAGE_HEADER_SIZE) {
+    return 0;
+  }
+  end = buffer + size;
   proto = read_u32_be(buffer);
   if (proto != PROTO_MAGIC) {
     return 0;
   }
   message_size = read_u32_be(buffer);
-  assert(message_size == size);
+  if (message_size != size) {
+    return 0;
+  }
+  type = read_u8_be(buffer);
+  if (type == MessageType_INVALID || type >= MessageType_COUNT) {
+    return 0;
+  }
   msg = arena_push(arena, sizeof(*msg), 8);
-  msg->header.type = (MessageType)read_u8_be(buffer);
+  msg->header.type = (MessageType)type;
   switch (msg->header.type) {
-  case MessageType_PEERS_TO_CONNECT: {
+  case MessageType_PEERS_TO_CONNECT:
+  case MessageType_GOSSIP_DELTA: {
     u32 i;
     msg->peers_to_connect.first = 0;
     msg->peers_to_connect.last = 0;
+    if (buffer + 4 > end) {
+      return 0;
+    }
     msg->peers_to_connect.count = read_u32_be(buffer);
     for (i = 0; i < msg->peers_to_connect.count; ++i) {
       PeerConnected *peer = arena_push(arena, sizeof(*peer), 8);
-      peer->addr = read_u32_be(buffer);
-      peer->port = read_u16_be(buffer);
-      peer->local_addr = read_u32_be(buffer);
-      peer->local_port = read_u16_be(buffer);
+      buffer = read_peer_connected(buffer, end, peer);
+      if (!buffer) {
+        return 0;
+      }
       dllist_push_back(msg->peers_to_connect.first, msg->peers_to_connect.last,
                        peer);
     }
   } break;
   case MessageType_CONNECT: {
-    msg->connect.addr = read_u32_be(buffer);
-    msg->connect.port = read_u16_be(buffer);
-    msg->connect.local_addr = read_u32_be(buffer);
-    msg->connect.local_port = read_u16_be(buffer);
+    if (buffer + 4 > end) {
+      return 0;
+    }
+    msg->connect.room = read_u32_be(buffer);
+    buffer = read_endpoint(buffer, end, &msg->connect.endpoint);
+    buffer = read_candidates(buffer, end, msg->connect.candidates,
+                             &msg->connect.candidates_count);
+    if (!buffer) {
+      return 0;
+    }
   } break;
   case MessageType_STUN_RESPONSE: {
-    msg->stun_response.addr = read_u32_be(buffer);
-    msg->stun_response.port = read_u16_be(buffer);
+    if (!read_endpoint(buffer, end, &msg->stun_response.endpoint)) {
+      return 0;
+    }
+  } break;
+  case MessageType_RELIABLE_DATA: {
+    if (buffer + 10 > end) {
+      return 0;
+    }
+    msg->reliable_data.seq = read_u32_be(buffer);
+    msg->reliable_data.timestamp = read_u32_be(buffer);
+    msg->reliable_data.size = read_u16_be(buffer);
+    if (buffer + msg->reliable_data.size > end) {
+      return 0;
+    }
+    msg->reliable_data.data = buffer;
+  } break;
+  case MessageType_RELIABLE_ACK: {
+    u32 sack_hi, sack_lo;
+    if (buffer + 20 > end) {
+      return 0;
+    }
+    msg->reliable_ack.ack = read_u32_be(buffer);
+    sack_hi = read_u32_be(buffer);
+    sack_lo = read_u32_be(buffer);
+    msg->reliable_ack.sack = ((u64)sack_hi << 32) | (u64)sack_lo;
+    msg->reliable_ack.window_end = read_u32_be(buffer);
+    msg->reliable_ack.timestamp_echo = read_u32_be(buffer);
+  } break;
+  case MessageType_SEQUENCED: {
+    if (buffer + 2 > end) {
+      return 0;
+    }
+    msg->sequenced.count = read_u16_be(buffer);
+    msg->sequenced.size = (u32)(end - buffer);
+    msg->sequenced.entries = buffer;
+  } break;
+  case MessageType_PUNCH:
+  case MessageType_PUNCH_ACK: {
+    if (!read_endpoint(buffer, end, &msg->punch.endpoint)) {
+      return 0;
+    }
+  } break;
+  case MessageType_GOSSIP_DIGEST: {
+    u32 i;
+    if (buffer + 5 + 4 * GOSSIP_DIGEST_BUCKETS > end) {
+      return 0;
+    }
+    msg->gossip_digest.reply = read_u8_be(buffer);
+    msg->gossip_digest.count = read_u32_be(buffer);
+    for (i = 0; i < GOSSIP_DIGEST_BUCKETS; ++i) {
+      msg->gossip_digest.buckets[i] = read_u32_be(buffer);
+    }
   } break;
   case MessageType_KEEP_ALIVE:
+  case MessageType_PEERS_MORE:
   case MessageType_STUN: {
     /* Tomi: empty body*/
   } break;
   case MessageType_INVALID:
   case MessageType_COUNT: {
-    assert(!"invalid code path");
+    return 0;
   }
   }
   return msg;
@@ -65,27 +286,64 @@ void message_serialize_internal(Message *msg, u8 *buffer, u64 *size) {
   write_u32_be_or_count(buffer, (u32)(*size), total_size);
   write_u8_be_or_count(buffer, (u8)msg->header.type, total_size);
   switch (msg->header.type) {
-  case MessageType_PEERS_TO_CONNECT: {
+  case MessageType_PEERS_TO_CONNECT:
+  case MessageType_GOSSIP_DELTA: {
     PeerConnected *peer;
     write_u32_be_or_count(buffer, msg->peers_to_connect.count, total_size);
     for (peer = msg->peers_to_connect.first; peer != 0; peer = peer->next) {
-      write_u32_be_or_count(buffer, peer->addr, total_size);
-      write_u16_be_or_count(buffer, peer->port, total_size);
-      write_u32_be_or_count(buffer, peer->local_addr, total_size);
-      write_u16_be_or_count(buffer, peer->local_port, total_size);
+      u32 entry_size;
+      entry_size = write_peer_connected(buffer, peer);
+      if (buffer) {
+        buffer += entry_size;
+      }
+      total_size += entry_size;
     }
   } break;
   case MessageType_CONNECT: {
-    write_u32_be_or_count(buffer, msg->connect.addr, total_size);
-    write_u16_be_or_count(buffer, msg->connect.port, total_size);
-    write_u32_be_or_count(buffer, msg->connect.local_addr, total_size);
-    write_u16_be_or_count(buffer, msg->connect.local_port, total_size);
+    write_u32_be_or_count(buffer, msg->connect.room, total_size);
+    write_endpoint_or_count(buffer, &msg->connect.endpoint, total_size);
+    write_candidates_or_count(buffer, msg->connect.candidates,
+                              msg->connect.candidates_count, total_size);
   } break;
   case MessageType_STUN_RESPONSE: {
-    write_u32_be_or_count(buffer, msg->stun_response.addr, total_size);
-    write_u16_be_or_count(buffer, msg->stun_response.port, total_size);
+    write_endpoint_or_count(buffer, &msg->stun_response.endpoint, total_size);
+  } break;
+  case MessageType_RELIABLE_DATA: {
+    write_u32_be_or_count(buffer, msg->reliable_data.seq, total_size);
+    write_u32_be_or_count(buffer, msg->reliable_data.timestamp, total_size);
+    write_u16_be_or_count(buffer, msg->reliable_data.size, total_size);
+    write_bytes_or_count(buffer, msg->reliable_data.data,
+                         msg->reliable_data.size, total_size);
+  } break;
+  case MessageType_RELIABLE_ACK: {
+    write_u32_be_or_count(buffer, msg->reliable_ack.ack, total_size);
+    write_u32_be_or_count(buffer, (u32)(msg->reliable_ack.sack >> 32),
+                          total_size);
+    write_u32_be_or_count(buffer, (u32)msg->reliable_ack.sack, total_size);
+    write_u32_be_or_count(buffer, msg->reliable_ack.window_end, total_size);
+    write_u32_be_or_count(buffer, msg->reliable_ack.timestamp_echo,
+                          total_size);
+  } break;
+  case MessageType_SEQUENCED: {
+    write_u16_be_or_count(buffer, msg->sequenced.count, total_size);
+    write_bytes_or_count(buffer, msg->sequenced.entries, msg->sequenced.size,
+                         total_size);
+  } break;
+  case MessageType_PUNCH:
+  case MessageType_PUNCH_ACK: {
+    write_endpoint_or_count(buffer, &msg->punch.endpoint, total_size);
+  } break;
+  case MessageType_GOSSIP_DIGEST: {
+    u32 i;
+    write_u8_be_or_count(buffer, msg->gossip_digest.reply, total_size);
+    write_u32_be_or_count(buffer, msg->gossip_digest.count, total_size);
+    for (i = 0; i < GOSSIP_DIGEST_BUCKETS; ++i) {
+      write_u32_be_or_count(buffer, msg->gossip_digest.buckets[i],
+                            total_size);
+    }
   } break;
   case MessageType_KEEP_ALIVE:
+  case MessageType_PEERS_MORE:
   case MessageType_STUN: {
     /* Tomi: empty body*/
   } break;
@@ -97,21 +355,260 @@ void message_serialize_internal(Message *msg, u8 *buffer, u64 *size) {
   *size = total_size;
 }
 
-u32 stream_message_write(Arena *arena, Stream *stream, Message *msg) {
+void stream_buffer_pool_init(StreamBufferPool *pool, Arena *arena,
+                             u32 buffers_max) {
   u64 size;
-  s32 total_sent;
+  memset(pool, 0, sizeof(*pool));
+  pool->scratch = arena_push(arena, STREAM_BUFFER_SIZE, 8);
+  assert(pool->scratch);
+  size = (u64)buffers_max * STREAM_BUFFER_SIZE;
+  arena_init(&pool->buffers, arena_push(arena, size, 8), size);
+}
+
+/* NOTE: a free buffer keeps the next free one in its first bytes, returns 0
+ * once every buffer of the reservation is in use */
+static u8 *stream_buffer_acquire(StreamBufferPool *pool) {
   u8 *buffer;
-  buffer = message_serialize(arena, msg, &size);
-  assert(buffer);
+  if (pool->first_free) {
+    buffer = pool->first_free;
+    memcpy(&pool->first_free, buffer, sizeof(pool->first_free));
+  } else {
+    buffer = arena_try_push(&pool->buffers, STREAM_BUFFER_SIZE, 8);
+    if (!buffer) {
+      pool->exhausted++;
+      return 0;
+    }
+    pool->allocated++;
+  }
+  pool->in_use++;
+  return buffer;
+}
+
+static void stream_buffer_release(StreamBufferPool *pool, u8 *buffer) {
+  memcpy(buffer, &pool->first_free, sizeof(pool->first_free));
+  pool->first_free = buffer;
+  pool->in_use--;
+}
+
+static void stream_send_clear(Stream *stream) {
+  if (stream->send_buffer) {
+    stream_buffer_release(stream->pool, stream->send_buffer);
+  }
+  stream->send_buffer = 0;
+  stream->send_size = 0;
+  stream->send_offset = 0;
+  stream->sending = false;
+  stream->send_next = 0;
+}
+
+/* NOTE: writes until the conn would block, returns how much went out or
+ * CONN_ERROR */
+static u32 stream_write_some(Stream *stream, u8 *buffer, u32 size) {
+  u32 total_sent;
   total_sent = 0;
-  while (total_sent < (u32)size) {
-    s32 sent =
-        conn_write(stream->conn, buffer + total_sent, (s32)size - total_sent);
+  while (total_sent < size) {
+    u32 sent;
+    sent = conn_write(stream->conn, buffer + total_sent, size - total_sent);
+    if (sent == CONN_WOULD_BLOCK) {
+      break;
+    }
     if (sent == CONN_ERROR) {
       return CONN_ERROR;
     }
     total_sent += sent;
   }
+  return total_sent;
+}
+
+/* NOTE: the rest of a buffer that did not go out is copied to a pool
+ * buffer, the message is in flight until it drains */
+static u32 stream_write_all(Stream *stream, u8 *buffer, u64 size) {
+  u32 sent;
+  sent = stream_write_some(stream, buffer, (u32)size);
+  if (sent == CONN_ERROR) {
+    stream_send_clear(stream);
+    return CONN_ERROR;
+  }
+  if (sent < (u32)size) {
+    assert(stream->pool);
+    stream->send_buffer = stream_buffer_acquire(stream->pool);
+    if (!stream->send_buffer) {
+      stream_send_clear(stream);
+      return CONN_ERROR;
+    }
+    stream->send_size = (u32)size - sent;
+    stream->send_offset = 0;
+    memcpy(stream->send_buffer, buffer + sent, stream->send_size);
+    stream->sending = true;
+    return CONN_WOULD_BLOCK;
+  }
+  if (stream->send_next) {
+    return CONN_WOULD_BLOCK;
+  }
+  stream->sending = false;
+  return CONN_OK;
+}
+
+/* NOTE: one chunk per call keeps a peer with a huge list from holding the
+ * loop, the frame header carries the size of the whole message */
+u32 stream_message_write(Arena *arena, Stream *stream, Message *msg) {
+  u64 size;
+  u8 *buffer, *cursor;
+  if (stream->send_buffer) {
+    u32 sent;
+    sent = stream_write_some(stream, stream->send_buffer + stream->send_offset,
+                             stream->send_size - stream->send_offset);
+    if (sent == CONN_ERROR) {
+      stream_send_clear(stream);
+      return CONN_ERROR;
+    }
+    stream->send_offset += sent;
+    if (stream->send_offset < stream->send_size) {
+      return CONN_WOULD_BLOCK;
+    }
+    stream_buffer_release(stream->pool, stream->send_buffer);
+    stream->send_buffer = 0;
+    stream->send_size = 0;
+    stream->send_offset = 0;
+    if (stream->send_next) {
+      return CONN_WOULD_BLOCK;
+    }
+    stream->sending = false;
+    return CONN_OK;
+  }
+  if (!stream->sending) {
+    message_serialize_internal(msg, 0, &size);
+    if (size <= STREAM_BUFFER_SIZE) {
+      buffer = arena_push(arena, size, 8);
+      assert(buffer);
+      message_serialize_internal(msg, buffer, &size);
+      return stream_write_all(stream, buffer, size);
+    }
+    assert(msg->header.type == MessageType_PEERS_TO_CONNECT);
+    buffer = arena_push(arena, STREAM_BUFFER_SIZE, 8);
+    assert(buffer);
+    cursor = buffer;
+    write_u32_be(cursor, PROTO_MAGIC);
+    write_u32_be(cursor, (u32)size);
+    write_u8_be(cursor, (u8)MessageType_PEERS_TO_CONNECT);
+    write_u32_be(cursor, msg->peers_to_connect.count);
+    stream->sending = true;
+    stream->send_next = msg->peers_to_connect.first;
+  } else {
+    buffer = arena_push(arena, STREAM_BUFFER_SIZE, 8);
+    assert(buffer);
+    cursor = buffer;
+  }
+  while (stream->send_next &&
+         (u64)(cursor - buffer) + write_peer_connected(0, stream->send_next) <=
+             STREAM_BUFFER_SIZE) {
+    cursor += write_peer_connected(cursor, stream->send_next);
+    stream->send_next = stream->send_next->next;
+  }
+  return stream_write_all(stream, buffer, (u64)(cursor - buffer));
+}
+
+void stream_init(Stream *stream, Conn conn, StreamBufferPool *pool) {
+  memset(stream, 0, sizeof(*stream));
+  stream->conn = conn;
+  stream->pool = pool;
+}
+
+void stream_reset(Stream *stream) {
+  if (stream->recv_buffer && stream->recv_buffer != stream->pool->scratch) {
+    stream_buffer_release(stream->pool, stream->recv_buffer);
+  }
+  stream->recv_buffer = 0;
+  stream->recv_buffer_used = 0;
+  stream->bytes_to_farm = 0;
+  stream->farming = false;
+  stream->decoding = false;
+  stream->decode_entries = 0;
+  stream->decode_bytes = 0;
+  stream->skip_bytes = 0;
+  stream_send_clear(stream);
+}
+
+/* NOTE: after a read is processed, what is left of a frame moves out of the
+ * scratch buffer and an empty buffer goes back to the pool. Returns
+ * CONN_ERROR when the pool has no buffer for what is left, it is lost */
+static u32 stream_buffer_settle(Stream *stream) {
+  StreamBufferPool *pool;
+  pool = stream->pool;
+  if (stream->recv_buffer == pool->scratch) {
+    stream->recv_buffer = 0;
+    if (stream->recv_buffer_used) {
+      stream->recv_buffer = stream_buffer_acquire(pool);
+      if (!stream->recv_buffer) {
+        stream->recv_buffer_used = 0;
+        return CONN_ERROR;
+      }
+      memcpy(stream->recv_buffer, pool->scratch, stream->recv_buffer_used);
+    }
+  } else if (!stream->recv_buffer_used) {
+    stream_buffer_release(pool, stream->recv_buffer);
+    stream->recv_buffer = 0;
+  }
+  return CONN_OK;
+}
+
+/* NOTE: magic, size, type and the entry count of a PEERS_TO_CONNECT */
+#define STREAM_PEERS_HEADER_SIZE 13
+
+static void stream_consume(Stream *stream, u32 size) {
+  stream->recv_buffer_used -= size;
+  memmove(stream->recv_buffer, stream->recv_buffer + size,
+          stream->recv_buffer_used);
+}
+
+/* NOTE: decodes the entries of a large PEERS_TO_CONNECT that are in the
+ * buffer, an entry cut by the end of a read waits for the next one */
+static u32 stream_decode_entries(Arena *arena, Stream *stream,
+                                 MessageCallback callback, void *param) {
+  Message *msg;
+  u8 *cursor, *end;
+  u32 consumed;
+  msg = arena_push(arena, sizeof(*msg), 8);
+  assert(msg);
+  memset(msg, 0, sizeof(*msg));
+  msg->header.type = MessageType_PEERS_TO_CONNECT;
+  cursor = stream->recv_buffer;
+  end = cursor + min(stream->recv_buffer_used, (u64)stream->decode_bytes);
+  while (stream->decode_entries) {
+    PeerConnected entry, *peer;
+    u8 *next;
+    next = read_peer_connected(cursor, end, &entry);
+    if (!next) {
+      u32 available, left;
+      available = (u32)(end - cursor);
+      left = stream->decode_bytes - (u32)(cursor - stream->recv_buffer);
+      /* NOTE: the whole entry was there and it is not valid */
+      if (available >= min(left, (u32)PEER_CONNECTED_WIRE_SIZE_MAX)) {
+        return CONN_ERROR;
+      }
+      break;
+    }
+    peer = arena_push(arena, sizeof(*peer), 8);
+    assert(peer);
+    *peer = entry;
+    dllist_push_back(msg->peers_to_connect.first, msg->peers_to_connect.last,
+                     peer);
+    msg->peers_to_connect.count++;
+    stream->decode_entries--;
+    cursor = next;
+  }
+  consumed = (u32)(cursor - stream->recv_buffer);
+  stream->decode_bytes -= consumed;
+  if (callback && msg->peers_to_connect.count) {
+    callback(stream, msg, param);
+  }
+  stream_consume(stream, consumed);
+  if (!stream->decode_entries) {
+    if (stream->decode_bytes) {
+      return CONN_ERROR;
+    }
+    stream->decoding = false;
+  }
   return CONN_OK;
 }
 
@@ -121,46 +618,118 @@ u32 stream_proccess_messages(Arena *arena, Stream *stream,
   u8 *recv_buffer_pos;
   u32 recv_buffer_size;
 
+  assert(stream->pool);
+  if (!stream->recv_buffer) {
+    stream->recv_buffer = stream->pool->scratch;
+  }
   recv_buffer_pos = stream->recv_buffer + stream->recv_buffer_used;
-  recv_buffer_size = array_len(stream->recv_buffer) - stream->recv_buffer_used;
+  recv_buffer_size = STREAM_BUFFER_SIZE - (u32)stream->recv_buffer_used;
   size = conn_read(stream->conn, recv_buffer_pos, recv_buffer_size);
-  if (size == CONN_ERROR) {
+  if (size == CONN_WOULD_BLOCK) {
+    return stream_buffer_settle(stream);
+  }
+  /* NOTE: readable with nothing to read is the other side closing */
+  if (size == CONN_ERROR || (size == 0 && recv_buffer_size != 0)) {
+    stream_buffer_settle(stream);
     return CONN_ERROR;
   }
   stream->recv_buffer_used += size;
 
-  while (stream->recv_buffer_used >= 8) {
-    while (!stream->farming) {
+  for (;;) {
+    Message *msg;
+    if (stream->decoding) {
+      if (stream_decode_entries(arena, stream, callback, param) ==
+          CONN_ERROR) {
+        stream_buffer_settle(stream);
+        return CONN_ERROR;
+      }
+      if (stream->decoding) {
+        break;
+      }
+      continue;
+    }
+    if (stream->skip_bytes) {
+      u32 skipped;
+      skipped = (u32)min((u64)stream->skip_bytes, stream->recv_buffer_used);
+      stream_consume(stream, skipped);
+      stream->skip_bytes -= skipped;
+      if (stream->skip_bytes) {
+        break;
+      }
+      continue;
+    }
+    if (stream->recv_buffer_used < 8) {
+      break;
+    }
+    if (!stream->farming) {
       u32 proto;
       u8 *buffer = stream->recv_buffer;
       proto = read_u32_be(buffer);
-      if (proto == PROTO_MAGIC) {
-        stream->bytes_to_farm = read_u32_be(buffer);
-        stream->farming = true;
-      } else {
-        stream->recv_buffer_used -= 1;
-        memcpy(stream->recv_buffer, stream->recv_buffer + 1,
-               stream->recv_buffer_used);
+      if (proto != PROTO_MAGIC) {
+        stream_consume(stream, 1);
+        continue;
+      }
+      stream->bytes_to_farm = read_u32_be(buffer);
+      stream->farming = true;
+    }
+    /* NOTE: the size counts the header, a smaller one never makes progress */
+    if (stream->bytes_to_farm < MESSAGE_HEADER_SIZE) {
+      stream_buffer_settle(stream);
+      return CONN_ERROR;
+    }
+    if (stream->types) {
+      u8 type;
+      if (stream->recv_buffer_used < MESSAGE_HEADER_SIZE) {
+        break;
+      }
+      type = stream->recv_buffer[8];
+      if (type >= MessageType_COUNT ||
+          !(stream->types & message_type_bit(type))) {
+        stream->skip_bytes = stream->bytes_to_farm;
+        stream->bytes_to_farm = 0;
+        stream->farming = false;
+        continue;
       }
     }
 
-    if (stream->farming && stream->recv_buffer_used >= stream->bytes_to_farm) {
-      Message *msg;
-      u32 extra_bytes;
-      msg = message_deserialize(arena, stream->recv_buffer,
-                                stream->bytes_to_farm);
-      if (callback) {
-        callback(stream, msg, param);
+    /* NOTE: only a peer list can be larger than the buffer, its entries are
+     * decoded as they arrive */
+    if (stream->bytes_to_farm > STREAM_BUFFER_SIZE) {
+      u8 *buffer;
+      u8 type;
+      if (stream->recv_buffer_used < STREAM_PEERS_HEADER_SIZE) {
+        break;
+      }
+      buffer = stream->recv_buffer + 8;
+      type = read_u8_be(buffer);
+      if (type != MessageType_PEERS_TO_CONNECT) {
+        stream_buffer_settle(stream);
+        return CONN_ERROR;
       }
-      extra_bytes = stream->recv_buffer_used - stream->bytes_to_farm;
-      memcpy(stream->recv_buffer, stream->recv_buffer + stream->bytes_to_farm,
-             extra_bytes);
-      stream->recv_buffer_used = extra_bytes;
+      stream->decode_entries = read_u32_be(buffer);
+      stream->decode_bytes = stream->bytes_to_farm - STREAM_PEERS_HEADER_SIZE;
+      stream->decoding = true;
       stream->bytes_to_farm = 0;
       stream->farming = false;
+      stream_consume(stream, STREAM_PEERS_HEADER_SIZE);
+      continue;
+    }
+
+    /* NOTE: the rest of the frame is still on the way */
+    if (stream->recv_buffer_used < stream->bytes_to_farm) {
+      break;
     }
+
+    msg = message_deserialize(arena, stream->recv_buffer,
+                              stream->bytes_to_farm);
+    if (callback && msg) {
+      callback(stream, msg, param);
+    }
+    stream_consume(stream, stream->bytes_to_farm);
+    stream->bytes_to_farm = 0;
+    stream->farming = false;
   }
-  return CONN_OK;
+  return stream_buffer_settle(stream);
 }
 
 u32 dgram_message_write_to(Arena *arena, Dgram *dgram, Message *msg,
@@ -192,23 +761,129 @@ Message *dgram_message_read_from(Arena *arena, Dgram *dgram, ConnAddr *from) {
   return msg;
 }
 
+u32 dgram_enable_segmentation(Dgram *dgram) {
+  return conn_enable_segmentation(dgram->conn);
+}
+
+void dgram_batch_init(DgramBatch *batch, u8 *buffer, u32 size) {
+  batch->buffer = buffer;
+  batch->size = size;
+  batch->used = 0;
+  batch->segment_size = 0;
+}
+
+void dgram_batch_clear(DgramBatch *batch) {
+  batch->used = 0;
+  batch->segment_size = 0;
+}
+
+u8 *dgram_batch_push(DgramBatch *batch, u32 size) {
+  u8 *segment;
+  assert(size > 0);
+  if (batch->segment_size == 0) {
+    batch->segment_size = size;
+  }
+  /* NOTE: after a short datagram the batch is sealed */
+  if (size > batch->segment_size || batch->used % batch->segment_size != 0 ||
+      batch->used + size > batch->size) {
+    return 0;
+  }
+  segment = batch->buffer + batch->used;
+  batch->used += size;
+  return segment;
+}
+
+b32 dgram_batch_push_message(DgramBatch *batch, Message *msg) {
+  u64 size;
+  u8 *buffer;
+  message_serialize_internal(msg, 0, &size);
+  buffer = dgram_batch_push(batch, (u32)size);
+  if (!buffer) {
+    return false;
+  }
+  message_serialize_internal(msg, buffer, &size);
+  return true;
+}
+
+u32 dgram_batch_count(DgramBatch *batch) {
+  if (batch->segment_size == 0) {
+    return 0;
+  }
+  return (batch->used + batch->segment_size - 1) / batch->segment_size;
+}
+
+u8 *dgram_batch_segment(DgramBatch *batch, u32 index, u32 *size) {
+  u32 offset;
+  offset = index * batch->segment_size;
+  assert(offset < batch->used);
+  *size = min(batch->segment_size, batch->used - offset);
+  return batch->buffer + offset;
+}
+
+Message *dgram_batch_message(Arena *arena, DgramBatch *batch, u32 index) {
+  u8 *buffer;
+  u32 size;
+  buffer = dgram_batch_segment(batch, index, &size);
+  if (size < MESSAGE_HEADER_SIZE || !valid_proto(buffer) ||
+      peek_u32_be(buffer + 4) != size) {
+    return 0;
+  }
+  return message_deserialize(arena, buffer, size);
+}
+
+u32 dgram_batch_write_to(Dgram *dgram, DgramBatch *batch, ConnAddr *to) {
+  u32 sent;
+  if (batch->used == 0) {
+    return CONN_OK;
+  }
+  sent = conn_write_segments_to(dgram->conn, batch->buffer, batch->used,
+                                batch->segment_size, to);
+  if (sent != batch->used) {
+    return CONN_ERROR;
+  }
+  return CONN_OK;
+}
+
+u32 dgram_batch_read_from(Dgram *dgram, DgramBatch *batch, ConnAddr *from) {
+  u32 size, segment_size;
+  dgram_batch_clear(batch);
+  size = conn_read_segments_from(dgram->conn, batch->buffer, batch->size,
+                                 &segment_size, from);
+  if (size == CONN_ERROR) {
+    return CONN_ERROR;
+  }
+  batch->used = size;
+  batch->segment_size = size ? segment_size : 0;
+  return CONN_OK;
+}
+
 void message_allocator_init(MessageAllocator *allocator, Arena *arena) {
   memset(allocator, 0, sizeof(*allocator));
   allocator->arena = arena;
 }
 
-Message *message_alloc(MessageAllocator *allocator) {
+Message *message_try_alloc(MessageAllocator *allocator) {
   Message *msg;
   if (allocator->first_free) {
     msg = (Message *)allocator->first_free;
     allocator->first_free = allocator->first_free->next;
   } else {
-    msg = (Message *)arena_push(allocator->arena, sizeof(*msg), 8);
+    msg = (Message *)arena_try_push(allocator->arena, sizeof(*msg), 8);
+    if (!msg) {
+      return 0;
+    }
   }
   memset(msg, 0, sizeof(*msg));
   return msg;
 }
 
+Message *message_alloc(MessageAllocator *allocator) {
+  Message *msg;
+  msg = message_try_alloc(allocator);
+  assert(msg);
+  return msg;
+}
+
 void message_free(MessageAllocator *allocator, Message *msg) {
   msg->header.next = allocator->first_free;
   msg->header.prev = 0;
@@ -4,19 +4,19 @@
 #include "net.h"
 
 #define write_u8_be(buffer, value)                                             \
-  ((u8 *)(buffer))[0] = (u8)((value >> 0) & 0xff);                             \
+  ((u8 *)(buffer))[0] = (u8)(((value) >> 0) & 0xff);                           \
   (buffer) = ((u8 *)(buffer)) + 1
 
 #define write_u16_be(buffer, value)                                            \
-  ((u8 *)(buffer))[0] = (u8)((value >> 8) & 0xff);                             \
-  ((u8 *)(buffer))[1] = (u8)((value >> 0) & 0xff);                             \
+  ((u8 *)(buffer))[0] = (u8)(((value) >> 8) & 0xff);                           \
+  ((u8 *)(buffer))[1] = (u8)(((value) >> 0) & 0xff);                           \
   (buffer) = ((u8 *)(buffer)) + 2
 
 #define write_u32_be(buffer, value)                                            \
-  ((u8 *)(buffer))[0] = (u8)((value >> 24) & 0xff);                            \
-  ((u8 *)(buffer))[1] = (u8)((value >> 16) & 0xff);                            \
-  ((u8 *)(buffer))[2] = (u8)((value >> 8) & 0xff);                             \
-  ((u8 *)(buffer))[3] = (u8)((value >> 0) & 0xff);                             \
+  ((u8 *)(buffer))[0] = (u8)(((value) >> 24) & 0xff);                          \
+  ((u8 *)(buffer))[1] = (u8)(((value) >> 16) & 0xff);                          \
+  ((u8 *)(buffer))[2] = (u8)(((value) >> 8) & 0xff);                           \
+  ((u8 *)(buffer))[3] = (u8)(((value) >> 0) & 0xff);                           \
   (buffer) = ((u8 *)(buffer)) + 4
 
 #define write_u8_be_or_count(buffer, value, size)                              \
@@ -43,9 +43,18 @@
     size += 4;                                                                 \
   } while (0)
 
+#define write_bytes_or_count(buffer, data, count, size)                        \
+  do {                                                                         \
+    if (buffer) {                                                              \
+      memcpy((buffer), (data), (count));                                       \
+      (buffer) = ((u8 *)(buffer)) + (count);                                   \
+    }                                                                          \
+    size += (count);                                                           \
+  } while (0)
+
 #define peek_u32_be(buffer)                                                    \
-  (u32)(((u8 *)(buffer))[0] << 24) | (u32)(((u8 *)(buffer))[1] << 16) |        \
-      (u32)(((u8 *)(buffer))[2] << 8) | (u32)(((u8 *)(buffer))[3] << 0)
+  ((u32)(((u8 *)(buffer))[0] << 24) | (u32)(((u8 *)(buffer))[1] << 16) |       \
+   (u32)(((u8 *)(buffer))[2] << 8) | (u32)(((u8 *)(buffer))[3] << 0))
 
 #define read_u32_be(buffer)                                                    \
   (u32)(((u8 *)(buffer))[0] << 24) | (u32)(((u8 *)(buffer))[1] << 16) |        \
@@ -60,11 +69,26 @@
   (u8)(((u8 *)(buffer))[0]);                                                   \
   (buffer) += 1
 
+/* NOTE: revision 2 carries ipv4 or ipv6 endpoints, the magic changed so
+ * revision 1 frames are dropped instead of misread */
 #define PROTO_MAGIC                                                            \
-  (((u32)'T' << 24) | ((u32)'E' << 16) | ((u32)'N' << 8) | ((u32)'T' << 0))
+  (((u32)'T' << 24) | ((u32)'E' << 16) | ((u32)'N' << 8) | ((u32)'2' << 0))
 
 #define valid_proto(buffer) (peek_u32_be(buffer) == PROTO_MAGIC)
 
+/* NOTE: magic, size and type */
+#define MESSAGE_HEADER_SIZE 9
+
+/* NOTE: endpoints go on the wire as the family (4 or 6), the address (4 or 16
+ * bytes) and the port */
+#define ENDPOINT_IPV4_WIRE_SIZE 7
+#define ENDPOINT_IPV6_WIRE_SIZE 19
+
+/* NOTE: header plus one endpoint, the only replies on the hot path */
+#define STUN_RESPONSE_IPV4_SIZE (9 + ENDPOINT_IPV4_WIRE_SIZE)
+#define STUN_RESPONSE_IPV6_SIZE (9 + ENDPOINT_IPV6_WIRE_SIZE)
+#define STUN_RESPONSE_ENDPOINT_OFFSET 9
+
 typedef enum MessageType {
   MessageType_INVALID,
   MessageType_STUN,
@@ -72,9 +96,23 @@ typedef enum MessageType {
   MessageType_KEEP_ALIVE,
   MessageType_CONNECT,
   MessageType_PEERS_TO_CONNECT,
+  MessageType_RELIABLE_DATA,
+  MessageType_RELIABLE_ACK,
+  MessageType_SEQUENCED,
+  MessageType_PUNCH,
+  MessageType_PUNCH_ACK,
+  /* NOTE: empty, asks the server for the next page of the room */
+  MessageType_PEERS_MORE,
+  /* NOTE: peer to peer, membership entries a peer learned, the body is the
+   * one of PEERS_TO_CONNECT */
+  MessageType_GOSSIP_DELTA,
+  MessageType_GOSSIP_DIGEST,
   MessageType_COUNT
 } MessageType;
 
+/* NOTE: bit of a type in Stream.types */
+#define message_type_bit(type) (1u << (type))
+
 typedef struct MessageHeader {
   MessageType type;
   struct MessageHeader *next;
@@ -83,23 +121,40 @@ typedef struct MessageHeader {
 
 typedef struct MessageStunResponse {
   MessageHeader header;
-  u32 addr;
-  u16 port;
+  ConnEndpoint endpoint;
 } MessageStunResponse;
 
+/* NOTE: ice style candidates without relays, host candidates are the
+ * addresses of the peer interfaces and the server reflexive one is what the
+ * stun server saw. On the wire a candidate list is a count byte followed by a
+ * type byte and an endpoint per candidate */
+#define CANDIDATES_MAX 8
+
+typedef enum CandidateType {
+  CandidateType_HOST,
+  CandidateType_SERVER_REFLEXIVE,
+  CandidateType_COUNT
+} CandidateType;
+
+typedef struct Candidate {
+  ConnEndpoint endpoint;
+  u8 type;
+} Candidate;
+
+/* NOTE: endpoint is the server reflexive endpoint, it identifies the peer */
 typedef struct MessageConnect {
   MessageHeader header;
-  u32 addr;
-  u16 port;
-  u32 local_addr;
-  u16 local_port;
+  /* NOTE: peers only get introduced to peers of the same room */
+  u32 room;
+  ConnEndpoint endpoint;
+  u32 candidates_count;
+  Candidate candidates[CANDIDATES_MAX];
 } MessageConnect;
 
 typedef struct PeerConnected {
-  u32 addr;
-  u16 port;
-  u32 local_addr;
-  u16 local_port;
+  ConnEndpoint endpoint;
+  u32 candidates_count;
+  Candidate candidates[CANDIDATES_MAX];
   struct PeerConnected *next;
   struct PeerConnected *prev;
 } PeerConnected;
@@ -111,29 +166,145 @@ typedef struct MessagePeersToConnect {
   u32 count;
 } MessagePeersToConnect;
 
+/* NOTE: data points into the buffer the message was deserialized from */
+typedef struct MessageReliableData {
+  MessageHeader header;
+  u32 seq;
+  u32 timestamp;
+  u16 size;
+  u8 *data;
+} MessageReliableData;
+
+typedef struct MessageReliableAck {
+  MessageHeader header;
+  u32 ack;
+  u64 sack;
+  u32 window_end;
+  u32 timestamp_echo;
+} MessageReliableAck;
+
+/* NOTE: entries points into the buffer the message was deserialized from */
+typedef struct MessageSequenced {
+  MessageHeader header;
+  u16 count;
+  u32 size;
+  u8 *entries;
+} MessageSequenced;
+
+/* NOTE: endpoint is the public endpoint of the sender, used by the other side
+ * to know which peer is punching */
+typedef struct MessagePunch {
+  MessageHeader header;
+  ConnEndpoint endpoint;
+} MessagePunch;
+
+/* NOTE: a summary of a membership set, every entry falls in a bucket by the
+ * hash of its endpoint and a bucket is the xor of the hashes in it. A reply
+ * is not answered with another digest */
+#define GOSSIP_DIGEST_BUCKETS 16
+
+typedef struct MessageGossipDigest {
+  MessageHeader header;
+  u8 reply;
+  u32 count;
+  u32 buckets[GOSSIP_DIGEST_BUCKETS];
+} MessageGossipDigest;
+
 typedef union Message {
   MessageHeader header;
   MessageStunResponse stun_response;
   MessageConnect connect;
   MessagePeersToConnect peers_to_connect;
+  MessageReliableData reliable_data;
+  MessageReliableAck reliable_ack;
+  MessageSequenced sequenced;
+  MessagePunch punch;
+  MessageGossipDigest gossip_digest;
 } Message;
 
+void endpoint_ipv4(ConnEndpoint *endpoint, u32 addr, u16 port);
+u32 endpoint_ipv4_addr(ConnEndpoint *endpoint);
+b32 endpoint_equals(ConnEndpoint *a, ConnEndpoint *b);
+/* NOTE: same address, any port */
+b32 endpoint_same_host(ConnEndpoint *a, ConnEndpoint *b);
+/* NOTE: same /24, or same /48 for ipv6, likely the same network */
+b32 endpoint_same_prefix(ConnEndpoint *a, ConnEndpoint *b);
+u32 endpoint_hash(ConnEndpoint *endpoint);
+u32 endpoint_wire_size(ConnEndpoint *endpoint);
+
 Message *message_deserialize(Arena *arena, u8 *buffer, u64 size);
 u8 *message_serialize(Arena *arena, Message *msg, u64 *size);
 
+#define STREAM_BUFFER_SIZE kb(10)
+
+/* NOTE: receive buffers shared by the streams of a process. A read lands in
+ * the scratch buffer and only the bytes of a frame that is not complete yet
+ * move to a buffer of their own, which goes back to the free list once the
+ * frame is done. Idle streams hold no buffer at all. The buffers come from
+ * a reservation of their own, a stream that finds it exhausted gets
+ * CONN_ERROR and the rest of the process goes on */
+typedef struct StreamBufferPool {
+  Arena buffers;
+  u8 *scratch;
+  u8 *first_free;
+  u32 in_use;
+  u32 allocated;
+  u32 exhausted;
+} StreamBufferPool;
+
+void stream_buffer_pool_init(StreamBufferPool *pool, Arena *arena,
+                             u32 buffers_max);
+
+/* NOTE: a PEERS_TO_CONNECT entry with the largest endpoints and every
+ * candidate */
+#define PEER_CONNECTED_WIRE_SIZE_MAX                                           \
+  (ENDPOINT_IPV6_WIRE_SIZE + 1 + CANDIDATES_MAX * (1 + ENDPOINT_IPV6_WIRE_SIZE))
+
+u32 peer_connected_wire_size(PeerConnected *peer);
+
 /* TODO: This is not a stream protocol, is a message protocol, consider change
  * this name */
 typedef struct Stream {
   Conn conn;
-  u8 recv_buffer[kb(10)];
+  StreamBufferPool *pool;
+  /* NOTE: zero while no frame is half read. In the message callback it
+   * starts with the frame being delivered, bytes_to_farm long */
+  u8 *recv_buffer;
   u64 recv_buffer_used;
   b32 farming;
   u32 bytes_to_farm;
+  /* NOTE: a PEERS_TO_CONNECT larger than the buffer is decoded as it
+   * arrives, the callback gets the entries of every read as a
+   * PEERS_TO_CONNECT of their own. The frame is not in recv_buffer then */
+  b32 decoding;
+  u32 decode_entries;
+  u32 decode_bytes;
+  /* NOTE: message_type_bit of the types the reader takes, 0 takes them all.
+   * A frame of another type is consumed as it arrives without decoding it,
+   * skip_bytes of it are still to come */
+  u32 types;
+  u32 skip_bytes;
+  /* NOTE: next entry of a PEERS_TO_CONNECT that goes out in chunks */
+  b32 sending;
+  PeerConnected *send_next;
+  /* NOTE: what a non blocking conn did not take of the last write, in a pool
+   * buffer, send_offset bytes of it are already out */
+  u8 *send_buffer;
+  u32 send_size;
+  u32 send_offset;
 } Stream;
 
+void stream_init(Stream *stream, Conn conn, StreamBufferPool *pool);
+/* NOTE: gives the buffer of a half read frame back, the conn is not closed */
+void stream_reset(Stream *stream);
+
 typedef void (*MessageCallback)(Stream *stream, Message *msg, void *param);
 u32 stream_proccess_messages(Arena *arena, Stream *stream,
                              MessageCallback callback, void *param);
+/* NOTE: a message larger than STREAM_BUFFER_SIZE goes out one buffer at a
+ * time, CONN_WOULD_BLOCK means the caller keeps it and calls again with it
+ * once the conn is writable. It is also what a non blocking conn with a
+ * full send buffer gets, the bytes it did not take wait in the stream */
 u32 stream_message_write(Arena *arena, Stream *stream, Message *msg);
 
 typedef struct Dgram {
@@ -144,6 +315,29 @@ u32 dgram_message_write_to(Arena *arena, Dgram *dgram, Message *msg,
                            struct ConnAddr *to);
 Message *dgram_message_read_from(Arena *arena, Dgram *dgram,
                                  struct ConnAddr *from);
+u32 dgram_enable_segmentation(Dgram *dgram);
+
+#define DGRAM_BATCH_SIZE kb(64)
+
+/* NOTE: a burst of same size datagrams for one destination, only the last
+ * datagram can be shorter than segment_size */
+typedef struct DgramBatch {
+  u8 *buffer;
+  u32 size;
+  u32 used;
+  u32 segment_size;
+} DgramBatch;
+
+void dgram_batch_init(DgramBatch *batch, u8 *buffer, u32 size);
+void dgram_batch_clear(DgramBatch *batch);
+u8 *dgram_batch_push(DgramBatch *batch, u32 size);
+b32 dgram_batch_push_message(DgramBatch *batch, Message *msg);
+u32 dgram_batch_count(DgramBatch *batch);
+u8 *dgram_batch_segment(DgramBatch *batch, u32 index, u32 *size);
+Message *dgram_batch_message(Arena *arena, DgramBatch *batch, u32 index);
+u32 dgram_batch_write_to(Dgram *dgram, DgramBatch *batch, struct ConnAddr *to);
+u32 dgram_batch_read_from(Dgram *dgram, DgramBatch *batch,
+                          struct ConnAddr *from);
 
 typedef struct AddrMessage {
   Message msg;
@@ -159,6 +353,8 @@ typedef struct MessageAllocator {
 
 void message_allocator_init(MessageAllocator *allocator, Arena *arena);
 Message *message_alloc(MessageAllocator *allocator);
+/* NOTE: 0 when the arena ran out, message_alloc asserts instead */
+Message *message_try_alloc(MessageAllocator *allocator);
 void message_free(MessageAllocator *allocator, Message *msg);
 
 typedef struct AddrMessageAllocator {
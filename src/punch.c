@@ -0,0 +1,416 @@
+#include "punch.h"
+
+void punch_init(Punch *punch, Arena *arena, Dgram *dgram, u32 max_targets) {
+  u32 capacity;
+  memset(punch, 0, sizeof(*punch));
+  punch->dgram = dgram;
+  punch->targets_capacity = max_targets;
+  punch->targets = arena_push(arena, sizeof(PunchTarget) * max_targets, 8);
+  punch->candidates = arena_push(
+      arena, sizeof(PunchCandidate) * max_targets * PUNCH_TARGET_CANDIDATES,
+      8);
+  punch->heap = arena_push(
+      arena, sizeof(u32) * max_targets * PUNCH_TARGET_CANDIDATES, 4);
+  capacity = 1;
+  while (capacity < max_targets * 2) {
+    capacity <<= 1;
+  }
+  punch->table_capacity = capacity;
+  punch->table = arena_push(arena, sizeof(u32) * capacity, 4);
+  punch->connected = arena_push(arena, sizeof(u32) * capacity, 4);
+  memset(punch->table, 0, sizeof(u32) * capacity);
+  memset(punch->connected, 0, sizeof(u32) * capacity);
+}
+
+void punch_set_identity(Punch *punch, ConnEndpoint *endpoint) {
+  punch->own_endpoint = *endpoint;
+}
+
+/* NOTE: the key of a target in one of the two tables */
+static ConnEndpoint *punch_key(Punch *punch, u32 *table, u32 slot) {
+  PunchTarget *target;
+  target = &punch->targets[slot - 1];
+  return table == punch->connected ? &target->connected_endpoint
+                                   : &target->endpoint;
+}
+
+static u32 *punch_slot_in(Punch *punch, u32 *table, ConnEndpoint *endpoint) {
+  u32 mask, index;
+  mask = punch->table_capacity - 1;
+  index = endpoint_hash(endpoint) & mask;
+  for (;;) {
+    u32 *slot = &table[index];
+    if (*slot == 0) {
+      return slot;
+    }
+    if (endpoint_equals(punch_key(punch, table, *slot), endpoint)) {
+      return slot;
+    }
+    index = (index + 1) & mask;
+  }
+}
+
+static u32 *punch_slot(Punch *punch, ConnEndpoint *endpoint) {
+  return punch_slot_in(punch, punch->table, endpoint);
+}
+
+PunchTarget *punch_find(Punch *punch, ConnEndpoint *endpoint) {
+  u32 *slot;
+  slot = punch_slot(punch, endpoint);
+  return *slot ? &punch->targets[*slot - 1] : 0;
+}
+
+PunchTarget *punch_find_connected(Punch *punch, ConnEndpoint *endpoint) {
+  u32 *slot;
+  slot = punch_slot_in(punch, punch->connected, endpoint);
+  return *slot ? &punch->targets[*slot - 1] : 0;
+}
+
+/* NOTE: backward shift deletion, the entries after the hole that probed
+ * past it move back so no lookup stops early at an empty slot */
+static void punch_slot_remove(Punch *punch, u32 *table, u32 *slot) {
+  u32 mask, hole, index;
+  mask = punch->table_capacity - 1;
+  hole = (u32)(slot - table);
+  index = hole;
+  for (;;) {
+    u32 home;
+    index = (index + 1) & mask;
+    if (table[index] == 0) {
+      break;
+    }
+    home = endpoint_hash(punch_key(punch, table, table[index])) & mask;
+    if (((index - home) & mask) >= ((index - hole) & mask)) {
+      table[hole] = table[index];
+      hole = index;
+    }
+  }
+  table[hole] = 0;
+}
+
+static b32 heap_less(Punch *punch, u32 a, u32 b) {
+  return punch->candidates[punch->heap[a]].next_send <
+         punch->candidates[punch->heap[b]].next_send;
+}
+
+static void heap_swap(Punch *punch, u32 a, u32 b) {
+  u32 tmp;
+  tmp = punch->heap[a];
+  punch->heap[a] = punch->heap[b];
+  punch->heap[b] = tmp;
+}
+
+static void heap_push(Punch *punch, u32 candidate) {
+  u32 index;
+  index = punch->heap_count++;
+  punch->heap[index] = candidate;
+  while (index > 0) {
+    u32 parent = (index - 1) / 2;
+    if (!heap_less(punch, index, parent)) {
+      break;
+    }
+    heap_swap(punch, index, parent);
+    index = parent;
+  }
+}
+
+static void heap_sift_down(Punch *punch, u32 index) {
+  for (;;) {
+    u32 left, right, smallest;
+    left = index * 2 + 1;
+    right = left + 1;
+    smallest = index;
+    if (left < punch->heap_count && heap_less(punch, left, smallest)) {
+      smallest = left;
+    }
+    if (right < punch->heap_count && heap_less(punch, right, smallest)) {
+      smallest = right;
+    }
+    if (smallest == index) {
+      break;
+    }
+    heap_swap(punch, index, smallest);
+    index = smallest;
+  }
+}
+
+static u32 heap_pop(Punch *punch) {
+  u32 top;
+  assert(punch->heap_count);
+  top = punch->heap[0];
+  punch->heap[0] = punch->heap[--punch->heap_count];
+  heap_sift_down(punch, 0);
+  return top;
+}
+
+/* NOTE: the candidates of a connected target are dropped lazily, a target
+ * that gets reused can not leave them behind */
+static void heap_remove_target(Punch *punch, u32 target) {
+  u32 i, count;
+  count = 0;
+  for (i = 0; i < punch->heap_count; ++i) {
+    if (punch->candidates[punch->heap[i]].target != target) {
+      punch->heap[count++] = punch->heap[i];
+    }
+  }
+  if (count == punch->heap_count) {
+    return;
+  }
+  punch->heap_count = count;
+  for (i = count / 2; i > 0; --i) {
+    heap_sift_down(punch, i - 1);
+  }
+}
+
+/* NOTE: rfc 8445 formula, type preference in the top byte and local
+ * preference below it. Behind the same nat the host candidates are the lan
+ * path. Behind different nats a private ipv4 host candidate is almost never
+ * reachable so it goes last, ipv6 host candidates have no nat in front and
+ * keep their preference */
+static u32 punch_candidate_priority(Punch *punch, PunchTarget *target,
+                                    PunchCandidate *candidate) {
+  u32 type_preference, local_preference;
+  b32 same_nat;
+  same_nat = endpoint_same_host(&target->endpoint, &punch->own_endpoint);
+  if (candidate->type == CandidateType_HOST) {
+    type_preference = 126;
+    if (!same_nat && candidate->endpoint.family == CONN_FAMILY_IPV4) {
+      type_preference = 0;
+    }
+  } else {
+    type_preference = 100;
+  }
+  local_preference =
+      candidate->endpoint.family == CONN_FAMILY_IPV6 ? 0xffff : 0x7fff;
+  return (type_preference << 24) | (local_preference << 8) | 0xff;
+}
+
+static void punch_schedule(Punch *punch, PunchTarget *target, u64 now) {
+  PunchCandidate *candidates;
+  u32 i, j;
+  target->state = PunchState_PROBING;
+  target->start_time = now;
+  target->candidates_active = target->candidates_count;
+  candidates = &punch->candidates[target->first_candidate];
+  /* NOTE: insertion sort, there are at most CANDIDATES_MAX */
+  for (i = 1; i < target->candidates_count; ++i) {
+    PunchCandidate candidate = candidates[i];
+    for (j = i; j > 0 && candidates[j - 1].priority < candidate.priority;
+         --j) {
+      candidates[j] = candidates[j - 1];
+    }
+    candidates[j] = candidate;
+  }
+  for (i = 0; i < target->candidates_count; ++i) {
+    candidates[i].attempts = 0;
+    candidates[i].next_send = now + (u64)i * PUNCH_STAGGER_US;
+    heap_push(punch, target->first_candidate + i);
+  }
+}
+
+static void punch_add_candidate(Punch *punch, PunchTarget *target, u8 type,
+                                ConnEndpoint *endpoint) {
+  PunchCandidate *candidate;
+  u32 i;
+  if (endpoint->family == CONN_FAMILY_NONE || endpoint->port == 0) {
+    return;
+  }
+  for (i = 0; i < target->candidates_count; ++i) {
+    candidate = &punch->candidates[target->first_candidate + i];
+    if (endpoint_equals(&candidate->endpoint, endpoint)) {
+      return;
+    }
+  }
+  candidate = &punch->candidates[target->first_candidate +
+                                 target->candidates_count++];
+  memset(candidate, 0, sizeof(*candidate));
+  candidate->target = (u32)(target - punch->targets);
+  candidate->type = type;
+  candidate->endpoint = *endpoint;
+  candidate->priority = punch_candidate_priority(punch, target, candidate);
+}
+
+void punch_remove(Punch *punch, PunchTarget *target) {
+  u32 index;
+  index = (u32)(target - punch->targets);
+  punch_slot_remove(punch, punch->table, punch_slot(punch, &target->endpoint));
+  if (target->state == PunchState_CONNECTED) {
+    u32 *slot;
+    slot = punch_slot_in(punch, punch->connected, &target->connected_endpoint);
+    /* NOTE: another target may have the same path */
+    if (*slot == index + 1) {
+      punch_slot_remove(punch, punch->connected, slot);
+    }
+  }
+  heap_remove_target(punch, index);
+  target->next_free = punch->first_free;
+  punch->first_free = index + 1;
+}
+
+/* NOTE: a free slot, a never used one, or the slot of a FAILED target */
+static PunchTarget *punch_target_alloc(Punch *punch) {
+  PunchTarget *target;
+  u32 i;
+  if (!punch->first_free && punch->targets_count == punch->targets_capacity) {
+    for (i = 0; i < punch->targets_count; ++i) {
+      if (punch->targets[i].state == PunchState_FAILED) {
+        punch_remove(punch, &punch->targets[i]);
+        punch->stats.recycled++;
+        break;
+      }
+    }
+  }
+  if (punch->first_free) {
+    target = &punch->targets[punch->first_free - 1];
+    punch->first_free = target->next_free;
+    return target;
+  }
+  if (punch->targets_count == punch->targets_capacity) {
+    return 0;
+  }
+  return &punch->targets[punch->targets_count++];
+}
+
+PunchTarget *punch_add(Punch *punch, PeerConnected *peer, u64 now) {
+  PunchTarget *target;
+  u32 *slot, i, index;
+  if (peer->endpoint.family == CONN_FAMILY_NONE || peer->endpoint.port == 0) {
+    return 0;
+  }
+  slot = punch_slot(punch, &peer->endpoint);
+  if (*slot) {
+    target = &punch->targets[*slot - 1];
+    if (target->state == PunchState_FAILED) {
+      punch_schedule(punch, target, now);
+    }
+    return target;
+  }
+  target = punch_target_alloc(punch);
+  if (!target) {
+    return 0;
+  }
+  index = (u32)(target - punch->targets);
+  memset(target, 0, sizeof(*target));
+  target->endpoint = peer->endpoint;
+  target->first_candidate = index * PUNCH_TARGET_CANDIDATES;
+  /* NOTE: a recycled slot may have moved the entries of the table */
+  slot = punch_slot(punch, &peer->endpoint);
+  *slot = index + 1;
+  /* NOTE: the endpoint the server saw is always worth a try even if the
+   * peer did not advertise it */
+  punch_add_candidate(punch, target, CandidateType_SERVER_REFLEXIVE,
+                      &peer->endpoint);
+  for (i = 0; i < peer->candidates_count; ++i) {
+    punch_add_candidate(punch, target, peer->candidates[i].type,
+                        &peer->candidates[i].endpoint);
+  }
+  punch_schedule(punch, target, now);
+  return target;
+}
+
+static void punch_send(Punch *punch, Arena *arena, MessageType type,
+                       ConnEndpoint *endpoint) {
+  Message msg;
+  ConnAddr *to;
+  u64 mark;
+  mark = arena->used;
+  msg.punch.header.type = type;
+  msg.punch.endpoint = punch->own_endpoint;
+  to = conn_address_endpoint(arena, endpoint);
+  dgram_message_write_to(arena, punch->dgram, &msg, to);
+  arena->used = mark;
+}
+
+PunchTarget *punch_process(Punch *punch, Arena *arena, Message *msg,
+                           ConnAddr *from, u64 now) {
+  PunchTarget *target;
+  ConnEndpoint from_endpoint;
+  conn_address_get_endpoint(from, &from_endpoint);
+  target = punch_find(punch, &msg->punch.endpoint);
+
+  switch (msg->header.type) {
+  case MessageType_PUNCH: {
+    punch_send(punch, arena, MessageType_PUNCH_ACK, &from_endpoint);
+    punch->stats.acks_sent++;
+    /* NOTE: the other side found a path we may not know about (its nat can
+     * map a different port for us), check it right away */
+    if (target && target->state == PunchState_PROBING) {
+      punch_send(punch, arena, MessageType_PUNCH, &from_endpoint);
+      punch->stats.probes_sent++;
+    }
+  } break;
+  case MessageType_PUNCH_ACK: {
+    if (target && target->state == PunchState_PROBING) {
+      u32 *slot;
+      target->state = PunchState_CONNECTED;
+      target->connected_endpoint = from_endpoint;
+      target->connect_time = now;
+      slot = punch_slot_in(punch, punch->connected, &from_endpoint);
+      if (!*slot) {
+        *slot = (u32)(target - punch->targets) + 1;
+      }
+      punch->stats.connected++;
+      return target;
+    }
+  } break;
+  default: {
+  } break;
+  }
+  return 0;
+}
+
+u32 punch_update(Punch *punch, Arena *arena, u64 now) {
+  u32 sent;
+  sent = 0;
+  if (punch->next_pace < now) {
+    punch->next_pace = now;
+  }
+  while (punch->heap_count) {
+    PunchCandidate *candidate;
+    PunchTarget *target;
+    u32 index;
+    index = punch->heap[0];
+    candidate = &punch->candidates[index];
+    target = &punch->targets[candidate->target];
+    if (target->state != PunchState_PROBING) {
+      /* NOTE: another candidate already won, drop it lazily */
+      heap_pop(punch);
+      punch->stats.cancelled++;
+      continue;
+    }
+    if (candidate->next_send > now ||
+        punch->next_pace > now + PUNCH_PACE_BURST_US) {
+      break;
+    }
+    heap_pop(punch);
+    if (candidate->attempts == PUNCH_MAX_ATTEMPTS) {
+      if (--target->candidates_active == 0) {
+        target->state = PunchState_FAILED;
+        punch->stats.failed++;
+      }
+      continue;
+    }
+    punch_send(punch, arena, MessageType_PUNCH, &candidate->endpoint);
+    punch->stats.probes_sent++;
+    punch->next_pace += PUNCH_PACE_US;
+    candidate->next_send =
+        now + min((u64)PUNCH_RETRY_US << candidate->attempts,
+                  (u64)PUNCH_MAX_RETRY_US);
+    candidate->attempts++;
+    heap_push(punch, index);
+    sent++;
+  }
+  return sent;
+}
+
+u64 punch_next_timeout(Punch *punch, u64 now) {
+  u64 deadline;
+  if (!punch->heap_count) {
+    return PUNCH_TIMEOUT_NONE;
+  }
+  deadline = punch->candidates[punch->heap[0]].next_send;
+  deadline = max(deadline, punch->next_pace > PUNCH_PACE_BURST_US
+                               ? punch->next_pace - PUNCH_PACE_BURST_US
+                               : 0);
+  return deadline > now ? deadline - now : 0;
+}
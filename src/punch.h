@@ -0,0 +1,106 @@
+#ifndef _PUNCH_H_
+#define _PUNCH_H_
+
+#include "proto.h"
+
+/* NOTE: hole punching scheduler. Every target (a peer from a PEERS_TO_CONNECT
+ * list, identified by its public endpoint) has the candidates it advertised.
+ * All targets are probed at the same time, the probes are paced globally and
+ * retransmitted from a timer heap with exponential backoff, and a target stops
+ * probing as soon as one candidate gets a PUNCH_ACK back. Inside a target the
+ * candidates are ranked ice style and each one starts PUNCH_STAGGER_US after
+ * the previous, so a lan path answers before the hairpin one is even tried.
+ * Once every slot is taken a FAILED target makes room for a new one, and
+ * punch_remove frees the target of a peer that is gone */
+
+#define PUNCH_PACE_US 20
+#define PUNCH_PACE_BURST_US 1000
+#define PUNCH_RETRY_US 50000
+#define PUNCH_MAX_RETRY_US 1000000
+#define PUNCH_MAX_ATTEMPTS 8
+#define PUNCH_STAGGER_US 2000
+#define PUNCH_TIMEOUT_NONE ((u64) - 1)
+/* NOTE: the advertised candidates plus the endpoint the server saw */
+#define PUNCH_TARGET_CANDIDATES (CANDIDATES_MAX + 1)
+
+typedef enum PunchState {
+  PunchState_PROBING,
+  PunchState_CONNECTED,
+  PunchState_FAILED
+} PunchState;
+
+typedef struct PunchTarget {
+  ConnEndpoint endpoint;
+  PunchState state;
+  u32 first_candidate;
+  u32 candidates_count;
+  u32 candidates_active;
+  /* NOTE: the endpoint that answered first, and what the caller keeps for
+   * the path it opened */
+  ConnEndpoint connected_endpoint;
+  void *peer;
+  u64 start_time;
+  u64 connect_time;
+  /* NOTE: index + 1 of the next free target while this one is free */
+  u32 next_free;
+} PunchTarget;
+
+typedef struct PunchCandidate {
+  u32 target;
+  u16 attempts;
+  u8 type;
+  u32 priority;
+  ConnEndpoint endpoint;
+  u64 next_send;
+} PunchCandidate;
+
+typedef struct PunchStats {
+  u64 probes_sent;
+  u64 acks_sent;
+  u64 connected;
+  u64 failed;
+  u64 cancelled;
+  u64 recycled;
+} PunchStats;
+
+typedef struct Punch {
+  Dgram *dgram;
+  ConnEndpoint own_endpoint;
+
+  /* NOTE: target i owns the candidates from i * PUNCH_TARGET_CANDIDATES */
+  PunchTarget *targets;
+  u32 targets_count;
+  u32 targets_capacity;
+  u32 first_free;
+  PunchCandidate *candidates;
+
+  /* NOTE: target index + 1 by public endpoint, and by connected endpoint
+   * for the connected ones, 0 is empty */
+  u32 *table;
+  u32 *connected;
+  u32 table_capacity;
+
+  /* NOTE: min heap of candidate indices by next_send */
+  u32 *heap;
+  u32 heap_count;
+
+  u64 next_pace;
+
+  PunchStats stats;
+} Punch;
+
+void punch_init(Punch *punch, Arena *arena, Dgram *dgram, u32 max_targets);
+void punch_set_identity(Punch *punch, ConnEndpoint *endpoint);
+PunchTarget *punch_add(Punch *punch, PeerConnected *peer, u64 now);
+PunchTarget *punch_find(Punch *punch, ConnEndpoint *endpoint);
+/* NOTE: the connected target whose path ends at endpoint, where its
+ * datagrams come from */
+PunchTarget *punch_find_connected(Punch *punch, ConnEndpoint *endpoint);
+void punch_remove(Punch *punch, PunchTarget *target);
+/* NOTE: returns the target when this message connected it */
+PunchTarget *punch_process(Punch *punch, Arena *arena, Message *msg,
+                           struct ConnAddr *from, u64 now);
+u32 punch_update(Punch *punch, Arena *arena, u64 now);
+u64 punch_next_timeout(Punch *punch, u64 now);
+
+#endif
@@ -0,0 +1,70 @@
+#include "rank.h"
+
+void rank_top_init(RankTop *top, RankEntry *entries, u32 capacity) {
+  top->entries = entries;
+  top->count = 0;
+  top->capacity = capacity;
+}
+
+static void rank_swap(RankEntry *a, RankEntry *b) {
+  RankEntry tmp;
+  tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+static void rank_sift_down(RankEntry *entries, u32 count, u32 index) {
+  for (;;) {
+    u32 left, right, largest;
+    left = index * 2 + 1;
+    right = left + 1;
+    largest = index;
+    if (left < count && entries[left].key > entries[largest].key) {
+      largest = left;
+    }
+    if (right < count && entries[right].key > entries[largest].key) {
+      largest = right;
+    }
+    if (largest == index) {
+      break;
+    }
+    rank_swap(&entries[index], &entries[largest]);
+    index = largest;
+  }
+}
+
+void rank_top_push(RankTop *top, u64 key, void *item) {
+  u32 index;
+  if (top->capacity == 0) {
+    return;
+  }
+  if (top->count == top->capacity) {
+    /* NOTE: ties keep the item that came first */
+    if (key >= top->entries[0].key) {
+      return;
+    }
+    top->entries[0].key = key;
+    top->entries[0].item = item;
+    rank_sift_down(top->entries, top->count, 0);
+    return;
+  }
+  index = top->count++;
+  top->entries[index].key = key;
+  top->entries[index].item = item;
+  while (index > 0) {
+    u32 parent = (index - 1) / 2;
+    if (top->entries[parent].key >= top->entries[index].key) {
+      break;
+    }
+    rank_swap(&top->entries[parent], &top->entries[index]);
+    index = parent;
+  }
+}
+
+void rank_top_sort(RankTop *top) {
+  u32 count;
+  for (count = top->count; count > 1; --count) {
+    rank_swap(&top->entries[0], &top->entries[count - 1]);
+    rank_sift_down(top->entries, count - 1, 0);
+  }
+}
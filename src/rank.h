@@ -0,0 +1,27 @@
+#ifndef _RANK_H_
+#define _RANK_H_
+
+#include "core.h"
+
+/* NOTE: keeps the k items with the smallest keys out of a stream of any
+ * length. A max heap of k entries, the worst kept item is at the top and a
+ * new one only goes in when it beats it, so a pass over n items is
+ * O(n log k) and needs no memory beyond the k entries */
+
+typedef struct RankEntry {
+  u64 key;
+  void *item;
+} RankEntry;
+
+typedef struct RankTop {
+  RankEntry *entries;
+  u32 count;
+  u32 capacity;
+} RankTop;
+
+void rank_top_init(RankTop *top, RankEntry *entries, u32 capacity);
+void rank_top_push(RankTop *top, u64 key, void *item);
+/* NOTE: leaves the entries in ascending key order, the heap is gone after */
+void rank_top_sort(RankTop *top);
+
+#endif
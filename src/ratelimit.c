@@ -0,0 +1,62 @@
+#include "ratelimit.h"
+
+#define addr_hash(addr) ((u32)(((u64)(addr) * 0x9e3779b97f4a7c15ull) >> 32))
+
+void rate_limiter_init(RateLimiter *limiter, Arena *arena, u32 sets_count,
+                       u32 rate, u32 burst) {
+  assert(is_power_of_two(sets_count));
+  assert(sizeof(RateBucketSet) == 64);
+  assert(burst > 0 && burst <= RATE_LIMIT_MAX_BURST);
+  limiter->sets = arena_push(arena, sizeof(RateBucketSet) * sets_count, 64);
+  memset(limiter->sets, 0, sizeof(RateBucketSet) * sets_count);
+  limiter->sets_mask = sets_count - 1;
+  limiter->rate = rate;
+  limiter->burst = burst;
+  memset(&limiter->stats, 0, sizeof(limiter->stats));
+}
+
+b32 rate_limiter_allow(RateLimiter *limiter, u32 addr, u64 now) {
+  RateBucketSet *set;
+  RateBucket *bucket, *oldest;
+  u32 i, capacity;
+  u64 tokens;
+  set = &limiter->sets[addr_hash(addr) & limiter->sets_mask];
+  capacity = limiter->burst * RATE_LIMIT_TOKEN;
+  bucket = 0;
+  oldest = &set->ways[0];
+  for (i = 0; i < RATE_LIMIT_WAYS; ++i) {
+    RateBucket *way = &set->ways[i];
+    if (way->addr == addr && way->last_time != 0) {
+      bucket = way;
+      break;
+    }
+    if (way->last_time < oldest->last_time) {
+      oldest = way;
+    }
+  }
+
+  if (bucket) {
+    /* NOTE: refill, the cap also keeps the multiplication from overflowing */
+    u64 elapsed = now > bucket->last_time ? now - bucket->last_time : 0;
+    elapsed = min(elapsed, (u64)capacity);
+    tokens = bucket->tokens + elapsed * limiter->rate;
+    bucket->tokens = (u32)min(tokens, (u64)capacity);
+  } else {
+    /* NOTE: new sources start with a full bucket */
+    if (oldest->last_time != 0) {
+      limiter->stats.evictions++;
+    }
+    bucket = oldest;
+    bucket->addr = addr;
+    bucket->tokens = capacity;
+  }
+  bucket->last_time = max(now, 1);
+
+  if (bucket->tokens < RATE_LIMIT_TOKEN) {
+    limiter->stats.dropped++;
+    return false;
+  }
+  bucket->tokens -= RATE_LIMIT_TOKEN;
+  limiter->stats.allowed++;
+  return true;
+}
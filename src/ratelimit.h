@@ -0,0 +1,49 @@
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include "core.h"
+
+/* NOTE: per source token buckets in a fixed size table. The table is split in
+ * cache line sized sets of RATE_LIMIT_WAYS buckets, a source address hashes to
+ * one set and, when it is not there, takes the way that was touched least
+ * recently. Buckets are refilled lazily when they are looked up, so a lookup
+ * costs one cache line and no timers. Tokens are fixed point, one token is
+ * RATE_LIMIT_TOKEN units and every elapsed microsecond adds `rate` units, so
+ * `rate` is also the number of tokens per second */
+
+#define RATE_LIMIT_WAYS 4
+#define RATE_LIMIT_TOKEN 1000000u
+#define RATE_LIMIT_MAX_BURST (0xffffffffu / RATE_LIMIT_TOKEN)
+
+typedef struct RateBucket {
+  u32 addr;
+  u32 tokens;
+  u64 last_time;
+} RateBucket;
+
+typedef struct RateBucketSet {
+  RateBucket ways[RATE_LIMIT_WAYS];
+} RateBucketSet;
+
+typedef struct RateLimiterStats {
+  u64 allowed;
+  u64 dropped;
+  u64 evictions;
+} RateLimiterStats;
+
+typedef struct RateLimiter {
+  RateBucketSet *sets;
+  u32 sets_mask;
+  u32 rate;
+  u32 burst;
+  RateLimiterStats stats;
+} RateLimiter;
+
+/* NOTE: sets_count must be a power of two, rate is in tokens per second */
+void rate_limiter_init(RateLimiter *limiter, Arena *arena, u32 sets_count,
+                       u32 rate, u32 burst);
+/* NOTE: takes one token from the bucket of addr, now is the caller cached time
+ * in microseconds */
+b32 rate_limiter_allow(RateLimiter *limiter, u32 addr, u64 now);
+
+#endif
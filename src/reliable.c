@@ -0,0 +1,511 @@
+#include "reliable.h"
+
+#define seq_lt(a, b) ((s32)((u32)(a) - (u32)(b)) < 0)
+#define seq_le(a, b) ((s32)((u32)(a) - (u32)(b)) <= 0)
+#define segment_at(segments, seq) (&(segments)[(seq) & (RELIABLE_WINDOW - 1)])
+
+/* NOTE: gains in hundredths */
+#define STARTUP_GAIN 289
+#define DRAIN_GAIN 35
+#define CWND_GAIN 200
+
+static u32 probe_bw_gains[] = {125, 75, 100, 100, 100, 100, 100, 100};
+
+void reliable_init(ReliableChannel *channel, Arena *arena, Dgram *dgram,
+                   ConnAddr *addr) {
+  u64 segments_size;
+  u8 *buffer;
+  memset(channel, 0, sizeof(*channel));
+  channel->dgram = dgram;
+  channel->addr = addr;
+
+  buffer = arena_push(arena, DGRAM_BATCH_SIZE, 8);
+  dgram_batch_init(&channel->batch, buffer, DGRAM_BATCH_SIZE);
+
+  segments_size = sizeof(ReliableSegment) * RELIABLE_WINDOW;
+  channel->send_segments = arena_push(arena, segments_size, 8);
+  channel->recv_segments = arena_push(arena, segments_size, 8);
+  memset(channel->send_segments, 0, segments_size);
+  memset(channel->recv_segments, 0, segments_size);
+
+  channel->window_end = RELIABLE_WINDOW;
+  channel->recv_advertised_end = RELIABLE_WINDOW;
+  channel->rto = RELIABLE_INITIAL_RTO_US;
+  channel->cwnd = RELIABLE_INITIAL_CWND;
+  channel->mode = ReliableMode_STARTUP;
+}
+
+u32 reliable_send_space(ReliableChannel *channel) {
+  u32 space;
+  space = (RELIABLE_WINDOW - (channel->send_end - channel->send_una)) *
+          RELIABLE_MSS;
+  if (channel->send_end != channel->send_next) {
+    ReliableSegment *tail;
+    tail = segment_at(channel->send_segments, channel->send_end - 1);
+    space += RELIABLE_MSS - tail->size;
+  }
+  return space;
+}
+
+u32 reliable_send(ReliableChannel *channel, u8 *data, u32 size) {
+  u32 accepted;
+  accepted = 0;
+  /* NOTE: top up the last segment if it did not leave yet */
+  if (channel->send_end != channel->send_next) {
+    ReliableSegment *tail;
+    u32 count;
+    tail = segment_at(channel->send_segments, channel->send_end - 1);
+    count = min(RELIABLE_MSS - tail->size, size);
+    memcpy(tail->data + tail->size, data, count);
+    tail->size += count;
+    accepted += count;
+  }
+  while (accepted < size &&
+         channel->send_end - channel->send_una < RELIABLE_WINDOW) {
+    ReliableSegment *segment;
+    u32 count;
+    segment = segment_at(channel->send_segments, channel->send_end);
+    count = min(RELIABLE_MSS, size - accepted);
+    segment->seq = channel->send_end;
+    segment->size = (u16)count;
+    segment->flags = 0;
+    segment->sent_time = 0;
+    memcpy(segment->data, data + accepted, count);
+    channel->send_end++;
+    accepted += count;
+  }
+  return accepted;
+}
+
+u32 reliable_recv(ReliableChannel *channel, u8 *data, u32 size) {
+  u32 copied;
+  copied = 0;
+  while (copied < size && channel->recv_read != channel->recv_next) {
+    ReliableSegment *segment;
+    u32 count;
+    segment = segment_at(channel->recv_segments, channel->recv_read);
+    count = min(segment->size - channel->recv_read_offset, size - copied);
+    memcpy(data + copied, segment->data + channel->recv_read_offset, count);
+    channel->recv_read_offset += count;
+    copied += count;
+    if (channel->recv_read_offset == segment->size) {
+      segment->flags = 0;
+      channel->recv_read++;
+      channel->recv_read_offset = 0;
+    }
+  }
+  /* NOTE: the sender may be stalled on our window, tell it there is room */
+  if (copied && channel->recv_advertised_end - channel->recv_next <
+                    RELIABLE_WINDOW / 4) {
+    channel->ack_pending = true;
+  }
+  return copied;
+}
+
+static void reliable_rtt_sample(ReliableChannel *channel, u64 rtt, u64 now) {
+  if (rtt == 0) {
+    rtt = 1;
+  }
+  if (channel->srtt == 0) {
+    channel->srtt = rtt;
+    channel->rttvar = rtt / 2;
+  } else {
+    u64 delta;
+    delta = channel->srtt > rtt ? channel->srtt - rtt : rtt - channel->srtt;
+    channel->rttvar = (3 * channel->rttvar + delta) / 4;
+    channel->srtt = (7 * channel->srtt + rtt) / 8;
+  }
+  if (channel->min_rtt == 0 || rtt <= channel->min_rtt ||
+      now - channel->min_rtt_time > RELIABLE_MIN_RTT_WINDOW_US) {
+    channel->min_rtt = rtt;
+    channel->min_rtt_time = now;
+  }
+  channel->rto = channel->srtt + max(4 * channel->rttvar, 1000);
+  channel->rto = max(channel->rto, RELIABLE_MIN_RTO_US);
+  channel->rto = min(channel->rto, RELIABLE_MAX_RTO_US);
+}
+
+static u32 reliable_segment_acked(ReliableChannel *channel,
+                                  ReliableSegment *segment,
+                                  ReliableSegment **latest) {
+  if (segment->flags & SegmentFlag_ACKED) {
+    return 0;
+  }
+  if (!*latest || (*latest)->sent_time < segment->sent_time) {
+    *latest = segment;
+  }
+  channel->delivered += segment->size;
+  if (segment->flags & SegmentFlag_IN_FLIGHT) {
+    channel->bytes_in_flight -= segment->size;
+  }
+  if (segment->flags & SegmentFlag_LOST) {
+    channel->lost_count--;
+  }
+  segment->flags = SegmentFlag_ACKED;
+  return segment->size;
+}
+
+static u64 reliable_bdp(ReliableChannel *channel, u32 gain) {
+  return (channel->btl_bw * channel->min_rtt / 1000000) * gain / 100;
+}
+
+static void reliable_model_update(ReliableChannel *channel,
+                                  ReliableSegment *latest, u64 now) {
+  u64 send_elapsed, ack_elapsed, interval, rate;
+  u32 i;
+
+  /* NOTE: a new round starts when a segment sent after the previous round
+   * start gets acked */
+  if (latest->delivered >= channel->round_delivered) {
+    channel->round_delivered = channel->delivered;
+    channel->round++;
+    channel->bw_rounds[channel->round % RELIABLE_BW_ROUNDS] = 0;
+    if (channel->mode == ReliableMode_STARTUP && channel->btl_bw) {
+      if (channel->btl_bw >= channel->full_bw * 5 / 4) {
+        channel->full_bw = channel->btl_bw;
+        channel->full_bw_rounds = 0;
+      } else if (++channel->full_bw_rounds >= 3) {
+        channel->mode = ReliableMode_DRAIN;
+      }
+    }
+  }
+
+  send_elapsed = latest->sent_time - latest->first_sent_time;
+  ack_elapsed = now - latest->delivered_time;
+  interval = max(send_elapsed, ack_elapsed);
+  if (interval >= channel->min_rtt / 2 && interval > 0) {
+    u64 *bw;
+    rate = (channel->delivered - latest->delivered) * 1000000 / interval;
+    bw = &channel->bw_rounds[channel->round % RELIABLE_BW_ROUNDS];
+    *bw = max(*bw, rate);
+  }
+  channel->btl_bw = 0;
+  for (i = 0; i < RELIABLE_BW_ROUNDS; ++i) {
+    channel->btl_bw = max(channel->btl_bw, channel->bw_rounds[i]);
+  }
+
+  if (channel->mode == ReliableMode_DRAIN &&
+      channel->bytes_in_flight <= reliable_bdp(channel, 100)) {
+    channel->mode = ReliableMode_PROBE_BW;
+    channel->cycle_index = 0;
+    channel->cycle_start = now;
+  }
+  if (channel->mode == ReliableMode_PROBE_BW &&
+      now - channel->cycle_start > channel->min_rtt) {
+    channel->cycle_index = (channel->cycle_index + 1) % 8;
+    channel->cycle_start = now;
+  }
+
+  if (channel->btl_bw) {
+    u32 gain;
+    gain = channel->mode == ReliableMode_STARTUP ? STARTUP_GAIN : CWND_GAIN;
+    channel->cwnd = (u32)reliable_bdp(channel, gain);
+    channel->cwnd = max(channel->cwnd, RELIABLE_MIN_CWND);
+  }
+}
+
+static void reliable_segment_lost(ReliableChannel *channel,
+                                  ReliableSegment *segment) {
+  assert(segment->flags & SegmentFlag_IN_FLIGHT);
+  channel->bytes_in_flight -= segment->size;
+  segment->flags = SegmentFlag_LOST;
+  channel->lost_count++;
+}
+
+static void reliable_process_ack(ReliableChannel *channel,
+                                 MessageReliableAck *ack, u64 now) {
+  ReliableSegment *latest;
+  u32 seq, newly_acked, highest_acked, i;
+  if (seq_lt(ack->ack, channel->send_una) ||
+      seq_lt(channel->send_next, ack->ack)) {
+    return;
+  }
+
+  newly_acked = 0;
+  latest = 0;
+  for (seq = channel->send_una; seq != ack->ack; ++seq) {
+    newly_acked += reliable_segment_acked(
+        channel, segment_at(channel->send_segments, seq), &latest);
+  }
+  channel->send_una = ack->ack;
+  highest_acked = ack->ack - 1;
+
+  for (i = 0; i < 64; ++i) {
+    seq = ack->ack + 1 + i;
+    if (!seq_lt(seq, channel->send_next)) {
+      break;
+    }
+    if (ack->sack & ((u64)1 << i)) {
+      newly_acked += reliable_segment_acked(
+          channel, segment_at(channel->send_segments, seq), &latest);
+      highest_acked = seq;
+    }
+  }
+
+  if (seq_lt(channel->window_end, ack->window_end)) {
+    channel->window_end = ack->window_end;
+  }
+
+  if (!newly_acked) {
+    return;
+  }
+  reliable_rtt_sample(channel, (u32)now - ack->timestamp_echo, now);
+  channel->delivered_time = now;
+  channel->first_sent_time = latest->sent_time;
+  reliable_model_update(channel, latest, now);
+
+  /* NOTE: fast retransmit, anything RELIABLE_DUP_THRESHOLD segments behind
+   * the highest acked one is considered lost, unless it was (re)sent after
+   * the segments that just got acked */
+  for (seq = channel->send_una;
+       seq_le(seq + RELIABLE_DUP_THRESHOLD, highest_acked); ++seq) {
+    ReliableSegment *segment;
+    segment = segment_at(channel->send_segments, seq);
+    if ((segment->flags & SegmentFlag_IN_FLIGHT) &&
+        segment->sent_time <= latest->sent_time) {
+      reliable_segment_lost(channel, segment);
+      channel->stats.fast_retransmits++;
+    }
+  }
+
+  channel->rto_deadline = channel->bytes_in_flight ? now + channel->rto : 0;
+}
+
+static void reliable_process_data(ReliableChannel *channel,
+                                  MessageReliableData *data) {
+  ReliableSegment *segment;
+  channel->stats.packets_received++;
+  channel->ack_pending = true;
+  channel->ack_timestamp_echo = data->timestamp;
+  if (seq_lt(data->seq, channel->recv_next) ||
+      !seq_lt(data->seq, channel->recv_read + RELIABLE_WINDOW) ||
+      data->size > RELIABLE_MSS) {
+    channel->stats.duplicates++;
+    return;
+  }
+  segment = segment_at(channel->recv_segments, data->seq);
+  if ((segment->flags & SegmentFlag_RECEIVED) && segment->seq == data->seq) {
+    channel->stats.duplicates++;
+    return;
+  }
+  segment->seq = data->seq;
+  segment->size = data->size;
+  segment->flags = SegmentFlag_RECEIVED;
+  memcpy(segment->data, data->data, data->size);
+  for (;;) {
+    segment = segment_at(channel->recv_segments, channel->recv_next);
+    if (!(segment->flags & SegmentFlag_RECEIVED) ||
+        segment->seq != channel->recv_next) {
+      break;
+    }
+    channel->recv_next++;
+  }
+}
+
+void reliable_process(ReliableChannel *channel, Message *msg, u64 now) {
+  switch (msg->header.type) {
+  case MessageType_RELIABLE_DATA: {
+    reliable_process_data(channel, &msg->reliable_data);
+  } break;
+  case MessageType_RELIABLE_ACK: {
+    reliable_process_ack(channel, &msg->reliable_ack, now);
+  } break;
+  default: {
+  } break;
+  }
+}
+
+static u32 reliable_flush(ReliableChannel *channel) {
+  u32 res;
+  res = dgram_batch_write_to(channel->dgram, &channel->batch, channel->addr);
+  dgram_batch_clear(&channel->batch);
+  return res;
+}
+
+static u32 reliable_push(ReliableChannel *channel, Message *msg) {
+  if (dgram_batch_push_message(&channel->batch, msg)) {
+    return CONN_OK;
+  }
+  if (reliable_flush(channel) == CONN_ERROR) {
+    return CONN_ERROR;
+  }
+  if (!dgram_batch_push_message(&channel->batch, msg)) {
+    return CONN_ERROR;
+  }
+  return CONN_OK;
+}
+
+static void reliable_on_timeout(ReliableChannel *channel) {
+  u32 seq;
+  for (seq = channel->send_una; seq != channel->send_next; ++seq) {
+    ReliableSegment *segment;
+    segment = segment_at(channel->send_segments, seq);
+    if (segment->flags & SegmentFlag_IN_FLIGHT) {
+      reliable_segment_lost(channel, segment);
+    }
+  }
+  /* NOTE: the path may have changed, forget the model and probe again */
+  memset(channel->bw_rounds, 0, sizeof(channel->bw_rounds));
+  channel->btl_bw = 0;
+  channel->full_bw = 0;
+  channel->full_bw_rounds = 0;
+  channel->mode = ReliableMode_STARTUP;
+  channel->cwnd = RELIABLE_MIN_CWND;
+  channel->rto = min(channel->rto * 2, RELIABLE_MAX_RTO_US);
+  channel->rto_deadline = 0;
+  channel->stats.timeouts++;
+}
+
+static ReliableSegment *reliable_next_segment(ReliableChannel *channel) {
+  if (channel->lost_count) {
+    u32 seq;
+    for (seq = channel->send_una; seq != channel->send_next; ++seq) {
+      ReliableSegment *segment;
+      segment = segment_at(channel->send_segments, seq);
+      if (segment->flags & SegmentFlag_LOST) {
+        return segment;
+      }
+    }
+  }
+  if (channel->send_next != channel->send_end &&
+      seq_lt(channel->send_next, channel->window_end)) {
+    return segment_at(channel->send_segments, channel->send_next);
+  }
+  return 0;
+}
+
+static u64 reliable_pacing_rate(ReliableChannel *channel) {
+  u64 gain;
+  switch (channel->mode) {
+  case ReliableMode_STARTUP: {
+    gain = STARTUP_GAIN;
+  } break;
+  case ReliableMode_DRAIN: {
+    gain = DRAIN_GAIN;
+  } break;
+  case ReliableMode_PROBE_BW:
+  default: {
+    gain = probe_bw_gains[channel->cycle_index];
+  } break;
+  }
+  if (channel->btl_bw) {
+    return channel->btl_bw * gain / 100;
+  }
+  /* NOTE: no bandwidth sample yet, pace the initial window over one rtt */
+  if (channel->srtt) {
+    return ((u64)channel->cwnd * 1000000 / channel->srtt) * gain / 100;
+  }
+  return 0;
+}
+
+u32 reliable_update(ReliableChannel *channel, u64 now) {
+  ReliableSegment *segment;
+  u64 rate;
+
+  if (channel->rto_deadline && now >= channel->rto_deadline) {
+    reliable_on_timeout(channel);
+  }
+
+  rate = reliable_pacing_rate(channel);
+  if (channel->next_send_time < now) {
+    channel->next_send_time = now;
+  }
+
+  dgram_batch_clear(&channel->batch);
+  while ((segment = reliable_next_segment(channel)) != 0) {
+    Message msg;
+    if (channel->bytes_in_flight &&
+        channel->bytes_in_flight + segment->size > channel->cwnd) {
+      break;
+    }
+    if (rate && channel->next_send_time > now + RELIABLE_PACING_QUANTUM_US) {
+      break;
+    }
+
+    msg.reliable_data.header.type = MessageType_RELIABLE_DATA;
+    msg.reliable_data.seq = segment->seq;
+    msg.reliable_data.timestamp = (u32)now;
+    msg.reliable_data.size = segment->size;
+    msg.reliable_data.data = segment->data;
+    if (reliable_push(channel, &msg) == CONN_ERROR) {
+      return CONN_ERROR;
+    }
+
+    if (segment->flags & SegmentFlag_LOST) {
+      channel->lost_count--;
+      channel->stats.retransmits++;
+    } else {
+      channel->send_next++;
+    }
+    if (!channel->bytes_in_flight) {
+      channel->first_sent_time = now;
+      channel->delivered_time = now;
+    }
+    segment->flags = SegmentFlag_IN_FLIGHT;
+    segment->sent_time = now;
+    segment->delivered = channel->delivered;
+    segment->delivered_time = channel->delivered_time;
+    segment->first_sent_time = channel->first_sent_time;
+    channel->bytes_in_flight += segment->size;
+    channel->stats.packets_sent++;
+    if (!channel->rto_deadline) {
+      channel->rto_deadline = now + channel->rto;
+    }
+    if (rate) {
+      channel->next_send_time += ((u64)segment->size * 1000000) / rate;
+    }
+  }
+
+  if (channel->ack_pending) {
+    Message msg;
+    u32 i;
+    msg.reliable_ack.header.type = MessageType_RELIABLE_ACK;
+    msg.reliable_ack.ack = channel->recv_next;
+    msg.reliable_ack.sack = 0;
+    for (i = 0; i < 64; ++i) {
+      ReliableSegment *received;
+      u32 seq;
+      seq = channel->recv_next + 1 + i;
+      if (!seq_lt(seq, channel->recv_read + RELIABLE_WINDOW)) {
+        break;
+      }
+      received = segment_at(channel->recv_segments, seq);
+      if ((received->flags & SegmentFlag_RECEIVED) && received->seq == seq) {
+        msg.reliable_ack.sack |= (u64)1 << i;
+      }
+    }
+    msg.reliable_ack.window_end = channel->recv_read + RELIABLE_WINDOW;
+    msg.reliable_ack.timestamp_echo = channel->ack_timestamp_echo;
+    if (reliable_push(channel, &msg) == CONN_ERROR) {
+      return CONN_ERROR;
+    }
+    channel->recv_advertised_end = msg.reliable_ack.window_end;
+    channel->ack_pending = false;
+    channel->stats.acks_sent++;
+  }
+
+  return reliable_flush(channel);
+}
+
+u64 reliable_next_timeout(ReliableChannel *channel, u64 now) {
+  u64 deadline;
+  ReliableSegment *segment;
+  if (channel->ack_pending) {
+    return 0;
+  }
+  deadline = channel->rto_deadline ? channel->rto_deadline
+                                   : RELIABLE_TIMEOUT_NONE;
+  segment = reliable_next_segment(channel);
+  if (segment && (!channel->bytes_in_flight ||
+                  channel->bytes_in_flight + segment->size <= channel->cwnd)) {
+    u64 pacing;
+    pacing = channel->next_send_time > RELIABLE_PACING_QUANTUM_US
+                 ? channel->next_send_time - RELIABLE_PACING_QUANTUM_US
+                 : 0;
+    deadline = min(deadline, pacing);
+  }
+  if (deadline == RELIABLE_TIMEOUT_NONE) {
+    return deadline;
+  }
+  return deadline > now ? deadline - now : 0;
+}
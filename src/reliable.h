@@ -0,0 +1,122 @@
+#ifndef _RELIABLE_H_
+#define _RELIABLE_H_
+
+#include "proto.h"
+
+/* NOTE: reliable ordered byte stream between two peers on top of a Dgram.
+ * Data is cut in RELIABLE_MSS segments, acked cumulatively plus a 64 segment
+ * selective ack bitmap, losses are detected by packet threshold (fast
+ * retransmit) or by the retransmission timer. Congestion control does not
+ * react to loss, it paces at the measured bottleneck bandwidth and keeps
+ * about two bandwidth delay products in flight (bbr style). All times are in
+ * microseconds */
+
+#define RELIABLE_MSS 1200
+#define RELIABLE_WINDOW 256
+#define RELIABLE_DUP_THRESHOLD 3
+#define RELIABLE_INITIAL_CWND (10 * RELIABLE_MSS)
+#define RELIABLE_MIN_CWND (4 * RELIABLE_MSS)
+#define RELIABLE_INITIAL_RTO_US 200000
+#define RELIABLE_MIN_RTO_US 10000
+#define RELIABLE_MAX_RTO_US 2000000
+#define RELIABLE_PACING_QUANTUM_US 1000
+#define RELIABLE_BW_ROUNDS 10
+#define RELIABLE_MIN_RTT_WINDOW_US 10000000
+#define RELIABLE_TIMEOUT_NONE ((u64) - 1)
+
+typedef enum SegmentFlag {
+  SegmentFlag_IN_FLIGHT = 1 << 0,
+  SegmentFlag_ACKED = 1 << 1,
+  SegmentFlag_LOST = 1 << 2,
+  SegmentFlag_RECEIVED = 1 << 3
+} SegmentFlag;
+
+typedef enum ReliableMode {
+  ReliableMode_STARTUP,
+  ReliableMode_DRAIN,
+  ReliableMode_PROBE_BW
+} ReliableMode;
+
+typedef struct ReliableSegment {
+  u32 seq;
+  u16 size;
+  u16 flags;
+  u64 sent_time;
+  /* NOTE: delivery state when the segment was sent, for rate samples */
+  u64 delivered;
+  u64 delivered_time;
+  u64 first_sent_time;
+  u8 data[RELIABLE_MSS];
+} ReliableSegment;
+
+typedef struct ReliableStats {
+  u64 packets_sent;
+  u64 packets_received;
+  u64 retransmits;
+  u64 fast_retransmits;
+  u64 timeouts;
+  u64 duplicates;
+  u64 acks_sent;
+} ReliableStats;
+
+typedef struct ReliableChannel {
+  Dgram *dgram;
+  ConnAddr *addr;
+  DgramBatch batch;
+
+  /* NOTE: send side, seqs in [send_una, send_end) are queued, the ones below
+   * send_next were transmitted at least once */
+  ReliableSegment *send_segments;
+  u32 send_una;
+  u32 send_next;
+  u32 send_end;
+  u32 window_end;
+  u32 lost_count;
+
+  /* NOTE: receive side, seqs in [recv_read, recv_next) are in order and
+   * waiting for reliable_recv */
+  ReliableSegment *recv_segments;
+  u32 recv_read;
+  u32 recv_read_offset;
+  u32 recv_next;
+  u32 recv_advertised_end;
+  b32 ack_pending;
+  u32 ack_timestamp_echo;
+
+  u64 srtt;
+  u64 rttvar;
+  u64 rto;
+  u64 rto_deadline;
+
+  u64 delivered;
+  u64 delivered_time;
+  u64 first_sent_time;
+  u64 round_delivered;
+  u32 round;
+  u64 bw_rounds[RELIABLE_BW_ROUNDS];
+  u64 btl_bw;
+  u64 min_rtt;
+  u64 min_rtt_time;
+  u64 full_bw;
+  u32 full_bw_rounds;
+  ReliableMode mode;
+  u32 cycle_index;
+  u64 cycle_start;
+
+  u32 cwnd;
+  u32 bytes_in_flight;
+  u64 next_send_time;
+
+  ReliableStats stats;
+} ReliableChannel;
+
+void reliable_init(ReliableChannel *channel, Arena *arena, Dgram *dgram,
+                   ConnAddr *addr);
+u32 reliable_send(ReliableChannel *channel, u8 *data, u32 size);
+u32 reliable_send_space(ReliableChannel *channel);
+u32 reliable_recv(ReliableChannel *channel, u8 *data, u32 size);
+void reliable_process(ReliableChannel *channel, Message *msg, u64 now);
+u32 reliable_update(ReliableChannel *channel, u64 now);
+u64 reliable_next_timeout(ReliableChannel *channel, u64 now);
+
+#endif
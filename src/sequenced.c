@@ -0,0 +1,188 @@
+#include "sequenced.h"
+
+#define seq16_newer(a, b) ((s16)((u16)(a) - (u16)(b)) > 0)
+
+void sequenced_init(SequencedChannel *channel, Arena *arena, Dgram *dgram,
+                    ConnAddr *addr, u64 flush_interval) {
+  u8 *buffer;
+  memset(channel, 0, sizeof(*channel));
+  channel->dgram = dgram;
+  channel->addr = addr;
+  channel->flush_interval = flush_interval;
+
+  buffer = arena_push(arena, DGRAM_BATCH_SIZE, 8);
+  dgram_batch_init(&channel->batch, buffer, DGRAM_BATCH_SIZE);
+
+  channel->packets = arena_push(
+      arena, sizeof(SequencedPacket) * SEQUENCED_MAX_PACKETS, 8);
+  channel->recv_buffer = arena_push(arena, SEQUENCED_RECV_BUFFER_SIZE, 8);
+  channel->recv_messages = arena_push(
+      arena, sizeof(SequencedMessage) * SEQUENCED_MAX_RECV, 8);
+}
+
+static SequencedPacket *sequenced_open_packet(SequencedChannel *channel,
+                                              u32 size) {
+  SequencedPacket *packet;
+  if (channel->packets_count) {
+    packet = &channel->packets[channel->packets_count - 1];
+    if (packet->size + size <= SEQUENCED_PAYLOAD_SIZE) {
+      return packet;
+    }
+  }
+  if (channel->packets_count == SEQUENCED_MAX_PACKETS) {
+    /* NOTE: more than a tick worth of data, do not wait for the tick */
+    if (sequenced_flush(channel) == CONN_ERROR) {
+      return 0;
+    }
+  }
+  packet = &channel->packets[channel->packets_count++];
+  packet->count = 0;
+  packet->size = 0;
+  return packet;
+}
+
+b32 sequenced_send(SequencedChannel *channel, u8 lane, u8 *data, u16 size) {
+  SequencedPacket *packet;
+  u8 *entry;
+  u16 seq;
+  if (lane >= SEQUENCED_LANES || size > SEQUENCED_MAX_MESSAGE_SIZE) {
+    return false;
+  }
+  packet = sequenced_open_packet(channel, SEQUENCED_ENTRY_HEADER_SIZE + size);
+  if (!packet) {
+    return false;
+  }
+  seq = ++channel->send_seq[lane];
+  entry = packet->entries + packet->size;
+  write_u8_be(entry, lane);
+  write_u16_be(entry, seq);
+  write_u16_be(entry, size);
+  memcpy(entry, data, size);
+  packet->size += SEQUENCED_ENTRY_HEADER_SIZE + size;
+  packet->count++;
+  channel->stats.messages_sent++;
+  return true;
+}
+
+u32 sequenced_send_batch(SequencedChannel *channel, SequencedMessage *msgs,
+                         u32 count) {
+  u32 i;
+  for (i = 0; i < count; ++i) {
+    if (!sequenced_send(channel, msgs[i].lane, msgs[i].data, msgs[i].size)) {
+      break;
+    }
+    msgs[i].seq = channel->send_seq[msgs[i].lane];
+  }
+  return i;
+}
+
+u32 sequenced_flush(SequencedChannel *channel) {
+  u32 i, res;
+  res = CONN_OK;
+  dgram_batch_clear(&channel->batch);
+  for (i = 0; i < channel->packets_count; ++i) {
+    SequencedPacket *packet;
+    Message msg;
+    packet = &channel->packets[i];
+    msg.sequenced.header.type = MessageType_SEQUENCED;
+    msg.sequenced.count = packet->count;
+    msg.sequenced.size = packet->size;
+    msg.sequenced.entries = packet->entries;
+    if (!dgram_batch_push_message(&channel->batch, &msg)) {
+      if (dgram_batch_write_to(channel->dgram, &channel->batch,
+                               channel->addr) == CONN_ERROR) {
+        res = CONN_ERROR;
+      }
+      dgram_batch_clear(&channel->batch);
+      dgram_batch_push_message(&channel->batch, &msg);
+    }
+    channel->stats.packets_sent++;
+  }
+  if (dgram_batch_write_to(channel->dgram, &channel->batch, channel->addr) ==
+      CONN_ERROR) {
+    res = CONN_ERROR;
+  }
+  dgram_batch_clear(&channel->batch);
+  channel->packets_count = 0;
+  return res;
+}
+
+u32 sequenced_update(SequencedChannel *channel, u64 now) {
+  if (now < channel->next_flush) {
+    return CONN_OK;
+  }
+  channel->next_flush = now + channel->flush_interval;
+  if (!channel->packets_count) {
+    return CONN_OK;
+  }
+  return sequenced_flush(channel);
+}
+
+u64 sequenced_next_timeout(SequencedChannel *channel, u64 now) {
+  if (!channel->packets_count) {
+    return SEQUENCED_TIMEOUT_NONE;
+  }
+  return channel->next_flush > now ? channel->next_flush - now : 0;
+}
+
+void sequenced_process(SequencedChannel *channel, Message *msg) {
+  u8 *entry, *end;
+  u32 i;
+  if (msg->header.type != MessageType_SEQUENCED) {
+    return;
+  }
+  channel->stats.packets_received++;
+  if (channel->recv_read == channel->recv_count) {
+    channel->recv_read = channel->recv_count = 0;
+    channel->recv_buffer_used = 0;
+  }
+  entry = msg->sequenced.entries;
+  end = entry + msg->sequenced.size;
+  for (i = 0; i < msg->sequenced.count; ++i) {
+    SequencedMessage *received;
+    u8 lane;
+    u16 seq, size;
+    if (entry + SEQUENCED_ENTRY_HEADER_SIZE > end) {
+      break;
+    }
+    lane = read_u8_be(entry);
+    seq = read_u16_be(entry);
+    size = read_u16_be(entry);
+    if (entry + size > end || lane >= SEQUENCED_LANES) {
+      break;
+    }
+    if ((channel->recv_lanes_seen & (1u << lane)) &&
+        !seq16_newer(seq, channel->recv_seq[lane])) {
+      channel->stats.stale_dropped++;
+      entry += size;
+      continue;
+    }
+    if (channel->recv_count == SEQUENCED_MAX_RECV ||
+        channel->recv_buffer_used + size > SEQUENCED_RECV_BUFFER_SIZE) {
+      channel->stats.overflow_dropped++;
+      entry += size;
+      continue;
+    }
+    channel->recv_lanes_seen |= 1u << lane;
+    channel->recv_seq[lane] = seq;
+    received = &channel->recv_messages[channel->recv_count++];
+    received->lane = lane;
+    received->seq = seq;
+    received->size = size;
+    received->data = channel->recv_buffer + channel->recv_buffer_used;
+    memcpy(received->data, entry, size);
+    channel->recv_buffer_used += size;
+    channel->stats.messages_received++;
+    entry += size;
+  }
+}
+
+u32 sequenced_recv_batch(SequencedChannel *channel, SequencedMessage *msgs,
+                         u32 count) {
+  u32 available;
+  available = min(count, channel->recv_count - channel->recv_read);
+  memcpy(msgs, channel->recv_messages + channel->recv_read,
+         sizeof(*msgs) * available);
+  channel->recv_read += available;
+  return available;
+}
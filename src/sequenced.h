@@ -0,0 +1,86 @@
+#ifndef _SEQUENCED_H_
+#define _SEQUENCED_H_
+
+#include "proto.h"
+
+/* NOTE: unreliable sequenced channel for real time state. Small messages are
+ * coalesced into datagrams of at most SEQUENCED_MTU bytes that leave once per
+ * flush tick, every message carries a lane and a per lane sequence number and
+ * the receiver drops anything not newer than what it already got on that
+ * lane. Nothing is acked or retransmitted */
+
+#define SEQUENCED_MTU 1200
+/* NOTE: proto magic, size, type and entry count */
+#define SEQUENCED_HEADER_SIZE 11
+/* NOTE: lane, seq and size of every entry */
+#define SEQUENCED_ENTRY_HEADER_SIZE 5
+#define SEQUENCED_PAYLOAD_SIZE (SEQUENCED_MTU - SEQUENCED_HEADER_SIZE)
+#define SEQUENCED_MAX_MESSAGE_SIZE                                             \
+  (SEQUENCED_PAYLOAD_SIZE - SEQUENCED_ENTRY_HEADER_SIZE)
+#define SEQUENCED_LANES 16
+#define SEQUENCED_MAX_PACKETS 16
+#define SEQUENCED_RECV_BUFFER_SIZE kb(64)
+#define SEQUENCED_MAX_RECV 1024
+#define SEQUENCED_TIMEOUT_NONE ((u64) - 1)
+
+typedef struct SequencedMessage {
+  u8 lane;
+  u16 seq;
+  u16 size;
+  u8 *data;
+} SequencedMessage;
+
+typedef struct SequencedPacket {
+  u16 count;
+  u16 size;
+  u8 entries[SEQUENCED_PAYLOAD_SIZE];
+} SequencedPacket;
+
+typedef struct SequencedStats {
+  u64 messages_sent;
+  u64 packets_sent;
+  u64 messages_received;
+  u64 packets_received;
+  u64 stale_dropped;
+  u64 overflow_dropped;
+} SequencedStats;
+
+typedef struct SequencedChannel {
+  Dgram *dgram;
+  ConnAddr *addr;
+  DgramBatch batch;
+
+  /* NOTE: packets waiting for the next flush, only the last one is open */
+  SequencedPacket *packets;
+  u32 packets_count;
+  u16 send_seq[SEQUENCED_LANES];
+
+  u16 recv_seq[SEQUENCED_LANES];
+  u32 recv_lanes_seen;
+  u8 *recv_buffer;
+  u32 recv_buffer_used;
+  SequencedMessage *recv_messages;
+  u32 recv_count;
+  u32 recv_read;
+
+  u64 flush_interval;
+  u64 next_flush;
+
+  SequencedStats stats;
+} SequencedChannel;
+
+void sequenced_init(SequencedChannel *channel, Arena *arena, Dgram *dgram,
+                    ConnAddr *addr, u64 flush_interval);
+b32 sequenced_send(SequencedChannel *channel, u8 lane, u8 *data, u16 size);
+u32 sequenced_send_batch(SequencedChannel *channel, SequencedMessage *msgs,
+                         u32 count);
+u32 sequenced_flush(SequencedChannel *channel);
+u32 sequenced_update(SequencedChannel *channel, u64 now);
+u64 sequenced_next_timeout(SequencedChannel *channel, u64 now);
+/* NOTE: data of the messages returned by sequenced_recv_batch is valid until
+ * the next call to sequenced_process */
+void sequenced_process(SequencedChannel *channel, Message *msg);
+u32 sequenced_recv_batch(SequencedChannel *channel, SequencedMessage *msgs,
+                         u32 count);
+
+#endif
@@ -1,4 +1,14 @@
+#include <signal.h>
+
+#include "capture.h"
+#include "config.h"
+#include "log.h"
+#include "metrics.h"
 #include "proto.h"
+#include "rank.h"
+#include "ratelimit.h"
+#include "stun.h"
+#include "trace.h"
 
 typedef struct PeerList {
   struct Peer *first;
@@ -7,24 +17,206 @@ typedef struct PeerList {
 
 typedef struct Peer {
   Stream stream;
+  /* NOTE: never reused, names the connection in a capture */
+  u32 id;
   MessageHeader *messages_first;
   MessageHeader *messages_last;
+  u32 messages_count;
+  /* NOTE: server memory held by the queue, see ctrl_message_cost */
+  u64 messages_bytes;
+  /* NOTE: the queue went over a limit, the peer waits in the context
+   * overflow list for peer_queues_enforce */
+  b32 overflowing;
+  struct Peer *overflow_next;
+  struct Peer *overflow_prev;
+  /* NOTE: the arena ran out building a message for the peer, it is in the
+   * overflow list and peer_queues_enforce lets it go */
+  b32 starved;
+  /* NOTE: the last queue-bytes-max pass that ran the policy on the peer */
+  u64 budget_stamp;
+
+  ConnEndpoint endpoint;
+  u32 candidates_count;
+  Candidate candidates[CANDIDATES_MAX];
 
-  u32 raw_addr;
-  u16 raw_port;
-  u32 raw_local_addr;
-  u16 raw_local_port;
+  /* NOTE: zero until the peer sends CONNECT */
+  struct Room *room;
+  struct Peer *room_next;
+  struct Peer *room_prev;
+  /* NOTE: order of the joins, a peer is told about the ones after its own.
+   * Until the joins of its room are flushed the peer is in room->joins */
+  u64 join_seq;
+  b32 joining;
+  struct Peer *join_next;
+  struct Peer *join_prev;
+  /* NOTE: when the peer last went into a ranked list, see peer_rank_key.
+   * rank_stamp marks the peers one ranking already looked at */
+  u64 assigned_seq;
+  u64 rank_stamp;
+  /* NOTE: the peer joined a large room and got a ranked list, only the peers
+   * in it hear about the join */
+  b32 ranked;
+  /* NOTE: same room and prefix chain of the context prefix table */
+  struct Peer **prefix_head;
+  struct Peer *prefix_next;
+  struct Peer *prefix_prev;
+  /* NOTE: where the next page starts and the pages served since the join.
+   * The peers whose cursor is this one are its page holders, a leave moves
+   * them on to the next peer of the room */
+  struct Peer *page_cursor;
+  u32 pages;
+  struct Peer *page_holders_first;
+  struct Peer *page_holders_last;
+  struct Peer *page_holder_next;
+  struct Peer *page_holder_prev;
+  /* NOTE: ranked joiners this peer was picked for, they go in its queue with
+   * the next flush. The peer is in the context announce list meanwhile */
+  MessagePeersToConnect *announce;
+  struct Peer *announce_next;
+  struct Peer *announce_prev;
 
   struct Peer *next;
   struct Peer *prev;
 } Peer;
 
+/* NOTE: a session, CONNECT fan out only walks the peers of one room. Rooms
+ * live in a chained hash table by id and go back to a free list once the
+ * last peer leaves */
+typedef struct Room {
+  u32 id;
+  u32 peers_count;
+  Peer *peers_first;
+  Peer *peers_last;
+  /* NOTE: peers that joined since the last flush, the room is in the
+   * context joins list while there is any */
+  Peer *joins_first;
+  Peer *joins_last;
+  u32 joins_count;
+  struct Room *joins_next;
+  struct Room *joins_prev;
+  /* NOTE: where the window of the next ranking starts, see room_top_peers */
+  Peer *rank_cursor;
+  /* NOTE: bucket chain, or free list link */
+  struct Room *next;
+} Room;
+
+/* NOTE: what happens to a peer that reads slower than its queue grows */
+typedef enum QueuePolicy {
+  /* NOTE: the queue is replaced by one list of the current room */
+  QueuePolicy_SNAPSHOT,
+  /* NOTE: the oldest messages go until the queue fits */
+  QueuePolicy_DROP,
+  QueuePolicy_DISCONNECT,
+  QueuePolicy_COUNT
+} QueuePolicy;
+
+static char *queue_policy_names[QueuePolicy_COUNT] = {"snapshot", "drop",
+                                                      "disconnect"};
+
+typedef struct ServerConfig {
+  char bind_address[CONFIG_STRING_SIZE];
+  u16 ctrl_port;
+  u16 stun_port;
+  u64 arena_size;
+  u64 event_arena_size;
+  u32 room_buckets;
+  u32 stun_limiter_sets;
+  u32 stun_limiter_rate;
+  u32 stun_limiter_burst;
+  u32 stun_max_pending_replies;
+  u64 stun_reply_batch_size;
+  u32 stats_interval_ms;
+  char metrics_path[CONFIG_STRING_SIZE];
+  u32 loop_slow_us;
+  char log_path[CONFIG_STRING_SIZE];
+  u32 log_capacity;
+  char capture_path[CONFIG_STRING_SIZE];
+  u64 capture_size;
+  u32 join_window_ms;
+  u32 join_peers_max;
+  u32 join_pages_max;
+  u32 gossip_seeds;
+  u32 peer_queue_messages;
+  u64 peer_queue_bytes;
+  u64 queue_bytes_max;
+  u32 stream_buffers_max;
+  char peer_queue_policy_name[CONFIG_STRING_SIZE];
+  QueuePolicy peer_queue_policy;
+} ServerConfig;
+
+/* NOTE: slots in the metrics file, see metrics.h. Gauges that mirror state
+ * kept somewhere else are refreshed once per loop iteration */
+typedef struct ServerMetrics {
+  MetricsValue *accepts;
+  MetricsValue *disconnects;
+  MetricsValue *connects;
+  MetricsValue *pages;
+  MetricsValue *messages_sent;
+  MetricsValue *stun_requests;
+  MetricsValue *stun_bindings;
+  MetricsValue *stun_rate_limited;
+  MetricsValue *stun_queue_dropped;
+  MetricsValue *keepalives;
+  MetricsValue *loop_iterations;
+  MetricsValue *log_suppressed;
+  MetricsValue *log_dropped;
+  MetricsValue *capture_records;
+  MetricsValue *capture_dropped;
+  MetricsValue *peers;
+  MetricsValue *rooms;
+  MetricsValue *queued_messages;
+  MetricsValue *queued_bytes;
+  MetricsValue *queue_snapshots;
+  MetricsValue *queue_dropped;
+  MetricsValue *queue_disconnects;
+  /* NOTE: policy runs because of queue-bytes-max, and peers let go because
+   * the arena ran out */
+  MetricsValue *queue_budget_runs;
+  MetricsValue *queue_starved;
+  /* NOTE: receive buffers held by half read frames, ever allocated, and
+   * streams disconnected because stream-buffers-max were in use */
+  MetricsValue *recv_buffers;
+  MetricsValue *recv_buffers_allocated;
+  MetricsValue *recv_buffers_exhausted;
+  MetricsValue *stun_pending;
+  MetricsValue *arena_used;
+  MetricsValue *event_arena_peak;
+  /* NOTE: recipients of one CONNECT */
+  MetricsHistogram *fanout;
+  /* NOTE: joins announced by one flush of a room */
+  MetricsHistogram *join_batch;
+  /* NOTE: length of a peer queue right after a push */
+  MetricsHistogram *queue_depth;
+  /* NOTE: serialize and write of one ctrl message, or of one chunk of a
+   * large one, in nanoseconds */
+  MetricsHistogram *send_ns;
+  /* NOTE: one sample per loop iteration, durations in nanoseconds. process
+   * does not include the time blocked in poll and busy is the iteration
+   * without it */
+  MetricsHistogram *loop_prepare_ns;
+  MetricsHistogram *loop_poll_ns;
+  MetricsHistogram *loop_process_ns;
+  MetricsHistogram *loop_cleanup_ns;
+  MetricsHistogram *loop_busy_ns;
+  MetricsHistogram *loop_ready;
+  MetricsHistogram *loop_work;
+} ServerMetrics;
+
 typedef struct Context {
+  ServerConfig config;
+
+  Metrics metrics;
+  ServerMetrics m;
+  Log log;
+  /* NOTE: only recording when capture.file.data is set */
+  Capture capture;
+
   Arena arena;
   Arena event_arena;
 
   MessageAllocator message_allocator;
   AddrMessageAllocator addr_message_allocator;
+  StreamBufferPool stream_buffers;
 
   Stream ctrl;
   ConnAddr *ctrl_addr;
@@ -38,9 +230,54 @@ typedef struct Context {
   Peer *peers_first;
   Peer *peers_last;
   Peer *peers_first_free;
+  u32 peers_count;
+  u32 peers_next_id;
+  u32 queued_messages;
+  u64 queued_bytes;
+  Peer *overflow_first;
+  Peer *overflow_last;
+  u64 budget_stamp;
+  /* NOTE: entries of queued PEERS_TO_CONNECT, they live until the message is
+   * written so they can not come from the event arena */
+  PeerConnected *peers_connected_first_free;
+
+  Room **rooms;
+  Room *rooms_first_free;
+  u32 rooms_count;
+  /* NOTE: rooms with joins not announced yet, see room_joins_flush */
+  Room *joins_rooms_first;
+  Room *joins_rooms_last;
+  u64 joins_time;
+  u64 join_seq;
+  u64 assign_seq;
+  u64 rank_stamp;
+  /* NOTE: room and prefix buckets, as many as room_buckets */
+  Peer **prefixes;
+  /* NOTE: peers with ranked joins to announce, see room_top_peers */
+  Peer *announce_first;
+  Peer *announce_last;
 
   AddrMessage *addr_messages_first;
   AddrMessage *addr_messages_last;
+  u32 addr_messages_count;
+
+  RateLimiter stun_limiter;
+  u64 stun_queue_dropped;
+  u64 stun_replies_inline;
+  u64 stun_replies_queued;
+  u8 stun_response_ipv4[STUN_RESPONSE_IPV4_SIZE];
+  u8 stun_response_ipv6[STUN_RESPONSE_IPV6_SIZE];
+  /* NOTE: rfc 5389 replies to one read batch, they leave together */
+  DgramBatch stun_replies;
+  u64 stun_binding_replies;
+
+  /* NOTE: time of the last wake up, in microseconds */
+  u64 now;
+  u64 stats_time;
+  /* NOTE: filled by event_loop_process for the phase histograms */
+  u64 loop_poll_ns;
+  u32 loop_ready;
+  u32 loop_work;
 
   b32 running;
 } Context;
@@ -51,10 +288,8 @@ b32 ctrl_server_init(Stream *ctrl, ConnAddr *addr) {
   if (tcp.err == CONN_ERROR) {
     return false;
   }
-  ctrl->conn = tcp.conn;
-  ctrl->recv_buffer_used = 0;
-  ctrl->bytes_to_farm = 0;
-  ctrl->farming = false;
+  /* NOTE: listens only, it never reads a frame */
+  stream_init(ctrl, tcp.conn, 0);
   if (conn_bind(ctrl->conn, addr) == CONN_ERROR) {
     return false;
   }
@@ -74,32 +309,342 @@ b32 stun_server_init(Dgram *stun, ConnAddr *addr) {
   if (conn_bind(stun->conn, addr) == CONN_ERROR) {
     return false;
   }
+  /* NOTE: optional, without it every datagram is read by its own syscall */
+  dgram_enable_segmentation(stun);
   return true;
 }
 
-#define SERVER_ADDRESS "192.168.100.197"
-#define CTRL_PORT 8080
-#define STUN_PORT 8081
+/* NOTE: defaults, every one of them can be changed with a flag or in the
+ * config file, see server_config_options */
+#define DEFAULT_BIND_ADDRESS ""
+#define DEFAULT_CTRL_PORT 8080
+#define DEFAULT_STUN_PORT 8081
 
 #define DEFAULT_ARENAS_SIZE mb(10)
+/* NOTE: power of two, chains stay short up to a few rooms per bucket */
+#define DEFAULT_ROOM_BUCKETS 8192
+
+/* NOTE: 4096 sets of 4 buckets is 256kb and tracks 16k sources */
+#define DEFAULT_STUN_LIMITER_SETS 4096
+#define DEFAULT_STUN_LIMITER_RATE 10
+#define DEFAULT_STUN_LIMITER_BURST 20
+#define DEFAULT_STUN_MAX_PENDING_REPLIES 4096
+#define DEFAULT_STATS_INTERVAL_MS 10000
+#define DEFAULT_METRICS_PATH ""
+#define DEFAULT_LOOP_SLOW_US 0
+#define DEFAULT_LOG_PATH ""
+#define DEFAULT_CAPTURE_PATH ""
+/* NOTE: 0 announces the joins of a loop iteration at its end */
+#define DEFAULT_JOIN_WINDOW_MS 0
+/* NOTE: 0 sends a joiner the whole room */
+#define DEFAULT_JOIN_PEERS_MAX 0
+#define DEFAULT_JOIN_PAGES_MAX 64
+/* NOTE: a ranking looks at this many candidates per peer it returns, from
+ * the prefix table and from the room window each */
+#define JOIN_SCAN_FACTOR 4
+/* NOTE: 0 announces every join to the whole room */
+#define DEFAULT_GOSSIP_SEEDS 0
+/* NOTE: a list of a room of a few thousand peers still fits */
+#define DEFAULT_PEER_QUEUE_MESSAGES 1024
+#define DEFAULT_PEER_QUEUE_BYTES mb(1)
+/* NOTE: 0 is half of arena-size */
+#define DEFAULT_QUEUE_BYTES_MAX 0
+#define DEFAULT_STREAM_BUFFERS_MAX 128
+#define DEFAULT_PEER_QUEUE_POLICY "snapshot"
+/* NOTE: room to grow, slots are registered once at startup */
+#define METRICS_VALUES_CAPACITY 64
+#define METRICS_HISTOGRAMS_CAPACITY 16
+
+void server_config_default(ServerConfig *config) {
+  memset(config, 0, sizeof(*config));
+  strcpy(config->bind_address, DEFAULT_BIND_ADDRESS);
+  config->ctrl_port = DEFAULT_CTRL_PORT;
+  config->stun_port = DEFAULT_STUN_PORT;
+  config->arena_size = DEFAULT_ARENAS_SIZE;
+  config->event_arena_size = DEFAULT_ARENAS_SIZE;
+  config->room_buckets = DEFAULT_ROOM_BUCKETS;
+  config->stun_limiter_sets = DEFAULT_STUN_LIMITER_SETS;
+  config->stun_limiter_rate = DEFAULT_STUN_LIMITER_RATE;
+  config->stun_limiter_burst = DEFAULT_STUN_LIMITER_BURST;
+  config->stun_max_pending_replies = DEFAULT_STUN_MAX_PENDING_REPLIES;
+  config->stun_reply_batch_size = DGRAM_BATCH_SIZE;
+  config->stats_interval_ms = DEFAULT_STATS_INTERVAL_MS;
+  strcpy(config->metrics_path, DEFAULT_METRICS_PATH);
+  config->loop_slow_us = DEFAULT_LOOP_SLOW_US;
+  strcpy(config->log_path, DEFAULT_LOG_PATH);
+  config->log_capacity = LOG_DEFAULT_CAPACITY;
+  strcpy(config->capture_path, DEFAULT_CAPTURE_PATH);
+  config->capture_size = CAPTURE_DEFAULT_SIZE;
+  config->join_window_ms = DEFAULT_JOIN_WINDOW_MS;
+  config->join_peers_max = DEFAULT_JOIN_PEERS_MAX;
+  config->join_pages_max = DEFAULT_JOIN_PAGES_MAX;
+  config->gossip_seeds = DEFAULT_GOSSIP_SEEDS;
+  config->peer_queue_messages = DEFAULT_PEER_QUEUE_MESSAGES;
+  config->peer_queue_bytes = DEFAULT_PEER_QUEUE_BYTES;
+  config->queue_bytes_max = DEFAULT_QUEUE_BYTES_MAX;
+  config->stream_buffers_max = DEFAULT_STREAM_BUFFERS_MAX;
+  strcpy(config->peer_queue_policy_name, DEFAULT_PEER_QUEUE_POLICY);
+  config->peer_queue_policy = QueuePolicy_SNAPSHOT;
+}
+
+u32 server_config_parse(ServerConfig *config, int argc, char **argv) {
+  u32 res, i;
+  ConfigOption options[] = {
+      {"bind", ConfigType_STRING, config->bind_address, 0, 0,
+       "address of the ctrl and stun sockets, empty is any"},
+      {"ctrl-port", ConfigType_U16, &config->ctrl_port, 1, 0xffff,
+       "tcp port of the ctrl server"},
+      {"stun-port", ConfigType_U16, &config->stun_port, 1, 0xffff,
+       "udp port of the stun server"},
+      {"arena-size", ConfigType_SIZE, &config->arena_size, mb(1), gb(64),
+       "bytes reserved for long lived state"},
+      {"event-arena-size", ConfigType_SIZE, &config->event_arena_size, mb(1),
+       gb(64), "bytes reserved for one event loop iteration"},
+      {"room-buckets", ConfigType_U32, &config->room_buckets, 1, 1u << 24,
+       "room hash table size, power of two"},
+      {"stun-limiter-sets", ConfigType_U32, &config->stun_limiter_sets, 1,
+       1u << 24, "stun rate limiter sets of 4 sources, power of two"},
+      {"stun-limiter-rate", ConfigType_U32, &config->stun_limiter_rate, 1,
+       RATE_LIMIT_TOKEN, "stun requests per second per source"},
+      {"stun-limiter-burst", ConfigType_U32, &config->stun_limiter_burst, 1,
+       RATE_LIMIT_MAX_BURST, "stun requests a source can burst"},
+      {"stun-max-pending-replies", ConfigType_U32,
+       &config->stun_max_pending_replies, 1, 1u << 24,
+       "stun replies queued while the socket would block"},
+      {"stun-reply-batch-size", ConfigType_SIZE,
+       &config->stun_reply_batch_size, STUN_BINDING_RESPONSE_IPV6_SIZE,
+       DGRAM_BATCH_SIZE, "bytes of rfc 5389 replies sent with one syscall"},
+      {"stats-interval-ms", ConfigType_U32, &config->stats_interval_ms, 1,
+       3600000, "milliseconds between stats lines"},
+      {"metrics", ConfigType_STRING, config->metrics_path, 0, 0,
+       "file shared with tenet-top, empty keeps the metrics private"},
+      {"loop-slow-us", ConfigType_U32, &config->loop_slow_us, 0, 0xffffffff,
+       "print the phases of loop iterations busy longer than this, 0 is off"},
+      {"log", ConfigType_STRING, config->log_path, 0, 0,
+       "file the log is appended to, empty is stdout"},
+      {"log-capacity", ConfigType_U32, &config->log_capacity, 16, 1u << 24,
+       "log records buffered for the writer thread, a power of two"},
+      {"capture", ConfigType_STRING, config->capture_path, 0, 0,
+       "pcapng file to record the traffic to for tenet-replay, empty is off"},
+      {"capture-size", ConfigType_SIZE, &config->capture_size, kb(64),
+       gb(64), "bytes reserved for the capture, recording stops when full"},
+      {"join-window-ms", ConfigType_U32, &config->join_window_ms, 0, 1000,
+       "milliseconds joins are collected before they are announced"},
+      {"join-peers-max", ConfigType_U32, &config->join_peers_max, 0,
+       1u << 20, "best peers a joiner gets, the rest in pages, 0 is all"},
+      {"join-pages-max", ConfigType_U32, &config->join_pages_max, 0,
+       1u << 20, "PEERS_MORE a peer gets answered after each join"},
+      {"gossip-seeds", ConfigType_U32, &config->gossip_seeds, 0, 64,
+       "peers a joiner meets, the room gossips the rest, 0 is off"},
+      {"peer-queue-messages", ConfigType_U32, &config->peer_queue_messages, 1,
+       1u << 24, "messages queued for a peer before its policy runs"},
+      {"peer-queue-bytes", ConfigType_SIZE, &config->peer_queue_bytes, kb(64),
+       gb(1), "bytes queued for a peer before its policy runs"},
+      {"queue-bytes-max", ConfigType_SIZE, &config->queue_bytes_max, 0,
+       gb(32), "bytes queued for all peers before the largest queues get "
+               "the policy, 0 is half of arena-size"},
+      {"stream-buffers-max", ConfigType_U32, &config->stream_buffers_max, 1,
+       1u << 20, "buffers of half read frames and unsent writes, a peer "
+                 "that finds none is disconnected"},
+      {"peer-queue-policy", ConfigType_STRING, config->peer_queue_policy_name,
+       0, 0, "slow peers get a snapshot, drop old messages or disconnect"},
+  };
+  res = config_parse_args(options, array_len(options), argc, argv);
+  if (res != CONFIG_OK) {
+    return res;
+  }
+  if (!is_power_of_two(config->room_buckets) ||
+      !is_power_of_two(config->stun_limiter_sets) ||
+      !is_power_of_two(config->log_capacity)) {
+    fprintf(stderr, "room-buckets, stun-limiter-sets and log-capacity must "
+                    "be powers of two\n");
+    return CONFIG_ERROR;
+  }
+  for (i = 0; i < QueuePolicy_COUNT; ++i) {
+    if (strcmp(config->peer_queue_policy_name, queue_policy_names[i]) == 0) {
+      break;
+    }
+  }
+  if (i == QueuePolicy_COUNT) {
+    fprintf(stderr, "peer-queue-policy must be snapshot, drop or disconnect\n");
+    return CONFIG_ERROR;
+  }
+  config->peer_queue_policy = (QueuePolicy)i;
+  /* NOTE: the queues share the arena with the peers and rooms, a budget
+   * near its size would assert before any policy had a chance to run */
+  if (!config->queue_bytes_max) {
+    config->queue_bytes_max = config->arena_size / 2;
+  }
+  if (config->queue_bytes_max > config->arena_size / 2) {
+    fprintf(stderr, "queue-bytes-max must be at most half of arena-size\n");
+    return CONFIG_ERROR;
+  }
+  if (config->peer_queue_bytes > config->queue_bytes_max / 4) {
+    fprintf(stderr,
+            "peer-queue-bytes must be at most a quarter of queue-bytes-max\n");
+    return CONFIG_ERROR;
+  }
+  /* NOTE: the buffers are reserved up front next to the queue budget */
+  if ((u64)config->stream_buffers_max * STREAM_BUFFER_SIZE >
+      config->arena_size / 4) {
+    fprintf(stderr, "stream-buffers-max must take at most a quarter of "
+                    "arena-size\n");
+    return CONFIG_ERROR;
+  }
+  config_print(options, array_len(options));
+  return CONFIG_OK;
+}
 
-void ctx_init(Context *ctx) {
+ConnAddr *server_bind_address(Context *ctx, u16 port) {
+  if (!ctx->config.bind_address[0]) {
+    return conn_address_any(&ctx->arena, port);
+  }
+  return conn_address(&ctx->arena, ctx->config.bind_address, port);
+}
+
+void stun_response_template_init(Context *ctx, u8 *template, u8 family,
+                                 u32 template_size) {
+  Message msg;
+  u8 *buffer;
+  u64 mark, size;
+  mark = ctx->arena.used;
+  memset(&msg, 0, sizeof(msg));
+  msg.stun_response.header.type = MessageType_STUN_RESPONSE;
+  msg.stun_response.endpoint.family = family;
+  buffer = message_serialize(&ctx->arena, &msg, &size);
+  assert(size == template_size);
+  memcpy(template, buffer, template_size);
+  ctx->arena.used = mark;
+}
+
+void server_metrics_init(Context *ctx) {
+  Metrics *metrics;
+  ServerMetrics *m;
+  metrics = &ctx->metrics;
+  m = &ctx->m;
+  if (!metrics_open(metrics, ctx->config.metrics_path,
+                    METRICS_VALUES_CAPACITY, METRICS_HISTOGRAMS_CAPACITY)) {
+    b32 res;
+    fprintf(stderr, "%s: can not create the metrics file, they stay "
+                    "private\n",
+            ctx->config.metrics_path);
+    res = metrics_open(metrics, 0, METRICS_VALUES_CAPACITY,
+                       METRICS_HISTOGRAMS_CAPACITY);
+    assert(res);
+    (void)res;
+  }
+  m->accepts = metrics_value(metrics, "ctrl.accepts", MetricType_COUNTER);
+  m->disconnects =
+      metrics_value(metrics, "ctrl.disconnects", MetricType_COUNTER);
+  m->connects = metrics_value(metrics, "ctrl.connects", MetricType_COUNTER);
+  m->messages_sent =
+      metrics_value(metrics, "ctrl.messages_sent", MetricType_COUNTER);
+  m->queued_messages =
+      metrics_value(metrics, "ctrl.queued_messages", MetricType_GAUGE);
+  m->queued_bytes =
+      metrics_value(metrics, "ctrl.queued_bytes", MetricType_GAUGE);
+  m->queue_snapshots =
+      metrics_value(metrics, "ctrl.queue_snapshots", MetricType_COUNTER);
+  m->queue_dropped =
+      metrics_value(metrics, "ctrl.queue_dropped", MetricType_COUNTER);
+  m->queue_disconnects =
+      metrics_value(metrics, "ctrl.queue_disconnects", MetricType_COUNTER);
+  m->queue_budget_runs =
+      metrics_value(metrics, "ctrl.queue_budget_runs", MetricType_COUNTER);
+  m->queue_starved =
+      metrics_value(metrics, "ctrl.queue_starved", MetricType_COUNTER);
+  m->recv_buffers =
+      metrics_value(metrics, "ctrl.recv_buffers", MetricType_GAUGE);
+  m->recv_buffers_allocated =
+      metrics_value(metrics, "ctrl.recv_buffers_allocated", MetricType_GAUGE);
+  m->recv_buffers_exhausted =
+      metrics_value(metrics, "ctrl.recv_buffers_exhausted", MetricType_COUNTER);
+  m->stun_requests =
+      metrics_value(metrics, "stun.requests", MetricType_COUNTER);
+  m->stun_bindings =
+      metrics_value(metrics, "stun.rfc5389_bindings", MetricType_COUNTER);
+  m->stun_rate_limited =
+      metrics_value(metrics, "stun.rate_limited", MetricType_COUNTER);
+  m->stun_queue_dropped =
+      metrics_value(metrics, "stun.queue_dropped", MetricType_COUNTER);
+  m->stun_pending = metrics_value(metrics, "stun.pending", MetricType_GAUGE);
+  m->keepalives = metrics_value(metrics, "stun.keepalives", MetricType_COUNTER);
+  m->loop_iterations =
+      metrics_value(metrics, "loop.iterations", MetricType_COUNTER);
+  m->log_suppressed =
+      metrics_value(metrics, "log.suppressed", MetricType_COUNTER);
+  m->log_dropped = metrics_value(metrics, "log.dropped", MetricType_COUNTER);
+  m->capture_records =
+      metrics_value(metrics, "capture.records", MetricType_COUNTER);
+  m->capture_dropped =
+      metrics_value(metrics, "capture.dropped", MetricType_COUNTER);
+  m->peers = metrics_value(metrics, "peers", MetricType_GAUGE);
+  m->rooms = metrics_value(metrics, "rooms", MetricType_GAUGE);
+  m->arena_used = metrics_value(metrics, "arena.used", MetricType_GAUGE);
+  m->event_arena_peak =
+      metrics_value(metrics, "event_arena.peak", MetricType_GAUGE);
+  m->fanout = metrics_histogram(metrics, "connect.fanout");
+  m->join_batch = metrics_histogram(metrics, "connect.join_batch");
+  m->pages = metrics_value(metrics, "connect.pages", MetricType_COUNTER);
+  m->queue_depth = metrics_histogram(metrics, "ctrl.queue_depth");
+  m->send_ns = metrics_histogram(metrics, "ctrl.send_ns");
+  m->loop_prepare_ns = metrics_histogram(metrics, "loop.prepare_ns");
+  m->loop_poll_ns = metrics_histogram(metrics, "loop.poll_ns");
+  m->loop_process_ns = metrics_histogram(metrics, "loop.process_ns");
+  m->loop_cleanup_ns = metrics_histogram(metrics, "loop.cleanup_ns");
+  m->loop_busy_ns = metrics_histogram(metrics, "loop.busy_ns");
+  m->loop_ready = metrics_histogram(metrics, "loop.ready");
+  m->loop_work = metrics_histogram(metrics, "loop.work");
+}
+
+void ctx_init(Context *ctx, ServerConfig *config) {
+  ctx->config = *config;
+  server_metrics_init(ctx);
+  if (!log_open(&ctx->log, ctx->config.log_path, ctx->config.log_capacity)) {
+    b32 res;
+    fprintf(stderr, "%s: can not open the log, using stdout\n",
+            ctx->config.log_path);
+    res = log_open(&ctx->log, 0, ctx->config.log_capacity);
+    assert(res);
+    (void)res;
+  }
+  if (ctx->config.capture_path[0] &&
+      !capture_open(&ctx->capture, ctx->config.capture_path,
+                    ctx->config.capture_size)) {
+    fprintf(stderr, "%s: can not create the capture, not recording\n",
+            ctx->config.capture_path);
+  }
   /* Tomi: arenas setup */
-  arena_init(&ctx->arena, (u8 *)malloc(DEFAULT_ARENAS_SIZE),
-             DEFAULT_ARENAS_SIZE);
-  arena_init(&ctx->event_arena, (u8 *)malloc(DEFAULT_ARENAS_SIZE),
-             DEFAULT_ARENAS_SIZE);
+  arena_init(&ctx->arena, (u8 *)malloc(config->arena_size),
+             config->arena_size);
+  arena_init(&ctx->event_arena, (u8 *)malloc(config->event_arena_size),
+             config->event_arena_size);
 
   /* Tomi: allocators setup */
   message_allocator_init(&ctx->message_allocator, &ctx->arena);
   addr_message_allocator_init(&ctx->addr_message_allocator, &ctx->arena);
+  stream_buffer_pool_init(&ctx->stream_buffers, &ctx->arena,
+                          config->stream_buffers_max);
 
   /* Tomi: ctrl server setup */
-  ctx->ctrl_addr = conn_address(&ctx->arena, SERVER_ADDRESS, CTRL_PORT);
+  ctx->ctrl_addr = server_bind_address(ctx, config->ctrl_port);
   assert(ctrl_server_init(&ctx->ctrl, ctx->ctrl_addr));
   /* Tomi: stun server setup */
-  ctx->stun_addr = conn_address(&ctx->arena, SERVER_ADDRESS, STUN_PORT);
+  ctx->stun_addr = server_bind_address(ctx, config->stun_port);
   assert(stun_server_init(&ctx->stun, ctx->stun_addr));
+  rate_limiter_init(&ctx->stun_limiter, &ctx->arena, config->stun_limiter_sets,
+                    config->stun_limiter_rate, config->stun_limiter_burst);
+  ctx->stun_queue_dropped = 0;
+  ctx->stun_replies_inline = 0;
+  ctx->stun_replies_queued = 0;
+  stun_response_template_init(ctx, ctx->stun_response_ipv4, CONN_FAMILY_IPV4,
+                              STUN_RESPONSE_IPV4_SIZE);
+  stun_response_template_init(ctx, ctx->stun_response_ipv6, CONN_FAMILY_IPV6,
+                              STUN_RESPONSE_IPV6_SIZE);
+  dgram_batch_init(&ctx->stun_replies,
+                   arena_push(&ctx->arena, config->stun_reply_batch_size, 8),
+                   (u32)config->stun_reply_batch_size);
+  ctx->stun_binding_replies = 0;
   /* Tomi: select sets setup */
   ctx->read = conn_set_create(&ctx->arena);
   ctx->write = conn_set_create(&ctx->arena);
@@ -109,8 +654,35 @@ void ctx_init(Context *ctx) {
   ctx->peers_first = 0;
   ctx->peers_last = 0;
   ctx->peers_first_free = 0;
+  ctx->peers_count = 0;
+  ctx->queued_messages = 0;
+  ctx->queued_bytes = 0;
+  ctx->budget_stamp = 0;
+  ctx->overflow_first = 0;
+  ctx->overflow_last = 0;
+  ctx->peers_connected_first_free = 0;
+  ctx->rooms =
+      arena_push(&ctx->arena, sizeof(Room *) * config->room_buckets, 8);
+  memset(ctx->rooms, 0, sizeof(Room *) * config->room_buckets);
+  ctx->rooms_first_free = 0;
+  ctx->rooms_count = 0;
+  ctx->joins_rooms_first = 0;
+  ctx->joins_rooms_last = 0;
+  ctx->joins_time = 0;
+  ctx->join_seq = 0;
+  ctx->assign_seq = 0;
+  ctx->rank_stamp = 0;
+  ctx->prefixes =
+      arena_push(&ctx->arena, sizeof(Peer *) * config->room_buckets, 8);
+  memset(ctx->prefixes, 0, sizeof(Peer *) * config->room_buckets);
+  ctx->announce_first = 0;
+  ctx->announce_last = 0;
   ctx->addr_messages_first = 0;
   ctx->addr_messages_last = 0;
+  ctx->addr_messages_count = 0;
+
+  ctx->now = conn_current_time_us();
+  ctx->stats_time = ctx->now;
 }
 
 void peer_connect(Context *ctx, Conn conn) {
@@ -119,26 +691,233 @@ void peer_connect(Context *ctx, Conn conn) {
     peer = ctx->peers_first_free;
     ctx->peers_first_free = ctx->peers_first_free->next;
   } else {
-    peer = arena_push(&ctx->arena, sizeof(*peer), 8);
+    peer = arena_try_push(&ctx->arena, sizeof(*peer), 8);
+  }
+  /* NOTE: no room for another peer, the connection goes and the server
+   * stays */
+  if (!peer) {
+    conn_close(conn);
+    metrics_add(ctx->m.queue_starved, 1);
+    return;
   }
-  assert(peer);
   memset(peer, 0, sizeof(*peer));
-  peer->stream.conn = conn;
+  /* NOTE: a slow peer must not hold the loop, what its socket does not take
+   * waits in its stream until it is writable again */
+  conn_set_non_blocking(conn);
+  stream_init(&peer->stream, conn, &ctx->stream_buffers);
+  /* NOTE: peer lists and gossip from a client would cost arena per entry and
+   * the server has no use for them, they are skipped undecoded */
+  peer->stream.types = message_type_bit(MessageType_CONNECT) |
+                       message_type_bit(MessageType_KEEP_ALIVE) |
+                       message_type_bit(MessageType_PEERS_MORE);
+  peer->id = ++ctx->peers_next_id;
   dllist_push_back(ctx->peers_first, ctx->peers_last, peer);
+  ctx->peers_count++;
+  metrics_add(ctx->m.accepts, 1);
+  capture_record(&ctx->capture, ctx->now, CaptureKind_OPEN, peer->id, 0, 0,
+                 0);
+}
+
+Room **room_bucket(Context *ctx, u32 id) {
+  return &ctx->rooms[(id * 0x9e3779b1u) & (ctx->config.room_buckets - 1)];
+}
+
+/* NOTE: 0 when a new room does not fit in the arena */
+Room *room_get(Context *ctx, u32 id) {
+  Room **bucket, *room;
+  bucket = room_bucket(ctx, id);
+  for (room = *bucket; room != 0; room = room->next) {
+    if (room->id == id) {
+      return room;
+    }
+  }
+  if (ctx->rooms_first_free) {
+    room = ctx->rooms_first_free;
+    ctx->rooms_first_free = ctx->rooms_first_free->next;
+  } else {
+    room = arena_try_push(&ctx->arena, sizeof(*room), 8);
+  }
+  if (!room) {
+    return 0;
+  }
+  memset(room, 0, sizeof(*room));
+  room->id = id;
+  room->next = *bucket;
+  *bucket = room;
+  ctx->rooms_count++;
+  return room;
+}
+
+/* NOTE: the same /24 or /48 as endpoint_same_prefix, in one room */
+Peer **prefix_bucket(Context *ctx, u32 room_id, ConnEndpoint *endpoint) {
+  ConnEndpoint prefix;
+  u32 hash;
+  memset(&prefix, 0, sizeof(prefix));
+  prefix.family = endpoint->family;
+  memcpy(prefix.addr, endpoint->addr,
+         endpoint->family == CONN_FAMILY_IPV6 ? 6 : 3);
+  hash = endpoint_hash(&prefix) ^ (room_id * 0x9e3779b1u);
+  return &ctx->prefixes[hash & (ctx->config.room_buckets - 1)];
+}
+
+void peer_page_cursor_set(Peer *peer, Peer *cursor) {
+  if (peer->page_cursor) {
+    dllist_remove_np(peer->page_cursor->page_holders_first,
+                     peer->page_cursor->page_holders_last, peer,
+                     page_holder_next, page_holder_prev);
+  }
+  peer->page_cursor = cursor;
+  if (cursor) {
+    dllist_push_back_np(cursor->page_holders_first, cursor->page_holders_last,
+                        peer, page_holder_next, page_holder_prev);
+  }
+}
+
+void ctrl_message_release(Context *ctx, MessageHeader *msg);
+
+/* NOTE: false when the arena has no room for a new room */
+b32 room_join(Context *ctx, Peer *peer, u32 id) {
+  Room *room;
+  room = room_get(ctx, id);
+  if (!room) {
+    return false;
+  }
+  dllist_push_back_np(room->peers_first, room->peers_last, peer, room_next,
+                      room_prev);
+  room->peers_count++;
+  peer->room = room;
+  peer->join_seq = ++ctx->join_seq;
+  peer->ranked = false;
+  peer->pages = 0;
+  if (ctx->config.join_peers_max) {
+    peer->prefix_head = prefix_bucket(ctx, id, &peer->endpoint);
+    peer->prefix_prev = 0;
+    peer->prefix_next = *peer->prefix_head;
+    if (peer->prefix_next) {
+      peer->prefix_next->prefix_prev = peer;
+    }
+    *peer->prefix_head = peer;
+  }
+  if (!room->joins_count) {
+    if (!ctx->joins_rooms_first) {
+      ctx->joins_time = ctx->now;
+    }
+    dllist_push_back_np(ctx->joins_rooms_first, ctx->joins_rooms_last, room,
+                        joins_next, joins_prev);
+  }
+  dllist_push_back_np(room->joins_first, room->joins_last, peer, join_next,
+                      join_prev);
+  room->joins_count++;
+  peer->joining = true;
+  return true;
+}
+
+void room_joins_clear(Context *ctx, Room *room) {
+  Peer *joiner;
+  for (joiner = room->joins_first; joiner != 0; joiner = joiner->join_next) {
+    joiner->joining = false;
+  }
+  room->joins_first = 0;
+  room->joins_last = 0;
+  room->joins_count = 0;
+  dllist_remove_np(ctx->joins_rooms_first, ctx->joins_rooms_last, room,
+                   joins_next, joins_prev);
+}
+
+void room_leave(Context *ctx, Peer *peer) {
+  Room **link, *room;
+  room = peer->room;
+  if (!room) {
+    return;
+  }
+  /* NOTE: pages that would start at the peer start at the one after it */
+  while (peer->page_holders_first) {
+    peer_page_cursor_set(peer->page_holders_first, peer->room_next);
+  }
+  peer_page_cursor_set(peer, 0);
+  if (room->rank_cursor == peer) {
+    room->rank_cursor = peer->room_next;
+  }
+  if (peer->prefix_head) {
+    if (peer->prefix_prev) {
+      peer->prefix_prev->prefix_next = peer->prefix_next;
+    } else {
+      *peer->prefix_head = peer->prefix_next;
+    }
+    if (peer->prefix_next) {
+      peer->prefix_next->prefix_prev = peer->prefix_prev;
+    }
+    peer->prefix_head = 0;
+  }
+  if (peer->announce) {
+    dllist_remove_np(ctx->announce_first, ctx->announce_last, peer,
+                     announce_next, announce_prev);
+    ctrl_message_release(ctx, (MessageHeader *)peer->announce);
+    peer->announce = 0;
+  }
+  dllist_remove_np(room->peers_first, room->peers_last, peer, room_next,
+                   room_prev);
+  room->peers_count--;
+  peer->room = 0;
+  if (peer->joining) {
+    peer->joining = false;
+    dllist_remove_np(room->joins_first, room->joins_last, peer, join_next,
+                     join_prev);
+    if (!--room->joins_count) {
+      dllist_remove_np(ctx->joins_rooms_first, ctx->joins_rooms_last, room,
+                       joins_next, joins_prev);
+    }
+  }
+  if (room->peers_count) {
+    return;
+  }
+  for (link = room_bucket(ctx, room->id); *link != room;
+       link = &(*link)->next) {
+  }
+  *link = room->next;
+  room->next = ctx->rooms_first_free;
+  ctx->rooms_first_free = room;
+  ctx->rooms_count--;
+}
+
+/* NOTE: every queued message belongs to a single peer, a PEERS_TO_CONNECT
+ * gives its entries back too */
+void ctrl_message_release(Context *ctx, MessageHeader *msg) {
+  if (msg->type == MessageType_PEERS_TO_CONNECT) {
+    MessagePeersToConnect *peers;
+    peers = (MessagePeersToConnect *)msg;
+    if (peers->last) {
+      peers->last->next = ctx->peers_connected_first_free;
+      ctx->peers_connected_first_free = peers->first;
+    }
+  }
+  message_free(&ctx->message_allocator, (Message *)msg);
 }
 
 void peer_disconnect(Context *ctx, Peer *peer) {
   MessageHeader *msg;
+  room_leave(ctx, peer);
   conn_close(peer->stream.conn);
+  stream_reset(&peer->stream);
+  capture_record(&ctx->capture, ctx->now, CaptureKind_CLOSE, peer->id, 0, 0,
+                 0);
   msg = peer->messages_first;
   while (msg != 0) {
     MessageHeader *to_free;
     to_free = msg;
     msg = msg->next;
     dllist_remove(peer->messages_first, peer->messages_last, to_free);
-    message_free(&ctx->message_allocator, (Message *)to_free);
+    ctrl_message_release(ctx, to_free);
+  }
+  ctx->queued_messages -= peer->messages_count;
+  ctx->queued_bytes -= peer->messages_bytes;
+  if (peer->overflowing) {
+    dllist_remove_np(ctx->overflow_first, ctx->overflow_last, peer,
+                     overflow_next, overflow_prev);
   }
   dllist_remove(ctx->peers_first, ctx->peers_last, peer);
+  ctx->peers_count--;
+  metrics_add(ctx->m.disconnects, 1);
   peer->next = ctx->peers_first_free;
   ctx->peers_first_free = peer;
 }
@@ -147,9 +926,85 @@ typedef struct MessageCallbackParams {
   Peer *peer;
 } MessageCallbackParams;
 
+/* NOTE: the message plus the entries of a PEERS_TO_CONNECT, this is what a
+ * stalled peer keeps from going back to the free lists */
+u64 ctrl_message_cost(MessageHeader *msg) {
+  u64 cost;
+  cost = sizeof(Message);
+  if (msg->type == MessageType_PEERS_TO_CONNECT) {
+    cost += ((MessagePeersToConnect *)msg)->count * sizeof(PeerConnected);
+  }
+  return cost;
+}
+
+b32 peer_queue_over_limit(Context *ctx, Peer *peer) {
+  return peer->messages_count > ctx->config.peer_queue_messages ||
+         peer->messages_bytes > ctx->config.peer_queue_bytes;
+}
+
+void peer_queue_push(Context *ctx, Peer *peer, MessageHeader *msg) {
+  u64 cost;
+  cost = ctrl_message_cost(msg);
+  dllist_push_back(peer->messages_first, peer->messages_last, msg);
+  peer->messages_count++;
+  peer->messages_bytes += cost;
+  ctx->queued_messages++;
+  ctx->queued_bytes += cost;
+  metrics_record(ctx->m.queue_depth, peer->messages_count);
+  if (!peer->overflowing && peer_queue_over_limit(ctx, peer)) {
+    peer->overflowing = true;
+    dllist_push_back_np(ctx->overflow_first, ctx->overflow_last, peer,
+                        overflow_next, overflow_prev);
+  }
+}
+
+/* NOTE: the arena is shared by every queue, when a message for the peer
+ * does not fit the peer goes instead of the server. It is not let go right
+ * away, the lists being walked may go through it */
+void peer_starve(Context *ctx, Peer *peer) {
+  if (peer->starved) {
+    return;
+  }
+  peer->starved = true;
+  if (!peer->overflowing) {
+    peer->overflowing = true;
+    dllist_push_back_np(ctx->overflow_first, ctx->overflow_last, peer,
+                        overflow_next, overflow_prev);
+  }
+}
+
+void peer_queue_remove(Context *ctx, Peer *peer, MessageHeader *msg) {
+  u64 cost;
+  cost = ctrl_message_cost(msg);
+  dllist_remove(peer->messages_first, peer->messages_last, msg);
+  peer->messages_count--;
+  peer->messages_bytes -= cost;
+  ctx->queued_messages--;
+  ctx->queued_bytes -= cost;
+}
+
+MessageHeader *peer_queue_pop(Context *ctx, Peer *peer) {
+  MessageHeader *msg;
+  msg = peer->messages_first;
+  assert(msg);
+  peer_queue_remove(ctx, peer, msg);
+  return msg;
+}
+
+/* NOTE: the oldest message a policy can let go, one that is half written
+ * stays or the peer would get a broken frame */
+MessageHeader *peer_queue_droppable(Peer *peer) {
+  MessageHeader *msg;
+  msg = peer->messages_first;
+  if (msg && peer->stream.sending) {
+    msg = msg->next;
+  }
+  return msg;
+}
+
 Message *push_ctrl_message(Context *ctx, Peer *peer) {
   MessageHeader *msg = (MessageHeader *)message_alloc(&ctx->message_allocator);
-  dllist_push_back(peer->messages_first, peer->messages_last, msg);
+  peer_queue_push(ctx, peer, msg);
   return (Message *)msg;
 }
 
@@ -177,82 +1032,551 @@ PeerList get_others_peers_list(Arena *arena, Peer *first, Peer *last,
 }
 #endif
 
-PeerConnected *allocate_peer_connected_node(Arena *arena, Peer *peer) {
-  PeerConnected *node = arena_push(arena, sizeof(*node), 8);
-  node->addr = peer->raw_addr;
-  node->port = peer->raw_port;
-  node->local_addr = peer->raw_local_addr;
-  node->local_port = peer->raw_local_port;
+/* NOTE: 0 when the arena ran out */
+PeerConnected *allocate_peer_connected_node(Context *ctx, Peer *peer) {
+  PeerConnected *node;
+  if (ctx->peers_connected_first_free) {
+    node = ctx->peers_connected_first_free;
+    ctx->peers_connected_first_free = node->next;
+  } else {
+    node = arena_try_push(&ctx->arena, sizeof(*node), 8);
+    if (!node) {
+      return 0;
+    }
+  }
+  node->endpoint = peer->endpoint;
+  node->candidates_count = peer->candidates_count;
+  memcpy(node->candidates, peer->candidates,
+         sizeof(Candidate) * peer->candidates_count);
   node->next = 0;
   node->prev = 0;
   return node;
 }
 
-MessagePeersToConnect *calculate_current_peer_connected_message(
-    Arena *arena, MessageAllocator *allocator, Peer *peer) {
-  PeerConnected *node;
+/* NOTE: a PEERS_TO_CONNECT for the peer to, 0 and to starves when the arena
+ * ran out */
+MessagePeersToConnect *peers_message_alloc(Context *ctx, Peer *to) {
   MessagePeersToConnect *msg;
-  msg = (MessagePeersToConnect *)message_alloc(allocator);
+  msg = (MessagePeersToConnect *)message_try_alloc(&ctx->message_allocator);
+  if (!msg) {
+    peer_starve(ctx, to);
+    return 0;
+  }
   msg->header.type = MessageType_PEERS_TO_CONNECT;
-  msg->count = 1;
-  node = allocate_peer_connected_node(arena, peer);
+  return msg;
+}
+
+/* NOTE: other goes at the end of the list, false and to starves when the
+ * arena ran out. The list stays valid, only shorter */
+b32 peers_message_add(Context *ctx, MessagePeersToConnect *msg, Peer *to,
+                      Peer *other) {
+  PeerConnected *node;
+  node = allocate_peer_connected_node(ctx, other);
+  if (!node) {
+    peer_starve(ctx, to);
+    return false;
+  }
   dllist_push_back(msg->first, msg->last, node);
+  msg->count++;
+  return true;
+}
+
+/* NOTE: smaller is better. Peers behind the same public address are likely
+ * on the same lan and the same prefix is likely close, inside a tier the
+ * peer handed out least recently goes first so introductions spread over
+ * the room */
+u64 peer_rank_key(Peer *peer, Peer *other) {
+  u64 tier;
+  if (endpoint_same_host(&peer->endpoint, &other->endpoint)) {
+    tier = 0;
+  } else if (endpoint_same_prefix(&peer->endpoint, &other->endpoint)) {
+    tier = 1;
+  } else {
+    tier = 2;
+  }
+  return (tier << 62) | other->assigned_seq;
+}
+
+/* NOTE: the joiner goes in the announce message of the peer, all of them
+ * are queued by the next room_joins_flush */
+void peer_announce(Context *ctx, Peer *peer, Peer *joiner) {
+  if (!peer->announce) {
+    peer->announce = peers_message_alloc(ctx, peer);
+    if (!peer->announce) {
+      return;
+    }
+    dllist_push_back_np(ctx->announce_first, ctx->announce_last, peer,
+                        announce_next, announce_prev);
+  }
+  peers_message_add(ctx, peer->announce, peer, joiner);
+}
+
+/* NOTE: the join-peers-max best others of a large room, the peer asks for
+ * the rest with PEERS_MORE. Candidates are the peers of the same prefix from
+ * the prefix table and a window of the room that moves on with every
+ * ranking, both at most JOIN_SCAN_FACTOR times join-peers-max long, so a
+ * join costs the same in any room size. A joiner is only announced to the
+ * peers it got, their punch work does not grow with the room either */
+MessagePeersToConnect *room_top_peers(Context *ctx, Room *room, Peer *peer) {
+  MessagePeersToConnect *msg;
+  RankTop top;
+  RankEntry *entries;
+  Peer *other;
+  u32 i, scan_max, scanned;
+  u64 stamp;
+  b32 announce;
+  entries = arena_push(&ctx->event_arena,
+                       sizeof(*entries) * ctx->config.join_peers_max, 8);
+  assert(entries);
+  rank_top_init(&top, entries, ctx->config.join_peers_max);
+  scan_max = ctx->config.join_peers_max * JOIN_SCAN_FACTOR;
+  stamp = ++ctx->rank_stamp;
+  peer->rank_stamp = stamp;
+  /* NOTE: the chain is shared with the other rooms and prefixes of the
+   * bucket */
+  for (other = *prefix_bucket(ctx, room->id, &peer->endpoint), scanned = 0;
+       other != 0 && scanned < scan_max;
+       other = other->prefix_next, ++scanned) {
+    if (other->rank_stamp == stamp || other->room != room ||
+        !endpoint_same_prefix(&peer->endpoint, &other->endpoint)) {
+      continue;
+    }
+    other->rank_stamp = stamp;
+    rank_top_push(&top, peer_rank_key(peer, other), other);
+  }
+  other = room->rank_cursor ? room->rank_cursor : room->peers_first;
+  for (scanned = 0; scanned < min(scan_max, room->peers_count); ++scanned) {
+    if (other->rank_stamp != stamp) {
+      other->rank_stamp = stamp;
+      rank_top_push(&top, peer_rank_key(peer, other), other);
+    }
+    other = other->room_next ? other->room_next : room->peers_first;
+  }
+  room->rank_cursor = other;
+  rank_top_sort(&top);
+
+  /* NOTE: a snapshot of a peer that joined earlier announces nothing */
+  announce = peer->joining && !peer->ranked;
+  peer->ranked = peer->ranked || peer->joining;
+  msg = peers_message_alloc(ctx, peer);
+  if (!msg) {
+    return 0;
+  }
+  for (i = 0; i < top.count; ++i) {
+    other = (Peer *)top.entries[i].item;
+    other->assigned_seq = ++ctx->assign_seq;
+    if (!peers_message_add(ctx, msg, peer, other)) {
+      break;
+    }
+    if (announce) {
+      peer_announce(ctx, other, peer);
+    }
+  }
+  return msg;
+}
+
+/* NOTE: the next join-peers-max others in join order, an empty page is the
+ * end. A page starts at the cursor the last one left, pages do not know what
+ * the ranked list had and peers ignore endpoints they already punch */
+MessagePeersToConnect *room_page_peers(Context *ctx, Room *room, Peer *peer) {
+  MessagePeersToConnect *msg;
+  Peer *other;
+  msg = peers_message_alloc(ctx, peer);
+  if (!msg || !ctx->config.join_peers_max) {
+    return msg;
+  }
+  for (other = peer->pages ? peer->page_cursor : room->peers_first;
+       other != 0 && msg->count < ctx->config.join_peers_max;
+       other = other->room_next) {
+    if (other == peer) {
+      continue;
+    }
+    if (!peers_message_add(ctx, msg, peer, other)) {
+      break;
+    }
+  }
+  peer->pages++;
+  peer_page_cursor_set(peer, other);
+  return msg;
+}
+
+/* NOTE: gossip mode, the peer gets the gossip-seeds peers that joined right
+ * before it and only they hear about it, see room_joins_flush_seeds. Every
+ * peer seeds the next few joiners, the load is spread and the room is one
+ * chain the peers gossip the membership along */
+MessagePeersToConnect *room_seed_peers(Context *ctx, Room *room, Peer *peer) {
+  MessagePeersToConnect *msg;
+  Peer *other;
+  msg = peers_message_alloc(ctx, peer);
+  if (!msg) {
+    return 0;
+  }
+  for (other = peer->room_prev;
+       other != 0 && msg->count < ctx->config.gossip_seeds;
+       other = other->room_prev) {
+    if (!peers_message_add(ctx, msg, peer, other)) {
+      break;
+    }
+  }
   return msg;
 }
 
 MessagePeersToConnect *
-calculate_others_peers_connected_message(Arena *arena,
-                                         MessageAllocator *allocator,
-                                         Peer *first, Peer *last, Peer *peer) {
+calculate_others_peers_connected_message(Context *ctx, Room *room, Peer *peer) {
 
   MessagePeersToConnect *msg;
-  msg = (MessagePeersToConnect *)message_alloc(allocator);
-  msg->count = 0;
   Peer *other;
-  for (other = first; other != 0; other = other->next) {
-    PeerConnected *node;
+  if (ctx->config.gossip_seeds) {
+    return room_seed_peers(ctx, room, peer);
+  }
+  if (ctx->config.join_peers_max &&
+      room->peers_count - 1 > ctx->config.join_peers_max) {
+    return room_top_peers(ctx, room, peer);
+  }
+  msg = peers_message_alloc(ctx, peer);
+  if (!msg) {
+    return 0;
+  }
+  for (other = room->peers_first; other != 0; other = other->room_next) {
     if (other == peer) {
       continue;
     }
-    msg->count++;
-    node = allocate_peer_connected_node(arena, other);
-    dllist_push_back(msg->first, msg->last, node);
+    if (!peers_message_add(ctx, msg, peer, other)) {
+      break;
+    }
   }
   return msg;
 }
 
+/* NOTE: the policy on one peer. With budget set it runs because all the
+ * queues together went over queue-bytes-max, drop lets go of messages until
+ * they fit again then */
+void peer_queue_policy(Context *ctx, Peer *peer, b32 budget) {
+  MessageHeader *msg;
+  switch (ctx->config.peer_queue_policy) {
+  case QueuePolicy_SNAPSHOT: {
+    /* NOTE: peers dedup by endpoint, a fresh list of the room says what the
+     * queue did */
+    while ((msg = peer_queue_droppable(peer)) != 0) {
+      peer_queue_remove(ctx, peer, msg);
+      ctrl_message_release(ctx, msg);
+    }
+    if (peer->room) {
+      msg = (MessageHeader *)calculate_others_peers_connected_message(
+          ctx, peer->room, peer);
+      if (msg) {
+        peer_queue_push(ctx, peer, msg);
+      }
+    }
+    metrics_add(ctx->m.queue_snapshots, 1);
+    /* NOTE: the room alone does not fit, nothing left but to let go */
+    if (peer->overflowing) {
+      metrics_add(ctx->m.queue_disconnects, 1);
+      peer_disconnect(ctx, peer);
+    }
+  } break;
+  case QueuePolicy_DROP: {
+    while ((budget ? ctx->queued_bytes > ctx->config.queue_bytes_max
+                   : peer_queue_over_limit(ctx, peer)) &&
+           (msg = peer_queue_droppable(peer)) != 0) {
+      peer_queue_remove(ctx, peer, msg);
+      ctrl_message_release(ctx, msg);
+      metrics_add(ctx->m.queue_dropped, 1);
+    }
+  } break;
+  case QueuePolicy_DISCONNECT: {
+    metrics_add(ctx->m.queue_disconnects, 1);
+    peer_disconnect(ctx, peer);
+  } break;
+  case QueuePolicy_COUNT: {
+    assert(!"invalid queue policy");
+  } break;
+  }
+}
+
+/* NOTE: the peer with the most bytes queued the budget pass stamp did not
+ * get to yet. A walk of every peer, it only runs while over the budget */
+Peer *peer_queue_largest(Context *ctx, u64 stamp) {
+  Peer *peer, *largest;
+  largest = 0;
+  for (peer = ctx->peers_first; peer != 0; peer = peer->next) {
+    if (peer->budget_stamp == stamp || !peer->messages_bytes) {
+      continue;
+    }
+    if (!largest || peer->messages_bytes > largest->messages_bytes) {
+      largest = peer;
+    }
+  }
+  return largest;
+}
+
+/* NOTE: runs the queue policy on the peers that went over a limit during
+ * the loop iteration, and lets the starved ones go. It waits until
+ * everything was queued so no list is walked while a peer leaves it */
+void peer_queues_enforce(Context *ctx) {
+  Peer *peer;
+  u64 stamp;
+  while (ctx->overflow_first) {
+    peer = ctx->overflow_first;
+    dllist_remove_np(ctx->overflow_first, ctx->overflow_last, peer,
+                     overflow_next, overflow_prev);
+    peer->overflowing = false;
+    if (peer->starved) {
+      metrics_add(ctx->m.queue_starved, 1);
+      peer_disconnect(ctx, peer);
+      continue;
+    }
+    if (!peer_queue_over_limit(ctx, peer)) {
+      continue;
+    }
+    peer_queue_policy(ctx, peer, false);
+  }
+  /* NOTE: queues within their own limit still add up past what the arena
+   * holds, the largest ones get the policy until they fit. A peer gets it
+   * once per pass, a snapshot that does not shrink can not loop */
+  stamp = ++ctx->budget_stamp;
+  while (ctx->queued_bytes > ctx->config.queue_bytes_max) {
+    peer = peer_queue_largest(ctx, stamp);
+    if (!peer) {
+      break;
+    }
+    peer->budget_stamp = stamp;
+    metrics_add(ctx->m.queue_budget_runs, 1);
+    peer_queue_policy(ctx, peer, true);
+  }
+}
+
+/* NOTE: a joiner goes to the gossip-seeds peers before it, the ones its own
+ * list had. The joins are the tail of the room, a recipient is at most
+ * gossip-seeds peers before the first one */
+void room_joins_flush_seeds(Context *ctx, Room *room) {
+  Peer *peer;
+  u32 i;
+  peer = room->joins_first;
+  for (i = 0; i < ctx->config.gossip_seeds && peer->room_prev; ++i) {
+    peer = peer->room_prev;
+  }
+  for (; peer != 0; peer = peer->room_next) {
+    MessagePeersToConnect *msg;
+    Peer *joiner;
+    msg = 0;
+    for (joiner = peer->room_next, i = 0;
+         joiner != 0 && i < ctx->config.gossip_seeds;
+         joiner = joiner->room_next, ++i) {
+      if (!joiner->joining) {
+        continue;
+      }
+      if (!msg) {
+        msg = peers_message_alloc(ctx, peer);
+        if (!msg) {
+          break;
+        }
+      }
+      if (!peers_message_add(ctx, msg, peer, joiner)) {
+        break;
+      }
+    }
+    if (msg) {
+      peer_queue_push(ctx, peer, (MessageHeader *)msg);
+    }
+  }
+}
+
+/* NOTE: announces the joins collected since the last flush, every peer of a
+ * room gets one PEERS_TO_CONNECT with the peers that joined after it. A wave
+ * of K joins into a room of N is N messages instead of K * N */
+void room_joins_flush(Context *ctx) {
+  while (ctx->announce_first) {
+    Peer *peer;
+    peer = ctx->announce_first;
+    dllist_remove_np(ctx->announce_first, ctx->announce_last, peer,
+                     announce_next, announce_prev);
+    peer_queue_push(ctx, peer, (MessageHeader *)peer->announce);
+    peer->announce = 0;
+  }
+  while (ctx->joins_rooms_first) {
+    Room *room;
+    Peer *peer, *joiner;
+    room = ctx->joins_rooms_first;
+    metrics_record(ctx->m.join_batch, room->joins_count);
+    if (ctx->config.gossip_seeds) {
+      room_joins_flush_seeds(ctx, room);
+      room_joins_clear(ctx, room);
+      continue;
+    }
+    /* NOTE: ranked joins were announced by room_top_peers, a batch of only
+     * those does not walk the room */
+    for (joiner = room->joins_first; joiner != 0 && joiner->ranked;
+         joiner = joiner->join_next) {
+    }
+    if (!joiner) {
+      room_joins_clear(ctx, room);
+      continue;
+    }
+    for (peer = room->peers_first; peer != 0; peer = peer->room_next) {
+      MessagePeersToConnect *msg;
+      msg = 0;
+      /* NOTE: one copy per recipient, a node can only be in one queue */
+      for (joiner = room->joins_last;
+           joiner != 0 && joiner->join_seq > peer->join_seq;
+           joiner = joiner->join_prev) {
+        if (joiner->ranked) {
+          continue;
+        }
+        if (!msg) {
+          msg = peers_message_alloc(ctx, peer);
+          if (!msg) {
+            break;
+          }
+        }
+        if (!peers_message_add(ctx, msg, peer, joiner)) {
+          break;
+        }
+      }
+      if (msg) {
+        peer_queue_push(ctx, peer, (MessageHeader *)msg);
+      }
+    }
+    room_joins_clear(ctx, room);
+  }
+}
+
 void message_callback(Stream *stream, Message *msg, void *param) {
   Context *ctx;
   Peer *peer;
   MessageCallbackParams *params = (MessageCallbackParams *)param;
   ctx = params->ctx;
   peer = params->peer;
+  ctx->loop_work++;
+  /* NOTE: a frame decoded in parts is not in the buffer, only peer lists
+   * are and the server stream skips them */
+  if (!stream->decoding) {
+    capture_record(&ctx->capture, ctx->now, CaptureKind_FRAME, peer->id, 0,
+                   stream->recv_buffer, stream->bytes_to_farm);
+  }
+  /* NOTE: one read holds hundreds of CONNECT, each a list of the room. Once
+   * the queue is over its limit the rest wait for the policy to run, they
+   * are ignored */
+  if (peer->overflowing) {
+    return;
+  }
 
   switch (msg->header.type) {
   case MessageType_CONNECT: {
-    Peer *other;
     MessageHeader *header;
 
-    peer->raw_addr = msg->connect.addr;
-    peer->raw_port = msg->connect.port;
-    peer->raw_local_addr = msg->connect.local_addr;
-    peer->raw_local_port = msg->connect.local_port;
+    peer->endpoint = msg->connect.endpoint;
+    peer->candidates_count = msg->connect.candidates_count;
+    memcpy(peer->candidates, msg->connect.candidates,
+           sizeof(Candidate) * msg->connect.candidates_count);
+    /* NOTE: a second CONNECT moves the peer to the new room */
+    room_leave(ctx, peer);
+    if (!room_join(ctx, peer, msg->connect.room)) {
+      peer_starve(ctx, peer);
+      break;
+    }
 
     header = (MessageHeader *)calculate_others_peers_connected_message(
-        &ctx->event_arena, &ctx->message_allocator, ctx->peers_first,
-        ctx->peers_last, peer);
-    dllist_push_back(peer->messages_first, peer->messages_last, header);
-
-    header = (MessageHeader *)calculate_current_peer_connected_message(
-        &ctx->event_arena, &ctx->message_allocator, peer);
-    for (other = ctx->peers_first; other != 0; other = other->next) {
-      if (other == peer) {
-        continue;
+        ctx, peer->room, peer);
+    if (header) {
+      peer_queue_push(ctx, peer, header);
+    }
+    metrics_add(ctx->m.connects, 1);
+    metrics_record(ctx->m.fanout, peer->room->peers_count - 1);
+    /* NOTE: the others hear about the peer in room_joins_flush */
+  } break;
+  case MessageType_PEERS_MORE: {
+    /* NOTE: a page is O(join-peers-max) and only join-pages-max of them are
+     * answered per join, the rest are ignored */
+    if (peer->room && peer->pages < ctx->config.join_pages_max) {
+      MessageHeader *header;
+      header = (MessageHeader *)room_page_peers(ctx, peer->room, peer);
+      if (header) {
+        peer_queue_push(ctx, peer, header);
       }
-      dllist_push_back(other->messages_first, other->messages_last, header);
+      metrics_add(ctx->m.pages, 1);
+    }
+  } break;
+  default: {
+  } break;
+  }
+}
+
+/* NOTE: rate limiter key of a source, ipv6 clients usually own a whole /64 so
+ * that is what gets limited */
+u32 stun_source_key(ConnEndpoint *endpoint) {
+  u64 prefix;
+  if (endpoint->family != CONN_FAMILY_IPV6) {
+    return endpoint_ipv4_addr(endpoint);
+  }
+  memcpy(&prefix, endpoint->addr, 8);
+  return (u32)((prefix * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+/* NOTE: the reply only depends on the source, patch it into the template and
+ * send it right away. Returns false when the socket would block and the reply
+ * has to wait in the queue */
+b32 stun_reply_inline(Context *ctx, ConnEndpoint *endpoint, ConnAddr *to) {
+  u8 buffer[STUN_RESPONSE_IPV6_SIZE];
+  u8 *cursor;
+  u32 res, size;
+  if (endpoint->family == CONN_FAMILY_IPV6) {
+    size = STUN_RESPONSE_IPV6_SIZE;
+    memcpy(buffer, ctx->stun_response_ipv6, size);
+  } else {
+    size = STUN_RESPONSE_IPV4_SIZE;
+    memcpy(buffer, ctx->stun_response_ipv4, size);
+  }
+  /* NOTE: skip the family, the template already has it */
+  cursor = buffer + STUN_RESPONSE_ENDPOINT_OFFSET + 1;
+  memcpy(cursor, endpoint->addr, size - STUN_RESPONSE_ENDPOINT_OFFSET - 3);
+  cursor += size - STUN_RESPONSE_ENDPOINT_OFFSET - 3;
+  write_u16_be(cursor, endpoint->port);
+  res = conn_try_write_to(ctx->stun.conn, buffer, size, to);
+  if (res == CONN_WOULD_BLOCK) {
+    return false;
+  }
+  /* NOTE: any other error is the client problem (unreachable and the like),
+   * queueing would not help */
+  ctx->stun_replies_inline++;
+  return true;
+}
+
+void stun_message_process(Context *ctx, Message *msg, ConnAddr *from) {
+  switch (msg->header.type) {
+  case MessageType_STUN: {
+    AddrMessage *addr_msg;
+    ConnEndpoint endpoint;
+    conn_address_get_endpoint(from, &endpoint);
+    metrics_add(ctx->m.stun_requests, 1);
+    if (!rate_limiter_allow(&ctx->stun_limiter, stun_source_key(&endpoint),
+                            ctx->now)) {
+      break;
     }
+    if (stun_reply_inline(ctx, &endpoint, from)) {
+      break;
+    }
+    /* NOTE: bound the memory spoofed sources can make us hold */
+    if (ctx->addr_messages_count >= ctx->config.stun_max_pending_replies) {
+      ctx->stun_queue_dropped++;
+      break;
+    }
+    addr_msg = addr_message_alloc(&ctx->addr_message_allocator);
+    addr_msg->msg.stun_response.header.type = MessageType_STUN_RESPONSE;
+    addr_msg->msg.stun_response.endpoint = endpoint;
+    conn_address_set(addr_msg->addr, from);
+    dllist_push_back(ctx->addr_messages_first, ctx->addr_messages_last,
+                     addr_msg);
+    ctx->addr_messages_count++;
+    ctx->stun_replies_queued++;
+  } break;
+  case MessageType_KEEP_ALIVE: {
+    metrics_add(ctx->m.keepalives, 1);
+    log_event(&ctx->log, ctx->now, 10, 20, "keep alive from %E",
+              log_address(from));
   } break;
   default: {
+    /* Tomi: ignore unknow messages */
   } break;
   }
 }
@@ -277,12 +1601,80 @@ void event_loop_prepare(Context *ctx) {
   }
 }
 
+void stun_binding_process(Context *ctx, u8 *request, u32 size,
+                          ConnAddr *from) {
+  ConnEndpoint endpoint;
+  u8 *response;
+  u32 response_size;
+  conn_address_get_endpoint(from, &endpoint);
+  if (!rate_limiter_allow(&ctx->stun_limiter, stun_source_key(&endpoint),
+                          ctx->now)) {
+    return;
+  }
+  /* NOTE: every reply in a batch goes to the same source, same size */
+  response_size = stun_binding_response_size(&endpoint);
+  response = dgram_batch_push(&ctx->stun_replies, response_size);
+  if (!response) {
+    dgram_batch_write_to(&ctx->stun, &ctx->stun_replies, from);
+    dgram_batch_clear(&ctx->stun_replies);
+    response = dgram_batch_push(&ctx->stun_replies, response_size);
+  }
+  if (!stun_binding_response_write(request, size, response, &endpoint)) {
+    /* NOTE: not a binding request, give the slot back */
+    ctx->stun_replies.used -= response_size;
+    return;
+  }
+  ctx->stun_binding_replies++;
+  metrics_add(ctx->m.stun_bindings, 1);
+}
+
+void stats_print(Context *ctx) {
+  RateLimiterStats *stats;
+  stats = &ctx->stun_limiter.stats;
+  printf("stun: allowed %llu rate limited %llu evictions %llu inline %llu "
+         "queued %llu queue full %llu pending %u rfc5389 %llu\n",
+         stats->allowed, stats->dropped, stats->evictions,
+         ctx->stun_replies_inline, ctx->stun_replies_queued,
+         ctx->stun_queue_dropped, ctx->addr_messages_count,
+         ctx->stun_binding_replies);
+  printf("rooms: %u\n", ctx->rooms_count);
+}
+
+/* NOTE: poll wakes up in time to flush the joins that are waiting */
+u32 event_loop_timeout_ms(Context *ctx) {
+  u64 waited_ms;
+  if (!ctx->joins_rooms_first && !ctx->announce_first) {
+    return ctx->config.stats_interval_ms;
+  }
+  waited_ms = (conn_current_time_us() - ctx->joins_time) / 1000;
+  if (waited_ms >= ctx->config.join_window_ms) {
+    return 0;
+  }
+  return min(ctx->config.join_window_ms - (u32)waited_ms,
+             ctx->config.stats_interval_ms);
+}
+
 void event_loop_process(Context *ctx) {
   Peer *peer;
   u32 res;
+  u64 start;
 
-  res = conn_select(ctx->read, ctx->write, CONN_TIMEOUT_INFINITY);
+  trace_probe(loop_poll_start);
+  start = conn_current_time_ns();
+  res = conn_select(ctx->read, ctx->write, event_loop_timeout_ms(ctx));
   assert(res != CONN_ERROR);
+  ctx->loop_poll_ns = conn_current_time_ns() - start;
+  ctx->loop_ready = res;
+  ctx->loop_work = 0;
+  trace_probe2(loop_poll_end, res, ctx->loop_poll_ns);
+
+  /* NOTE: one clock read per wake up, the handlers use the cached value */
+  ctx->now = conn_current_time_us();
+  if (ctx->now - ctx->stats_time >=
+      (u64)ctx->config.stats_interval_ms * 1000) {
+    ctx->stats_time = ctx->now;
+    stats_print(ctx);
+  }
 
   /* NOTE: ctrl socket  */
 
@@ -290,6 +1682,7 @@ void event_loop_process(Context *ctx) {
     ConnErr other;
     other = conn_accept(ctx->ctrl.conn, 0);
     if (other.err == CONN_OK) {
+      ctx->loop_work++;
       peer_connect(ctx, other.conn);
     }
   }
@@ -314,12 +1707,21 @@ void event_loop_process(Context *ctx) {
 
     if (conn_set_has(ctx->write, peer->stream.conn)) {
       u32 res;
+      u64 start;
       MessageHeader *msg;
-      assert(peer->messages_first);
       msg = peer->messages_first;
-      dllist_remove(peer->messages_first, peer->messages_last, msg);
+      start = conn_current_time_ns();
       res = stream_message_write(&ctx->event_arena, &peer->stream,
                                  (Message *)msg);
+      metrics_record(ctx->m.send_ns, conn_current_time_ns() - start);
+      ctx->loop_work++;
+      /* NOTE: a large list stays queued until its last chunk is out, any
+       * message until its last byte is */
+      if (res != CONN_WOULD_BLOCK) {
+        peer_queue_pop(ctx, peer);
+        metrics_add(ctx->m.messages_sent, 1);
+        ctrl_message_release(ctx, msg);
+      }
       if (res == CONN_ERROR) {
         peer_disconnect(ctx, peer);
         goto next;
@@ -330,35 +1732,56 @@ void event_loop_process(Context *ctx) {
     peer = next_peer;
   }
 
+  /* NOTE: announces can outlive the joins that made them when a joiner
+   * leaves before the flush, joins_time is older than the window then */
+  if ((ctx->joins_rooms_first || ctx->announce_first) &&
+      ctx->now - ctx->joins_time >=
+          (u64)ctx->config.join_window_ms * 1000) {
+    room_joins_flush(ctx);
+  }
+  peer_queues_enforce(ctx);
+
   /* NOTE: stun socket  */
 
   if (conn_set_has(ctx->read, ctx->stun.conn)) {
-    Message *msg;
+    DgramBatch batch;
     ConnAddr *from;
+    u8 *buffer;
     from = conn_address_create(&ctx->event_arena);
-    msg = dgram_message_read_from(&ctx->event_arena, &ctx->stun, from);
-    if (msg) {
-      switch (msg->header.type) {
-      case MessageType_STUN: {
-        AddrMessage *addr_msg;
-        addr_msg = addr_message_alloc(&ctx->addr_message_allocator);
-        addr_msg->msg.stun_response.header.type = MessageType_STUN_RESPONSE;
-        conn_address_get_address_and_port(from,
-                                          &addr_msg->msg.stun_response.addr,
-                                          &addr_msg->msg.stun_response.port);
-        conn_address_set(addr_msg->addr, from);
-        dllist_push_back(ctx->addr_messages_first, ctx->addr_messages_last,
-                         addr_msg);
-      } break;
-      case MessageType_KEEP_ALIVE: {
-        static u8 buffer[64];
-        conn_address_string(from, buffer, sizeof(buffer));
-        printf("Keep alive package receive from: %s\n", buffer);
-      } break;
-      default: {
-        /* Tomi: ignore unknow messages */
-      } break;
+    buffer = arena_push(&ctx->event_arena, DGRAM_BATCH_SIZE, 8);
+    dgram_batch_init(&batch, buffer, DGRAM_BATCH_SIZE);
+    if (dgram_batch_read_from(&ctx->stun, &batch, from) != CONN_ERROR) {
+      u32 i, count;
+      ConnEndpoint source;
+      count = dgram_batch_count(&batch);
+      ctx->loop_work += count;
+      if (ctx->capture.file.data) {
+        conn_address_get_endpoint(from, &source);
       }
+      for (i = 0; i < count; ++i) {
+        u8 *segment;
+        u32 size;
+        segment = dgram_batch_segment(&batch, i, &size);
+        capture_record(&ctx->capture, ctx->now, CaptureKind_DGRAM, 0, &source,
+                       segment, size);
+        switch (datagram_classify(segment, size)) {
+        case DatagramKind_TENT: {
+          Message *msg;
+          msg = dgram_batch_message(&ctx->event_arena, &batch, i);
+          if (msg) {
+            stun_message_process(ctx, msg, from);
+          }
+        } break;
+        case DatagramKind_STUN: {
+          stun_binding_process(ctx, segment, size, from);
+        } break;
+        case DatagramKind_UNKNOWN: {
+        } break;
+        }
+      }
+      /* NOTE: a read batch comes from a single source */
+      dgram_batch_write_to(&ctx->stun, &ctx->stun_replies, from);
+      dgram_batch_clear(&ctx->stun_replies);
     }
   }
 
@@ -367,30 +1790,122 @@ void event_loop_process(Context *ctx) {
     assert(ctx->addr_messages_first);
     addr_msg = ctx->addr_messages_first;
     dllist_remove(ctx->addr_messages_first, ctx->addr_messages_last, addr_msg);
+    ctx->addr_messages_count--;
+    ctx->loop_work++;
     dgram_message_write_to(&ctx->event_arena, &ctx->stun, &addr_msg->msg,
                            addr_msg->addr);
     addr_message_free(&ctx->addr_message_allocator, addr_msg);
   }
 }
 
-void event_loop_cleanup(Context *ctx) { ctx->event_arena.used = 0; }
+void server_metrics_update(Context *ctx) {
+  ServerMetrics *m;
+  m = &ctx->m;
+  metrics_add(m->loop_iterations, 1);
+  metrics_set(m->peers, ctx->peers_count);
+  metrics_set(m->rooms, ctx->rooms_count);
+  metrics_set(m->queued_messages, ctx->queued_messages);
+  metrics_set(m->queued_bytes, ctx->queued_bytes);
+  metrics_set(m->recv_buffers, ctx->stream_buffers.in_use);
+  metrics_set(m->recv_buffers_allocated, ctx->stream_buffers.allocated);
+  metrics_set(m->recv_buffers_exhausted, ctx->stream_buffers.exhausted);
+  metrics_set(m->stun_pending, ctx->addr_messages_count);
+  metrics_set(m->stun_rate_limited, ctx->stun_limiter.stats.dropped);
+  metrics_set(m->stun_queue_dropped, ctx->stun_queue_dropped);
+  metrics_set(m->arena_used, ctx->arena.used);
+  metrics_set(m->log_suppressed, ctx->log.stats.suppressed);
+  metrics_set(m->log_dropped, ctx->log.stats.dropped);
+  metrics_set(m->capture_records, ctx->capture.records);
+  metrics_set(m->capture_dropped, ctx->capture.dropped);
+  if (ctx->event_arena.used > metrics_load(&m->event_arena_peak->value)) {
+    metrics_set(m->event_arena_peak, ctx->event_arena.used);
+  }
+}
+
+void event_loop_cleanup(Context *ctx) {
+  server_metrics_update(ctx);
+  ctx->event_arena.used = 0;
+}
+
+/* NOTE: one iteration with every phase timed. The busy time is what a stall
+ * looks like from the outside, the phases and the counts say where it went */
+void event_loop_run(Context *ctx) {
+  ServerMetrics *m;
+  u64 start, prepared, processed, end, process_ns, busy_ns;
+  m = &ctx->m;
+
+  trace_probe(loop_prepare_start);
+  start = conn_current_time_ns();
+  event_loop_prepare(ctx);
+  prepared = conn_current_time_ns();
+  event_loop_process(ctx);
+  processed = conn_current_time_ns();
+  trace_probe1(loop_process_end, ctx->loop_work);
+  event_loop_cleanup(ctx);
+  end = conn_current_time_ns();
+
+  process_ns = processed - prepared - ctx->loop_poll_ns;
+  busy_ns = end - start - ctx->loop_poll_ns;
+  trace_probe1(loop_cleanup_end, busy_ns);
+  metrics_record(m->loop_prepare_ns, prepared - start);
+  metrics_record(m->loop_poll_ns, ctx->loop_poll_ns);
+  metrics_record(m->loop_process_ns, process_ns);
+  metrics_record(m->loop_cleanup_ns, end - processed);
+  metrics_record(m->loop_busy_ns, busy_ns);
+  metrics_record(m->loop_ready, ctx->loop_ready);
+  metrics_record(m->loop_work, ctx->loop_work);
+
+  if (ctx->config.loop_slow_us &&
+      busy_ns >= (u64)ctx->config.loop_slow_us * 1000) {
+    log_event(&ctx->log, ctx->now, 100, 100,
+              "slow loop: busy %uus prepare %uus process %uus cleanup %uus "
+              "ready %u work %u",
+              busy_ns / 1000, (prepared - start) / 1000, process_ns / 1000,
+              (end - processed) / 1000, ctx->loop_ready, ctx->loop_work);
+  }
+}
 
-int main(void) {
+/* NOTE: set by SIGINT and SIGTERM, the loop ends and main closes what has to
+ * be closed (the capture is cut to size, the log is written out) */
+static volatile sig_atomic_t server_stop;
+
+static void server_on_signal(int signal_number) {
+  unused(signal_number);
+  server_stop = 1;
+}
+
+void ctx_shutdown(Context *ctx) {
+  capture_close(&ctx->capture);
+  log_close(&ctx->log);
+  metrics_close(&ctx->metrics);
+}
+
+int main(int argc, char **argv) {
   static Context _context;
   Context *ctx = &_context;
+  ServerConfig config;
+  u32 res;
+
+  server_config_default(&config);
+  res = server_config_parse(&config, argc, argv);
+  if (res != CONFIG_OK) {
+    return res == CONFIG_EXIT ? 0 : 1;
+  }
 
   conn_init();
-  ctx_init(ctx);
+  ctx_init(ctx, &config);
+  signal(SIGINT, server_on_signal);
+  signal(SIGTERM, server_on_signal);
 
   for (;;) {
-    if (!ctx->running) {
+    if (!ctx->running || server_stop) {
       break;
     }
 
-    event_loop_prepare(ctx);
-    event_loop_process(ctx);
-    event_loop_cleanup(ctx);
+    event_loop_run(ctx);
   }
 
+  ctx_shutdown(ctx);
+
   return 0;
 }
@@ -0,0 +1,89 @@
+#include "stun.h"
+
+static u32 crc32_table[256];
+static b32 crc32_table_ready;
+
+static void crc32_table_init(void) {
+  u32 i, j;
+  for (i = 0; i < 256; ++i) {
+    u32 crc = i;
+    for (j = 0; j < 8; ++j) {
+      crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1)));
+    }
+    crc32_table[i] = crc;
+  }
+  crc32_table_ready = true;
+}
+
+static u32 crc32(u8 *buffer, u32 size) {
+  u32 crc, i;
+  if (!crc32_table_ready) {
+    crc32_table_init();
+  }
+  crc = 0xffffffffu;
+  for (i = 0; i < size; ++i) {
+    crc = (crc >> 8) ^ crc32_table[(crc ^ buffer[i]) & 0xff];
+  }
+  return crc ^ 0xffffffffu;
+}
+
+DatagramKind datagram_classify(u8 *buffer, u32 size) {
+  if (size >= 9 && valid_proto(buffer)) {
+    return DatagramKind_TENT;
+  }
+  if (size >= STUN_HEADER_SIZE && (buffer[0] & 0xc0) == 0 &&
+      peek_u32_be(buffer + 4) == STUN_MAGIC_COOKIE) {
+    return DatagramKind_STUN;
+  }
+  return DatagramKind_UNKNOWN;
+}
+
+u32 stun_binding_response_write(u8 *request, u32 request_size, u8 *response,
+                                ConnEndpoint *endpoint) {
+  u8 *cursor, *mask;
+  u16 type, length;
+  u32 fingerprint, size, addr_size, i;
+  if (request_size < STUN_HEADER_SIZE) {
+    return 0;
+  }
+  cursor = request;
+  type = read_u16_be(cursor);
+  length = read_u16_be(cursor);
+  if (type != STUN_BINDING_REQUEST || (length & 3) != 0 ||
+      STUN_HEADER_SIZE + (u32)length != request_size) {
+    return 0;
+  }
+
+  size = stun_binding_response_size(endpoint);
+  addr_size = endpoint->family == CONN_FAMILY_IPV6 ? 16 : 4;
+
+  cursor = response;
+  write_u16_be(cursor, STUN_BINDING_RESPONSE);
+  write_u16_be(cursor, size - STUN_HEADER_SIZE);
+  /* NOTE: magic cookie and transaction id are echoed as they are, they are
+   * also the xor mask of the address */
+  mask = cursor;
+  memcpy(cursor, request + 4, 4 + STUN_TRANSACTION_ID_SIZE);
+  cursor += 4 + STUN_TRANSACTION_ID_SIZE;
+
+  write_u16_be(cursor, STUN_ATTR_XOR_MAPPED_ADDRESS);
+  write_u16_be(cursor, 4 + addr_size);
+  write_u8_be(cursor, 0);
+  write_u8_be(cursor, endpoint->family == CONN_FAMILY_IPV6 ? STUN_FAMILY_IPV6
+                                                           : STUN_FAMILY_IPV4);
+  write_u16_be(cursor, endpoint->port ^ (STUN_MAGIC_COOKIE >> 16));
+  for (i = 0; i < addr_size; ++i) {
+    cursor[i] = endpoint->addr[i] ^ mask[i];
+  }
+  cursor += addr_size;
+
+  /* NOTE: the crc covers everything before the attribute, with the length in
+   * the header already counting it */
+  fingerprint = crc32(response, size - 8);
+  write_u16_be(cursor, STUN_ATTR_FINGERPRINT);
+  write_u16_be(cursor, 4);
+  write_u32_be(cursor, fingerprint ^ STUN_FINGERPRINT_XOR);
+
+  assert(cursor - response == size);
+  return size;
+}
@@ -0,0 +1,45 @@
+#ifndef _STUN_H_
+#define _STUN_H_
+
+#include "proto.h"
+
+/* NOTE: rfc 5389 binding responder so standard stun clients can use the same
+ * port as our own protocol. Only binding requests are answered, with
+ * XOR-MAPPED-ADDRESS and FINGERPRINT, everything else is ignored. No
+ * authentication and no long term state */
+
+#define STUN_HEADER_SIZE 20
+#define STUN_MAGIC_COOKIE 0x2112a442
+#define STUN_TRANSACTION_ID_SIZE 12
+#define STUN_BINDING_REQUEST 0x0001
+#define STUN_BINDING_RESPONSE 0x0101
+#define STUN_ATTR_XOR_MAPPED_ADDRESS 0x0020
+#define STUN_ATTR_FINGERPRINT 0x8028
+#define STUN_FINGERPRINT_XOR 0x5354554e
+#define STUN_FAMILY_IPV4 0x01
+#define STUN_FAMILY_IPV6 0x02
+/* NOTE: header, XOR-MAPPED-ADDRESS (4 + 8 or 4 + 20) and FINGERPRINT (4 + 4) */
+#define STUN_BINDING_RESPONSE_IPV4_SIZE (STUN_HEADER_SIZE + 12 + 8)
+#define STUN_BINDING_RESPONSE_IPV6_SIZE (STUN_HEADER_SIZE + 24 + 8)
+#define stun_binding_response_size(endpoint)                                   \
+  ((endpoint)->family == CONN_FAMILY_IPV6 ? STUN_BINDING_RESPONSE_IPV6_SIZE    \
+                                          : STUN_BINDING_RESPONSE_IPV4_SIZE)
+
+typedef enum DatagramKind {
+  DatagramKind_UNKNOWN,
+  DatagramKind_TENT,
+  DatagramKind_STUN
+} DatagramKind;
+
+/* NOTE: looks at the first 8 bytes only, the two protocols can not collide:
+ * stun messages start with two zero bits and carry the magic cookie at byte 4,
+ * ours start with 'T' */
+DatagramKind datagram_classify(u8 *buffer, u32 size);
+
+/* NOTE: writes the response to a binding request into response (at least
+ * stun_binding_response_size bytes) and returns its size, 0 when request is
+ * not a well formed binding request */
+u32 stun_binding_response_write(u8 *request, u32 request_size, u8 *response,
+                                ConnEndpoint *endpoint);
+
+#endif
@@ -0,0 +1,153 @@
+#include "config.h"
+#include "metrics.h"
+#include "net.h"
+
+/* NOTE: reader of a metrics file. Every interval it copies the values and
+ * histograms out of the mapping and prints counters as rates, gauges as they
+ * are and histogram percentiles over the samples recorded in the interval.
+ * The process that writes the file is never involved */
+
+typedef struct TopConfig {
+  char metrics_path[CONFIG_STRING_SIZE];
+  u32 interval_ms;
+  u32 count;
+} TopConfig;
+
+typedef struct TopSnapshot {
+  u64 time;
+  u32 values_count;
+  u32 histograms_count;
+  u64 *values;
+  u64 *counts;
+  u64 *sums;
+  u64 *buckets;
+} TopSnapshot;
+
+#define DEFAULT_METRICS_PATH "tenet-server.metrics"
+#define DEFAULT_INTERVAL_MS 1000
+
+static void top_snapshot_init(TopSnapshot *snapshot, Metrics *metrics) {
+  u32 values, histograms;
+  values = metrics->header->values_capacity;
+  histograms = metrics->header->histograms_capacity;
+  memset(snapshot, 0, sizeof(*snapshot));
+  snapshot->values = calloc(max(values, 1), sizeof(u64));
+  snapshot->counts = calloc(max(histograms, 1), sizeof(u64));
+  snapshot->sums = calloc(max(histograms, 1), sizeof(u64));
+  snapshot->buckets = calloc(max(histograms, 1), sizeof(u64) * METRICS_BUCKETS);
+  assert(snapshot->values && snapshot->counts && snapshot->sums &&
+         snapshot->buckets);
+}
+
+static void top_snapshot_take(TopSnapshot *snapshot, Metrics *metrics) {
+  u32 i, j;
+  snapshot->time = conn_current_time_us();
+  snapshot->values_count = metrics_values_count(metrics);
+  snapshot->histograms_count = metrics_histograms_count(metrics);
+  for (i = 0; i < snapshot->values_count; ++i) {
+    snapshot->values[i] = metrics_load(&metrics->values[i].value);
+  }
+  for (i = 0; i < snapshot->histograms_count; ++i) {
+    MetricsHistogram *histogram;
+    u64 *buckets;
+    histogram = &metrics->histograms[i];
+    buckets = snapshot->buckets + (u64)i * METRICS_BUCKETS;
+    snapshot->counts[i] = metrics_load(&histogram->count);
+    snapshot->sums[i] = metrics_load(&histogram->sum);
+    for (j = 0; j < METRICS_BUCKETS; ++j) {
+      buckets[j] = metrics_load(&histogram->buckets[j]);
+    }
+  }
+}
+
+static void top_print(Metrics *metrics, TopSnapshot *previous,
+                      TopSnapshot *current) {
+  static u64 delta[METRICS_BUCKETS];
+  f64 seconds;
+  u32 i, j;
+  seconds = (f64)(current->time - previous->time) / 1e6;
+  printf("\nuptime %.1fs interval %.2fs\n",
+         (f64)(current->time - metrics->header->created_time) / 1e6, seconds);
+  printf("%-40s %14s %12s\n", "value", "total", "/s");
+  for (i = 0; i < current->values_count; ++i) {
+    MetricsValue *value;
+    value = &metrics->values[i];
+    if (value->type == MetricType_GAUGE) {
+      printf("%-40s %14llu %12s\n", value->name, current->values[i], "-");
+    } else {
+      u64 before;
+      before = i < previous->values_count ? previous->values[i] : 0;
+      printf("%-40s %14llu %12.1f\n", value->name, current->values[i],
+             (f64)(current->values[i] - before) / seconds);
+    }
+  }
+  if (!current->histograms_count) {
+    return;
+  }
+  printf("%-28s %12s %10s %10s %10s %10s %10s\n", "histogram", "count", "/s",
+         "p50", "p99", "max", "mean");
+  for (i = 0; i < current->histograms_count; ++i) {
+    u64 *now_buckets, *old_buckets, count, sum;
+    b32 existed;
+    existed = i < previous->histograms_count;
+    now_buckets = current->buckets + (u64)i * METRICS_BUCKETS;
+    old_buckets = previous->buckets + (u64)i * METRICS_BUCKETS;
+    count = current->counts[i] - (existed ? previous->counts[i] : 0);
+    sum = current->sums[i] - (existed ? previous->sums[i] : 0);
+    for (j = 0; j < METRICS_BUCKETS; ++j) {
+      delta[j] = now_buckets[j] - (existed ? old_buckets[j] : 0);
+    }
+    printf("%-28s %12llu %10.1f %10llu %10llu %10llu %10.1f\n",
+           metrics->histograms[i].name, current->counts[i], count / seconds,
+           metrics_percentile(delta, count, 50),
+           metrics_percentile(delta, count, 99),
+           metrics_percentile(delta, count, 100),
+           count ? (f64)sum / count : 0.0);
+  }
+}
+
+int main(int argc, char **argv) {
+  TopConfig config;
+  TopSnapshot snapshots[2], *previous, *current, *swap;
+  Metrics metrics;
+  u32 res, i;
+  ConfigOption options[] = {
+      {"metrics", ConfigType_STRING, config.metrics_path, 0, 0,
+       "metrics file written by the server or a peer"},
+      {"interval-ms", ConfigType_U32, &config.interval_ms, 10, 3600000,
+       "milliseconds between samples"},
+      {"count", ConfigType_U32, &config.count, 0, 0xffffffff,
+       "samples to print before exiting, 0 is forever"},
+  };
+
+  memset(&config, 0, sizeof(config));
+  strcpy(config.metrics_path, DEFAULT_METRICS_PATH);
+  config.interval_ms = DEFAULT_INTERVAL_MS;
+  res = config_parse_args(options, array_len(options), argc, argv);
+  if (res != CONFIG_OK) {
+    return res == CONFIG_EXIT ? 0 : 1;
+  }
+
+  if (!metrics_attach(&metrics, config.metrics_path)) {
+    fprintf(stderr, "%s: not a metrics file, start the server with "
+                    "--metrics\n",
+            config.metrics_path);
+    return 1;
+  }
+  top_snapshot_init(&snapshots[0], &metrics);
+  top_snapshot_init(&snapshots[1], &metrics);
+  previous = &snapshots[0];
+  current = &snapshots[1];
+  top_snapshot_take(previous, &metrics);
+  for (i = 0; config.count == 0 || i < config.count; ++i) {
+    conn_sleep_ms(config.interval_ms);
+    top_snapshot_take(current, &metrics);
+    top_print(&metrics, previous, current);
+    fflush(stdout);
+    swap = previous;
+    previous = current;
+    current = swap;
+  }
+  metrics_close(&metrics);
+  return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/* NOTE: static tracepoints. Built with TENET_USDT (cmake -DTENET_USDT=ON,
+ * needs systemtap's sys/sdt.h) every probe is a nop in the binary plus a note
+ * that bpftrace, perf or systemtap can attach to:
+ *
+ *   bpftrace -e 'usdt:./tenet-server:tenet:loop_poll_end { @r = hist(arg0); }'
+ *
+ * Without it the probes compile to nothing */
+
+#if defined(TENET_USDT)
+#include <sys/sdt.h>
+#define trace_probe(name) DTRACE_PROBE(tenet, name)
+#define trace_probe1(name, a) DTRACE_PROBE1(tenet, name, a)
+#define trace_probe2(name, a, b) DTRACE_PROBE2(tenet, name, a, b)
+#else
+#define trace_probe(name) ((void)0)
+#define trace_probe1(name, a) ((void)0)
+#define trace_probe2(name, a, b) ((void)0)
+#endif
+
+#endif
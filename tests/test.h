@@ -0,0 +1,30 @@
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include "../src/core.h"
+
+/* NOTE: minimal unit test harness. A failed expect prints where it happened
+ * and the test keeps going, the binary exits with 1 when anything failed */
+
+extern u32 test_checks;
+extern u32 test_failures;
+
+void test_fail(char *file, u32 line, char *expression);
+
+#define expect(cond)                                                           \
+  ((cond) ? (void)test_checks++ : test_fail(__FILE__, __LINE__, #cond))
+
+void test_proto(void);
+void test_ratelimit(void);
+void test_stun(void);
+void test_config(void);
+void test_punch(void);
+void test_metrics(void);
+void test_log(void);
+void test_capture(void);
+void test_rank(void);
+void test_gossip(void);
+void test_reliable(void);
+void test_sequenced(void);
+
+#endif
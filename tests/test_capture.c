@@ -0,0 +1,90 @@
+#include "../src/capture.h"
+#include "../src/proto.h"
+#include "test.h"
+
+#define TEST_CAPTURE_PATH "tenet-test.pcapng"
+
+void test_capture(void) {
+  Capture capture;
+  CaptureReader reader;
+  CaptureRecord record;
+  ConnEndpoint source;
+  u8 datagram[] = {1, 2, 3, 4, 5};
+  u8 frame[64];
+  u8 block[48];
+  FILE *file;
+  u64 first_time;
+  u32 i, records;
+
+  for (i = 0; i < sizeof(frame); ++i) {
+    frame[i] = (u8)i;
+  }
+  endpoint_ipv4(&source, 0x7f000001, 4000);
+  /* NOTE: the header blocks take 48 bytes and the first three records 240,
+   * a packet block is 32 bytes plus the padded data */
+  if (!capture_open(&capture, TEST_CAPTURE_PATH, 300)) {
+    expect(!"can not create " TEST_CAPTURE_PATH);
+    return;
+  }
+  capture_record(&capture, 100, CaptureKind_DGRAM, 0, &source, datagram,
+                 sizeof(datagram));
+  capture_record(&capture, 200, CaptureKind_OPEN, 7, 0, 0, 0);
+  capture_record(&capture, 300, CaptureKind_FRAME, 7, 0, frame, sizeof(frame));
+  /* NOTE: does not fit anymore */
+  capture_record(&capture, 400, CaptureKind_FRAME, 7, 0, frame, sizeof(frame));
+  capture_record(&capture, 500, CaptureKind_CLOSE, 7, 0, 0, 0);
+  expect(capture.records == 3);
+  expect(capture.dropped == 2);
+  capture_close(&capture);
+
+  /* NOTE: a pcapng section header in host order, then the interface */
+  file = fopen(TEST_CAPTURE_PATH, "rb");
+  expect(file != 0);
+  if (file) {
+    u32 type, byte_order;
+    u16 link_type;
+    expect(fread(block, 1, sizeof(block), file) == sizeof(block));
+    fclose(file);
+    memcpy(&type, block, 4);
+    memcpy(&byte_order, block + 8, 4);
+    memcpy(&link_type, block + 28 + 8, 2);
+    expect(type == 0x0a0d0d0a);
+    expect(byte_order == 0x1a2b3c4d);
+    expect(link_type == CAPTURE_LINKTYPE_USER0);
+  }
+
+  expect(capture_reader_open(&reader, TEST_CAPTURE_PATH));
+  records = 0;
+  first_time = 0;
+  while (capture_reader_next(&reader, &record)) {
+    switch (records) {
+    case 0: {
+      expect(record.kind == CaptureKind_DGRAM);
+      expect(endpoint_equals(&record.endpoint, &source));
+      expect(record.size == sizeof(datagram));
+      expect(memcmp(record.data, datagram, sizeof(datagram)) == 0);
+    } break;
+    case 1: {
+      expect(record.kind == CaptureKind_OPEN);
+      expect(record.conn == 7);
+      expect(record.size == 0);
+    } break;
+    case 2: {
+      expect(record.kind == CaptureKind_FRAME);
+      expect(record.size == sizeof(frame));
+      expect(memcmp(record.data, frame, sizeof(frame)) == 0);
+    } break;
+    }
+    /* NOTE: the epoch offset is the same for every record */
+    if (records == 0) {
+      first_time = record.time;
+    }
+    expect(record.time - first_time == 100 * records);
+    records++;
+  }
+  expect(records == 3);
+  capture_reader_close(&reader);
+  remove(TEST_CAPTURE_PATH);
+
+  expect(!capture_reader_open(&reader, TEST_CAPTURE_PATH));
+}
@@ -0,0 +1,62 @@
+#include "../src/config.h"
+#include "test.h"
+
+typedef struct TestConfig {
+  char address[CONFIG_STRING_SIZE];
+  u16 port;
+  u32 count;
+  u64 size;
+} TestConfig;
+
+static u32 test_config_parse(TestConfig *config, int argc, char **argv) {
+  ConfigOption options[] = {
+      {"address", ConfigType_STRING, config->address, 0, 0, "address"},
+      {"port", ConfigType_U16, &config->port, 1, 0xffff, "port"},
+      {"count", ConfigType_U32, &config->count, 0, 100, "count"},
+      {"size", ConfigType_SIZE, &config->size, 0, gb(1), "size"},
+  };
+  return config_parse_args(options, array_len(options), argc, argv);
+}
+
+void test_config(void) {
+  TestConfig config;
+  char *args[] = {"test", "--address", "::1", "--port=80", "--size", "4m"};
+  char *range[] = {"test", "--count", "101"};
+  char *suffix[] = {"test", "--count", "1k"};
+  char *unknown[] = {"test", "--nope", "1"};
+  char *missing[] = {"test", "--port"};
+  char *file_args[] = {"test", "--port", "9", "--config", 0};
+  char path[] = "tenet_test_config.conf";
+  FILE *file;
+
+  memset(&config, 0, sizeof(config));
+  expect(test_config_parse(&config, array_len(args), args) == CONFIG_OK);
+  expect(strcmp(config.address, "::1") == 0);
+  expect(config.port == 80);
+  expect(config.size == mb(4));
+
+  expect(test_config_parse(&config, array_len(range), range) == CONFIG_ERROR);
+  expect(test_config_parse(&config, array_len(suffix), suffix) ==
+         CONFIG_ERROR);
+  expect(test_config_parse(&config, array_len(unknown), unknown) ==
+         CONFIG_ERROR);
+  expect(test_config_parse(&config, array_len(missing), missing) ==
+         CONFIG_ERROR);
+
+  /* NOTE: flags win over the file even when they come first */
+  file = fopen(path, "w");
+  expect(file != 0);
+  if (!file) {
+    return;
+  }
+  fprintf(file, "# comment\n  port = 7\ncount=3 # trailing\n\nsize = 1k\n");
+  fclose(file);
+  file_args[4] = path;
+  memset(&config, 0, sizeof(config));
+  expect(test_config_parse(&config, array_len(file_args), file_args) ==
+         CONFIG_OK);
+  expect(config.port == 9);
+  expect(config.count == 3);
+  expect(config.size == kb(1));
+  remove(path);
+}
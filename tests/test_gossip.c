@@ -0,0 +1,107 @@
+#include "../src/gossip.h"
+#include "test.h"
+
+static void test_gossip_member(PeerConnected *peer, u32 index) {
+  memset(peer, 0, sizeof(*peer));
+  endpoint_ipv4(&peer->endpoint, 0x0a000000 + index, (u16)(1000 + index));
+  peer->candidates_count = 1;
+  peer->candidates[0].type = CandidateType_HOST;
+  endpoint_ipv4(&peer->candidates[0].endpoint, 0xc0a80000 + index, 4000);
+}
+
+/* NOTE: from sends the buckets that differ to to, through the wire */
+static u32 test_gossip_repair(Gossip *from, Gossip *to, Arena *arena) {
+  u32 mask, cursor, learned;
+  mask = gossip_digest_diff(from, &to->digest);
+  cursor = 0;
+  learned = 0;
+  while (cursor < from->members_count) {
+    Message msg, *received;
+    PeerConnected *entry;
+    u8 *buffer;
+    u64 size;
+    if (!gossip_delta(from, arena, &msg, mask, &cursor,
+                      from->members_count)) {
+      break;
+    }
+    buffer = message_serialize(arena, &msg, &size);
+    expect(size <= GOSSIP_DATAGRAM_SIZE);
+    received = message_deserialize(arena, buffer, size);
+    expect(received && received->header.type == MessageType_GOSSIP_DELTA);
+    if (!received) {
+      break;
+    }
+    for (entry = gossip_process(to, arena, received, 0); entry != 0;
+         entry = entry->next) {
+      learned++;
+    }
+  }
+  return learned;
+}
+
+void test_gossip(void) {
+  static u8 memory[kb(512)];
+  Arena arena;
+  Gossip a, b;
+  PeerConnected peer;
+  Message *digest;
+  u8 *buffer;
+  u64 size;
+  u32 i;
+
+  arena_init(&arena, memory, sizeof(memory));
+  gossip_init(&a, &arena, 0, 256, 1);
+  gossip_init(&b, &arena, 0, 256, 2);
+
+  /* NOTE: a knows 0 to 199, b knows 0 to 99 and 500, 501 */
+  for (i = 0; i < 200; ++i) {
+    test_gossip_member(&peer, i);
+    expect(gossip_add(&a, &peer) != 0);
+    if (i < 100) {
+      expect(gossip_add(&b, &peer) != 0);
+    }
+  }
+  test_gossip_member(&peer, 500);
+  gossip_add(&b, &peer);
+  test_gossip_member(&peer, 501);
+  gossip_add(&b, &peer);
+  /* NOTE: a known entry is not a rumor again */
+  expect(gossip_add(&b, &peer) == 0);
+  expect(b.members_count == 102 && b.hot_count == 102);
+  expect(gossip_digest_diff(&a, &b.digest) != 0);
+
+  /* NOTE: the digest goes over the wire */
+  buffer = message_serialize(&arena, (Message *)&b.digest, &size);
+  digest = message_deserialize(&arena, buffer, size);
+  expect(digest && digest->header.type == MessageType_GOSSIP_DIGEST);
+  if (digest) {
+    expect(digest->gossip_digest.count == 102);
+    expect(memcmp(digest->gossip_digest.buckets, b.digest.buckets,
+                  sizeof(b.digest.buckets)) == 0);
+  }
+
+  /* NOTE: one exchange each way and both sets are the same */
+  expect(test_gossip_repair(&a, &b, &arena) == 100);
+  expect(test_gossip_repair(&b, &a, &arena) == 2);
+  expect(a.members_count == 202 && b.members_count == 202);
+  expect(gossip_digest_diff(&a, &b.digest) == 0);
+  expect(gossip_digest_diff(&b, &a.digest) == 0);
+  test_gossip_member(&peer, 150);
+  expect(gossip_find(&b, &peer.endpoint) != 0);
+  expect(gossip_find(&b, &peer.endpoint)->peer.candidates_count == 1);
+  expect(test_gossip_repair(&a, &b, &arena) == 0);
+
+  /* NOTE: entries without an endpoint are rejected */
+  memset(&peer, 0, sizeof(peer));
+  expect(gossip_add(&a, &peer) == 0);
+  expect(a.stats.rejected == 0);
+
+  /* NOTE: a full set counts what it could not take, not what it knows */
+  for (i = 202; i < 260; ++i) {
+    test_gossip_member(&peer, i);
+    gossip_add(&a, &peer);
+  }
+  expect(a.members_count == 256 && a.stats.rejected == 4);
+  test_gossip_member(&peer, 10);
+  expect(gossip_add(&a, &peer) == 0 && a.stats.rejected == 4);
+}
@@ -0,0 +1,114 @@
+#include "../src/log.h"
+#include "test.h"
+
+#define TEST_LOG_PATH "tenet-test.log"
+
+static void test_log_format(void) {
+  static LogSite site = {"a %u b %x c %E %% d %u %q", 0, 0, 0};
+  static u8 memory[kb(1)];
+  LogRecord record;
+  ConnEndpoint endpoint;
+  Arena arena;
+  char buffer[256];
+  u64 args[] = {42, 255, 0, 0, 0};
+  arena_init(&arena, memory, sizeof(memory));
+  conn_address_get_endpoint(conn_address(&arena, "10.1.2.3", 8081),
+                            &endpoint);
+  args[2] = log_endpoint_word(&endpoint, 0);
+  args[3] = log_endpoint_word(&endpoint, 1);
+  args[4] = log_endpoint_word(&endpoint, 2);
+
+  memset(&record, 0, sizeof(record));
+  record.time = 3000042;
+  record.site = &site;
+  record.args_count = array_len(args);
+  memcpy(record.args, args, sizeof(args));
+  log_format(&record, buffer, sizeof(buffer));
+  /* NOTE: the argument after the endpoint is missing and %q is unknown */
+  expect(strcmp(buffer, "[3.000042] a 42 b ff c 10.1.2.3:8081 % d ? ?") == 0);
+
+  record.suppressed = 7;
+  log_format(&record, buffer, sizeof(buffer));
+  expect(strstr(buffer, "(7 suppressed)") != 0);
+
+  /* NOTE: a small buffer truncates instead of overflowing */
+  expect(log_format(&record, buffer, 8) == 7);
+  expect(strlen(buffer) == 7);
+}
+
+static void test_log_rate(void) {
+  LogSite site = {"x %u", 10, 5, 5};
+  u64 now;
+  u32 i, allowed;
+  now = 1000000;
+  allowed = 0;
+  for (i = 0; i < 100; ++i) {
+    allowed += log_site_allow(&site, now);
+  }
+  expect(allowed == 5);
+  expect(site.suppressed == 95);
+
+  /* NOTE: 10 per second, 300ms later there are 3 */
+  now += 300000;
+  allowed = 0;
+  for (i = 0; i < 100; ++i) {
+    allowed += log_site_allow(&site, now);
+  }
+  expect(allowed == 3);
+
+  /* NOTE: rate 0 is no limit */
+  site.rate = 0;
+  expect(log_site_allow(&site, now));
+}
+
+static void test_log_ring(void) {
+  static LogSite site = {"record %u", 0, 0, 0};
+  Log log;
+  FILE *file;
+  char line[128];
+  u32 lines, value, previous;
+  u64 pushed;
+  b32 ordered;
+  remove(TEST_LOG_PATH);
+  if (!log_open(&log, TEST_LOG_PATH, 16)) {
+    expect(!"can not open " TEST_LOG_PATH);
+    return;
+  }
+  /* NOTE: more than the ring holds, the writer thread may not keep up and
+   * what does not fit is counted as dropped */
+  for (value = 0; value < 1000; ++value) {
+    log_event(&log, value, 0, 0, "record %u", value);
+  }
+  log_push(&log, &site, 1000, 0, 0);
+  expect(log.stats.pushed + log.stats.dropped == 1001);
+  expect(log.stats.pushed >= 16);
+  pushed = log.stats.pushed;
+  log_close(&log);
+
+  file = fopen(TEST_LOG_PATH, "rb");
+  expect(file != 0);
+  if (!file) {
+    return;
+  }
+  lines = 0;
+  previous = 0;
+  ordered = true;
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(strchr(line, ']') + 2, "record %u", &value) == 1) {
+      ordered = ordered && (lines == 0 || value > previous);
+      previous = value;
+    }
+    lines++;
+  }
+  fclose(file);
+  remove(TEST_LOG_PATH);
+  /* NOTE: close writes everything that was pushed, in order */
+  expect(ordered);
+  expect(lines == pushed);
+}
+
+void test_log(void) {
+  test_log_format();
+  test_log_rate();
+  test_log_ring();
+}
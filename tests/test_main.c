@@ -0,0 +1,43 @@
+#include "../src/net.h"
+#include "test.h"
+
+u32 test_checks;
+u32 test_failures;
+
+void test_fail(char *file, u32 line, char *expression) {
+  test_checks++;
+  test_failures++;
+  fprintf(stderr, "%s:%u: expect(%s) failed\n", file, line, expression);
+}
+
+typedef struct Test {
+  char *name;
+  void (*run)(void);
+} Test;
+
+static Test tests[] = {
+    {"proto", test_proto},   {"ratelimit", test_ratelimit},
+    {"stun", test_stun},     {"config", test_config},
+    {"punch", test_punch},   {"metrics", test_metrics},
+    {"log", test_log},       {"capture", test_capture},
+    {"rank", test_rank},     {"gossip", test_gossip},
+    {"reliable", test_reliable}, {"sequenced", test_sequenced},
+};
+
+int main(int argc, char **argv) {
+  u32 i;
+  conn_init();
+  for (i = 0; i < array_len(tests); ++i) {
+    u32 failures;
+    /* NOTE: an argument runs a single test */
+    if (argc > 1 && strcmp(argv[1], tests[i].name) != 0) {
+      continue;
+    }
+    failures = test_failures;
+    tests[i].run();
+    printf("%-12s %s\n", tests[i].name,
+           test_failures == failures ? "ok" : "FAILED");
+  }
+  printf("%u checks, %u failed\n", test_checks, test_failures);
+  return test_failures ? 1 : 0;
+}
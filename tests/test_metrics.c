@@ -0,0 +1,110 @@
+#include "../src/metrics.h"
+#include "test.h"
+
+#define TEST_METRICS_PATH "tenet-test.metrics"
+
+static void test_metrics_buckets(void) {
+  static u64 buckets[METRICS_BUCKETS];
+  u64 value;
+  u32 i;
+
+  /* NOTE: small values are exact */
+  for (i = 0; i < 32; ++i) {
+    expect(metrics_bucket(i) == i);
+    expect(metrics_bucket_value(i) == i);
+  }
+  expect(metrics_bucket(32) == 32);
+  expect(metrics_bucket(64) == 48);
+  expect(metrics_bucket(((u64)1 << METRICS_MAX_BITS) - 1) ==
+         METRICS_BUCKETS - 1);
+  expect(metrics_bucket((u64)1 << 50) == METRICS_BUCKETS - 1);
+
+  /* NOTE: every value lands in a bucket that covers it and the bound is less
+   * than 1/16 above it */
+  for (value = 1; value < ((u64)1 << METRICS_MAX_BITS); value = value * 3 + 1) {
+    u64 bound;
+    bound = metrics_bucket_value(metrics_bucket(value));
+    expect(bound >= value);
+    expect(bound - value <= value / 16);
+  }
+  for (i = 1; i < METRICS_BUCKETS; ++i) {
+    expect(metrics_bucket_value(i) > metrics_bucket_value(i - 1));
+    expect(metrics_bucket(metrics_bucket_value(i)) == i);
+  }
+
+  /* NOTE: 1..100 once each */
+  for (value = 1; value <= 100; ++value) {
+    buckets[metrics_bucket(value)]++;
+  }
+  /* NOTE: the upper bound of the bucket, 48..51 for the median */
+  expect(metrics_percentile(buckets, 100, 50) == 51);
+  expect(metrics_percentile(buckets, 100, 99) >= 99);
+  expect(metrics_percentile(buckets, 100, 99) <= 103);
+  expect(metrics_percentile(buckets, 100, 100) >= 100);
+  expect(metrics_percentile(buckets, 0, 50) == 0);
+}
+
+static void test_metrics_registry(void) {
+  Metrics metrics;
+  MetricsValue *a, *b;
+  MetricsHistogram *histogram;
+  expect(metrics_open(&metrics, 0, 4, 2));
+  a = metrics_value(&metrics, "a", MetricType_COUNTER);
+  b = metrics_value(&metrics, "b", MetricType_GAUGE);
+  expect(a != b);
+  expect(metrics_value(&metrics, "a", MetricType_COUNTER) == a);
+  expect(metrics_values_count(&metrics) == 2);
+
+  metrics_add(a, 3);
+  metrics_add(a, 4);
+  metrics_set(b, 9);
+  metrics_set(b, 2);
+  expect(metrics_load(&a->value) == 7);
+  expect(metrics_load(&b->value) == 2);
+
+  histogram = metrics_histogram(&metrics, "h");
+  expect(metrics_histogram(&metrics, "h") == histogram);
+  metrics_record(histogram, 10);
+  metrics_record(histogram, 1000);
+  expect(histogram->count == 2);
+  expect(histogram->sum == 1010);
+  expect(histogram->buckets[metrics_bucket(1000)] == 1);
+  metrics_close(&metrics);
+}
+
+static void test_metrics_file(void) {
+  Metrics writer, reader;
+  MetricsValue *value;
+  MetricsHistogram *histogram;
+  expect(!metrics_attach(&reader, TEST_METRICS_PATH ".missing"));
+  if (!metrics_open(&writer, TEST_METRICS_PATH, 8, 2)) {
+    expect(!"can not create " TEST_METRICS_PATH);
+    return;
+  }
+  value = metrics_value(&writer, "peers", MetricType_GAUGE);
+  histogram = metrics_histogram(&writer, "send_ns");
+  metrics_set(value, 42);
+  metrics_record(histogram, 500);
+
+  /* NOTE: the reader sees what the writer did before and after it attached */
+  expect(metrics_attach(&reader, TEST_METRICS_PATH));
+  expect(metrics_values_count(&reader) == 1);
+  expect(metrics_histograms_count(&reader) == 1);
+  expect(strcmp(reader.values[0].name, "peers") == 0);
+  expect(reader.values[0].type == MetricType_GAUGE);
+  expect(metrics_load(&reader.values[0].value) == 42);
+  expect(reader.histograms[0].count == 1);
+  metrics_set(value, 43);
+  metrics_value(&writer, "late", MetricType_COUNTER);
+  expect(metrics_load(&reader.values[0].value) == 43);
+  expect(metrics_values_count(&reader) == 2);
+  metrics_close(&reader);
+  metrics_close(&writer);
+  remove(TEST_METRICS_PATH);
+}
+
+void test_metrics(void) {
+  test_metrics_buckets();
+  test_metrics_registry();
+  test_metrics_file();
+}
@@ -0,0 +1,506 @@
+#include "../src/proto.h"
+#include "test.h"
+
+static void test_connect_round_trip(Arena *arena) {
+  Message msg, *out;
+  u8 *buffer;
+  u64 size, cut;
+  memset(&msg, 0, sizeof(msg));
+  msg.connect.header.type = MessageType_CONNECT;
+  msg.connect.room = 0xdeadbeef;
+  endpoint_ipv4(&msg.connect.endpoint, 0x01020304, 4000);
+  msg.connect.candidates_count = 2;
+  msg.connect.candidates[0].type = CandidateType_HOST;
+  msg.connect.candidates[0].endpoint.family = CONN_FAMILY_IPV6;
+  msg.connect.candidates[0].endpoint.addr[0] = 0xfd;
+  msg.connect.candidates[0].endpoint.addr[15] = 2;
+  msg.connect.candidates[0].endpoint.port = 5000;
+  msg.connect.candidates[1].type = CandidateType_SERVER_REFLEXIVE;
+  msg.connect.candidates[1].endpoint = msg.connect.endpoint;
+
+  buffer = message_serialize(arena, &msg, &size);
+  out = message_deserialize(arena, buffer, size);
+  expect(out != 0);
+  if (!out) {
+    return;
+  }
+  expect(out->header.type == MessageType_CONNECT);
+  expect(out->connect.room == 0xdeadbeef);
+  expect(endpoint_equals(&out->connect.endpoint, &msg.connect.endpoint));
+  expect(out->connect.candidates_count == 2);
+  expect(out->connect.candidates[0].type == CandidateType_HOST);
+  expect(endpoint_equals(&out->connect.candidates[0].endpoint,
+                         &msg.connect.candidates[0].endpoint));
+  expect(out->connect.candidates[1].type == CandidateType_SERVER_REFLEXIVE);
+
+  /* NOTE: a truncated message must never deserialize */
+  for (cut = 9; cut < size; ++cut) {
+    u8 *copy;
+    copy = arena_push(arena, size, 8);
+    memcpy(copy, buffer, size);
+    /* NOTE: keep the header size consistent with the cut */
+    copy[4] = (u8)(cut >> 24);
+    copy[5] = (u8)(cut >> 16);
+    copy[6] = (u8)(cut >> 8);
+    copy[7] = (u8)cut;
+    expect(message_deserialize(arena, copy, cut) == 0);
+  }
+}
+
+static void test_peers_to_connect_round_trip(Arena *arena) {
+  Message msg, *out;
+  PeerConnected peers[2], *peer;
+  u8 *buffer;
+  u64 size;
+  u32 i;
+  memset(&msg, 0, sizeof(msg));
+  memset(peers, 0, sizeof(peers));
+  msg.peers_to_connect.header.type = MessageType_PEERS_TO_CONNECT;
+  for (i = 0; i < 2; ++i) {
+    endpoint_ipv4(&peers[i].endpoint, 0x0a000001 + i, (u16)(1000 + i));
+    peers[i].candidates_count = 1;
+    peers[i].candidates[0].endpoint = peers[i].endpoint;
+    peers[i].candidates[0].type = CandidateType_SERVER_REFLEXIVE;
+    dllist_push_back(msg.peers_to_connect.first, msg.peers_to_connect.last,
+                     &peers[i]);
+  }
+  msg.peers_to_connect.count = 2;
+
+  buffer = message_serialize(arena, &msg, &size);
+  out = message_deserialize(arena, buffer, size);
+  expect(out != 0);
+  if (!out) {
+    return;
+  }
+  expect(out->peers_to_connect.count == 2);
+  i = 0;
+  for (peer = out->peers_to_connect.first; peer != 0; peer = peer->next) {
+    expect(endpoint_equals(&peer->endpoint, &peers[i].endpoint));
+    expect(peer->candidates_count == 1);
+    i++;
+  }
+  expect(i == 2);
+}
+
+static void test_dgram_batch(Arena *arena) {
+  DgramBatch batch;
+  Message msg, *out;
+  u8 *segment;
+  u32 size;
+  dgram_batch_init(&batch, arena_push(arena, DGRAM_BATCH_SIZE, 8),
+                   DGRAM_BATCH_SIZE);
+  memset(&msg, 0, sizeof(msg));
+  msg.punch.header.type = MessageType_PUNCH;
+  endpoint_ipv4(&msg.punch.endpoint, 0x7f000001, 9000);
+  expect(dgram_batch_push_message(&batch, &msg));
+  expect(dgram_batch_push_message(&batch, &msg));
+  expect(dgram_batch_count(&batch) == 2);
+  segment = dgram_batch_segment(&batch, 1, &size);
+  expect(segment != 0 && size == batch.segment_size);
+  out = dgram_batch_message(arena, &batch, 1);
+  expect(out && out->header.type == MessageType_PUNCH);
+  expect(out && endpoint_equals(&out->punch.endpoint, &msg.punch.endpoint));
+}
+
+static void test_stream_count(Stream *stream, Message *msg, void *param) {
+  unused(stream);
+  if (msg->header.type == MessageType_CONNECT) {
+    (*(u32 *)param)++;
+  }
+}
+
+/* NOTE: a header with the given size field and type, the body is zeros */
+static u8 *test_header(Arena *arena, u32 size, u32 size_field, u8 type) {
+  u8 *buffer, *cursor;
+  buffer = arena_push(arena, size, 8);
+  memset(buffer, 0, size);
+  cursor = buffer;
+  write_u32_be(cursor, PROTO_MAGIC);
+  write_u32_be(cursor, size_field);
+  write_u8_be(cursor, type);
+  return buffer;
+}
+
+/* NOTE: frames split across reads, one byte at a time and with a frame and a
+ * half in one read */
+static void test_stream_partial_frames(Arena *arena) {
+  StreamBufferPool pool;
+  Stream *stream;
+  Conn writer, reader;
+  Message msg;
+  u8 *frame, frames[256];
+  u64 size, i;
+  u32 received;
+  stream_buffer_pool_init(&pool, arena, 4);
+  stream = arena_push(arena, sizeof(*stream), 8);
+  expect(conn_stream_pair(&writer, &reader) == CONN_OK);
+  stream_init(stream, reader, &pool);
+  memset(&msg, 0, sizeof(msg));
+  msg.connect.header.type = MessageType_CONNECT;
+  endpoint_ipv4(&msg.connect.endpoint, 0x01020304, 4000);
+  frame = message_serialize(arena, &msg, &size);
+  memcpy(frames, frame, size);
+  memcpy(frames + size, frame, size);
+  memcpy(frames + size * 2, frame, size);
+  received = 0;
+  for (i = 0; i < size; ++i) {
+    conn_write(writer, frames + i, 1);
+    expect(stream_proccess_messages(arena, stream, test_stream_count,
+                                    &received) == CONN_OK);
+  }
+  expect(received == 1);
+  /* NOTE: a buffer is only held while a frame is half read */
+  expect(stream->recv_buffer == 0 && pool.in_use == 0);
+  conn_write(writer, frames + size, (u32)(size + size / 2));
+  expect(stream_proccess_messages(arena, stream, test_stream_count,
+                                  &received) == CONN_OK);
+  expect(received == 2);
+  expect(stream->recv_buffer != 0 && pool.in_use == 1);
+  conn_write(writer, frames + size * 2 + size / 2, (u32)(size - size / 2));
+  expect(stream_proccess_messages(arena, stream, test_stream_count,
+                                  &received) == CONN_OK);
+  expect(received == 3 && stream->recv_buffer_used == 0);
+  expect(stream->recv_buffer == 0 && pool.in_use == 0 && pool.allocated == 1);
+
+  /* NOTE: a stream reset with a half frame gives its buffer back */
+  conn_write(writer, frames, (u32)(size / 2));
+  expect(stream_proccess_messages(arena, stream, test_stream_count,
+                                  &received) == CONN_OK);
+  expect(pool.in_use == 1);
+  stream_reset(stream);
+  expect(pool.in_use == 0 && stream->recv_buffer == 0);
+
+  /* NOTE: a frame size below the header would never be consumed */
+  frame = test_header(arena, 9, 0, MessageType_KEEP_ALIVE);
+  conn_write(writer, frame, 9);
+  expect(stream_proccess_messages(arena, stream, test_stream_count,
+                                  &received) == CONN_ERROR);
+  expect(received == 3);
+  stream_reset(stream);
+  expect(pool.in_use == 0);
+  conn_close(writer);
+  conn_close(stream->conn);
+}
+
+typedef struct TestPeerList {
+  u32 callbacks;
+  u32 entries;
+  b32 in_order;
+} TestPeerList;
+
+static void test_stream_peer_list(Stream *stream, Message *msg, void *param) {
+  TestPeerList *list;
+  PeerConnected *peer;
+  unused(stream);
+  list = (TestPeerList *)param;
+  if (msg->header.type != MessageType_PEERS_TO_CONNECT) {
+    return;
+  }
+  list->callbacks++;
+  for (peer = msg->peers_to_connect.first; peer != 0; peer = peer->next) {
+    list->entries++;
+    if (peer->endpoint.port != list->entries ||
+        peer->candidates_count != 1) {
+      list->in_order = false;
+    }
+  }
+}
+
+/* NOTE: a list several times the stream buffer goes out in chunks and
+ * reaches the callback in parts, in order */
+static void test_stream_large_peer_list(Arena *arena) {
+  StreamBufferPool pool;
+  Stream *in, *out;
+  Conn writer, reader;
+  Message msg;
+  TestPeerList list;
+  u32 i, res, chunks;
+  stream_buffer_pool_init(&pool, arena, 4);
+  in = arena_push(arena, sizeof(*in), 8);
+  out = arena_push(arena, sizeof(*out), 8);
+  expect(conn_stream_pair(&writer, &reader) == CONN_OK);
+  stream_init(in, reader, &pool);
+  stream_init(out, writer, 0);
+  memset(&msg, 0, sizeof(msg));
+  msg.header.type = MessageType_PEERS_TO_CONNECT;
+  for (i = 0; i < 3000; ++i) {
+    PeerConnected *peer;
+    peer = arena_push(arena, sizeof(*peer), 8);
+    memset(peer, 0, sizeof(*peer));
+    endpoint_ipv4(&peer->endpoint, 0x0a000001, (u16)(i + 1));
+    peer->candidates_count = 1;
+    peer->candidates[0].type = CandidateType_HOST;
+    endpoint_ipv4(&peer->candidates[0].endpoint, 0xc0a80001, (u16)(i + 1));
+    dllist_push_back(msg.peers_to_connect.first, msg.peers_to_connect.last,
+                     peer);
+    msg.peers_to_connect.count++;
+  }
+
+  chunks = 0;
+  do {
+    res = stream_message_write(arena, out, &msg);
+    chunks++;
+  } while (res == CONN_WOULD_BLOCK);
+  expect(res == CONN_OK && chunks > 1 && !out->sending);
+
+  memset(&list, 0, sizeof(list));
+  list.in_order = true;
+  for (i = 0; i < 100 && list.entries < 3000; ++i) {
+    expect(stream_proccess_messages(arena, in, test_stream_peer_list,
+                                    &list) == CONN_OK);
+  }
+  expect(list.entries == 3000 && list.in_order && list.callbacks > 1);
+  expect(!in->decoding && in->recv_buffer_used == 0 && pool.in_use == 0);
+
+  /* NOTE: nothing but a peer list may be larger than the buffer */
+  {
+    u8 frame[16], *cursor;
+    cursor = frame;
+    write_u32_be(cursor, PROTO_MAGIC);
+    write_u32_be(cursor, STREAM_BUFFER_SIZE + 1);
+    write_u8_be(cursor, (u8)MessageType_CONNECT);
+    write_u32_be(cursor, 0);
+    conn_write(writer, frame, 13);
+    expect(stream_proccess_messages(arena, in, test_stream_peer_list,
+                                    &list) == CONN_ERROR);
+  }
+  conn_close(writer);
+  conn_close(reader);
+}
+
+/* NOTE: a non blocking conn takes part of a frame, the rest waits in a pool
+ * buffer of the stream and goes out once the other side reads */
+static void test_stream_non_blocking_write(Arena *arena) {
+  StreamBufferPool pool;
+  Stream *in, *out;
+  Conn writer, reader;
+  Message msg;
+  TestPeerList list;
+  u32 i, res, sent;
+  u64 mark;
+  /* NOTE: the loops below roll the arena back, the pool reserved its
+   * buffers before */
+  stream_buffer_pool_init(&pool, arena, 4);
+  in = arena_push(arena, sizeof(*in), 8);
+  out = arena_push(arena, sizeof(*out), 8);
+  expect(conn_stream_pair(&writer, &reader) == CONN_OK);
+  conn_set_non_blocking(writer);
+  stream_init(in, reader, &pool);
+  stream_init(out, writer, &pool);
+  memset(&msg, 0, sizeof(msg));
+  msg.header.type = MessageType_PEERS_TO_CONNECT;
+  for (i = 0; i < 200; ++i) {
+    PeerConnected *peer;
+    peer = arena_push(arena, sizeof(*peer), 8);
+    memset(peer, 0, sizeof(*peer));
+    endpoint_ipv4(&peer->endpoint, 0x0a000001, (u16)(i + 1));
+    dllist_push_back(msg.peers_to_connect.first, msg.peers_to_connect.last,
+                     peer);
+    msg.peers_to_connect.count++;
+  }
+
+  /* NOTE: nobody reads, the socket fills up in the middle of a frame */
+  sent = 0;
+  mark = arena->used;
+  for (i = 0; i < 10000 && !out->send_buffer; ++i) {
+    res = stream_message_write(arena, out, &msg);
+    expect(res != CONN_ERROR);
+    sent += res == CONN_OK;
+    arena->used = mark;
+  }
+  expect(out->send_buffer && out->sending && pool.in_use == 1);
+  expect(stream_message_write(arena, out, &msg) == CONN_WOULD_BLOCK);
+
+  memset(&list, 0, sizeof(list));
+  res = CONN_WOULD_BLOCK;
+  for (i = 0; i < 10000 && res == CONN_WOULD_BLOCK; ++i) {
+    expect(stream_proccess_messages(arena, in, test_stream_peer_list,
+                                    &list) == CONN_OK);
+    res = stream_message_write(arena, out, &msg);
+    arena->used = mark;
+  }
+  expect(res == CONN_OK && !out->send_buffer && !out->sending);
+  sent++;
+  for (i = 0; i < 10000 && list.entries < sent * 200; ++i) {
+    expect(stream_proccess_messages(arena, in, test_stream_peer_list,
+                                    &list) == CONN_OK);
+    arena->used = mark;
+  }
+  expect(list.entries == sent * 200 && list.callbacks == sent);
+  expect(pool.in_use == 0);
+  conn_close(writer);
+  conn_close(reader);
+}
+
+/* NOTE: a stream that only takes some types skips the rest undecoded, a
+ * large peer list from a client costs no arena */
+static void test_stream_skipped_types(Arena *arena) {
+  StreamBufferPool pool;
+  Stream *in, *out;
+  Conn writer, reader;
+  Message list, connect, digest;
+  u32 i, received;
+  u64 mark, used_max;
+  stream_buffer_pool_init(&pool, arena, 4);
+  in = arena_push(arena, sizeof(*in), 8);
+  out = arena_push(arena, sizeof(*out), 8);
+  expect(conn_stream_pair(&writer, &reader) == CONN_OK);
+  stream_init(in, reader, &pool);
+  in->types = message_type_bit(MessageType_CONNECT) |
+              message_type_bit(MessageType_KEEP_ALIVE);
+  stream_init(out, writer, 0);
+  memset(&list, 0, sizeof(list));
+  list.header.type = MessageType_PEERS_TO_CONNECT;
+  for (i = 0; i < 3000; ++i) {
+    PeerConnected *peer;
+    peer = arena_push(arena, sizeof(*peer), 8);
+    memset(peer, 0, sizeof(*peer));
+    endpoint_ipv4(&peer->endpoint, 0x0a000001, (u16)(i + 1));
+    dllist_push_back(list.peers_to_connect.first, list.peers_to_connect.last,
+                     peer);
+    list.peers_to_connect.count++;
+  }
+  memset(&connect, 0, sizeof(connect));
+  connect.header.type = MessageType_CONNECT;
+  endpoint_ipv4(&connect.connect.endpoint, 0x01020304, 4000);
+  memset(&digest, 0, sizeof(digest));
+  digest.header.type = MessageType_GOSSIP_DIGEST;
+
+  while (stream_message_write(arena, out, &list) == CONN_WOULD_BLOCK) {
+  }
+  expect(stream_message_write(arena, out, &connect) == CONN_OK);
+  expect(stream_message_write(arena, out, &digest) == CONN_OK);
+  expect(stream_message_write(arena, out, &connect) == CONN_OK);
+
+  received = 0;
+  mark = arena->used;
+  used_max = 0;
+  for (i = 0; i < 100 && received < 2; ++i) {
+    expect(stream_proccess_messages(arena, in, test_stream_count,
+                                    &received) == CONN_OK);
+    used_max = max(used_max, arena->used - mark);
+    arena->used = mark;
+  }
+  expect(received == 2 && !in->decoding && in->skip_bytes == 0);
+  /* NOTE: decoded, the list alone would take 3000 PeerConnected */
+  expect(used_max < kb(4));
+  expect(in->recv_buffer_used == 0 && pool.in_use == 0);
+  conn_close(writer);
+  conn_close(reader);
+}
+
+/* NOTE: a stream with a half frame and no buffer left in the pool gets an
+ * error, the one holding the last buffer goes on */
+static void test_stream_buffers_exhausted(Arena *arena) {
+  StreamBufferPool pool;
+  Stream *a, *b;
+  Conn writer_a, reader_a, writer_b, reader_b;
+  Message msg;
+  u8 *frame;
+  u64 size;
+  u32 received;
+  stream_buffer_pool_init(&pool, arena, 1);
+  a = arena_push(arena, sizeof(*a), 8);
+  b = arena_push(arena, sizeof(*b), 8);
+  expect(conn_stream_pair(&writer_a, &reader_a) == CONN_OK);
+  expect(conn_stream_pair(&writer_b, &reader_b) == CONN_OK);
+  stream_init(a, reader_a, &pool);
+  stream_init(b, reader_b, &pool);
+  memset(&msg, 0, sizeof(msg));
+  msg.connect.header.type = MessageType_CONNECT;
+  endpoint_ipv4(&msg.connect.endpoint, 0x01020304, 4000);
+  frame = message_serialize(arena, &msg, &size);
+
+  received = 0;
+  conn_write(writer_a, frame, (u32)(size / 2));
+  expect(stream_proccess_messages(arena, a, test_stream_count, &received) ==
+         CONN_OK);
+  expect(pool.in_use == 1);
+  conn_write(writer_b, frame, (u32)(size / 2));
+  expect(stream_proccess_messages(arena, b, test_stream_count, &received) ==
+         CONN_ERROR);
+  expect(pool.exhausted == 1 && b->recv_buffer == 0);
+  stream_reset(b);
+
+  conn_write(writer_a, frame + size / 2, (u32)(size - size / 2));
+  expect(stream_proccess_messages(arena, a, test_stream_count, &received) ==
+         CONN_OK);
+  expect(received == 1 && pool.in_use == 0 && pool.allocated == 1);
+  conn_close(writer_a);
+  conn_close(reader_a);
+  conn_close(writer_b);
+  conn_close(reader_b);
+}
+
+static void test_malformed(Arena *arena) {
+  u8 *buffer;
+  /* NOTE: type 0 used to reach an assert */
+  buffer = test_header(arena, 9, 9, MessageType_INVALID);
+  expect(message_deserialize(arena, buffer, 9) == 0);
+  buffer = test_header(arena, 9, 9, MessageType_COUNT);
+  expect(message_deserialize(arena, buffer, 9) == 0);
+  buffer = test_header(arena, 9, 9, 0xff);
+  expect(message_deserialize(arena, buffer, 9) == 0);
+  /* NOTE: the size field does not match what arrived */
+  buffer = test_header(arena, 9, 10, MessageType_KEEP_ALIVE);
+  expect(message_deserialize(arena, buffer, 9) == 0);
+  buffer = test_header(arena, 9, 0, MessageType_KEEP_ALIVE);
+  expect(message_deserialize(arena, buffer, 9) == 0);
+  expect(message_deserialize(arena, buffer, 4) == 0);
+  /* NOTE: a header without the body its type needs */
+  buffer = test_header(arena, 9, 9, MessageType_PUNCH);
+  expect(message_deserialize(arena, buffer, 9) == 0);
+  buffer = test_header(arena, 9, 9, MessageType_PEERS_TO_CONNECT);
+  expect(message_deserialize(arena, buffer, 9) == 0);
+  buffer = test_header(arena, 9, 9, MessageType_KEEP_ALIVE);
+  expect(message_deserialize(arena, buffer, 9) != 0);
+  /* NOTE: fixed size fields are checked before they are read */
+  buffer = test_header(arena, 18, 18, MessageType_RELIABLE_DATA);
+  expect(message_deserialize(arena, buffer, 18) == 0);
+  buffer = test_header(arena, 19, 19, MessageType_RELIABLE_DATA);
+  expect(message_deserialize(arena, buffer, 19) != 0);
+  buffer = test_header(arena, 28, 28, MessageType_RELIABLE_ACK);
+  expect(message_deserialize(arena, buffer, 28) == 0);
+  buffer = test_header(arena, 29, 29, MessageType_RELIABLE_ACK);
+  expect(message_deserialize(arena, buffer, 29) != 0);
+  buffer = test_header(arena, 10, 10, MessageType_SEQUENCED);
+  expect(message_deserialize(arena, buffer, 10) == 0);
+  buffer = test_header(arena, 11, 11, MessageType_SEQUENCED);
+  expect(message_deserialize(arena, buffer, 11) != 0);
+}
+
+static void test_endpoints(void) {
+  ConnEndpoint a, b;
+  endpoint_ipv4(&a, 0xc0a80001, 1);
+  endpoint_ipv4(&b, 0xc0a80001, 2);
+  expect(!endpoint_equals(&a, &b));
+  expect(endpoint_same_host(&a, &b));
+  expect(endpoint_same_prefix(&a, &b));
+  endpoint_ipv4(&b, 0xc0a800fe, 1);
+  expect(!endpoint_same_host(&a, &b) && endpoint_same_prefix(&a, &b));
+  endpoint_ipv4(&b, 0xc0a80101, 1);
+  expect(!endpoint_same_prefix(&a, &b));
+  endpoint_ipv4(&b, 0xc0a80001, 2);
+  expect(endpoint_ipv4_addr(&a) == 0xc0a80001);
+  b.port = 1;
+  expect(endpoint_equals(&a, &b));
+  expect(endpoint_hash(&a) == endpoint_hash(&b));
+  /* NOTE: the same value on little and big endian hosts */
+  expect(endpoint_hash(&a) == 0x979342a5);
+}
+
+void test_proto(void) {
+  static u8 memory[mb(4)];
+  Arena arena;
+  arena_init(&arena, memory, sizeof(memory));
+  test_connect_round_trip(&arena);
+  test_peers_to_connect_round_trip(&arena);
+  test_dgram_batch(&arena);
+  test_stream_partial_frames(&arena);
+  test_stream_large_peer_list(&arena);
+  test_stream_non_blocking_write(&arena);
+  test_stream_skipped_types(&arena);
+  test_stream_buffers_exhausted(&arena);
+  test_endpoints();
+  test_malformed(&arena);
+}
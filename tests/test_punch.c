@@ -0,0 +1,154 @@
+#include "../src/punch.h"
+#include "test.h"
+
+static PunchCandidate *test_candidate(Punch *punch, PunchTarget *target,
+                                      u32 index) {
+  return &punch->candidates[target->first_candidate + index];
+}
+
+/* NOTE: with every slot taken a FAILED target makes room, and targets
+ * removed in any order leave the rest findable */
+static void test_punch_recycle(Arena *arena) {
+  Punch punch;
+  PeerConnected peer;
+  PunchTarget *target, *failed;
+  ConnEndpoint live[8];
+  u32 i, round;
+  u64 now;
+  punch_init(&punch, arena, 0, 8);
+  now = 1000;
+  memset(&peer, 0, sizeof(peer));
+  for (i = 0; i < 8; ++i) {
+    endpoint_ipv4(&live[i], 0x0a000001 + i, 5000);
+    peer.endpoint = live[i];
+    expect(punch_add(&punch, &peer, now) != 0);
+  }
+  expect(punch.heap_count == 8);
+  endpoint_ipv4(&peer.endpoint, 0x0a000100, 5000);
+  expect(punch_add(&punch, &peer, now) == 0);
+
+  /* NOTE: what punch_update leaves once every candidate ran out */
+  failed = punch_find(&punch, &live[2]);
+  expect(failed != 0);
+  if (!failed) {
+    return;
+  }
+  failed->state = PunchState_FAILED;
+  target = punch_add(&punch, &peer, now);
+  expect(target == failed && punch.stats.recycled == 1);
+  expect(punch_find(&punch, &live[2]) == 0);
+  expect(punch_find(&punch, &peer.endpoint) == target);
+  expect(punch.heap_count == 8);
+  live[2] = peer.endpoint;
+
+  /* NOTE: the slot of a peer that is gone */
+  for (round = 0; round < 1000; ++round) {
+    i = (round * 5) % 8;
+    target = punch_find(&punch, &live[i]);
+    expect(target != 0);
+    if (!target) {
+      return;
+    }
+    punch_remove(&punch, target);
+    expect(punch_find(&punch, &live[i]) == 0);
+    endpoint_ipv4(&live[i], 0x0b000000 + round * 2654435761u, 6000);
+    peer.endpoint = live[i];
+    expect(punch_add(&punch, &peer, now) != 0);
+  }
+  for (i = 0; i < 8; ++i) {
+    target = punch_find(&punch, &live[i]);
+    expect(target && endpoint_equals(&target->endpoint, &live[i]));
+  }
+  expect(punch.heap_count == 8 && punch.stats.recycled == 1);
+}
+
+/* NOTE: a PUNCH_ACK files the target under the endpoint it came from, the
+ * one later datagrams of that peer come from */
+static void test_punch_connected(Arena *arena) {
+  Punch punch;
+  PeerConnected peer;
+  PunchTarget *target;
+  Message msg;
+  ConnEndpoint path;
+  ConnAddr *from;
+  u64 now;
+  punch_init(&punch, arena, 0, 8);
+  now = 1000;
+  memset(&peer, 0, sizeof(peer));
+  endpoint_ipv4(&peer.endpoint, 0x02020202, 2000);
+  target = punch_add(&punch, &peer, now);
+  expect(target != 0);
+  endpoint_ipv4(&path, 0xc0a80002, 3000);
+  expect(punch_find_connected(&punch, &path) == 0);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.punch.header.type = MessageType_PUNCH_ACK;
+  msg.punch.endpoint = peer.endpoint;
+  from = conn_address_endpoint(arena, &path);
+  expect(punch_process(&punch, arena, &msg, from, now) == target);
+  expect(punch_find_connected(&punch, &path) == target);
+  expect(punch_find_connected(&punch, &peer.endpoint) == 0);
+  /* NOTE: a second ack connects nothing */
+  expect(punch_process(&punch, arena, &msg, from, now) == 0);
+
+  punch_remove(&punch, target);
+  expect(punch_find_connected(&punch, &path) == 0);
+  expect(punch_find(&punch, &peer.endpoint) == 0);
+}
+
+void test_punch(void) {
+  static u8 memory[kb(256)];
+  Arena arena;
+  Punch punch;
+  PeerConnected peer;
+  PunchTarget *target;
+  ConnEndpoint own;
+  u64 now;
+
+  arena_init(&arena, memory, sizeof(memory));
+  punch_init(&punch, &arena, 0, 16);
+  now = 1000;
+
+  /* NOTE: different nats, the reflexive candidate goes before the private
+   * ipv4 host candidate */
+  endpoint_ipv4(&own, 0x01010101, 1000);
+  punch_set_identity(&punch, &own);
+  memset(&peer, 0, sizeof(peer));
+  endpoint_ipv4(&peer.endpoint, 0x02020202, 2000);
+  peer.candidates_count = 2;
+  peer.candidates[0].type = CandidateType_HOST;
+  endpoint_ipv4(&peer.candidates[0].endpoint, 0xc0a80002, 3000);
+  peer.candidates[1].type = CandidateType_SERVER_REFLEXIVE;
+  peer.candidates[1].endpoint = peer.endpoint;
+  target = punch_add(&punch, &peer, now);
+  expect(target != 0);
+  if (!target) {
+    return;
+  }
+  /* NOTE: the reflexive endpoint is not duplicated */
+  expect(target->candidates_count == 2);
+  expect(test_candidate(&punch, target, 0)->type ==
+         CandidateType_SERVER_REFLEXIVE);
+  expect(test_candidate(&punch, target, 1)->next_send ==
+         now + PUNCH_STAGGER_US);
+  expect(punch_find(&punch, &peer.endpoint) == target);
+  expect(punch_add(&punch, &peer, now) == target);
+
+  /* NOTE: same nat, the host candidate is the lan path and goes first */
+  endpoint_ipv4(&peer.endpoint, 0x01010101, 4000);
+  peer.candidates[1].endpoint = peer.endpoint;
+  target = punch_add(&punch, &peer, now);
+  expect(target != 0);
+  if (!target) {
+    return;
+  }
+  expect(test_candidate(&punch, target, 0)->type == CandidateType_HOST);
+  expect(test_candidate(&punch, target, 0)->next_send == now);
+
+  /* NOTE: targets without an endpoint are rejected */
+  memset(&peer, 0, sizeof(peer));
+  expect(punch_add(&punch, &peer, now) == 0);
+
+  test_punch_recycle(&arena);
+  test_punch_connected(&arena);
+}
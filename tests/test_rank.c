@@ -0,0 +1,48 @@
+#include "../src/rank.h"
+#include "test.h"
+
+void test_rank(void) {
+  RankEntry entries[8];
+  RankTop top;
+  u64 items[64];
+  u32 i;
+
+  for (i = 0; i < array_len(items); ++i) {
+    items[i] = i;
+  }
+  /* NOTE: keys out of order, the smallest 8 are 0 to 7 */
+  rank_top_init(&top, entries, array_len(entries));
+  for (i = 0; i < array_len(items); ++i) {
+    u64 key;
+    key = (i * 37) % array_len(items);
+    rank_top_push(&top, key, &items[key]);
+  }
+  expect(top.count == 8);
+  rank_top_sort(&top);
+  for (i = 0; i < top.count; ++i) {
+    expect(top.entries[i].key == i);
+    expect(*(u64 *)top.entries[i].item == i);
+  }
+
+  /* NOTE: fewer items than the capacity are all kept */
+  rank_top_init(&top, entries, array_len(entries));
+  rank_top_push(&top, 5, &items[5]);
+  rank_top_push(&top, 3, &items[3]);
+  rank_top_push(&top, 9, &items[9]);
+  rank_top_sort(&top);
+  expect(top.count == 3);
+  expect(top.entries[0].key == 3 && top.entries[1].key == 5 &&
+         top.entries[2].key == 9);
+
+  /* NOTE: equal keys keep the first ones pushed */
+  rank_top_init(&top, entries, 2);
+  rank_top_push(&top, 1, &items[0]);
+  rank_top_push(&top, 1, &items[1]);
+  rank_top_push(&top, 1, &items[2]);
+  expect(top.count == 2);
+  expect(top.entries[0].item != &items[2] && top.entries[1].item != &items[2]);
+
+  rank_top_init(&top, entries, 0);
+  rank_top_push(&top, 1, &items[0]);
+  expect(top.count == 0);
+}
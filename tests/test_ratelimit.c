@@ -0,0 +1,37 @@
+#include "../src/ratelimit.h"
+#include "test.h"
+
+void test_ratelimit(void) {
+  static u8 memory[kb(64)];
+  Arena arena;
+  RateLimiter limiter;
+  u64 now;
+  u32 i, allowed;
+  arena_init(&arena, memory, sizeof(memory));
+  rate_limiter_init(&limiter, &arena, 16, 10, 20);
+
+  /* NOTE: the burst goes through and then the source is cut */
+  now = 1000000;
+  allowed = 0;
+  for (i = 0; i < 100; ++i) {
+    allowed += rate_limiter_allow(&limiter, 0x0a000001, now);
+  }
+  expect(allowed == 20);
+
+  /* NOTE: 10 tokens per second, half a second later there are 5 */
+  now += 500000;
+  allowed = 0;
+  for (i = 0; i < 100; ++i) {
+    allowed += rate_limiter_allow(&limiter, 0x0a000001, now);
+  }
+  expect(allowed == 5);
+
+  /* NOTE: another source has its own bucket */
+  expect(rate_limiter_allow(&limiter, 0x0a000002, now));
+
+  /* NOTE: a flood of sources evicts but never blocks a new one */
+  for (i = 0; i < 10000; ++i) {
+    expect(rate_limiter_allow(&limiter, 0x0b000000 + i, now));
+  }
+  expect(limiter.stats.evictions > 0);
+}
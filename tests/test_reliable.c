@@ -0,0 +1,167 @@
+#include "../src/net.h"
+#include "../src/reliable.h"
+#include "test.h"
+
+#define TEST_RELIABLE_SIZE kb(200)
+#define TEST_RELIABLE_HELD 8
+#define TEST_RELIABLE_STEP_US 500
+
+/* NOTE: one side of a loopback pair. Datagrams that arrive are dropped,
+ * held back and delivered after later ones, or delivered right away */
+typedef struct TestLink {
+  Dgram dgram;
+  ConnAddr *addr;
+  ConnAddr *from;
+  ConnSet *read;
+  DgramBatch batch;
+  ReliableChannel channel;
+  u8 held[TEST_RELIABLE_HELD][RELIABLE_MSS + 64];
+  u32 held_size[TEST_RELIABLE_HELD];
+  u32 held_count;
+  u32 dropped;
+  u32 reordered;
+  u32 seed;
+} TestLink;
+
+static u32 test_random(u32 *seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return (*seed >> 16) & 0x7fff;
+}
+
+static void test_link_init(Arena *arena, TestLink *link, u32 seed) {
+  ConnEndpoint endpoint;
+  ConnErr udp;
+  udp = conn_udp();
+  expect(udp.err == CONN_OK);
+  link->dgram.conn = udp.conn;
+  expect(conn_bind(udp.conn, conn_address(arena, "127.0.0.1", 0)) ==
+         CONN_OK);
+  conn_get_local_endpoint(udp.conn, &endpoint);
+  link->addr = conn_address(arena, "127.0.0.1", endpoint.port);
+  link->from = conn_address_create(arena);
+  link->read = conn_set_create(arena);
+  dgram_batch_init(&link->batch, arena_push(arena, DGRAM_BATCH_SIZE, 8),
+                   DGRAM_BATCH_SIZE);
+  link->seed = seed;
+}
+
+static void test_link_deliver(Arena *arena, TestLink *link, u8 *buffer,
+                              u32 size, u64 now) {
+  Message *msg;
+  u64 mark;
+  mark = arena->used;
+  msg = message_deserialize(arena, buffer, size);
+  expect(msg != 0);
+  if (msg) {
+    reliable_process(&link->channel, msg, now);
+  }
+  arena->used = mark;
+}
+
+/* NOTE: reads what is there without waiting. A tenth of the datagrams is
+ * lost, another tenth goes in after the rest of the read, newest first */
+static void test_link_pump(Arena *arena, TestLink *link, u64 now) {
+  for (;;) {
+    u32 i, count;
+    conn_set_clear(link->read);
+    conn_set_add(link->read, link->dgram.conn);
+    if (conn_select(link->read, 0, 0) == CONN_ERROR ||
+        !conn_set_has(link->read, link->dgram.conn)) {
+      break;
+    }
+    if (dgram_batch_read_from(&link->dgram, &link->batch, link->from) ==
+        CONN_ERROR) {
+      break;
+    }
+    count = dgram_batch_count(&link->batch);
+    for (i = 0; i < count; ++i) {
+      u8 *segment;
+      u32 size, roll;
+      segment = dgram_batch_segment(&link->batch, i, &size);
+      roll = test_random(&link->seed) % 10;
+      if (roll == 0) {
+        link->dropped++;
+      } else if (roll == 1 && link->held_count < TEST_RELIABLE_HELD &&
+                 size <= sizeof(link->held[0])) {
+        memcpy(link->held[link->held_count], segment, size);
+        link->held_size[link->held_count] = size;
+        link->held_count++;
+      } else {
+        test_link_deliver(arena, link, segment, size, now);
+      }
+    }
+  }
+  while (link->held_count) {
+    link->held_count--;
+    link->reordered++;
+    test_link_deliver(arena, link, link->held[link->held_count],
+                      link->held_size[link->held_count], now);
+  }
+}
+
+/* NOTE: both sides send a different stream at once, with drops and
+ * reordering in both directions, and read back exactly what the other one
+ * wrote */
+static void test_reliable_lossy_loopback(Arena *arena) {
+  TestLink *a, *b;
+  u8 *a_data, *b_data, *a_out, *b_out;
+  u32 i, a_sent, b_sent, a_received, b_received;
+  u64 now;
+  a = arena_push(arena, sizeof(*a), 8);
+  b = arena_push(arena, sizeof(*b), 8);
+  memset(a, 0, sizeof(*a));
+  memset(b, 0, sizeof(*b));
+  test_link_init(arena, a, 1);
+  test_link_init(arena, b, 2);
+  reliable_init(&a->channel, arena, &a->dgram, b->addr);
+  reliable_init(&b->channel, arena, &b->dgram, a->addr);
+
+  a_data = arena_push(arena, TEST_RELIABLE_SIZE, 8);
+  b_data = arena_push(arena, TEST_RELIABLE_SIZE, 8);
+  a_out = arena_push(arena, TEST_RELIABLE_SIZE, 8);
+  b_out = arena_push(arena, TEST_RELIABLE_SIZE, 8);
+  for (i = 0; i < TEST_RELIABLE_SIZE; ++i) {
+    a_data[i] = (u8)(i * 7 + i / 251);
+    b_data[i] = (u8)(i * 13 + i / 241);
+  }
+  memset(a_out, 0, TEST_RELIABLE_SIZE);
+  memset(b_out, 0, TEST_RELIABLE_SIZE);
+
+  a_sent = b_sent = a_received = b_received = 0;
+  now = 1;
+  for (i = 0; i < 100000; ++i) {
+    if (a_received == TEST_RELIABLE_SIZE && b_received == TEST_RELIABLE_SIZE) {
+      break;
+    }
+    a_sent += reliable_send(&a->channel, a_data + a_sent,
+                            TEST_RELIABLE_SIZE - a_sent);
+    b_sent += reliable_send(&b->channel, b_data + b_sent,
+                            TEST_RELIABLE_SIZE - b_sent);
+    expect(reliable_update(&a->channel, now) == CONN_OK);
+    expect(reliable_update(&b->channel, now) == CONN_OK);
+    now += TEST_RELIABLE_STEP_US;
+    test_link_pump(arena, a, now);
+    test_link_pump(arena, b, now);
+    a_received += reliable_recv(&a->channel, a_out + a_received,
+                                TEST_RELIABLE_SIZE - a_received);
+    b_received += reliable_recv(&b->channel, b_out + b_received,
+                                TEST_RELIABLE_SIZE - b_received);
+    now += TEST_RELIABLE_STEP_US;
+  }
+  expect(a_received == TEST_RELIABLE_SIZE);
+  expect(b_received == TEST_RELIABLE_SIZE);
+  expect(memcmp(b_out, a_data, TEST_RELIABLE_SIZE) == 0);
+  expect(memcmp(a_out, b_data, TEST_RELIABLE_SIZE) == 0);
+  /* NOTE: the path did lose and reorder, and the losses were repaired */
+  expect(a->dropped && b->dropped && a->reordered && b->reordered);
+  expect(a->channel.stats.retransmits && b->channel.stats.retransmits);
+  conn_close(a->dgram.conn);
+  conn_close(b->dgram.conn);
+}
+
+void test_reliable(void) {
+  static u8 memory[mb(4)];
+  Arena arena;
+  arena_init(&arena, memory, sizeof(memory));
+  test_reliable_lossy_loopback(&arena);
+}
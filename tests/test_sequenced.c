@@ -0,0 +1,294 @@
+#include "../src/net.h"
+#include "../src/sequenced.h"
+#include "test.h"
+
+/* NOTE: a SEQUENCED message built by hand, entries go in as they are
+ * written, valid or not */
+typedef struct TestSequencedPacket {
+  u8 entries[SEQUENCED_PAYLOAD_SIZE];
+  u8 *cursor;
+  u16 count;
+} TestSequencedPacket;
+
+static void test_packet_clear(TestSequencedPacket *packet) {
+  packet->cursor = packet->entries;
+  packet->count = 0;
+}
+
+static void test_packet_entry(TestSequencedPacket *packet, u8 lane, u16 seq,
+                              u16 size) {
+  write_u8_be(packet->cursor, lane);
+  write_u16_be(packet->cursor, seq);
+  write_u16_be(packet->cursor, size);
+  memset(packet->cursor, (u8)seq, size);
+  packet->cursor += size;
+  packet->count++;
+}
+
+static void test_packet_process(SequencedChannel *channel,
+                                TestSequencedPacket *packet) {
+  Message msg;
+  msg.sequenced.header.type = MessageType_SEQUENCED;
+  msg.sequenced.count = packet->count;
+  msg.sequenced.size = (u32)(packet->cursor - packet->entries);
+  msg.sequenced.entries = packet->entries;
+  sequenced_process(channel, &msg);
+}
+
+/* NOTE: one entry per packet, as if every message took its own datagram */
+static void test_process_one(SequencedChannel *channel, u8 lane, u16 seq,
+                             u16 size) {
+  TestSequencedPacket packet;
+  test_packet_clear(&packet);
+  test_packet_entry(&packet, lane, seq, size);
+  test_packet_process(channel, &packet);
+}
+
+/* NOTE: each lane keeps its own newest seq, an old or repeated one is
+ * dropped there and does not affect the others */
+static void test_sequenced_stale(Arena *arena) {
+  SequencedChannel channel;
+  SequencedMessage msgs[8];
+  sequenced_init(&channel, arena, 0, 0, 0);
+  test_process_one(&channel, 0, 5, 4);
+  test_process_one(&channel, 0, 5, 4);
+  test_process_one(&channel, 0, 4, 4);
+  test_process_one(&channel, 1, 4, 4);
+  test_process_one(&channel, 1, 3, 4);
+  test_process_one(&channel, 1, 4, 4);
+  test_process_one(&channel, 0, 6, 4);
+  expect(channel.stats.stale_dropped == 4);
+  expect(channel.stats.messages_received == 3);
+  expect(sequenced_recv_batch(&channel, msgs, array_len(msgs)) == 3);
+  expect(msgs[0].lane == 0 && msgs[0].seq == 5);
+  expect(msgs[1].lane == 1 && msgs[1].seq == 4);
+  expect(msgs[2].lane == 0 && msgs[2].seq == 6);
+  /* NOTE: the first message of a lane is taken whatever its seq */
+  test_process_one(&channel, 2, 0, 4);
+  expect(channel.stats.messages_received == 4);
+}
+
+/* NOTE: seqs are 16 bits, 0 comes right after 65535 */
+static void test_sequenced_wraparound(Arena *arena) {
+  SequencedChannel channel;
+  SequencedMessage msgs[8];
+  sequenced_init(&channel, arena, 0, 0, 0);
+  test_process_one(&channel, 3, 65534, 4);
+  test_process_one(&channel, 3, 65535, 4);
+  test_process_one(&channel, 3, 0, 4);
+  test_process_one(&channel, 3, 65535, 4);
+  test_process_one(&channel, 3, 1, 4);
+  /* NOTE: half the seq space ahead reads as behind */
+  test_process_one(&channel, 3, 1 + 32768, 4);
+  expect(channel.stats.messages_received == 4);
+  expect(channel.stats.stale_dropped == 2);
+  expect(sequenced_recv_batch(&channel, msgs, array_len(msgs)) == 4);
+  expect(msgs[2].seq == 0 && msgs[3].seq == 1);
+
+  /* NOTE: the sender wraps the same way */
+  channel.send_seq[3] = 65535;
+  expect(sequenced_send(&channel, 3, (u8 *)"x", 1));
+  expect(channel.send_seq[3] == 0);
+}
+
+/* NOTE: a lane out of range or an entry that runs past the packet ends the
+ * packet, what came before it is kept */
+static void test_sequenced_malformed(Arena *arena) {
+  SequencedChannel channel;
+  TestSequencedPacket packet;
+  u8 *size_field;
+  sequenced_init(&channel, arena, 0, 0, 0);
+
+  test_packet_clear(&packet);
+  test_packet_entry(&packet, 4, 1, 8);
+  test_packet_entry(&packet, SEQUENCED_LANES, 1, 8);
+  test_packet_entry(&packet, 5, 1, 8);
+  test_packet_process(&channel, &packet);
+  expect(channel.stats.messages_received == 1);
+
+  /* NOTE: the count promises an entry whose header is cut */
+  test_packet_clear(&packet);
+  test_packet_entry(&packet, 6, 1, 8);
+  write_u8_be(packet.cursor, 7);
+  write_u16_be(packet.cursor, 1);
+  packet.count++;
+  test_packet_process(&channel, &packet);
+  expect(channel.stats.messages_received == 2);
+
+  /* NOTE: the entry size goes past the end of the packet */
+  test_packet_clear(&packet);
+  test_packet_entry(&packet, 8, 1, 8);
+  size_field = packet.cursor + 3;
+  test_packet_entry(&packet, 9, 1, 8);
+  write_u16_be(size_field, 9);
+  test_packet_process(&channel, &packet);
+  expect(channel.stats.messages_received == 3);
+
+  /* NOTE: a count larger than the entries that are there */
+  test_packet_clear(&packet);
+  test_packet_entry(&packet, 10, 1, 8);
+  packet.count = 100;
+  test_packet_process(&channel, &packet);
+  expect(channel.stats.messages_received == 4);
+  expect(channel.stats.stale_dropped == 0);
+  expect(channel.stats.overflow_dropped == 0);
+}
+
+/* NOTE: messages nobody reads pile up until the receive buffer is full, the
+ * rest are dropped and the seq of the lane does not move for them */
+static void test_sequenced_overflow(Arena *arena) {
+  SequencedChannel channel;
+  SequencedMessage msgs[64];
+  u32 fit, i, received;
+  sequenced_init(&channel, arena, 0, 0, 0);
+  fit = SEQUENCED_RECV_BUFFER_SIZE / SEQUENCED_MAX_MESSAGE_SIZE;
+  for (i = 0; i < fit + 5; ++i) {
+    test_process_one(&channel, 0, (u16)(i + 1), SEQUENCED_MAX_MESSAGE_SIZE);
+  }
+  expect(channel.stats.messages_received == fit);
+  expect(channel.stats.overflow_dropped == 5);
+  expect(channel.recv_seq[0] == fit);
+  received = sequenced_recv_batch(&channel, msgs, array_len(msgs));
+  expect(received == fit && msgs[fit - 1].seq == fit);
+  /* NOTE: once read the buffer starts over */
+  test_process_one(&channel, 0, (u16)(fit + 6), SEQUENCED_MAX_MESSAGE_SIZE);
+  expect(channel.stats.messages_received == fit + 1);
+
+  /* NOTE: the message count has a limit of its own */
+  sequenced_init(&channel, arena, 0, 0, 0);
+  for (i = 0; i < SEQUENCED_MAX_RECV + 3; ++i) {
+    test_process_one(&channel, 1, (u16)(i + 1), 1);
+  }
+  expect(channel.stats.messages_received == SEQUENCED_MAX_RECV);
+  expect(channel.stats.overflow_dropped == 3);
+}
+
+static Conn test_udp_bound(Arena *arena, ConnAddr **addr) {
+  ConnEndpoint endpoint;
+  ConnErr udp;
+  udp = conn_udp();
+  expect(udp.err == CONN_OK);
+  expect(conn_bind(udp.conn, conn_address(arena, "127.0.0.1", 0)) ==
+         CONN_OK);
+  conn_get_local_endpoint(udp.conn, &endpoint);
+  *addr = conn_address(arena, "127.0.0.1", endpoint.port);
+  return udp.conn;
+}
+
+/* NOTE: feeds the receiver every datagram that is waiting, returns how many
+ * packets it got */
+static u32 test_sequenced_pump(Arena *arena, Dgram *dgram,
+                               SequencedChannel *channel) {
+  ConnSet *read;
+  ConnAddr *from;
+  DgramBatch batch;
+  u32 packets;
+  u64 mark;
+  mark = arena->used;
+  read = conn_set_create(arena);
+  from = conn_address_create(arena);
+  dgram_batch_init(&batch, arena_push(arena, DGRAM_BATCH_SIZE, 8),
+                   DGRAM_BATCH_SIZE);
+  packets = 0;
+  for (;;) {
+    u32 i, count;
+    conn_set_clear(read);
+    conn_set_add(read, dgram->conn);
+    if (conn_select(read, 0, 0) == CONN_ERROR ||
+        !conn_set_has(read, dgram->conn)) {
+      break;
+    }
+    if (dgram_batch_read_from(dgram, &batch, from) == CONN_ERROR) {
+      break;
+    }
+    count = dgram_batch_count(&batch);
+    for (i = 0; i < count; ++i) {
+      Message *msg;
+      msg = dgram_batch_message(arena, &batch, i);
+      expect(msg && msg->header.type == MessageType_SEQUENCED);
+      if (msg) {
+        sequenced_process(channel, msg);
+        packets++;
+      }
+    }
+  }
+  arena->used = mark;
+  return packets;
+}
+
+/* NOTE: small messages share a packet, a message that does not fit opens
+ * the next one and a full set of packets goes out before the tick */
+static void test_sequenced_packing(Arena *arena) {
+  SequencedChannel *out, *in;
+  SequencedMessage msgs[SEQUENCED_MAX_PACKETS + 8];
+  Dgram sender, receiver;
+  ConnAddr *sender_addr, *receiver_addr;
+  u8 data[SEQUENCED_MAX_MESSAGE_SIZE];
+  u32 i, received;
+  out = arena_push(arena, sizeof(*out), 8);
+  in = arena_push(arena, sizeof(*in), 8);
+  sender.conn = test_udp_bound(arena, &sender_addr);
+  receiver.conn = test_udp_bound(arena, &receiver_addr);
+  sequenced_init(out, arena, &sender, receiver_addr, 10000);
+  sequenced_init(in, arena, &receiver, sender_addr, 10000);
+  memset(data, 0xab, sizeof(data));
+  /* NOTE: the first tick only sets when the next one is due */
+  expect(sequenced_update(out, 0) == CONN_OK);
+
+  expect(!sequenced_send(out, SEQUENCED_LANES, data, 1));
+  expect(!sequenced_send(out, 0, data, SEQUENCED_MAX_MESSAGE_SIZE + 1));
+  for (i = 0; i < 3; ++i) {
+    expect(sequenced_send(out, (u8)i, data, 10));
+  }
+  expect(out->packets_count == 1 && out->packets[0].count == 3);
+  expect(out->packets[0].size == 3 * (SEQUENCED_ENTRY_HEADER_SIZE + 10));
+  expect(sequenced_send(out, 3, data, SEQUENCED_MAX_MESSAGE_SIZE));
+  expect(out->packets_count == 2 && out->packets[1].count == 1);
+  /* NOTE: nothing leaves before the tick */
+  expect(sequenced_update(out, 5000) == CONN_OK);
+  expect(out->stats.packets_sent == 0 && out->packets_count == 2);
+  expect(sequenced_next_timeout(out, 5000) == 5000);
+  expect(sequenced_update(out, 10000) == CONN_OK);
+  expect(out->stats.packets_sent == 2 && out->packets_count == 0);
+  expect(sequenced_next_timeout(out, 10000) == SEQUENCED_TIMEOUT_NONE);
+  expect(sequenced_send(out, 0, data, 10));
+  expect(sequenced_update(out, 20000) == CONN_OK);
+  expect(out->stats.packets_sent == 3 && out->packets_count == 0);
+  expect(test_sequenced_pump(arena, &receiver, in) == 3);
+  received = sequenced_recv_batch(in, msgs, array_len(msgs));
+  expect(received == 5);
+  expect(msgs[3].lane == 3 && msgs[3].size == SEQUENCED_MAX_MESSAGE_SIZE);
+  expect(msgs[4].lane == 0 && msgs[4].seq == 2);
+  expect(memcmp(msgs[3].data, data, SEQUENCED_MAX_MESSAGE_SIZE) == 0);
+
+  /* NOTE: the packet after SEQUENCED_MAX_PACKETS full ones flushes them */
+  for (i = 0; i < SEQUENCED_MAX_PACKETS; ++i) {
+    expect(sequenced_send(out, 4, data, SEQUENCED_MAX_MESSAGE_SIZE));
+  }
+  expect(out->packets_count == SEQUENCED_MAX_PACKETS);
+  expect(out->stats.packets_sent == 3);
+  expect(sequenced_send(out, 4, data, SEQUENCED_MAX_MESSAGE_SIZE));
+  expect(out->packets_count == 1);
+  expect(out->stats.packets_sent == 3 + SEQUENCED_MAX_PACKETS);
+  expect(sequenced_flush(out) == CONN_OK);
+  expect(test_sequenced_pump(arena, &receiver, in) ==
+         SEQUENCED_MAX_PACKETS + 1);
+  received = sequenced_recv_batch(in, msgs, array_len(msgs));
+  expect(received == SEQUENCED_MAX_PACKETS + 1);
+  expect(msgs[0].seq == 1 && msgs[SEQUENCED_MAX_PACKETS].seq ==
+                                 SEQUENCED_MAX_PACKETS + 1);
+  expect(in->stats.stale_dropped == 0 && in->stats.overflow_dropped == 0);
+  conn_close(sender.conn);
+  conn_close(receiver.conn);
+}
+
+void test_sequenced(void) {
+  static u8 memory[mb(4)];
+  Arena arena;
+  arena_init(&arena, memory, sizeof(memory));
+  test_sequenced_stale(&arena);
+  test_sequenced_wraparound(&arena);
+  test_sequenced_malformed(&arena);
+  test_sequenced_overflow(&arena);
+  test_sequenced_packing(&arena);
+}
@@ -0,0 +1,67 @@
+#include "../src/stun.h"
+#include "test.h"
+
+static u8 binding_request[STUN_HEADER_SIZE] = {
+    0x00, 0x01, 0x00, 0x00, 0x21, 0x12, 0xa4, 0x42, 1, 2, 3, 4, 5, 6, 7, 8,
+    9,    10,   11,   12};
+
+/* NOTE: the read macros are statements, these make them expressions */
+static u16 take_u16(u8 **cursor) {
+  u16 value;
+  value = read_u16_be(*cursor);
+  return value;
+}
+
+static u32 take_u32(u8 **cursor) {
+  u32 value;
+  value = read_u32_be(*cursor);
+  return value;
+}
+
+void test_stun(void) {
+  u8 response[STUN_BINDING_RESPONSE_IPV6_SIZE];
+  u8 tent[9] = {0};
+  ConnEndpoint endpoint;
+  u8 *cursor;
+  u32 size;
+
+  expect(datagram_classify(binding_request, sizeof(binding_request)) ==
+         DatagramKind_STUN);
+  cursor = tent;
+  write_u32_be(cursor, PROTO_MAGIC);
+  expect(datagram_classify(tent, sizeof(tent)) == DatagramKind_TENT);
+  expect(datagram_classify(tent, 4) == DatagramKind_UNKNOWN);
+
+  endpoint_ipv4(&endpoint, 0xc0000201, 0x1234);
+  size = stun_binding_response_write(binding_request, sizeof(binding_request),
+                                     response, &endpoint);
+  expect(size == STUN_BINDING_RESPONSE_IPV4_SIZE);
+  cursor = response;
+  expect(take_u16(&cursor) == STUN_BINDING_RESPONSE);
+  expect(take_u16(&cursor) == size - STUN_HEADER_SIZE);
+  expect(memcmp(response + 4, binding_request + 4, 16) == 0);
+  /* NOTE: XOR-MAPPED-ADDRESS, port and address xored with the cookie */
+  cursor = response + STUN_HEADER_SIZE;
+  expect(take_u16(&cursor) == STUN_ATTR_XOR_MAPPED_ADDRESS);
+  expect(take_u16(&cursor) == 8);
+  expect(take_u16(&cursor) == STUN_FAMILY_IPV4);
+  expect(take_u16(&cursor) == (0x1234 ^ (STUN_MAGIC_COOKIE >> 16)));
+  expect(take_u32(&cursor) == (0xc0000201 ^ STUN_MAGIC_COOKIE));
+  expect(take_u16(&cursor) == STUN_ATTR_FINGERPRINT);
+
+  memset(&endpoint, 0, sizeof(endpoint));
+  endpoint.family = CONN_FAMILY_IPV6;
+  endpoint.addr[0] = 0x20;
+  endpoint.port = 1;
+  size = stun_binding_response_write(binding_request, sizeof(binding_request),
+                                     response, &endpoint);
+  expect(size == STUN_BINDING_RESPONSE_IPV6_SIZE);
+
+  /* NOTE: anything but a well formed binding request is ignored */
+  expect(stun_binding_response_write(binding_request, 10, response,
+                                     &endpoint) == 0);
+  binding_request[1] = 0x02;
+  expect(stun_binding_response_write(binding_request, sizeof(binding_request),
+                                     response, &endpoint) == 0);
+  binding_request[1] = 0x01;
+}